@@ -12,6 +12,10 @@
 #include <fstream>
 #include <sstream>
 #include <algorithm>
+#include <cstdlib>
+#include <ctime>
+#include <cmath>
+
 
 /*! \brief Constructor
  *
@@ -22,6 +26,7 @@ aggie::aggie()
 	  clients_filename_(""),
 	  pm_(NULL),
 	  pm_url(""),
+	  subscribers_(NULL),
 	  received_a_pm_message(false),
 	  last_received_pm_message(0),
 	  sent_a_pm_message(false),
@@ -29,20 +34,29 @@ aggie::aggie()
 	  pm_connected_time(0),
 	  running(false),
 	  stop_main_loop(false),
+	  client_reload_requested(false),
 	  new_data_from_client(false),
 	  new_configs(false),
 	  new_connections(false),
+	  pm_binary(false),
+	  pm_binary_requested(false),
+	  pm_sequence(0),
+	  pm_snapshot_requested(true),
+	  subscriber_snapshot_requested(false),
 	  previous_client_count(0)
 {
 	last_received_pm_message = timers.add_stopwatch();
 	last_sent_pm_message = timers.add_stopwatch();
 	pm_connected_time = timers.add_stopwatch();
-	::pthread_mutex_init(&mutex_pm_queue, NULL);
-	::pthread_mutex_init(&mutex_client_queue, NULL);
-	::pthread_cond_init(&cond_message_received, NULL);
-	::pthread_mutex_init(&mutex_message_received, NULL);
+	main_loop_timer = timers.add_stopwatch();
+	last_pm_snapshot = timers.add_stopwatch();
 	::pthread_cond_init(&cond_main_action, NULL);
 	::pthread_mutex_init(&mutex_main_action, NULL);
+	::srandom(::time(NULL) ^ ::getpid()); // Reconnect jitter must differ between instances
+	poll_commands.push_back(GET_CLIENT_NODES);
+	poll_commands.push_back(GET_CONFIGS);
+	poll_commands.push_back(GET_CONNECTIONS);
+	router.set_timeout(config::pm_command_timeout_sec * 1000);
 }
 
 /*! \brief Controlled termination of the class.
@@ -53,14 +67,23 @@ RH aggie::shutdown()
 	RH result;
 	result.set_ok();
 
+	stop_subscriber_server();
 	disconnect_pm();
 	disconnect_clients();
 	delete_clients();
+	stop_reactors();
+
+	std::vector<dispatcher_shard*>::iterator shards_itr = shards.begin();
+	while (shards_itr != shards.end())
+	{
+		(*shards_itr)->stop();
+		delete *shards_itr;
+		shards_itr += 1;
+	}
+	shards.clear();
 
-	::pthread_mutex_destroy(&mutex_pm_queue);
-	::pthread_mutex_destroy(&mutex_client_queue);
-	::pthread_cond_destroy(&cond_message_received);
-	::pthread_mutex_destroy(&mutex_message_received);
+	::pthread_cond_destroy(&cond_main_action);
+	::pthread_mutex_destroy(&mutex_main_action);
 	return(result);
 }
 
@@ -68,7 +91,8 @@ RH aggie::shutdown()
  *
  * The file must contain one client entry per line, with each entry
  * given as "IP-or-hostname port", e.g. "192.168.3.44 4002"
- * (without the quotes).
+ * (without the quotes). The entry may be followed by the client's
+ * own poll interval in seconds, e.g. "192.168.3.44 4002 5".
  *
  * \param clients_filename Filename of textfile
  * \return Always returns #resulthandler::OK
@@ -95,6 +119,7 @@ RH aggie::add_clients(std::string clients_filename)
 				vout(VOUT_DEBUG) << ", ";
 			}
 			wclient *c = new wclient(str);
+			c->shard = clients.size(); // Spreads the clients evenly over the dispatcher shards
 			clients.push_back(c);
 			vout(VOUT_DEBUG) << c->host() << ":" << c->port();
     	}
@@ -124,6 +149,10 @@ RH aggie::add_clients()
 }
 
 /*! \brief Removes all clients from memory.
+ *
+ * Must be called from the main thread, or after the main loop has ended,
+ * since the clients are also taken out of the poll schedule and of
+ * #aggregated_nodes, which are not thread safe.
  *
  * \return Always returns #resulthandler::OK
  */
@@ -136,6 +165,9 @@ RH aggie::delete_clients()
 	while (clients_itr != clients.end())
 	{
 		vout(VOUT_DEBUG) << "Deleting client " << (*clients_itr)->text() << std::endlc;
+		poll_schedule.cancel(*clients_itr);
+		router.remove_client(*clients_itr);
+		aggregated_nodes.remove_source(*clients_itr);
 		delete (*clients_itr)->socket;
 		delete *clients_itr;
 		clients.erase(clients_itr);
@@ -158,23 +190,41 @@ RH aggie::connect_clients()
 
 	unsigned connected_clients = 0;
 
+	if (reactors.empty() && (config::reactor_threads > 0))
+	{
+		start_reactors(config::reactor_threads);
+	}
+
+	// Connect to all clients at once, so that clients that are down
+	// do not delay the others
+	std::vector<tcpsocket*> sockets;
 	std::vector<wclient*>::iterator clients_itr = clients.begin();
 	while (clients_itr != clients.end())
 	{
 		(*clients_itr)->socket->set_destination((*clients_itr)->host());
 		(*clients_itr)->socket->set_port((*clients_itr)->port());
+		sockets.push_back((*clients_itr)->socket);
+		clients_itr += 1;
+	}
+	vout(VOUT_INFO) << "Connecting to " << sockets.size() << " client" << (sockets.size() != 1 ? "s" : "") << " ..." << std::endlc;
+	tcpsocket::connect_all(sockets, config::client_connect_timeout_ms);
+
+	clients_itr = clients.begin();
+	while (clients_itr != clients.end())
+	{
 		vout(VOUT_INFO) << "Connecting to client " << (*clients_itr)->text() << " ... ";
-		vout(VOUT_INFO).flush();
-		(*clients_itr)->socket->connect();
 		if ((*clients_itr)->socket->connected())
 		{
 			vout(VOUT_INFO) << "OK" << std::endlc;
-			(*clients_itr)->socket->start_tcpsocket_client_listener(::client_listener);
+			(*clients_itr)->connection_state = wclient::STATE_CONNECTED;
+			start_client_listener(*clients_itr);
 			connected_clients += 1;
 		}
 		else
 		{
 			vout(VOUT_INFO) << ansi::red << "Failed" << std::endlc;
+			// Keep trying in the background
+			(*clients_itr)->schedule_reconnect(config::reconnect_min_delay_ms, config::reconnect_max_delay_ms);
 		}
 		clients_itr += 1;
 	}
@@ -217,6 +267,186 @@ RH aggie::disconnect_clients()
 	return result;
 }
 
+/*! \brief Starts the event loops that serve all client connections.
+ *
+ * \param count Number of reactor threads to start
+ * \return #resulthandler::OK, or the error from the first reactor that failed to start
+ */
+RH aggie::start_reactors(unsigned count)
+{
+	RH result;
+	result.set_ok();
+
+	for (unsigned i = 0; i < count; i++)
+	{
+		reactor *r = new reactor();
+		result = r->start();
+		if (result.is_not_ok())
+		{
+			vout(VOUT_ERROR) << "Could not start reactor: " << result.text() << std::endlc;
+			delete r;
+			break;
+		}
+		reactors.push_back(r);
+	}
+	vout(VOUT_VERBOSE) << "Serving client connections with " << reactors.size() << " reactor thread" << (reactors.size() != 1 ? "s" : "") << std::endlc;
+
+	return(result);
+}
+
+/*! \brief Stops all event loops serving the client connections.
+ *
+ * All clients should be disconnected first.
+ *
+ * \return Always returns #resulthandler::OK
+ */
+RH aggie::stop_reactors()
+{
+	RH result;
+	result.set_ok();
+
+	std::vector<reactor*>::iterator reactors_itr = reactors.begin();
+	while (reactors_itr != reactors.end())
+	{
+		(*reactors_itr)->stop();
+		delete *reactors_itr;
+		reactors_itr += 1;
+	}
+	reactors.clear();
+
+	return(result);
+}
+
+/*! \brief Starts receiving messages from a connected client.
+ *
+ * Uses the least busy reactor, or a dedicated thread if there are no reactors.
+ *
+ * \param c Client
+ * \return Result from the socket
+ */
+RH aggie::start_client_listener(wclient *c)
+{
+	if (reactors.empty())
+	{
+		return(c->socket->start_tcpsocket_client_listener(::client_listener));
+	}
+	return(c->socket->start_tcpsocket_reactor_listener(least_busy_reactor(), ::client_listener));
+}
+
+/*! \brief Re-establishes lost client connections.
+ *
+ * Called regularly from the main loop. Every client is handled on its own,
+ * so a client that is down never disturbs the others. Connection attempts
+ * do not block; an attempt that has not completed is checked again on the
+ * next call.
+ */
+void aggie::reconnect_clients()
+{
+	std::vector<wclient*>::iterator clients_itr = clients.begin();
+	while (clients_itr != clients.end())
+	{
+		wclient *c = *clients_itr;
+		clients_itr += 1;
+
+		if (c->connection_state == wclient::STATE_CONNECTED)
+		{
+			if (!c->socket->connected())
+			{
+				vout(VOUT_INFO) << ansi::red << "Lost connection to client " << c->text() << std::endlc;
+				c->socket->disconnect();
+				c->reconnect_attempts = 0;
+				c->schedule_reconnect(config::reconnect_min_delay_ms, config::reconnect_max_delay_ms);
+			}
+			continue;
+		}
+
+		RH result;
+		if (c->connection_state == wclient::STATE_WAITING_TO_RECONNECT)
+		{
+			if (timers.get_stopwatch_elapsed_time_in_ms(c->reconnect_timer).value() < c->reconnect_delay_ms)
+			{
+				continue;
+			}
+			vout(VOUT_VERBOSE) << "Reconnecting to client " << c->text() << " (attempt " << c->reconnect_attempts << ")" << std::endlc;
+			c->socket->disconnect();
+			result = c->socket->restart_connect();
+			timers.restart_stopwatch(c->reconnect_timer);
+		}
+		else // wclient::STATE_RECONNECTING
+		{
+			result = c->socket->poll_connect();
+		}
+
+		if (result.is_not_ok())
+		{
+			vout(VOUT_VERBOSE) << "Could not reconnect to client " << c->text() << ": " << result.text() << std::endlc;
+			c->socket->abort_connect();
+			c->schedule_reconnect(config::reconnect_min_delay_ms, config::reconnect_max_delay_ms);
+		}
+		else if (result == SOCKET_CONNECT_IN_PROGRESS)
+		{
+			c->connection_state = wclient::STATE_RECONNECTING;
+			if (timers.get_stopwatch_elapsed_time_in_ms(c->reconnect_timer).value() >= config::client_connect_timeout_ms)
+			{
+				vout(VOUT_VERBOSE) << "Timed out while reconnecting to client " << c->text() << std::endlc;
+				c->socket->abort_connect();
+				c->schedule_reconnect(config::reconnect_min_delay_ms, config::reconnect_max_delay_ms);
+			}
+		}
+		else
+		{
+			client_reconnected(c);
+		}
+	}
+}
+
+/*! \brief Resumes a client session after it has been reconnected.
+ *
+ * Anything left over from the previous session is discarded, and the
+ * client is asked for its lists the same way as at startup.
+ *
+ * \param c Client that has just been reconnected
+ */
+void aggie::client_reconnected(wclient *c)
+{
+	vout(VOUT_INFO) << "Reconnected to client " << c->text() << " after " << c->reconnect_attempts << " attempt" << (c->reconnect_attempts != 1 ? "s" : "") << std::endlc;
+
+	// Messages from the old session may still be in the queue
+	shard_of(c)->lock_clients();
+	c->reset_session();
+	shard_of(c)->unlock_clients();
+
+	c->connection_state = wclient::STATE_CONNECTED;
+	c->reconnect_attempts = 0;
+	c->reconnect_count += 1;
+	if (start_client_listener(c).is_not_ok())
+	{
+		c->socket->disconnect(); // Picked up again by the next call to reconnect_clients()
+		return;
+	}
+	get_info_from_client(c, poll_commands);
+	router.forget_client(c); // Commands sent before the connection was lost are not answered
+}
+
+/*! \brief Finds the reactor currently serving the fewest clients.
+ * \return Pointer to reactor, or NULL if there are no reactors
+ */
+reactor *aggie::least_busy_reactor()
+{
+	reactor *least_busy = NULL;
+	std::vector<reactor*>::iterator reactors_itr = reactors.begin();
+	while (reactors_itr != reactors.end())
+	{
+		if ((least_busy == NULL) || ((*reactors_itr)->handler_count() < least_busy->handler_count()))
+		{
+			least_busy = *reactors_itr;
+		}
+		reactors_itr += 1;
+	}
+
+	return(least_busy);
+}
+
 wclient *aggie::find_client(tcpsocket *socket)
 {
 	wclient *found_client = NULL;
@@ -238,10 +468,12 @@ wclient *aggie::find_client(tcpsocket *socket)
  *
  * \param listener Pointer to the tcpsocket instance
  *        message was receive on
- * \param data Incoming message
+ * \param line Incoming message (not NUL-terminated; only valid during the call)
+ * \param length Length of message
  */
-void aggie::client_listener(tcpsocket *listener, std::string data)
+void aggie::client_listener(tcpsocket *listener, const char *line, unsigned length)
 {
+	std::string data(line, length);
 	wclient *c = find_client(listener);
 	if (c == NULL)
 	{
@@ -258,10 +490,7 @@ void aggie::client_listener(tcpsocket *listener, std::string data)
 		//std::cout << " post-restart: " << timers.get_stopwatch_elapsed_time_in_ms(c->last_received_message) << std::endl;
 		if (message_listener_running)
 		{
-			::pthread_mutex_lock(&mutex_client_queue);
-			msgqueue_client_in.push(client_message(c, data));
-			::pthread_mutex_unlock(&mutex_client_queue);
-			::pthread_cond_signal(&cond_message_received);
+			shard_of(c)->push(client_message(c, data));
 		}
 		vout(VOUT_VERBOSEST) << ansi::cyan << "-> from client " << c->text() << ": " << data << std::endlc;
 	}
@@ -278,10 +507,7 @@ void aggie::pm_listener(websocket *listener, std::string data)
 {
 	received_a_pm_message = true;
 	timers.restart_stopwatch(last_received_pm_message);
-	::pthread_mutex_lock(&mutex_pm_queue);
 	msgqueue_pm_in.push(data);
-	::pthread_mutex_unlock(&mutex_pm_queue);
-	::pthread_cond_signal(&cond_message_received);
 	vout(VOUT_VERBOSEST) << ansi::cyan << "-> from PM: " << data << std::endlc;
 }
 
@@ -371,10 +597,14 @@ RH aggie::connect_pm(std::string destination, unsigned port, std::string path)
 
 	pm_url = "ws://" + destination + ":" + int_to_string(port) + path;
 	pm_ = new websocket(destination, port, path);
+	pm_->set_keepalive(config::pm_keepalive_sec * 1000, config::pm_keepalive_max_misses);
+	pm_->set_compression(config::pm_deflate_level, config::pm_deflate_min_bytes);
 	result = pm_->connect();
 	if (result.is_ok())
 	{
 		timers.restart_stopwatch(pm_connected_time);
+		pm_snapshot_requested = true; // A new PM knows nothing
+		pm_binary_requested = false; // ...and has not asked for binary yet
 		vout(VOUT_INFO) << "Connected to presentation manager " << pm_->url() << std::endlc;
 	}
 	else
@@ -396,9 +626,11 @@ RH aggie::disconnect_pm()
 
 	if (pm_ != NULL)
 	{
-		if (pm_->connected())
+		// The listener outlives a lost link, so it is stopped in any case
+		bool was_connected = pm_->connected();
+		pm_->stop_websocket_client_listener();
+		if (was_connected)
 		{
-			pm_->stop_websocket_client_listener();
 			vout(VOUT_INFO) << "Disconnected from presentation manager " << pm_url << std::endlc;
 		}
 		pm_->disconnect();
@@ -411,414 +643,1198 @@ RH aggie::disconnect_pm()
 
 /*! \brief Sends a message to the presentation manager.
  * \param data Message to send
+ * \param binary TRUE to send it as a binary message, FALSE for text
  * \return resulthandler::OK if all is OK, otherwise either
  *         #SOCKET_ERROR_NOT_CONNECTED or #SOCKET_ERROR.
 
  */
-RH aggie::send_pm(std::string data)
+RH aggie::send_pm(const std::string &data, bool binary)
 {
 	sent_a_pm_message = true;
 	timers.restart_stopwatch(last_sent_pm_message);
-	return pm_->send(data);
+	return pm_->send(data.data(), data.length(), (binary ? wsframe_decoder::BINARY_FRAME : wsframe_decoder::TEXT_FRAME));
 }
 
-/*! \brief Processes incoming messages from clients.
+/*! \brief Starts accepting websocket subscribers, which get the same updates as the PM.
+ *
+ * Subscribers always get the JSON encoding.
  *
- * Runs in it's own thread, and sleeps until the #client_listener wakes it up.
+ * \param port Port to listen on
+ * \param callback Function that calls #subscriber_listener()
+ * \return #resulthandler::OK, or the reason the server could not be set up
  */
-void aggie::thread_entry()
+RH aggie::start_subscriber_server(unsigned port, websocketserver::websocketserver_callback callback)
 {
-	int condwait;
-
-	message_listener_running = true;
-	std::string current_dataset = "";
+	RH result;
+	result.set_ok();
 
-	// Dispatch loop
-	while (message_listener_running)
+	stop_subscriber_server();
+	subscribers_ = new websocketserver();
+	subscribers_->set_local_port(port);
+	subscribers_->set_queue_limit(config::subscriber_queue_kb * 1024);
+	result = subscribers_->setup_server("");
+	if (result.is_not_ok())
 	{
-		condwait = pthread_cond_wait(&cond_message_received, &mutex_message_received);
-		if (condwait == 0)
-		{
-			if (::pthread_mutex_trylock(&mutex_pm_queue) == 0)
-			{
-				// We have incoming PM messages. Deal with them.
-				std::string msg = "";
-				while (!msgqueue_pm_in.empty())
-				{
-					msg = msgqueue_pm_in.front();
-					vout(VOUT_VERBOSE) << "From PM: " << msg << std::endlc;
-					msgqueue_pm_in.pop();
-				}
-				::pthread_mutex_unlock(&mutex_pm_queue);
-			}
-			if (::pthread_mutex_trylock(&mutex_client_queue) == 0)
-			{
-				// We have incoming client messages. Deal with them.
-				while (!msgqueue_client_in.empty())
-				{
-					client_message c = msgqueue_client_in.front();
-					msgqueue_client_in.pop();
-					wclient *client = c.get_client();
-					if (client == NULL)
-					{
-						vout(VOUT_ERROR) << "Invalid client" << std::endlc;
-						continue;
-					}
-//					vout(VOUT_VERBOSER) << "From client " << c.get_client()->text() <<  ": " << c.message() << std::endlc;
-					std::string msg = c.message();
-					std::replace(msg.begin(), msg.end(), '\t', ' '); // replace \t with space for easier parsing
-					std::istringstream iss (msg);
-					std::string token;
-					iss >> token;
-					int msg_id;
-					string_to_int(token, msg_id);
-//std::cout << "token = " << token << "    msg_id = " << msg_id << std::endl;
-					if (msg_id == IPCSERVER_REPLY_BUSY)
-					{
-//						client->socket->disconnect();
-						vout(VOUT_VERBOSE) << "Client " << client->host_and_port() << " is busy. Disconnecting." << std::endlc;
-					}
-					else if (msg_id == IPCSERVER_REPLY_HELP)
-					{
-						// Extract data columns
-						client->data_column.clear(); // Erase whatever columns we had before
-						while (!iss.eof())
-						{
-							iss >> token;
-							client->data_column.push_back(token);
-						}
-					}
-					else if (msg_id == IPCSERVER_REPLY_COMMAND_OUTPUT)
-					{
-						::pthread_mutex_lock(&client->request_command_mutex);
-						if (client->request_command.size() > 0)
-						{
-							current_dataset = client->request_command.front();
-						}
-						::pthread_mutex_unlock(&client->request_command_mutex);
-						struct wclient::client_node cn;
-						struct wclient::configuration config;
-						struct wclient::connection connection;
-						int column_index = 0;
-						while (!iss.eof())
-						{
-							iss >> token;
-							std::string field = client->data_column[column_index];
-//std::cout << ansi::green << "  " << "field = " << field<< std::endlc;
-//std::cout << ansi::green << "  " << "token = " << token<< std::endlc;
-							if (current_dataset == "list cn")
-							{
-								if (client->client_nodes_list_finished)
-								{
-									vout(VOUT_DEBUG2) << "Clearing client node list from client " << client->host_and_port() << std::endlc;
-									client->client_nodes.clear();
-									client->client_nodes_list_finished = false;
-								}
-								if (field == "ID") string_to_unsigned(token, cn.id);
-								if (field == "AGE") string_to_unsigned(token, cn.age);
-								if (field == "CR") string_to_unsigned(token, cn.cr);
-								if (field == "LAT") string_to_double(token, cn.lat);
-								if (field == "LON") string_to_double(token, cn.lon);
-								if (field == "P2P_IP") cn.p2p_ip.set_host_and_port(token);
-								if (field == "RADAC_IP") cn.radac_ip.set_host_and_port(token);
-							}
-							if (current_dataset == "list connections")
-							{
-								if (client->connection_list_finished)
-								{
-									vout(VOUT_DEBUG2) << "Clearing connection list from client " << client->host_and_port() << std::endlc;
-									client->connections.clear();
-									client->connection_list_finished = false;
-								}
-								if (field == "DIR") connection.dir = token;
-								if (field == "PEER_ID") string_to_unsigned(token, connection.peer_id);
-								if (field == "PEER_IP") connection.peer_ip.set_host_and_port(token);
-							}
-							if (current_dataset == "list configs")
-							{
-								if (client->config_list_finished)
-								{
-									vout(VOUT_DEBUG2) << "Clearing configuration list from client " << client->host_and_port() << std::endlc;
-									client->configs.clear();
-									client->config_list_finished = false;
-								}
-								if (field == "ID") string_to_unsigned(token, config.id);
-								if (field == "AGE") string_to_unsigned(token, config.age);
-								if (field == "SRC_IP") config.src_ip.set_host_and_port(token);
-								if (field == "CONFIG") config.config = token;
-							}
-							column_index += 1;
-						}
-						// Complete line has been read; now store it:
-						if (current_dataset == "list cn")
-						{
-							client->client_nodes.push_back(cn);
-							vout(VOUT_DEBUG2) << client->host_and_port() << ": Added new client_node entry:" << std::endlc;
-							vout(VOUT_DEBUG2) << " - ID       = " << cn.id << std::endlc;
-							vout(VOUT_DEBUG2) << " - AGE      = " << cn.age << std::endlc;
-							vout(VOUT_DEBUG2) << " - CR       = " << cn.cr << std::endlc;
-							vout(VOUT_DEBUG2) << " - LAT      = " << cn.lat << std::endlc;
-							vout(VOUT_DEBUG2) << " - LON      = " << cn.lon << std::endlc;
-							vout(VOUT_DEBUG2) << " - P2P_IP   = " << cn.p2p_ip.host_and_port() << std::endlc;
-							vout(VOUT_DEBUG2) << " - RADAC_IP = " << cn.radac_ip.host_and_port() << std::endlc;
-							vout(VOUT_DEBUG2) << " New client_node count = " << client->client_nodes.size() << std::endlc;
-						}
-						if (current_dataset == "list connections")
-						{
-							client->connections.push_back(connection);
-							vout(VOUT_DEBUG2) << client->host_and_port() << ": Added new connection entry:" << std::endlc;
-							vout(VOUT_DEBUG2) << " - DIR      = " << connection.dir << std::endlc;
-							vout(VOUT_DEBUG2) << " - PEER_ID  = " << connection.peer_id << std::endlc;
-							vout(VOUT_DEBUG2) << " - PEER_IP  = " << connection.peer_ip.host_and_port() << std::endlc;
-							vout(VOUT_DEBUG2) << " New connection count = " << client->connections.size() << std::endlc;
-						}
-						if (current_dataset == "list configs")
-						{
-							client->configs.push_back(config);
-							vout(VOUT_DEBUG2) << client->host_and_port() << ": Added new configuration entry:" << std::endlc;
-							vout(VOUT_DEBUG2) << " - ID       = " << config.id << std::endlc;
-							vout(VOUT_DEBUG2) << " - AGE      = " << config.age << std::endlc;
-							vout(VOUT_DEBUG2) << " - SRC_IP   = " << config.src_ip.host_and_port() << std::endlc;
-							vout(VOUT_DEBUG2) << " - CONFIG   = " << config.config << std::endlc;
-							vout(VOUT_DEBUG2) << " New configuration count = " << client->configs.size() << std::endlc;
-						}
-					}
-					if (msg_id == IPCSERVER_REPLY_READY)
-					{
-						// Finished current data set
-						vout(VOUT_DEBUG2) << "Finished current current_dataset \"" << current_dataset << "\" from client " << client->host_and_port() << std::endlc;
-
-						::pthread_mutex_lock(&client->request_command_mutex);
-						if (client->request_command.size() > 0)
-						{
-//std::cout << ansi::green << "  " << "current_dataset = " << current_dataset << std::endlc;
-//std::cout << "About to pop..." << std::endl;
-							client->request_command.pop();
-//std::cout << "Popped" << std::endl;
-						}
-						::pthread_mutex_unlock(&client->request_command_mutex);
-						if (current_dataset == "list cn")
-						{
-							client->client_nodes_list_finished = true;
-							client->data_changed = true;
-							new_data_from_client = true;
-							vout(VOUT_DEBUG2) << "Received all client nodes from client " << client->host_and_port() << std::endlc;
-						}
-						if (current_dataset == "list connections")
-						{
-							client->connection_list_finished = true;
-							client->data_changed = true;
-							new_data_from_client = true;
-							vout(VOUT_DEBUG2) << "Received all connections from client " << client->host_and_port() << std::endlc;
-						}
-						if (current_dataset == "list configs")
-						{
-							client->config_list_finished = true;
-							client->data_changed = true;
-							new_data_from_client = true;
-							vout(VOUT_DEBUG2) << "Received all configs from client " << client->host_and_port() << std::endlc;
-						}
-//						std::cout << "Received 200" << std::endlc;
-//std::cout << "[3] request_command size = " << client->request_command.size() << std::endlc;
-					}
+		delete subscribers_;
+		subscribers_ = NULL;
+		return(result);
+	}
+	result = subscribers_->start_websocket_server(callback);
+	vout(VOUT_INFO) << "Accepting websocket subscribers on port " << port << std::endlc;
+	return(result);
+}
 
-				}
-				::pthread_mutex_unlock(&mutex_client_queue);
-			}
-		}
+/*! \brief Disconnects all subscribers, and stops accepting new ones.
+ * \return Always returns #resulthandler::OK
+ */
+RH aggie::stop_subscriber_server()
+{
+	RH result;
+	result.set_ok();
+
+	if (subscribers_ != NULL)
+	{
+		subscribers_->stop_websocket_server();
+		delete subscribers_;
+		subscribers_ = NULL;
 	}
-	vout(VOUT_DEBUG) << "[aggie] exiting listener thread" << std::endlc;
+
+	return(result);
 }
 
-/*! \brief Starts the message listener \ref thread_entry() "thread" that
- * processes incoming messages from clients.
+/*! \brief Called by the subscriber server when a subscriber needs a snapshot. Wakes the main loop to send one.
+ * \param server The subscriber server
  */
-void aggie::start_message_listener()
+void aggie::subscriber_listener(websocketserver *server)
 {
-	run();
-	while (!message_listener_running); // Wait til message listener thread has been started properly
-	vout(VOUT_DEBUG) << "[aggie] listener thread started" << std::endlc;
+	(void) server;
+	::pthread_mutex_lock(&mutex_main_action);
+	subscriber_snapshot_requested = true; // Only the subscribers; the PM's deltas go on as before
+	::pthread_cond_signal(&cond_main_action);
+	::pthread_mutex_unlock(&mutex_main_action);
+}
 
+/*! \brief Checks whether the updates must also be written for subscribers.
+ */
+bool aggie::have_subscribers()
+{
+	return((subscribers_ != NULL) && (subscribers_->subscriber_count() > 0));
 }
 
-/*! \brief Requests information from clients.
- *
- * \param info_command Request \ref CLIENT_COMMANDS "command string" to send to the clients
- *
+/*! \brief Reads a \c "command" request from the PM.
+ * \param request The request
+ * \param[out] command The command. Its \c id is set even if the request is not valid.
+ * \param[out] error What is wrong with the request
+ * \return TRUE if the request is valid
  */
-void aggie::get_info_from_clients(std::string info_command)
+static bool parse_pm_command(const Json::Value &request, command_router::pm_command &command, std::string &error)
 {
-	std::vector<wclient*>::iterator itr = clients.begin();
-	while (itr != clients.end())
+	command.id = "null";
+	if (request.isMember("id"))
+	{
+		Json::FastWriter writer;
+		command.id = writer.write(request["id"]);
+		trim(command.id); // The writer ends with a newline
+	}
+	command.all_nodes = false;
+	command.nodes.clear();
+	command.commands.clear();
+
+	const Json::Value &nodes = request["nodes"];
+	if (nodes.isString() && (nodes.asString() == "all"))
 	{
-		// How long to wait before discarding a previous request:
-		unsigned timeout = (config::client_poll_interval_sec * 1000) / 2; // Always discard before new poll
-		if (timeout == 0) timeout = 1000;  // One second by default
-		if (timers.get_stopwatch_elapsed_time_in_ms((*itr)->last_received_message) > timeout)
+		command.all_nodes = true;
+	}
+	else if (nodes.isArray() && (nodes.size() > 0))
+	{
+		for (Json::ArrayIndex i = 0; i < nodes.size(); i++)
 		{
-			if ((*itr)->request_command.size() > 0)
+			if (!nodes[i].isUInt())
 			{
-				(*itr)->request_command.pop();
-				vout(VOUT_DEBUG) << "Too long since last reply from " << (*itr)->host_and_port() << " - removing last request. request queue size is now " << (*itr)->request_command.size() << std::endlc;
+				error = "node ids must be unsigned integers";
+				return(false);
 			}
+			command.nodes.push_back(nodes[i].asUInt());
 		}
-		if (((*itr)->socket->connected()) && ((*itr)->send_command(info_command).is_not_ok()))
-		{
-			vout(VOUT_ERROR) << "Error in connection to " << (*itr)->host_and_port() << " - forcing disconnect" << std::endlc;
-			(*itr)->socket->disconnect();
-		}
-		sleep_ms(50);
-		itr += 1;
 	}
-}
-
-void aggie::get_info_from_clients()
-{
-	if (clients.size() > 0)
+	else
 	{
-		vout(VOUT_VERBOSER) << "Polling clients" << std::endlc;
-		get_info_from_clients(GET_CLIENT_NODES);
-		get_info_from_clients(GET_CONFIGS);
-		get_info_from_clients(GET_CONNECTIONS);
+		error = "\"nodes\" must be a list of node ids, or \"all\"";
+		return(false);
 	}
-}
 
-void aggie::send_info_to_pm(wclient *client)
-{
-	Json::Value root;
-	std::string host = client->host();
-	std::string port = client->port();
-	std::string cn("cn");
-	std::vector<struct wclient::client_node>::iterator itr = client->client_nodes.begin();
-	while(itr != client->client_nodes.end())
+	const Json::Value &single = request["command"];
+	const Json::Value &list = request["commands"];
+	if (single.isString())
 	{
-		std::string id = int_to_string(itr->id);
-		root[host][port][cn][id]["age"]      = itr->age;
-		root[host][port][cn][id]["cr"]       = itr->cr;
-		root[host][port][cn][id]["lat"]      = itr->lat;
-		root[host][port][cn][id]["lon"]      = itr->lon;
-		root[host][port][cn][id]["p2pip"]    = itr->p2p_ip.host_and_port();
-		root[host][port][cn][id]["radac_ip"] = itr->radac_ip.host_and_port();
-		itr += 1;
+		command.commands.push_back(single.asString());
 	}
-	send_pm(root.toStyledString());
-}
-
-void aggie::send_client_nodes_to_pm()
-{
-	Json::Value root;
-	Json::Value data;
-
-	std::set<struct wclient::client_node, wclient::compare>::iterator itr = aggregated_cn_list.begin();
-	while(itr != aggregated_cn_list.end())
-	{
-		Json::Value entry;
-		std::string lat;
-		std::string lon;
-		double_to_string(itr->lat, lat);
-		double_to_string(itr->lon, lon);
-		entry["unitId"]     = itr->id;
-		entry["unitPos"]    = lat + " " + lon;
-		entry["unitSymbol"] = "SFGPICU---Exxx";
-		entry["unitEnum"]   = "";
-		entry["unitAlt"]    = 0.0;
-		entry["unitSpeed"]  = 0.0;
-		data.append(entry);
-		itr++;
+	else if (list.isArray())
+	{
+		for (Json::ArrayIndex i = 0; i < list.size(); i++)
+		{
+			if (!list[i].isString())
+			{
+				error = "commands must be strings";
+				return(false);
+			}
+			command.commands.push_back(list[i].asString());
+		}
 	}
-	root["data"] = data;
-	vout(VOUT_DEBUG) << "Sending client nodes to PM:" << std::endl << root.toStyledString() << std::endlc;
-	send_pm(root.toStyledString());
-}
-
-void aggie::add_to_aggregated_list(wclient *client)
-{
-	std::vector<struct wclient::client_node>::iterator itr = client->client_nodes.begin();
-	while(itr != client->client_nodes.end())
+	for (unsigned i = 0; i < command.commands.size(); i++)
 	{
-		aggregated_cn_list.insert(*itr);
-		itr += 1;
+		// A line break would let one command pass for several
+		if (command.commands[i].empty() || (command.commands[i].find_first_of("\r\n") != std::string::npos))
+		{
+			error = "commands must be single, non-empty lines";
+			return(false);
+		}
 	}
-}
-
-std::vector<std::string> aggie::get_cn_list()
-{
-	std::vector<std::string> cn_list;
-
-	std::set<struct wclient::client_node, wclient::compare>::iterator itr = aggregated_cn_list.begin();
-	while(itr != aggregated_cn_list.end())
+	if (command.commands.empty())
 	{
-		std::stringstream cn;
-		cn << "ID: " << itr->id << " age=" << itr->age << " cr=" << itr->cr << " lat/lon=" << itr->lat << "/" << itr->lon << " p2p-ip=" << itr->p2p_ip.host_and_port() << " radac-ip=" << itr->radac_ip.host_and_port();
-		cn_list.push_back(cn.str());
-		itr++;
+		error = "\"command\" or \"commands\" is missing";
+		return(false);
 	}
-
-	return(cn_list);
+	return(true);
 }
 
-/*! \brief Main application loop.
- *
- * This is where all it all happens after everything has been set up.
- *
+/*! \brief Processes incoming messages from the PM.
  *
- * \return Always returns resulthandler::OK
+ * Runs in it's own thread, and sleeps until the #pm_listener wakes it up.
+ * Messages from the clients are processed by the \ref dispatcher_shard "dispatcher shards".
  */
-RH aggie::start()
+void aggie::thread_entry()
 {
-	RH result;
-	result.set_ok();
-
-	int poll_intervall_counter = config::client_poll_interval_sec * 1000;
-
-	sleep_ms(CLIENTS_CN_POLL_INITIAL_DELAY_MS);
-	get_info_from_clients();
+	message_listener_running = true;
 
-	running = true;
-	while (!stop_main_loop)
+	// Dispatch loop
+	while (message_listener_running)
 	{
-		if (new_data_from_client)
+		std::string pm_msg = "";
+		if (!msgqueue_pm_in.pop(pm_msg))
 		{
-			// New list of client nodes has been received from one or more of the clients.
-			// This information must be aggregated and transmitted to the PM.
-			aggregated_cn_list.clear();
-			std::vector<wclient*>::iterator clients_itr = clients.begin();
-			while (clients_itr != clients.end())
-			{
-//				if ((*clients_itr)->data_changed)
-//				{
-					//send_info_to_pm(*clients_itr);
-					add_to_aggregated_list(*clients_itr);
-					(*clients_itr)->data_changed= false;
-//				}
-				clients_itr += 1;
-			}
-			new_data_from_client = false;
-			if (previous_client_count != aggregated_cn_list.size())
+			msgqueue_pm_in.wait(message_listener_running);
+			continue;
+		}
+		vout(VOUT_VERBOSE) << "From PM: " << pm_msg << std::endlc;
+		Json::Value request;
+		Json::Reader reader;
+		if (!reader.parse(pm_msg, request, false) || !request.isObject())
+		{
+			continue;
+		}
+		std::string request_type = request.get("request", "").asString();
+		if ((request_type == "snapshot") || (request_type == "encoding"))
+		{
+			// The PM has lost track of the deltas, or wants them in another
+			// encoding, which must start with a snapshot
+			::pthread_mutex_lock(&mutex_main_action);
+			if (request_type == "encoding")
 			{
-				vout(VOUT_INFO) << "Total client count: " << aggregated_cn_list.size() << std::endlc;
-				previous_client_count = aggregated_cn_list.size();
+				pm_binary_requested = (request.get("encoding", "").asString() == "binary");
 			}
-			send_client_nodes_to_pm();
+			pm_snapshot_requested = true;
+			::pthread_cond_signal(&cond_main_action);
+			::pthread_mutex_unlock(&mutex_main_action);
 		}
-
-		unsigned long sleep_delay_ms = 500;
-		sleep_ms(sleep_delay_ms);
-
-		if (config::client_poll_interval_sec > 0)
+		else if (request_type == "command")
 		{
-			// Perform repolling of clients at specified interval if requested on command line
-			if (poll_intervall_counter <= 0)
+			// Routed to the clients by the main loop, which knows where each node is
+			command_router::pm_command command;
+			std::string error = "";
+			if (parse_pm_command(request, command, error))
+			{
+				router.submit(command);
+			}
+			else
 			{
-				vout(VOUT_VERBOSEST) << "Repolling clients after " << config::client_poll_interval_sec << " second" << (config::client_poll_interval_sec > 1 ? "s" : "") << std::endlc;
-				get_info_from_clients(GET_CLIENT_NODES);
-				get_info_from_clients(GET_CONFIGS);
-				get_info_from_clients(GET_CONNECTIONS);
-				poll_intervall_counter = config::client_poll_interval_sec * 1000;
+				vout(VOUT_VERBOSE) << "Invalid command from PM: " << error << std::endlc;
+				router.reject(command.id, error); // The main loop sends the answer
 			}
-			poll_intervall_counter -= sleep_delay_ms;
+			::pthread_mutex_lock(&mutex_main_action);
+			::pthread_cond_signal(&cond_main_action);
+			::pthread_mutex_unlock(&mutex_main_action);
 		}
-
+	}
+	vout(VOUT_DEBUG) << "[aggie] exiting listener thread" << std::endlc;
+}
+
+/*! \brief Processes one incoming message from a client.
+ *
+ * Called from the \ref dispatcher_shard "dispatcher shard" the client belongs to,
+ * so messages from the same client are always processed in order, by the same thread.
+ *
+ * \param c The message. It is modified while being parsed.
+ * \param tokens Storage for the tokens of the message, reused between calls
+ */
+void aggie::dispatch_client_message(client_message &c, std::vector<char*> &tokens)
+{
+	std::string current_dataset = "";
+	wclient *client = c.get_client();
+	if (client == NULL)
+	{
+		vout(VOUT_ERROR) << "Invalid client" << std::endlc;
+		return;
+	}
+//	vout(VOUT_VERBOSER) << "From client " << c.get_client()->text() <<  ": " << c.message() << std::endlc;
+	std::string &msg = c.message();
+	if (msg.empty())
+	{
+		return;
+	}
+	// Split the message where it is; the tokens are only valid until the next message
+	tokens.clear();
+	split_in_place(&msg[0], tokens);
+	unsigned msg_id = 0;
+	if (tokens.empty() || !parse_unsigned(tokens[0], msg_id))
+	{
+		vout(VOUT_DEBUG) << "Ignoring message without ID from client " << client->host_and_port() << std::endlc;
+		return;
+	}
+	if (msg_id == IPCSERVER_REPLY_BUSY)
+	{
+//		client->socket->disconnect();
+		vout(VOUT_VERBOSE) << "Client " << client->host_and_port() << " is busy. Disconnecting." << std::endlc;
+	}
+
+	// Find out what the message answers
+	unsigned ticket = 0;
+	::pthread_mutex_lock(&client->request_command_mutex);
+	if (client->request_command.size() > 0)
+	{
+		current_dataset = client->request_command.front().command;
+		ticket = client->request_command.front().ticket;
+		if ((msg_id == IPCSERVER_REPLY_READY) || (msg_id == IPCSERVER_REPLY_BUSY)
+		    || (msg_id == IPCSERVER_REPLY_INVALID_COMMAND) || (msg_id == IPCSERVER_REPLY_INVALID_PARAMETER))
+		{
+			client->request_command.pop(); // The final answer
+		}
+	}
+	::pthread_mutex_unlock(&client->request_command_mutex);
+
+	if (ticket != 0)
+	{
+		// The answer to a command from the PM; its output goes back as text
+		if ((msg_id == IPCSERVER_REPLY_HELP) || (msg_id == IPCSERVER_REPLY_COMMAND_OUTPUT))
+		{
+			if (client->command_output.length() < COMMAND_ROUTER_MAX_OUTPUT)
+			{
+				if (!client->command_output.empty())
+				{
+					client->command_output += '\n';
+				}
+				for (unsigned i = 1; i < tokens.size(); i++)
+				{
+					if (i > 1)
+					{
+						client->command_output += ' ';
+					}
+					client->command_output += tokens[i];
+				}
+			}
+		}
+		else if ((msg_id == IPCSERVER_REPLY_READY) || (msg_id == IPCSERVER_REPLY_BUSY)
+		         || (msg_id == IPCSERVER_REPLY_INVALID_COMMAND) || (msg_id == IPCSERVER_REPLY_INVALID_PARAMETER))
+		{
+			if (router.reply(client, ticket, msg_id, client->command_output))
+			{
+				// A result for the main loop to send to the PM
+				::pthread_mutex_lock(&mutex_main_action);
+				::pthread_cond_signal(&cond_main_action);
+				::pthread_mutex_unlock(&mutex_main_action);
+			}
+			client->command_output.clear();
+		}
+		return;
+	}
+
+	if (msg_id == IPCSERVER_REPLY_HELP)
+	{
+		// Extract data columns
+		client->data_column.assign(tokens.begin() + 1, tokens.end()); // Erase whatever columns we had before
+		// The header belongs to the answer to the oldest request
+		client->compile_columns(wclient::dataset_of(current_dataset));
+	}
+	else if (msg_id == IPCSERVER_REPLY_COMMAND_OUTPUT)
+	{
+		wclient::dataset_type dataset = wclient::dataset_of(current_dataset);
+		if (dataset != client->columns_dataset)
+		{
+			client->compile_columns(dataset); // No header for this list
+		}
+		// Every field is handed to the decoder compiled for its column
+		struct wclient::row row = wclient::row();
+		unsigned column_count = tokens.size() - 1;
+		bool valid = (column_count >= client->columns_required);
+		if (!valid)
+		{
+			vout(VOUT_VERBOSE) << "Incomplete row (" << column_count << " of " << client->columns_required << " columns) from client " << client->host_and_port() << std::endlc;
+		}
+		for (unsigned column_index = 0; valid && (column_index < column_count) && (column_index < client->column_decoders.size()); column_index++)
+		{
+			wclient::field_decoder decoder = client->column_decoders[column_index];
+			if ((decoder != NULL) && !decoder(row, tokens[column_index + 1]))
+			{
+				vout(VOUT_VERBOSE) << "Invalid " << client->data_column[column_index] << " \"" << tokens[column_index + 1] << "\" from client " << client->host_and_port() << std::endlc;
+				valid = false;
+			}
+		}
+		if (!valid)
+		{
+			// Better to leave the row out than to store fields we don't have
+			client->rejected_rows += 1;
+			dataset = wclient::DATASET_NONE;
+		}
+		// Complete line has been read; now store it:
+		if (dataset == wclient::DATASET_CLIENT_NODES)
+		{
+			client->client_nodes.back().push_back(row.cn);
+			vout(VOUT_DEBUG2) << client->host_and_port() << ": Added new client_node entry:" << std::endlc;
+			vout(VOUT_DEBUG2) << " - ID       = " << row.cn.id << std::endlc;
+			vout(VOUT_DEBUG2) << " - AGE      = " << row.cn.age << std::endlc;
+			vout(VOUT_DEBUG2) << " - CR       = " << row.cn.cr << std::endlc;
+			vout(VOUT_DEBUG2) << " - LAT      = " << row.cn.lat << std::endlc;
+			vout(VOUT_DEBUG2) << " - LON      = " << row.cn.lon << std::endlc;
+			vout(VOUT_DEBUG2) << " - P2P_IP   = " << row.cn.p2p_ip.host_and_port() << std::endlc;
+			vout(VOUT_DEBUG2) << " - RADAC_IP = " << row.cn.radac_ip.host_and_port() << std::endlc;
+			vout(VOUT_DEBUG2) << " New client_node count = " << client->client_nodes.back().size() << std::endlc;
+		}
+		if (dataset == wclient::DATASET_CONNECTIONS)
+		{
+			client->connections.back().push_back(row.conn);
+			vout(VOUT_DEBUG2) << client->host_and_port() << ": Added new connection entry:" << std::endlc;
+			vout(VOUT_DEBUG2) << " - DIR      = " << row.conn.dir << std::endlc;
+			vout(VOUT_DEBUG2) << " - PEER_ID  = " << row.conn.peer_id << std::endlc;
+			vout(VOUT_DEBUG2) << " - PEER_IP  = " << row.conn.peer_ip.host_and_port() << std::endlc;
+			vout(VOUT_DEBUG2) << " New connection count = " << client->connections.back().size() << std::endlc;
+		}
+		if (dataset == wclient::DATASET_CONFIGS)
+		{
+			client->configs.back().push_back(row.config);
+			vout(VOUT_DEBUG2) << client->host_and_port() << ": Added new configuration entry:" << std::endlc;
+			vout(VOUT_DEBUG2) << " - ID       = " << row.config.id << std::endlc;
+			vout(VOUT_DEBUG2) << " - AGE      = " << row.config.age << std::endlc;
+			vout(VOUT_DEBUG2) << " - SRC_IP   = " << row.config.src_ip.host_and_port() << std::endlc;
+			vout(VOUT_DEBUG2) << " - CONFIG   = " << row.config.config << std::endlc;
+			vout(VOUT_DEBUG2) << " New configuration count = " << client->configs.back().size() << std::endlc;
+		}
+	}
+	else if ((msg_id == IPCSERVER_REPLY_BUSY) || (msg_id == IPCSERVER_REPLY_INVALID_COMMAND) || (msg_id == IPCSERVER_REPLY_INVALID_PARAMETER))
+	{
+		// One of our polls was refused; whatever it listed so far is not a complete list
+		vout(VOUT_VERBOSE) << "Client " << client->host_and_port() << " refused \"" << current_dataset << "\" with " << msg_id << std::endlc;
+		client->discard_partial_lists();
+	}
+	if (msg_id == IPCSERVER_REPLY_READY)
+	{
+		// Finished current data set
+		vout(VOUT_DEBUG2) << "Finished current current_dataset \"" << current_dataset << "\" from client " << client->host_and_port() << std::endlc;
+		// The list is complete; the main thread may have it
+		client->publish_list(wclient::dataset_of(current_dataset));
+		if (current_dataset == "list cn")
+		{
+			client->data_changed = true;
+			new_data_from_client = true;
+			vout(VOUT_DEBUG2) << "Received all client nodes from client " << client->host_and_port() << std::endlc;
+		}
+		if (current_dataset == "list connections")
+		{
+			client->data_changed = true;
+			new_data_from_client = true;
+			vout(VOUT_DEBUG2) << "Received all connections from client " << client->host_and_port() << std::endlc;
+		}
+		if (current_dataset == "list configs")
+		{
+			client->data_changed = true;
+			new_data_from_client = true;
+			vout(VOUT_DEBUG2) << "Received all configs from client " << client->host_and_port() << std::endlc;
+		}
+//		std::cout << "Received 200" << std::endlc;
+//std::cout << "[3] request_command size = " << client->request_command.size() << std::endlc;
+	}
+}
+
+/*! \brief Starts the message listener \ref thread_entry() "thread" that
+ * processes incoming messages from the PM, and the
+ * \ref dispatcher_shard "dispatcher shards" that process incoming messages from clients.
+ *
+ * \param shard_count Number of dispatcher shards. At least one is always started.
+ */
+void aggie::start_message_listener(unsigned shard_count)
+{
+	if (shard_count == 0) shard_count = 1;
+	for (unsigned i = 0; i < shard_count; i++)
+	{
+		dispatcher_shard *shard = new dispatcher_shard(this);
+		shard->start();
+		shards.push_back(shard);
+	}
+	vout(VOUT_VERBOSE) << "Processing client messages with " << shards.size() << " dispatcher thread" << (shards.size() != 1 ? "s" : "") << std::endlc;
+
+	run();
+	while (!message_listener_running); // Wait til message listener thread has been started properly
+	vout(VOUT_DEBUG) << "[aggie] listener thread started" << std::endlc;
+
+}
+
+/*! \brief Finds the dispatcher shard that processes a client's messages.
+ * \param c Client
+ * \return Dispatcher shard
+ */
+aggie::dispatcher_shard *aggie::shard_of(wclient *c)
+{
+	return(shards[c->shard % shards.size()]);
+}
+
+/*! \brief Constructor.
+ * \param owner The aggie instance whose clients the shard serves
+ */
+aggie::dispatcher_shard::dispatcher_shard(aggie *owner)
+	: dispatched(0),
+	  owner_(owner),
+	  running(false)
+{
+	::pthread_mutex_init(&mutex_client_data, NULL);
+}
+
+/*! \brief Destructor. The shard must have been stopped.
+ */
+aggie::dispatcher_shard::~dispatcher_shard()
+{
+	::pthread_mutex_destroy(&mutex_client_data);
+}
+
+/*! \brief Starts the shard's \ref thread_entry() "thread".
+ */
+void aggie::dispatcher_shard::start()
+{
+	run();
+	while (!running); // Wait til the thread has been started properly
+}
+
+/*! \brief Stops the shard's thread. Messages still in the queue are not processed.
+ */
+void aggie::dispatcher_shard::stop()
+{
+	if (running)
+	{
+		running = false;
+		queue.interrupt();
+		wait();
+	}
+}
+
+/*! \brief Queues a message from one of the shard's clients. May be called from any thread.
+ * \param message The message
+ */
+void aggie::dispatcher_shard::push(const client_message &message)
+{
+	queue.push(message);
+}
+
+/*! \brief Keeps the shard from updating its clients' data until #unlock_clients().
+ */
+void aggie::dispatcher_shard::lock_clients()
+{
+	::pthread_mutex_lock(&mutex_client_data);
+}
+
+/*! \brief Lets the shard update its clients' data again.
+ */
+void aggie::dispatcher_shard::unlock_clients()
+{
+	::pthread_mutex_unlock(&mutex_client_data);
+}
+
+/*! \brief Processes the messages queued for the shard.
+ *
+ * Messages are taken out of the queue in batches of up to #DISPATCH_BATCH_SIZE.
+ */
+void aggie::dispatcher_shard::thread_entry()
+{
+	std::vector<client_message> batch;
+	std::vector<char*> tokens; // Points into the message being parsed
+
+	running = true;
+	while (running)
+	{
+		batch.clear();
+		if (queue.pop_batch(batch, DISPATCH_BATCH_SIZE) == 0)
+		{
+			queue.wait(running);
+			continue;
+		}
+		lock_clients();
+		std::vector<client_message>::iterator batch_itr = batch.begin();
+		while (batch_itr != batch.end())
+		{
+			owner_->dispatch_client_message(*batch_itr, tokens);
+			batch_itr += 1;
+		}
+		unlock_clients();
+		dispatched += batch.size();
+	}
+}
+
+/*! \brief Requests information from clients.
+ *
+ * \param info_command Request \ref CLIENT_COMMANDS "command string" to send to the clients
+ *
+ */
+void aggie::get_info_from_clients(std::string info_command)
+{
+	get_info_from_clients(std::vector<std::string>(1, info_command));
+}
+
+/*! \brief Sends a set of requests to every client.
+ *
+ * The requests are pipelined, so every client gets all of them in one write,
+ * and nothing here waits for any client.
+ *
+ * \param info_commands Request \ref CLIENT_COMMANDS "command strings" to send to the clients
+ */
+void aggie::get_info_from_clients(const std::vector<std::string> &info_commands)
+{
+	std::vector<wclient*>::iterator itr = clients.begin();
+	while (itr != clients.end())
+	{
+		if ((*itr)->socket->connected())
+		{
+			get_info_from_client(*itr, info_commands);
+		}
+		itr += 1;
+	}
+}
+
+/*! \brief Sends a set of requests to a single client.
+ *
+ * Requests that the client has left unanswered for too long are forgotten first.
+ *
+ * \param c Client
+ * \param info_commands Request \ref CLIENT_COMMANDS "command strings" to send
+ */
+void aggie::get_info_from_client(wclient *c, const std::vector<std::string> &info_commands)
+{
+	// How long to wait before discarding previous requests:
+	unsigned timeout = poll_interval_ms(c) / 2; // Always discard before new poll
+	if (timeout == 0) timeout = 1000;  // One second by default
+
+	if (timers.get_stopwatch_elapsed_time_in_ms(c->last_received_message).value() > timeout)
+	{
+		// None of the outstanding requests will be answered now
+		vout(VOUT_DEBUG) << "Too long since last reply from " << c->host_and_port() << " - removing old requests" << std::endlc;
+		c->forget_requests();
+	}
+
+	RH sent = c->send_commands(info_commands);
+	if (sent == SOCKET_ERROR_SEND_QUEUE_FULL)
+	{
+		// Client is not reading what we send; skip it this time
+		vout(VOUT_VERBOSE) << "Client " << c->host_and_port() << " is not keeping up: " << sent.text() << std::endlc;
+	}
+	else if (sent.is_not_ok())
+	{
+		vout(VOUT_ERROR) << "Error in connection to " << c->host_and_port() << " - forcing disconnect" << std::endlc;
+		c->socket->disconnect();
+	}
+}
+
+/*! \brief Tells how often a client is to be polled.
+ *
+ * \param c Client
+ * \return Poll interval in milliseconds, or 0 if the client is not to be repolled
+ */
+unsigned aggie::poll_interval_ms(wclient *c)
+{
+	if (c->poll_interval_sec > 0)
+	{
+		return(c->poll_interval_sec * 1000);
+	}
+	return(config::client_poll_interval_sec * 1000);
+}
+
+/*! \brief Asks the main thread to read the client list again, e.g. for the supervisor.
+ *
+ * The clients are replaced by #reload_clients() in the main loop, since
+ * the poll schedule and the aggregated nodes refer to them.
+ */
+void aggie::request_client_reload()
+{
+	::pthread_mutex_lock(&mutex_main_action);
+	client_reload_requested = true;
+	::pthread_cond_signal(&cond_main_action);
+	::pthread_mutex_unlock(&mutex_main_action);
+}
+
+/*! \brief Replaces every client with the ones in the client list file. Called by the main thread.
+ *
+ * The new clients are polled at once, and then get their place in the poll schedule.
+ */
+void aggie::reload_clients()
+{
+	vout(VOUT_INFO) << "Reloading clients from \"" << clients_filename_ << "\"" << std::endlc;
+	disconnect_clients();
+	delete_clients();
+	// The nodes of the old clients are gone; the PM and the supervisor are told with the next update
+	aggregated_nodes.copy_nodes(aggregated_cn_list.back());
+	aggregated_cn_list.publish();
+	new_data_from_client = true;
+	add_clients();
+	connect_clients();
+	get_info_from_clients();
+	schedule_polls();
+}
+
+/*! \brief Gives every client its first repoll deadline.
+ *
+ * The deadlines are spread evenly over the poll interval, so the
+ * clients are polled one at a time rather than all at once.
+ */
+void aggie::schedule_polls()
+{
+	poll_schedule.clear();
+	unsigned index = 0;
+	std::vector<wclient*>::iterator clients_itr = clients.begin();
+	while (clients_itr != clients.end())
+	{
+		unsigned interval = poll_interval_ms(*clients_itr);
+		if (interval > 0)
+		{
+			unsigned offset = (unsigned long long) interval * index / clients.size();
+			poll_schedule.schedule(*clients_itr, interval + offset);
+		}
+		index += 1;
+		clients_itr += 1;
+	}
+}
+
+/*! \brief Polls the clients whose deadline has passed, and sets their next deadline.
+ *
+ * Clients that are not connected keep their place in the schedule; they
+ * are polled by #client_reconnected() when they come back.
+ */
+void aggie::poll_due_clients()
+{
+	std::vector<void*> due;
+	poll_schedule.expire(due);
+	std::vector<void*>::iterator itr = due.begin();
+	while (itr != due.end())
+	{
+		wclient *c = static_cast<wclient*>(*itr);
+		itr += 1;
+
+		unsigned interval = poll_interval_ms(c);
+		if (interval == 0)
+		{
+			continue;
+		}
+		poll_schedule.schedule(c, interval);
+		if ((c->connection_state == wclient::STATE_CONNECTED) && c->socket->connected())
+		{
+			vout(VOUT_VERBOSEST) << "Repolling client " << c->text() << " after " << interval << " ms" << std::endlc;
+			get_info_from_client(c, poll_commands);
+		}
+	}
+}
+
+/*! \brief Lets the main thread sleep until it has something to do.
+ *
+ * Returns early if #stop() is called.
+ *
+ * \param timeout_ms Maximum time to sleep
+ */
+void aggie::wait_for_main_action(unsigned timeout_ms)
+{
+	if (timeout_ms == 0)
+	{
+		return;
+	}
+	struct timespec deadline;
+	::clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += timeout_ms / 1000;
+	deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L)
+	{
+		deadline.tv_sec += 1;
+		deadline.tv_nsec -= 1000000000L;
+	}
+	::pthread_mutex_lock(&mutex_main_action);
+	if (!stop_main_loop)
+	{
+		::pthread_cond_timedwait(&cond_main_action, &mutex_main_action, &deadline);
+	}
+	::pthread_mutex_unlock(&mutex_main_action);
+}
+
+/*! \brief Requests all information from all clients.
+ */
+void aggie::get_info_from_clients()
+{
+	if (clients.size() > 0)
+	{
+		vout(VOUT_VERBOSER) << "Polling clients" << std::endlc;
+		get_info_from_clients(poll_commands);
+	}
+}
+
+void aggie::send_info_to_pm(wclient *client)
+{
+	Json::Value root;
+	std::string host = client->host();
+	std::string port = client->port();
+	std::string cn("cn");
+	const std::vector<struct wclient::client_node> &client_nodes = client->client_nodes.read();
+	std::vector<struct wclient::client_node>::const_iterator itr = client_nodes.begin();
+	while(itr != client_nodes.end())
+	{
+		std::string id = int_to_string(itr->id);
+		root[host][port][cn][id]["age"]      = itr->age;
+		root[host][port][cn][id]["cr"]       = itr->cr;
+		root[host][port][cn][id]["lat"]      = itr->lat;
+		root[host][port][cn][id]["lon"]      = itr->lon;
+		root[host][port][cn][id]["p2pip"]    = itr->p2p_ip.host_and_port();
+		root[host][port][cn][id]["radac_ip"] = itr->radac_ip.host_and_port();
+		itr += 1;
+	}
+	send_pm(root.toStyledString());
+}
+
+/*! \brief Writes a client node as a unit for the PM.
+ * \param writer Where to write the unit
+ * \param cn Client node
+ */
+void aggie::write_pm_unit(json_writer &writer, const struct wclient::client_node &cn)
+{
+	char position[2 * JSON_NUMBER_TEXT_LENGTH];
+	unsigned length = json_writer::format_double(position, cn.lat);
+	position[length++] = ' ';
+	length += json_writer::format_double(position + length, cn.lon);
+	writer.begin_object();
+	writer.key("unitId");     writer.value(cn.id);
+	writer.key("unitPos");    writer.value(position, length);
+	writer.key("unitSymbol"); writer.value("SFGPICU---Exxx");
+	writer.key("unitEnum");   writer.value("");
+	writer.key("unitAlt");    writer.value(0.0);
+	writer.key("unitSpeed");  writer.value(0.0);
+	writer.end_object();
+}
+
+/*! \brief Writes a client node as a unit for the PM, in the binary encoding.
+ * \param encoder Where to write the unit
+ * \param cn Client node
+ */
+void aggie::write_pm_unit(pm_binary_encoder &encoder, const struct wclient::client_node &cn)
+{
+	encoder.unit(cn.id, cn.lat, cn.lon, "SFGPICU---Exxx", "", 0.0, 0.0);
+}
+
+/*! \brief Gets the rendering of a unit, rendering it only if it has changed since last time.
+ * \param e The unit's entry in #aggregated_nodes
+ * \return The unit as JSON. Only valid until #aggregated_nodes is updated.
+ */
+const std::string &aggie::pm_fragment(const node_index::entry &e)
+{
+	if (e.fragment.empty())
+	{
+		pm_fragment_writer.clear();
+		write_pm_unit(pm_fragment_writer, e.node);
+		e.fragment = pm_fragment_writer.str();
+	}
+	return(e.fragment);
+}
+
+/*! \brief Sends every known unit to the PM.
+ *
+ * In delta mode the snapshot is also the base for the following deltas.
+ * A snapshot is also where the PM's choice of encoding takes effect.
+ */
+void aggie::send_client_nodes_to_pm()
+{
+	if (config::pm_delta_updates)
+	{
+		pm_units.clear();
+	}
+	if (pm_binary != pm_binary_requested)
+	{
+		pm_binary = pm_binary_requested;
+		vout(VOUT_INFO) << "Sending updates to PM as " << (pm_binary ? "binary" : "JSON") << std::endlc;
+	}
+	// Subscribers get JSON, whatever the PM gets
+	bool text = !pm_binary || have_subscribers();
+	pm_sequence += 1;
+	pm_writer.clear();
+	if (pm_binary)
+	{
+		pm_encoder.begin(PM_BINARY_SNAPSHOT, pm_sequence);
+		pm_encoder.count(aggregated_nodes.size());
+	}
+	if (text)
+	{
+		pm_writer.begin_object();
+		pm_writer.key("type"); pm_writer.value("snapshot");
+		pm_writer.key("seq");  pm_writer.value(pm_sequence);
+		pm_writer.key("data");
+		pm_writer.begin_array();
+	}
+	node_index::const_iterator itr = aggregated_nodes.begin();
+	while(itr != aggregated_nodes.end())
+	{
+		if (pm_binary)
+		{
+			write_pm_unit(pm_encoder, itr->node);
+		}
+		if (text)
+		{
+			const std::string &fragment = pm_fragment(*itr);
+			pm_writer.raw(fragment.data(), fragment.length());
+		}
+		if (config::pm_delta_updates)
+		{
+			pm_units[itr->node.id] = itr->node;
+		}
+		itr++;
+	}
+	pm_snapshot_requested = false;
+	subscriber_snapshot_requested = false; // They get this one
+	timers.restart_stopwatch(last_pm_snapshot);
+	if (text)
+	{
+		pm_writer.end_array();
+		pm_writer.end_object();
+	}
+	if (pm_binary)
+	{
+		vout(VOUT_DEBUG) << "Sending client nodes to PM: " << pm_encoder.str().length() << " bytes" << std::endlc;
+		send_pm(pm_encoder.str(), true);
+	}
+	else
+	{
+		if (verbosity >= VOUT_DEBUG)
+		{
+			vout(VOUT_DEBUG) << "Sending client nodes to PM: " << pm_writer.str() << std::endlc;
+		}
+		send_pm(pm_writer.str());
+	}
+	if (text && (subscribers_ != NULL))
+	{
+		subscribers_->publish(pm_writer.str(), true);
+	}
+}
+
+/*! \brief Sends every known unit to the subscribers that are waiting for a snapshot.
+ *
+ * The snapshot is made from the cached fragments, and carries the sequence
+ * number of the last update to the PM, so the deltas that follow build on
+ * it. Neither the PM nor the subscribers that are up to date get it.
+ */
+void aggie::send_client_nodes_to_subscribers()
+{
+	subscriber_snapshot_requested = false;
+	if (subscribers_ == NULL)
+	{
+		return;
+	}
+	pm_writer.clear();
+	pm_writer.begin_object();
+	pm_writer.key("type"); pm_writer.value("snapshot");
+	pm_writer.key("seq");  pm_writer.value(pm_sequence);
+	pm_writer.key("data");
+	pm_writer.begin_array();
+	node_index::const_iterator itr = aggregated_nodes.begin();
+	while(itr != aggregated_nodes.end())
+	{
+		const std::string &fragment = pm_fragment(*itr);
+		pm_writer.raw(fragment.data(), fragment.length());
+		itr++;
+	}
+	pm_writer.end_array();
+	pm_writer.end_object();
+	vout(VOUT_DEBUG) << "Sending client nodes to waiting subscribers: " << pm_writer.str().length() << " bytes" << std::endlc;
+	subscribers_->publish(pm_writer.str(), true, true);
+}
+
+/*! \brief Sends the units that were added, removed, or moved since the PM last heard of them.
+ *
+ * Units whose changes are all below the configured thresholds are left
+ * out, and nothing is sent if no unit is left. Each delta carries the
+ * next sequence number, so the PM can tell when it has missed one and
+ * ask for a snapshot.
+ *
+ * \param ids Nodes that have changed in #aggregated_nodes
+ */
+void aggie::send_client_node_changes_to_pm(const std::vector<unsigned> &ids)
+{
+	// Sort the changes first, so each list can be written in one go
+	std::vector<const node_index::entry*> &added = pm_added;
+	std::vector<const node_index::entry*> &changed = pm_changed;
+	std::vector<unsigned> &removed = pm_removed;
+	added.clear();
+	changed.clear();
+	removed.clear();
+	std::vector<unsigned>::const_iterator ids_itr = ids.begin();
+	while (ids_itr != ids.end())
+	{
+		const node_index::entry *e = aggregated_nodes.find(*ids_itr);
+		std::map<unsigned, struct wclient::client_node>::iterator sent = pm_units.find(*ids_itr);
+		if (e == NULL)
+		{
+			if (sent != pm_units.end())
+			{
+				removed.push_back(*ids_itr);
+				pm_units.erase(sent);
+			}
+		}
+		else if (sent == pm_units.end())
+		{
+			added.push_back(e);
+			pm_units[*ids_itr] = e->node;
+		}
+		else if (unit_moved(sent->second, e->node))
+		{
+			changed.push_back(e);
+			sent->second = e->node;
+		}
+		ids_itr += 1;
+	}
+	if (added.empty() && changed.empty() && removed.empty())
+	{
+		return;
+	}
+
+	pm_sequence += 1;
+	if (pm_binary)
+	{
+		pm_encoder.begin(PM_BINARY_DELTA, pm_sequence);
+		pm_encoder.count(added.size());
+		for (unsigned i = 0; i < added.size(); i++)
+		{
+			write_pm_unit(pm_encoder, added[i]->node);
+		}
+		pm_encoder.count(changed.size());
+		for (unsigned i = 0; i < changed.size(); i++)
+		{
+			write_pm_unit(pm_encoder, changed[i]->node);
+		}
+		pm_encoder.count(removed.size());
+		for (unsigned i = 0; i < removed.size(); i++)
+		{
+			pm_encoder.id(removed[i]);
+		}
+		vout(VOUT_DEBUG) << "Sending client node changes to PM: " << pm_encoder.str().length() << " bytes" << std::endlc;
+		send_pm(pm_encoder.str(), true);
+		if (!have_subscribers())
+		{
+			return;
+		}
+	}
+	pm_writer.clear();
+	pm_writer.begin_object();
+	pm_writer.key("type"); pm_writer.value("delta");
+	pm_writer.key("seq");  pm_writer.value(pm_sequence);
+	pm_writer.key("added");
+	pm_writer.begin_array();
+	for (unsigned i = 0; i < added.size(); i++)
+	{
+		const std::string &fragment = pm_fragment(*added[i]);
+		pm_writer.raw(fragment.data(), fragment.length());
+	}
+	pm_writer.end_array();
+	pm_writer.key("changed");
+	pm_writer.begin_array();
+	for (unsigned i = 0; i < changed.size(); i++)
+	{
+		const std::string &fragment = pm_fragment(*changed[i]);
+		pm_writer.raw(fragment.data(), fragment.length());
+	}
+	pm_writer.end_array();
+	pm_writer.key("removed");
+	pm_writer.begin_array();
+	for (unsigned i = 0; i < removed.size(); i++)
+	{
+		pm_writer.value(removed[i]);
+	}
+	pm_writer.end_array();
+	pm_writer.end_object();
+	if (!pm_binary)
+	{
+		if (verbosity >= VOUT_DEBUG)
+		{
+			vout(VOUT_DEBUG) << "Sending client node changes to PM: " << pm_writer.str() << std::endlc;
+		}
+		send_pm(pm_writer.str());
+	}
+	if (subscribers_ != NULL)
+	{
+		subscribers_->publish(pm_writer.str(), false);
+	}
+}
+
+/*! \brief Checks whether a unit has changed enough for the PM to be told.
+ * \param sent The unit as last sent to the PM
+ * \param now The unit as it is now
+ * \return TRUE if any of the configured thresholds is reached
+ */
+bool aggie::unit_moved(const struct wclient::client_node &sent, const struct wclient::client_node &now)
+{
+	if (config::pm_delta_distance_m > 0)
+	{
+		// Equirectangular approximation; plenty for a few meters
+		const double earth_radius_m = 6371000.0;
+		const double radians = M_PI / 180.0;
+		double north = (now.lat - sent.lat) * radians;
+		double east = (now.lon - sent.lon) * radians * cos((now.lat + sent.lat) * radians / 2);
+		if (earth_radius_m * sqrt(north * north + east * east) >= config::pm_delta_distance_m)
+		{
+			return(true);
+		}
+	}
+	if ((config::pm_delta_cr_change > 0) &&
+	    (((now.cr > sent.cr) ? now.cr - sent.cr : sent.cr - now.cr) >= config::pm_delta_cr_change))
+	{
+		return(true);
+	}
+	if ((config::pm_delta_age_change > 0) &&
+	    (((now.age > sent.age) ? now.age - sent.age : sent.age - now.age) >= config::pm_delta_age_change))
+	{
+		return(true);
+	}
+	return(false);
+}
+
+/*! \brief Checks whether it is time for a full snapshot to the PM, in delta mode.
+ * \return TRUE if the PM has asked for one, or the snapshot interval has passed
+ */
+bool aggie::pm_snapshot_due()
+{
+	if (pm_snapshot_requested)
+	{
+		return(true);
+	}
+	return((config::pm_snapshot_interval_sec > 0) &&
+	       (timers.get_stopwatch_elapsed_time_in_ms(last_pm_snapshot).value() >= config::pm_snapshot_interval_sec * 1000));
+}
+
+/*! \brief Brings #aggregated_nodes up to date with the clients that have sent new lists.
+ *
+ * Only clients whose \ref wclient::data_changed "data_changed" flag is set are
+ * looked at, and only the nodes they report are touched.
+ *
+ * \return Number of nodes that were added, removed, or changed
+ */
+unsigned aggie::aggregate_changed_clients()
+{
+	unsigned changes = 0;
+	std::vector<wclient*>::iterator clients_itr = clients.begin();
+	while (clients_itr != clients.end())
+	{
+		wclient *c = *clients_itr;
+		clients_itr += 1;
+		if (!c->data_changed)
+		{
+			continue;
+		}
+		c->data_changed = false;
+		if (c->client_nodes.fresh())
+		{
+			changes += aggregated_nodes.update(c, c->client_nodes.read());
+		}
+	}
+	return(changes);
+}
+
+std::vector<std::string> aggie::get_cn_list()
+{
+	std::vector<std::string> cn_list;
+
+	// Called from the supervisor thread, while the main thread builds the next list
+	const std::vector<struct wclient::client_node> &aggregated = aggregated_cn_list.read();
+	std::vector<struct wclient::client_node>::const_iterator itr = aggregated.begin();
+	while(itr != aggregated.end())
+	{
+		std::stringstream cn;
+		cn << "ID: " << itr->id << " age=" << itr->age << " cr=" << itr->cr << " lat/lon=" << itr->lat << "/" << itr->lon << " p2p-ip=" << itr->p2p_ip.host_and_port() << " radac-ip=" << itr->radac_ip.host_and_port();
+		cn_list.push_back(cn.str());
+		itr++;
+	}
+
+	return(cn_list);
+}
+
+/*! \brief Main application loop.
+ *
+ * This is where all it all happens after everything has been set up.
+ *
+ *
+ * \return Always returns resulthandler::OK
+ */
+RH aggie::start()
+{
+	RH result;
+	result.set_ok();
+
+	sleep_ms(CLIENTS_CN_POLL_INITIAL_DELAY_MS);
+	get_info_from_clients();
+	schedule_polls();
+	timers.restart_stopwatch(main_loop_timer);
+
+	running = true;
+	while (!stop_main_loop)
+	{
+		if (client_reload_requested)
+		{
+			client_reload_requested = false;
+			reload_clients();
+		}
+
+		if (new_data_from_client && (timers.get_stopwatch_elapsed_time_in_ms(main_loop_timer).value() >= MAIN_LOOP_INTERVAL_MS))
+		{
+			// New lists have been received from one or more of the clients.
+			// The client nodes must be aggregated and transmitted to the PM.
+			new_data_from_client = false;
+			if (aggregate_changed_clients() > 0)
+			{
+				if (previous_client_count != aggregated_nodes.size())
+				{
+					vout(VOUT_INFO) << "Total client count: " << aggregated_nodes.size() << std::endlc;
+					previous_client_count = aggregated_nodes.size();
+				}
+				aggregated_nodes.copy_nodes(aggregated_cn_list.back());
+				aggregated_cn_list.publish();
+			}
+			aggregated_nodes.take_changes(changed_node_ids);
+			if (!config::pm_delta_updates || pm_snapshot_due())
+			{
+				send_client_nodes_to_pm();
+			}
+			else
+			{
+				send_client_node_changes_to_pm(changed_node_ids);
+			}
+		}
+		else if (pm_snapshot_requested || (config::pm_delta_updates && pm_snapshot_due()))
+		{
+			aggregated_nodes.take_changes(changed_node_ids); // Covered by the snapshot
+			send_client_nodes_to_pm();
+		}
+		if (subscriber_snapshot_requested)
+		{
+			send_client_nodes_to_subscribers();
+		}
+
+		if (timers.get_stopwatch_elapsed_time_in_ms(main_loop_timer).value() >= MAIN_LOOP_INTERVAL_MS)
+		{
+			timers.restart_stopwatch(main_loop_timer);
+			reconnect_clients();
+		}
+
+		// Polls are spread out, so each client is polled exactly when it is due
+		poll_due_clients();
+
+		route_pm_commands();
+
+		unsigned elapsed_ms = timers.get_stopwatch_elapsed_time_in_ms(main_loop_timer).value();
+		unsigned housekeeping_ms = (elapsed_ms < MAIN_LOOP_INTERVAL_MS) ? MAIN_LOOP_INTERVAL_MS - elapsed_ms : 0;
+		wait_for_main_action(poll_schedule.time_to_next(housekeeping_ms));
 	}
 
 	vout(VOUT_DEBUG) << "[aggie] leaving main thread loop" << std::endlc;
@@ -827,6 +1843,66 @@ RH aggie::start()
 	return(result);
 }
 
+/*! \brief Sends the commands from the PM on to the clients, and the results back to the PM.
+ *
+ * Each target node is reached through the client whose report of it is in
+ * #aggregated_nodes, which is why this runs in the main thread.
+ */
+void aggie::route_pm_commands()
+{
+	command_router::pm_command command;
+	while (router.take(command))
+	{
+		std::map<wclient*, std::vector<unsigned> > targets;
+		std::vector<unsigned> unknown_nodes;
+		if (command.all_nodes)
+		{
+			node_index::const_iterator itr = aggregated_nodes.begin();
+			while (itr != aggregated_nodes.end())
+			{
+				targets[(wclient*) itr->source].push_back(itr->node.id);
+				itr++;
+			}
+		}
+		else
+		{
+			std::vector<unsigned>::const_iterator nodes_itr = command.nodes.begin();
+			while (nodes_itr != command.nodes.end())
+			{
+				const node_index::entry *e = aggregated_nodes.find(*nodes_itr);
+				if (e == NULL)
+				{
+					unknown_nodes.push_back(*nodes_itr);
+				}
+				else
+				{
+					targets[(wclient*) e->source].push_back(*nodes_itr);
+				}
+				nodes_itr++;
+			}
+		}
+		vout(VOUT_VERBOSE) << "Routing command " << command.id << " from PM to " << targets.size() << " client" << (targets.size() != 1 ? "s" : "") << std::endlc;
+		std::map<wclient*, std::vector<unsigned> >::iterator targets_itr = targets.begin();
+		while (targets_itr != targets.end())
+		{
+			router.route(command.job, targets_itr->first, targets_itr->second);
+			targets_itr++;
+		}
+		router.routed(command.job, unknown_nodes);
+	}
+	router.expire();
+
+	std::string result;
+	while (router.take_result(result))
+	{
+		vout(VOUT_VERBOSE) << "Command result to PM: " << result << std::endlc;
+		if ((pm_ != NULL) && pm_->connected())
+		{
+			send_pm(result);
+		}
+	}
+}
+
 /*! \brief Stops the main application loop.
  *
  * \return Always returns resulthandler::OK
@@ -836,6 +1912,10 @@ RH aggie::stop()
 	RH result;
 	result.set_ok();
 
+	::pthread_mutex_lock(&mutex_main_action);
+	stop_main_loop = true; // Also if start() has not yet entered the main loop
+	::pthread_cond_signal(&cond_main_action); // Wakes the main loop
+	::pthread_mutex_unlock(&mutex_main_action);
 	if (running || message_listener_running)
 	{
 		vout(VOUT_DEBUG) << "Stopping aggie" << std::endlc;
@@ -843,13 +1923,14 @@ RH aggie::stop()
 		if (message_listener_running)
 		{
 			message_listener_running = false;
-			::pthread_cond_signal(&cond_message_received); // Must "fake" this to wake the thread
+			msgqueue_pm_in.interrupt(); // Wakes the thread whether it sleeps or not
 			wait();
 		}
-		if (running)
+		std::vector<dispatcher_shard*>::iterator shards_itr = shards.begin();
+		while (shards_itr != shards.end())
 		{
-			stop_main_loop = true;
-//		while (running); // Wait for main loop top finish
+			(*shards_itr)->stop();
+			shards_itr += 1;
 		}
 	}
 
@@ -866,11 +1947,21 @@ std::vector<std::string> aggie::status()
 	if ((pm_ == NULL) || (!pm_->connected()))
 	{
 		status.push_back("Not connected to PM");
+		if ((pm_ != NULL) && (config::pm_keepalive_sec > 0) && (pm_->missed_pongs() >= config::pm_keepalive_max_misses))
+		{
+			status.push_back(format_string("Link to PM @ %s given up after %u unanswered pings", pm_->url().c_str(), pm_->missed_pongs()));
+		}
 	}
 	else
 	{
-		status.push_back(format_string("Connected to PM @ %s for %ld seconds", pm_->url().c_str(),
-		                 timers.get_stopwatch_elapsed_time_in_ms(pm_connected_time).value() / 1000));
+		status.push_back(format_string("Connected to PM @ %s for %ld seconds%s", pm_->url().c_str(),
+		                 timers.get_stopwatch_elapsed_time_in_ms(pm_connected_time).value() / 1000,
+		                 (pm_->compressed() ? " (permessage-deflate)" : "")));
+		if (config::pm_keepalive_sec > 0)
+		{
+			status.push_back(format_string("PM round trip time: %s", pm_->round_trip_times().text().c_str()));
+			status.push_back(format_string("Unanswered pings to PM: %u (gives up at %u)", pm_->missed_pongs(), config::pm_keepalive_max_misses));
+		}
 	}
 	status.push_back(format_string("Last message sent to PM: %s%s",
 	                 (sent_a_pm_message ? int_to_string(timers.get_stopwatch_elapsed_time_in_ms(last_sent_pm_message).value() / 1000).c_str() : "never"),
@@ -889,7 +1980,24 @@ std::vector<std::string> aggie::status()
 		}
 		clients_itr += 1;
 	}
+	if (subscribers_ != NULL)
+	{
+		std::vector<std::string> subscriber_status = subscribers_->status();
+		status.insert(status.end(), subscriber_status.begin(), subscriber_status.end());
+	}
 	status.push_back(format_string("Clients connected: %d of %d", clients_connected, clients.size()));
+	std::vector<std::string> router_status = router.status();
+	status.insert(status.end(), router_status.begin(), router_status.end());
+
+	std::string dispatched = "";
+	std::vector<dispatcher_shard*>::iterator shards_itr = shards.begin();
+	while (shards_itr != shards.end())
+	{
+		dispatched += (dispatched.empty() ? "" : ", ") + format_string("%llu", (*shards_itr)->dispatched);
+		shards_itr += 1;
+	}
+	status.push_back(format_string("Client messages processed by %d dispatcher thread%s: %s",
+	                 shards.size(), (shards.size() != 1 ? "s" : ""), dispatched.c_str()));
 	return(status);
 }
 
@@ -903,6 +2011,9 @@ std::vector<std::string> aggie::client_status(wclient *c)
 	std::vector<std::string> status;
 	status.push_back(format_string("Client %s:%s is %sconnected", c->host().c_str(), c->port().c_str(),
 	                 (c->socket->connected() ? "" : "not ")));
+	status.push_back(format_string(" - Connection: %s", c->connection_state_text().c_str()));
+	status.push_back(format_string(" - Poll interval: %s", (poll_interval_ms(c) > 0 ? format_string("%d seconds%s", poll_interval_ms(c) / 1000, (c->poll_interval_sec > 0 ? " (from client list)" : "")).c_str() : "no repolling")));
+	status.push_back(format_string(" - Rejected rows: %u", c->rejected_rows));
 	status.push_back(format_string(" - Last message sent: %s%s",
 	                 (c->sent_message ? int_to_string(timers.get_stopwatch_elapsed_time_in_ms(c->last_sent_message).value() / 1000).c_str() : "never"),
                      (c->sent_message ? " seconds ago" : "")));
@@ -21,10 +21,16 @@
 #include "timetools.hpp"
 #include "wclient.hpp"
 #include "threadable.hpp"
+#include "reactor.hpp"
+#include "timerwheel.hpp"
+#include "mpscqueue.hpp"
+#include "nodeindex.hpp"
+#include "jsonwriter.hpp"
+#include "pmbinary.hpp"
+#include "commandrouter.hpp"
 
-#include <queue>
 #include <vector>
-#include <set>
+#include <map>
 
 #ifdef PLATFORM_WINDOWS
 #	include <windows.h>
@@ -35,13 +41,10 @@
 
 //! \brief Time to wait after startup before requesting information from the clients.
 #define CLIENTS_CN_POLL_INITIAL_DELAY_MS 10
-
-//! \defgroup CLIENT_COMMANDS Commands we send to the clients.
-//!@{
-#define GET_CLIENT_NODES "list cn"
-#define GET_CONFIGS "list configs"
-#define GET_CONNECTIONS "list connections"
-//!@}
+//! \brief How often the main loop sends news to the PM and looks after lost clients.
+#define MAIN_LOOP_INTERVAL_MS 500
+//! \brief Maximum number of client messages the dispatcher takes out of its queue at a time.
+#define DISPATCH_BATCH_SIZE 256
 
 /*! \brief The main application class where most of the work is coordinated.
  *
@@ -55,23 +58,32 @@ public:
 	RH delete_clients();
 	RH connect_clients();
 	RH disconnect_clients();
+	RH start_reactors(unsigned count);
+	RH stop_reactors();
 	RH connect_pm(std::string url);
 	RH connect_pm(std::string destination, unsigned port, std::string path);
 	RH start_pm_listener(websocket::websocket_callback);
 	RH disconnect_pm();
-	RH send_pm(std::string);
+	RH send_pm(const std::string &data, bool binary = false);
+	RH start_subscriber_server(unsigned port, websocketserver::websocketserver_callback callback);
+	RH stop_subscriber_server();
 	RH start();
 	RH stop();
 	RH shutdown();
 	void pm_listener(websocket *listener, std::string data);
-	void client_listener(tcpsocket *listener, std::string data);
+	void subscriber_listener(websocketserver *server);
+	void client_listener(tcpsocket *listener, const char *line, unsigned length);
 	std::vector<std::string> client_status(wclient *c);
 	std::vector<std::string> client_status();
 	std::vector<std::string> client_status(std::string host, std::string port);
 	std::vector<std::string> status();
 	void get_info_from_clients();
 	void get_info_from_clients(std::string info_command);
-	void start_message_listener();
+	void get_info_from_clients(const std::vector<std::string> &info_commands);
+	void get_info_from_client(wclient *c, const std::vector<std::string> &info_commands);
+	void reconnect_clients();
+	void request_client_reload();
+	void start_message_listener(unsigned shard_count);
 	std::vector<std::string> get_cn_list();
 protected:
 private:
@@ -84,43 +96,105 @@ private:
 		client_message() : client_(NULL), message_("") {}
 		client_message(wclient* c, std::string s) : client_(c), message_(s) {};
 		wclient *get_client() { return client_; } //!< Client getter
-		std::string message() { return message_; } //!< Message getter
+		std::string &message() { return message_; } //!< Message getter. The message may be modified in place.
 	private:
 		wclient *client_; //!< Pointer to client
 		std::string message_; //!< The message
 	};
 	wclient *find_client(tcpsocket *);
 	std::vector<wclient*> clients; //!< List of all clients
-	std::queue<std::string> msgqueue_pm_in; //!< Queue of incoming messages from PM
+	std::vector<std::string> poll_commands; //!< \ref CLIENT_COMMANDS "Commands" sent to every client at each poll
+	std::vector<reactor*> reactors; //!< Event loops serving the client connections (empty if each client has its own thread)
+	reactor *least_busy_reactor();
+	RH start_client_listener(wclient *c);
+	void client_reconnected(wclient *c);
+	timerwheel poll_schedule; //!< When each client is to be polled next. Only used by the main thread.
+	unsigned poll_interval_ms(wclient *c);
+	void schedule_polls();
+	void poll_due_clients();
+	void wait_for_main_action(unsigned timeout_ms);
+	command_router router; //!< Commands from the PM on their way to the clients
+	void route_pm_commands();
+	timetools::handle main_loop_timer; //!< Time since the main loop last did its regular work
+	waitable_mpscqueue<std::string> msgqueue_pm_in; //!< Queue of incoming messages from PM
 #	ifdef PLATFORM_LINUX
-		pthread_mutex_t mutex_pm_queue; //!< Mutex for PM incoming messages queue
-		pthread_mutex_t mutex_client_queue; //!< Mutex for client incoming messages queue
-		pthread_cond_t  cond_message_received; //!< Condition variable for when messages are received
-		pthread_mutex_t  mutex_message_received; //!< Mutex for condition variable
 		pthread_cond_t  cond_main_action; //!< Condition variable for when main thread should take action
 		pthread_mutex_t  mutex_main_action; //!< Mutex for condition variable
 #	endif
-	std::queue<client_message> msgqueue_client_in; //!< Queue of incoming messages from clients
+	/*! \brief Dispatcher thread processing the messages from a fixed share of the clients.
+	 *
+	 * Each client belongs to one shard, so its messages are processed in order
+	 * and its request and list state is only ever touched by one thread.
+	 */
+	class dispatcher_shard : public threadable
+	{
+	public:
+		dispatcher_shard(aggie *owner);
+		~dispatcher_shard();
+		void start();
+		void stop();
+		void push(const client_message &message);
+		void lock_clients();
+		void unlock_clients();
+		unsigned long long dispatched; //!< Number of messages processed
+	private:
+		void thread_entry();
+		aggie *owner_; //!< The aggie instance whose clients we serve
+		waitable_mpscqueue<client_message> queue; //!< Incoming messages from our clients
+		volatile bool running; //!< TRUE while the thread is running
+#		ifdef PLATFORM_LINUX
+			pthread_mutex_t mutex_client_data; //!< Held while the shard updates its clients' data
+#		endif
+	};
+	std::vector<dispatcher_shard*> shards; //!< Dispatcher shards processing the messages from the clients
+	dispatcher_shard *shard_of(wclient *c);
+	void dispatch_client_message(client_message &c, std::vector<char*> &tokens);
 	volatile bool message_listener_running; //!< TRUE if this message listener is running (separate thread)
 	volatile bool running; // TRUE as long as this class is in control of the main thread
 	volatile bool stop_main_loop; // TRUE when main loop should stop executing
+	volatile bool client_reload_requested; //!< TRUE when the client list is to be read again by the main thread
+	void reload_clients();
 	pthread_t supervisor_thread; //!< Instance of #supervisor thread
 	std::string clients_filename_; //!< Filename of textfile containing all client IPs and ports. Default is defined in #DEFAULT_CLIENTLIST_FILENAME.
 	websocket *pm_; //!< Pointer to websocket instance for communicating with presentation manager
 	std::string pm_url; //!< URL of presentation manager server
+	websocketserver *subscribers_; //!< Server sending the updates to the PM also to any number of subscribers, or NULL
+	bool have_subscribers();
 	bool received_a_pm_message; //!< TRUE if we've ever recevied any message from PM
 	timetools::handle last_received_pm_message; //!< Time since we last recevied a message from PM
 	bool sent_a_pm_message; //!< TRUE if we've ever sent any message to PM
 	timetools::handle last_sent_pm_message; //!< Time since we last sent a message to PM
 	timetools::handle pm_connected_time; //!< Time we've been connected to PM
 	void thread_entry();
-	bool new_data_from_client; //!< TRUE when any client has sent us a list of client nodes that we haven't yet processed
+	volatile bool new_data_from_client; //!< TRUE when any client has sent us a list of client nodes that we haven't yet processed
 	bool new_configs; //!< TRUE when any client has sent us a list of configs that we haven't yet processed
 	bool new_connections; //!< TRUE when any client has sent us a list of connections that we haven't yet processed
 	void send_info_to_pm(wclient *client);
-	std::set<struct wclient::client_node, wclient::compare> aggregated_cn_list;
-	void add_to_aggregated_list(wclient *client);
+	node_index aggregated_nodes; //!< Every client node reported by any client. Only used by the main thread.
+	snapshot<std::vector<struct wclient::client_node> > aggregated_cn_list; //!< Copy of #aggregated_nodes for the supervisor
+	std::vector<unsigned> changed_node_ids; //!< Nodes changed in #aggregated_nodes since the last update to the PM
+	unsigned aggregate_changed_clients();
 	void send_client_nodes_to_pm();
+	void send_client_nodes_to_subscribers();
+	void send_client_node_changes_to_pm(const std::vector<unsigned> &ids);
+	bool pm_snapshot_due();
+	static bool unit_moved(const struct wclient::client_node &sent, const struct wclient::client_node &now);
+	static void write_pm_unit(json_writer &writer, const struct wclient::client_node &cn);
+	static void write_pm_unit(pm_binary_encoder &encoder, const struct wclient::client_node &cn);
+	const std::string &pm_fragment(const node_index::entry &e);
+	json_writer pm_writer; //!< Reused for every update to the PM
+	json_writer pm_fragment_writer; //!< Reused for rendering single units
+	pm_binary_encoder pm_encoder; //!< Writes the updates to the PM in binary mode
+	bool pm_binary; //!< TRUE if updates are sent to the PM in the binary encoding. Only changed with a snapshot.
+	volatile bool pm_binary_requested; //!< TRUE if the PM has asked for the binary encoding
+	std::vector<const node_index::entry*> pm_added; //!< Units added by the delta being written
+	std::vector<const node_index::entry*> pm_changed; //!< Units changed by the delta being written
+	std::vector<unsigned> pm_removed; //!< Units removed by the delta being written
+	std::map<unsigned, struct wclient::client_node> pm_units; //!< Units as the PM knows them, in delta mode
+	unsigned long long pm_sequence; //!< Sequence number of the last update sent to the PM
+	volatile bool pm_snapshot_requested; //!< TRUE when the PM (and the subscribers) are to get a full snapshot as soon as possible
+	volatile bool subscriber_snapshot_requested; //!< TRUE when a subscriber is waiting for a snapshot of its own
+	timetools::handle last_pm_snapshot; //!< Time since the last full snapshot was sent to the PM
 	unsigned previous_client_count;
 };
 
@@ -0,0 +1,541 @@
+/*! \file commandrouter.cpp
+ *  \copydoc commandrouter.hpp
+ */
+
+#include "commandrouter.hpp"
+#include "jsonwriter.hpp"
+#include "stringutils.hpp"
+#include "vout.hpp"
+
+#include <set>
+#include <algorithm>
+
+#ifdef PLATFORM_LINUX
+#	include <time.h>
+#endif
+
+//! \brief Placeholder in a command that is replaced by the id of each target node.
+#define COMMAND_ROUTER_NODE_PLACEHOLDER "{node}"
+
+/*! \brief Returns a monotonic timestamp in miliseconds.
+ */
+static unsigned long long monotonic_ms()
+{
+	struct timespec now;
+	::clock_gettime(CLOCK_MONOTONIC, &now);
+	return ((unsigned long long) now.tv_sec * 1000) + (now.tv_nsec / 1000000);
+}
+
+/*! \brief Constructor.
+ */
+command_router::command_router()
+	: timeout_ms_(COMMAND_ROUTER_DEFAULT_TIMEOUT_MS),
+	  next_job(1),
+	  next_ticket(1),
+	  finished(0),
+	  timed_out(0)
+{
+	::pthread_mutex_init(&mutex, NULL);
+}
+
+/*! \brief Destructor.
+ */
+command_router::~command_router()
+{
+	::pthread_mutex_destroy(&mutex);
+}
+
+/*! \brief Sets how long to wait for the answers to a command. Takes effect from the next command.
+ */
+void command_router::set_timeout(unsigned timeout_ms)
+{
+	::pthread_mutex_lock(&mutex);
+	timeout_ms_ = timeout_ms;
+	::pthread_mutex_unlock(&mutex);
+}
+
+/*! \brief Accepts a command from the PM. Called by the PM thread.
+ *
+ * The main thread must be woken afterwards, to #take() it.
+ *
+ * \param command The command; its \c job is set
+ * \return The job number
+ */
+unsigned command_router::submit(pm_command &command)
+{
+	::pthread_mutex_lock(&mutex);
+	command.job = next_job++;
+	struct job &j = jobs[command.job];
+	j.id = command.id;
+	j.commands = command.commands;
+	j.deadline_ms = monotonic_ms() + timeout_ms_;
+	j.routed = false;
+	j.outstanding = 0;
+	::pthread_mutex_unlock(&mutex);
+
+	incoming.push(command);
+	return(command.job);
+}
+
+/*! \brief Answers a command from the PM that could not be understood. Called by the PM thread.
+ * \param id The PM's id of the command, as JSON
+ * \param reason What was wrong
+ */
+void command_router::reject(const std::string &id, const std::string &reason)
+{
+	::pthread_mutex_lock(&mutex);
+	write_result(id, "failed", NULL, reason);
+	::pthread_mutex_unlock(&mutex);
+}
+
+/*! \brief Takes out the oldest submitted command. Must only be called from the main thread.
+ * \param[out] command The command, if any
+ * \return TRUE if there was one
+ */
+bool command_router::take(pm_command &command)
+{
+	return(incoming.pop(command));
+}
+
+/*! \brief Sends the commands of a job to one client, for the target nodes it reaches.
+ * \param job The job number
+ * \param client The client
+ * \param nodes Target nodes reached through \c client
+ */
+void command_router::route(unsigned job, wclient *client, const std::vector<unsigned> &nodes)
+{
+	::pthread_mutex_lock(&mutex);
+	std::map<unsigned, struct job>::iterator jobs_itr = jobs.find(job);
+	if (jobs_itr != jobs.end())
+	{
+		struct job &j = jobs_itr->second;
+		std::vector<std::string>::const_iterator commands_itr = j.commands.begin();
+		while (commands_itr != j.commands.end())
+		{
+			if (commands_itr->find(COMMAND_ROUTER_NODE_PLACEHOLDER) == std::string::npos)
+			{
+				add_ticket(job, j, client, *commands_itr, nodes);
+			}
+			else
+			{
+				for (unsigned i = 0; i < nodes.size(); i++)
+				{
+					std::string command = *commands_itr;
+					std::string id = format_string("%u", nodes[i]);
+					size_t position = 0;
+					while ((position = command.find(COMMAND_ROUTER_NODE_PLACEHOLDER, position)) != std::string::npos)
+					{
+						command.replace(position, sizeof COMMAND_ROUTER_NODE_PLACEHOLDER - 1, id);
+						position += id.length();
+					}
+					add_ticket(job, j, client, command, std::vector<unsigned>(1, nodes[i]));
+				}
+			}
+			commands_itr++;
+		}
+		pump(client);
+	}
+	::pthread_mutex_unlock(&mutex);
+}
+
+/*! \brief Marks a job as completely #route()d.
+ * \param job The job number
+ * \param unknown_nodes Target nodes no client reports
+ */
+void command_router::routed(unsigned job, const std::vector<unsigned> &unknown_nodes)
+{
+	::pthread_mutex_lock(&mutex);
+	std::map<unsigned, struct job>::iterator jobs_itr = jobs.find(job);
+	if (jobs_itr != jobs.end())
+	{
+		jobs_itr->second.unknown_nodes = unknown_nodes;
+		jobs_itr->second.routed = true;
+		finish_if_done(job); // At once if nothing was sent
+	}
+	::pthread_mutex_unlock(&mutex);
+}
+
+/*! \brief Takes the final answer of a client to a command. Called by the client's dispatcher shard.
+ *
+ * More commands waiting for the client are sent.
+ *
+ * \param client The client
+ * \param ticket Ticket the command was sent with
+ * \param code The client's reply code
+ * \param output Whatever the client wrote before the reply code
+ * \return TRUE if a result is ready for the PM
+ */
+bool command_router::reply(wclient *client, unsigned ticket, unsigned code, const std::string &output)
+{
+	bool done = false;
+	::pthread_mutex_lock(&mutex);
+	std::map<unsigned, struct ticket>::iterator itr = tickets.find(ticket);
+	if ((itr != tickets.end()) && (itr->second.client == client))
+	{
+		unsigned job = itr->second.job;
+		settle(itr, (code == 200) ? "ok" : ((code == 500) ? "busy" : "failed"), code, output);
+		done = finish_if_done(job);
+		pump(client);
+	}
+	// Otherwise the command has timed out, and the answer is too late
+	::pthread_mutex_unlock(&mutex);
+	return(done);
+}
+
+/*! \brief Gives up on the commands a client was sent before it lost its connection. Called by the main thread when it is back.
+ *
+ * Commands that were not yet sent are sent now, if the client is back.
+ *
+ * \param client The client
+ */
+void command_router::forget_client(wclient *client)
+{
+	::pthread_mutex_lock(&mutex);
+	std::set<unsigned> affected_jobs;
+	std::map<unsigned, struct ticket>::iterator itr = tickets.begin();
+	while (itr != tickets.end())
+	{
+		std::map<unsigned, struct ticket>::iterator current = itr++;
+		if ((current->second.client == client) && current->second.sent)
+		{
+			affected_jobs.insert(current->second.job);
+			settle(current, "connection lost", 0, "");
+		}
+	}
+	std::set<unsigned>::iterator jobs_itr = affected_jobs.begin();
+	while (jobs_itr != affected_jobs.end())
+	{
+		finish_if_done(*jobs_itr);
+		jobs_itr++;
+	}
+	pump(client);
+	::pthread_mutex_unlock(&mutex);
+}
+
+/*! \brief Gives up on every command for a client that is about to be deleted. Called by the main thread.
+ *
+ * Commands sent to it, and commands still waiting to be sent, are
+ * reported as lost, and the client is never referred to again.
+ *
+ * \param client The client
+ */
+void command_router::remove_client(wclient *client)
+{
+	::pthread_mutex_lock(&mutex);
+	std::set<unsigned> affected_jobs;
+	std::map<unsigned, struct ticket>::iterator itr = tickets.begin();
+	while (itr != tickets.end())
+	{
+		std::map<unsigned, struct ticket>::iterator current = itr++;
+		if (current->second.client == client)
+		{
+			affected_jobs.insert(current->second.job);
+			settle(current, "connection lost", 0, "");
+		}
+	}
+	std::set<unsigned>::iterator jobs_itr = affected_jobs.begin();
+	while (jobs_itr != affected_jobs.end())
+	{
+		finish_if_done(*jobs_itr);
+		jobs_itr++;
+	}
+	queues.erase(client);
+	::pthread_mutex_unlock(&mutex);
+}
+
+/*! \brief Finishes the jobs whose time is up, and retries the queues that are stuck. Called regularly by the main thread.
+ *
+ * Commands still unanswered are reported as timed out, or as not sent if
+ * they never left the queue. Commands that could not be sent before, e.g.
+ * because the client's send queue was full, are tried again, since a
+ * client with nothing in flight gets no reply that would do it.
+ */
+void command_router::expire()
+{
+	unsigned long long now = monotonic_ms();
+	::pthread_mutex_lock(&mutex);
+	std::set<wclient*> affected_clients;
+	std::map<unsigned, struct job>::iterator jobs_itr = jobs.begin();
+	while (jobs_itr != jobs.end())
+	{
+		unsigned job = jobs_itr->first;
+		struct job &j = jobs_itr->second;
+		jobs_itr++;
+		if (j.deadline_ms > now)
+		{
+			continue;
+		}
+		for (unsigned i = 0; i < j.tickets.size(); i++)
+		{
+			std::map<unsigned, struct ticket>::iterator itr = tickets.find(j.tickets[i]);
+			if (itr != tickets.end())
+			{
+				affected_clients.insert(itr->second.client);
+				if (itr->second.sent)
+				{
+					timed_out += 1;
+				}
+				settle(itr, itr->second.sent ? "timeout" : "not sent", 0, "");
+			}
+		}
+		j.routed = true; // Nodes the main thread has not got to are left out
+		finish_if_done(job);
+	}
+	std::map<wclient*, struct client_queue>::iterator queues_itr = queues.begin();
+	while (queues_itr != queues.end())
+	{
+		if (!queues_itr->second.pending.empty())
+		{
+			affected_clients.insert(queues_itr->first);
+		}
+		queues_itr++;
+	}
+	std::set<wclient*>::iterator clients_itr = affected_clients.begin();
+	while (clients_itr != affected_clients.end())
+	{
+		pump(*clients_itr);
+		clients_itr++;
+	}
+	::pthread_mutex_unlock(&mutex);
+}
+
+/*! \brief Takes out the oldest result for the PM. Called by the main thread.
+ * \param[out] result The result, as JSON
+ * \return TRUE if there was one
+ */
+bool command_router::take_result(std::string &result)
+{
+	bool found = false;
+	::pthread_mutex_lock(&mutex);
+	if (!results.empty())
+	{
+		result.swap(results.front());
+		results.pop_front();
+		found = true;
+	}
+	::pthread_mutex_unlock(&mutex);
+	return(found);
+}
+
+/*! \brief Returns a description of the commands in progress, for the status report.
+ */
+std::vector<std::string> command_router::status()
+{
+	std::vector<std::string> status;
+	::pthread_mutex_lock(&mutex);
+	unsigned waiting = 0;
+	unsigned in_flight = 0;
+	std::map<wclient*, struct client_queue>::iterator itr = queues.begin();
+	while (itr != queues.end())
+	{
+		waiting += itr->second.pending.size();
+		in_flight += itr->second.in_flight;
+		itr++;
+	}
+	status.push_back(format_string("PM commands: %u in progress, %llu finished; %u sent to clients, %u waiting to be sent, %llu timed out",
+	                 jobs.size(), finished, in_flight, waiting, timed_out));
+	::pthread_mutex_unlock(&mutex);
+	return(status);
+}
+
+/*! \brief Adds a command for a client to a job, and puts it in the client's queue. #mutex must be held.
+ */
+void command_router::add_ticket(unsigned job_number, struct job &j, wclient *client, const std::string &command, const std::vector<unsigned> &nodes)
+{
+	struct outcome o;
+	o.client = client->host_and_port();
+	o.command = command;
+	o.nodes = nodes;
+	o.status = NULL;
+	o.code = 0;
+	j.outcomes.push_back(o);
+
+	unsigned number = next_ticket++;
+	if (next_ticket == 0)
+	{
+		next_ticket = 1;
+	}
+	struct ticket &t = tickets[number];
+	t.job = job_number;
+	t.outcome = j.outcomes.size() - 1;
+	t.client = client;
+	t.sent = false;
+	j.tickets.push_back(number);
+	j.outstanding += 1;
+	queues[client].pending.push_back(number);
+}
+
+/*! \brief Sends as many of the commands waiting for a client as it may have unanswered, in one write. #mutex must be held.
+ *
+ * Commands for a client that is not connected wait until it is, or until they time out.
+ */
+void command_router::pump(wclient *client)
+{
+	std::map<wclient*, struct client_queue>::iterator itr = queues.find(client);
+	if (itr == queues.end())
+	{
+		return;
+	}
+	struct client_queue &q = itr->second;
+	if (q.pending.empty() && (q.in_flight == 0))
+	{
+		queues.erase(itr);
+		return;
+	}
+	if (q.pending.empty() || (q.in_flight >= COMMAND_ROUTER_MAX_IN_FLIGHT) || !client->socket->connected())
+	{
+		return;
+	}
+
+	std::vector<struct wclient::request> batch;
+	for (unsigned i = 0; (i < q.pending.size()) && (q.in_flight + i < COMMAND_ROUTER_MAX_IN_FLIGHT); i++)
+	{
+		struct wclient::request r;
+		r.ticket = q.pending[i];
+		struct ticket &t = tickets[r.ticket];
+		r.command = jobs[t.job].outcomes[t.outcome].command;
+		batch.push_back(r);
+	}
+	RH_INT sent = client->send_requests(batch);
+	if (sent.is_not_ok())
+	{
+		vout(VOUT_VERBOSE) << "[command_router] " << sent.value() << " of " << batch.size() << " commands sent to "
+		                   << client->host_and_port() << ": " << sent.text() << std::endlc;
+	}
+	for (int i = 0; i < sent.value(); i++)
+	{
+		tickets[q.pending.front()].sent = true;
+		q.pending.pop_front();
+		q.in_flight += 1;
+	}
+}
+
+/*! \brief Records what became of a command, and forgets its ticket. #mutex must be held.
+ * \param itr The ticket
+ * \param status How it went
+ * \param code The client's reply code, or 0
+ * \param output The client's output
+ */
+void command_router::settle(std::map<unsigned, struct ticket>::iterator itr, const char *status, unsigned code, const std::string &output)
+{
+	struct ticket &t = itr->second;
+	struct job &j = jobs[t.job];
+	struct outcome &o = j.outcomes[t.outcome];
+	o.status = status;
+	o.code = code;
+	o.output = output.substr(0, COMMAND_ROUTER_MAX_OUTPUT);
+	j.outstanding -= 1;
+
+	struct client_queue &q = queues[t.client];
+	if (t.sent)
+	{
+		q.in_flight -= 1;
+	}
+	else
+	{
+		std::deque<unsigned>::iterator pending_itr = std::find(q.pending.begin(), q.pending.end(), itr->first);
+		if (pending_itr != q.pending.end())
+		{
+			q.pending.erase(pending_itr);
+		}
+	}
+	tickets.erase(itr);
+}
+
+/*! \brief Writes the result of a job and forgets it, if every command has been answered. #mutex must be held.
+ * \return TRUE if the job was finished
+ */
+bool command_router::finish_if_done(unsigned job_number)
+{
+	std::map<unsigned, struct job>::iterator itr = jobs.find(job_number);
+	if ((itr == jobs.end()) || !itr->second.routed || (itr->second.outstanding > 0))
+	{
+		return(false);
+	}
+	struct job &j = itr->second;
+	unsigned succeeded = 0;
+	for (unsigned i = 0; i < j.outcomes.size(); i++)
+	{
+		if (j.outcomes[i].code == 200)
+		{
+			succeeded += 1;
+		}
+	}
+	const char *status = "partial";
+	if (succeeded == 0)
+	{
+		status = "failed";
+	}
+	else if ((succeeded == j.outcomes.size()) && j.unknown_nodes.empty())
+	{
+		status = "ok";
+	}
+	write_result(j.id, status, &j, "");
+	jobs.erase(itr);
+	finished += 1;
+	return(true);
+}
+
+/*! \brief Puts a result for the PM in #results. #mutex must be held.
+ * \param id The PM's id of the command, as JSON
+ * \param status Overall status
+ * \param j The job, or NULL if the command was rejected
+ * \param error Why the command was rejected, or empty
+ */
+void command_router::write_result(const std::string &id, const char *status, const struct job *j, const std::string &error)
+{
+	json_writer json;
+	json.begin_object();
+	json.key("type");
+	json.value("command_result");
+	json.key("id");
+	json.raw(id.data(), id.length());
+	json.key("status");
+	json.value(status);
+	if (!error.empty())
+	{
+		json.key("error");
+		json.value(error);
+	}
+	json.key("results");
+	json.begin_array();
+	if (j != NULL)
+	{
+		for (unsigned i = 0; i < j->outcomes.size(); i++)
+		{
+			const struct outcome &o = j->outcomes[i];
+			json.begin_object();
+			json.key("client");
+			json.value(o.client);
+			json.key("command");
+			json.value(o.command);
+			json.key("nodes");
+			json.begin_array();
+			for (unsigned n = 0; n < o.nodes.size(); n++)
+			{
+				json.value(o.nodes[n]);
+			}
+			json.end_array();
+			json.key("status");
+			json.value((o.status != NULL) ? o.status : "timeout");
+			json.key("code");
+			json.value(o.code);
+			json.key("output");
+			json.value(o.output);
+			json.end_object();
+		}
+	}
+	json.end_array();
+	json.key("unknown");
+	json.begin_array();
+	if (j != NULL)
+	{
+		for (unsigned n = 0; n < j->unknown_nodes.size(); n++)
+		{
+			json.value(j->unknown_nodes[n]);
+		}
+	}
+	json.end_array();
+	json.end_object();
+	results.push_back(json.str());
+}
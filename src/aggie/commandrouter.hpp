@@ -0,0 +1,157 @@
+/*! \file commandrouter.hpp
+ * \brief Forwards commands from the PM to the clients that can reach the target nodes.
+ *
+ * The PM sends a command as a JSON request:
+ *
+ * \code
+ * {"request":"command", "id":17, "nodes":[12, 34], "command":"set txpower 10"}
+ * \endcode
+ *
+ * \c "nodes" may also be \c "all", and \c "commands" may give a list of
+ * commands instead of \c "command". Each node is reached through the
+ * client whose report of it is the freshest. A command is sent once to
+ * each of those clients; if it contains \c {node}, it is sent once for
+ * every target node instead, with \c {node} replaced by the node id.
+ *
+ * When every command has been answered, or has timed out, the PM gets:
+ *
+ * \code
+ * {"type":"command_result", "id":17, "status":"ok", "unknown":[],
+ *  "results":[{"client":"10.0.0.1:4002", "command":"set txpower 10", "nodes":[12, 34],
+ *              "status":"ok", "code":200, "output":""}]}
+ * \endcode
+ *
+ * The overall status is \c "ok" if every command succeeded and every node
+ * was known, \c "failed" if none succeeded, and \c "partial" otherwise.
+ * The status of a single command is \c "ok", \c "failed" (refused by the
+ * client), \c "busy", \c "timeout", \c "connection lost" or \c "not sent"
+ * (the client was not connected).
+ */
+
+#ifndef __COMMANDROUTER_HPP
+#define __COMMANDROUTER_HPP
+
+#include "platform.h"
+#include "wclient.hpp"
+#include "mpscqueue.hpp"
+
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+#ifdef PLATFORM_LINUX
+#	include <pthread.h>
+#endif
+
+//! \brief Largest number of commands from the PM a client may have unanswered at a time.
+#define COMMAND_ROUTER_MAX_IN_FLIGHT 16
+//! \brief Output beyond this many bytes from a single command is left out of the result.
+#define COMMAND_ROUTER_MAX_OUTPUT 4096
+//! \brief Default time to wait for the answers to a command from the PM.
+#define COMMAND_ROUTER_DEFAULT_TIMEOUT_MS 10000
+
+/*! \brief Keeps track of the commands from the PM, from when they arrive until their results are sent back.
+ *
+ * The PM thread #submit()s commands. The main thread, which owns the node
+ * index, #take()s them, #route()s them to the clients and says when it is
+ * done with each by calling #routed(). Commands wait in a queue for each
+ * client, and are sent in batches of up to #COMMAND_ROUTER_MAX_IN_FLIGHT
+ * in one write. The client's dispatcher shard hands each final answer to
+ * #reply(), which sends more from the queue. The main thread also picks
+ * up the finished results with #take_result(), and sends them to the PM,
+ * and calls #expire() regularly, which also retries the queues that could
+ * not be sent.
+ *
+ * Nothing here waits for a client or for the PM. #reply() returns TRUE
+ * when a result is ready, so the dispatcher can wake the main thread.
+ *
+ * \note Thread safe.
+ */
+class command_router
+{
+public:
+	//! \brief A command from the PM, as parsed.
+	struct pm_command
+	{
+		unsigned job; //!< Number given by #submit()
+		std::string id; //!< The PM's id of the command, as JSON; echoed in the result
+		std::vector<std::string> commands; //!< Commands to send for the targets
+		bool all_nodes; //!< TRUE if every known node is a target
+		std::vector<unsigned> nodes; //!< Target node ids, unless #all_nodes
+	};
+	command_router();
+	~command_router();
+	void set_timeout(unsigned timeout_ms);
+	unsigned submit(pm_command &command);
+	void reject(const std::string &id, const std::string &reason);
+	bool take(pm_command &command);
+	void route(unsigned job, wclient *client, const std::vector<unsigned> &nodes);
+	void routed(unsigned job, const std::vector<unsigned> &unknown_nodes);
+	bool reply(wclient *client, unsigned ticket, unsigned code, const std::string &output);
+	void forget_client(wclient *client);
+	void remove_client(wclient *client);
+	void expire();
+	bool take_result(std::string &result);
+	std::vector<std::string> status();
+private:
+	command_router(const command_router &); // Not copyable
+	command_router &operator=(const command_router &);
+	//! \brief What became of one command sent to one client.
+	struct outcome
+	{
+		std::string client; //!< The client, as host:port
+		std::string command; //!< The command as sent
+		std::vector<unsigned> nodes; //!< Target nodes reached through this command
+		const char *status; //!< How it went; NULL until it is known
+		unsigned code; //!< The client's reply code, or 0 if there was none
+		std::string output; //!< The client's output
+	};
+	//! \brief A command from the PM, while it is being carried out.
+	struct job
+	{
+		std::string id; //!< The PM's id of the command, as JSON
+		std::vector<std::string> commands; //!< Commands to send for the targets
+		unsigned long long deadline_ms; //!< When the commands not answered by then have timed out
+		bool routed; //!< TRUE when every target has been given its commands
+		unsigned outstanding; //!< Commands not yet answered
+		std::vector<struct outcome> outcomes; //!< One for each command sent to each client
+		std::vector<unsigned> tickets; //!< Tickets of the commands, answered or not
+		std::vector<unsigned> unknown_nodes; //!< Target nodes no client reports
+	};
+	//! \brief A command on its way to a client.
+	struct ticket
+	{
+		unsigned job; //!< The job the command belongs to
+		unsigned outcome; //!< Index of its #outcome in the job
+		wclient *client; //!< The client it is for
+		bool sent; //!< TRUE when it has been sent; FALSE while it waits in the client's queue
+	};
+	//! \brief Commands for one client.
+	struct client_queue
+	{
+		client_queue() : in_flight(0) {}
+		std::deque<unsigned> pending; //!< Tickets of the commands not yet sent, oldest first
+		unsigned in_flight; //!< Number of commands sent and not yet answered
+	};
+	void add_ticket(unsigned job_number, struct job &j, wclient *client, const std::string &command, const std::vector<unsigned> &nodes);
+	void pump(wclient *client);
+	void settle(std::map<unsigned, struct ticket>::iterator itr, const char *status, unsigned code, const std::string &output);
+	bool finish_if_done(unsigned job_number);
+	void write_result(const std::string &id, const char *status, const struct job *j, const std::string &error);
+	mpscqueue<pm_command> incoming; //!< Commands submitted and not yet taken by the main thread
+	std::map<unsigned, struct job> jobs; //!< Commands submitted and not yet finished, by job number
+	std::map<unsigned, struct ticket> tickets; //!< Commands not yet answered, by ticket
+	std::map<wclient*, struct client_queue> queues; //!< Commands for each client
+	std::deque<std::string> results; //!< Results waiting to be sent to the PM
+	unsigned timeout_ms_; //!< Time to wait for the answers to a command
+	unsigned next_job; //!< Number of the next job
+	unsigned next_ticket; //!< Next ticket; never 0, which stands for our own polls
+	unsigned long long finished; //!< Number of commands from the PM finished
+	unsigned long long timed_out; //!< Number of commands to clients that were never answered
+#	ifdef PLATFORM_LINUX
+		pthread_mutex_t mutex; //!< Protects everything but #incoming
+#	endif
+};
+
+#endif // __COMMANDROUTER_HPP
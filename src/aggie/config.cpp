@@ -25,6 +25,23 @@ namespace config
 		clientlist_filename = DEFAULT_CLIENTLIST_FILENAME;
 		supervisor_listening_port = DEFAULT_SUPERVISOR_LISTENING_PORT;
 		client_poll_interval_sec = DEFAULT_CLIENT_REPOLL_INTERVALL_SEC;
+		reactor_threads = DEFAULT_REACTOR_THREADS;
+		dispatcher_threads = DEFAULT_DISPATCHER_THREADS;
+		client_connect_timeout_ms = DEFAULT_CLIENT_CONNECT_TIMEOUT_MS;
+		reconnect_min_delay_ms = DEFAULT_RECONNECT_MIN_DELAY_MS;
+		reconnect_max_delay_ms = DEFAULT_RECONNECT_MAX_DELAY_MS;
+		pm_delta_updates = false;
+		pm_snapshot_interval_sec = DEFAULT_PM_SNAPSHOT_INTERVAL_SEC;
+		pm_delta_distance_m = DEFAULT_PM_DELTA_DISTANCE_M;
+		pm_delta_cr_change = DEFAULT_PM_DELTA_CR;
+		pm_delta_age_change = DEFAULT_PM_DELTA_AGE;
+		pm_keepalive_sec = DEFAULT_PM_KEEPALIVE_SEC;
+		pm_keepalive_max_misses = DEFAULT_PM_KEEPALIVE_MISSES;
+		pm_deflate_level = DEFAULT_PM_DEFLATE_LEVEL;
+		pm_deflate_min_bytes = DEFAULT_PM_DEFLATE_MIN_SIZE;
+		subscriber_listening_port = DEFAULT_SUBSCRIBER_LISTENING_PORT;
+		subscriber_queue_kb = DEFAULT_SUBSCRIBER_QUEUE_KB;
+		pm_command_timeout_sec = DEFAULT_PM_COMMAND_TIMEOUT_SEC;
 		return result;
 	}
 
@@ -52,6 +69,23 @@ namespace config
 		new_clients_filename = cmdl.add_token_string("c",  "clients", 0, 1, format_string("File containing client list - default %s", DEFAULT_CLIENTLIST_FILENAME));
 		supervisor_port      = cmdl.add_token_uint  ("l",  "listen-port", 0, 1, format_string("Supervisor listening port - default %u", DEFAULT_SUPERVISOR_LISTENING_PORT));
 		client_poll_interval = cmdl.add_token_uint  ("p",  "poll-interval", 0, 1, format_string("Interval (in seconds) between repolling of clients (0 means no repolling) - default %d", DEFAULT_CLIENT_REPOLL_INTERVALL_SEC));
+		reactor_thread_count = cmdl.add_token_uint  ("r",  "reactor-threads", 0, 1, format_string("Number of threads serving all client connections (0 means one thread per client) - default %d", DEFAULT_REACTOR_THREADS));
+		dispatcher_thread_count = cmdl.add_token_uint("d", "dispatcher-threads", 0, 1, format_string("Number of threads processing messages from the clients - default %d", DEFAULT_DISPATCHER_THREADS));
+		client_connect_timeout = cmdl.add_token_uint("t",  "connect-timeout", 0, 1, format_string("Time (in miliseconds) to wait for clients to accept a connection, once their names are resolved - default %d", DEFAULT_CLIENT_CONNECT_TIMEOUT_MS));
+		reconnect_min_delay  = cmdl.add_token_uint  ("",   "reconnect-delay", 0, 1, format_string("Time (in miliseconds) before the first attempt to reconnect a lost client - default %d", DEFAULT_RECONNECT_MIN_DELAY_MS));
+		reconnect_max_delay  = cmdl.add_token_uint  ("",   "reconnect-max-delay", 0, 1, format_string("Longest time (in miliseconds) between attempts to reconnect a lost client - default %d", DEFAULT_RECONNECT_MAX_DELAY_MS));
+		pm_delta             = cmdl.add_token_flag  ("",   "pm-delta", 0, 1, "Only send added, changed and removed units to the PM, with a full snapshot now and then");
+		pm_snapshot_interval = cmdl.add_token_uint  ("",   "pm-snapshot-interval", 0, 1, format_string("Interval (in seconds) between full snapshots to the PM in delta mode (0 means only on request) - default %d", DEFAULT_PM_SNAPSHOT_INTERVAL_SEC));
+		pm_delta_distance    = cmdl.add_token_double("",   "pm-delta-distance", 0, 1, format_string("Distance (in meters) a unit must move to be sent in delta mode (0 means position is ignored) - default %.1f", DEFAULT_PM_DELTA_DISTANCE_M));
+		pm_delta_cr          = cmdl.add_token_uint  ("",   "pm-delta-cr", 0, 1, format_string("Change in CR for a unit to be sent in delta mode (0 means CR is ignored) - default %d", DEFAULT_PM_DELTA_CR));
+		pm_delta_age         = cmdl.add_token_uint  ("",   "pm-delta-age", 0, 1, format_string("Change in age for a unit to be sent in delta mode (0 means age is ignored) - default %d", DEFAULT_PM_DELTA_AGE));
+		pm_keepalive         = cmdl.add_token_uint  ("",   "pm-keepalive", 0, 1, format_string("Interval (in seconds) between pings to the PM (0 means no pings) - default %d", DEFAULT_PM_KEEPALIVE_SEC));
+		pm_keepalive_misses  = cmdl.add_token_uint  ("",   "pm-keepalive-misses", 0, 1, format_string("Number of pings in a row the PM may leave unanswered before the link is considered dead - default %d", DEFAULT_PM_KEEPALIVE_MISSES));
+		pm_deflate           = cmdl.add_token_uint  ("",   "pm-deflate", 0, 1, format_string("Compression level (1-9) for messages to the PM, if the PM supports permessage-deflate (0 means no compression) - default %d", DEFAULT_PM_DEFLATE_LEVEL));
+		pm_deflate_min_size  = cmdl.add_token_uint  ("",   "pm-deflate-min-size", 0, 1, format_string("Messages to the PM shorter than this (in bytes) are not compressed - default %d", DEFAULT_PM_DEFLATE_MIN_SIZE));
+		subscriber_port      = cmdl.add_token_uint  ("",   "subscriber-port", 0, 1, "Port on which to accept websocket subscribers, which get the same updates as the PM (0 means no subscribers) - default 0");
+		subscriber_queue     = cmdl.add_token_uint  ("",   "subscriber-queue", 0, 1, format_string("Data (in kilobytes) that may wait for a subscriber before it is skipped ahead to the next snapshot - default %d", DEFAULT_SUBSCRIBER_QUEUE_KB));
+		pm_command_timeout   = cmdl.add_token_uint  ("",   "pm-command-timeout", 0, 1, format_string("Time (in seconds) to wait for the clients to answer a command from the PM - default %d", DEFAULT_PM_COMMAND_TIMEOUT_SEC));
 
 		print_help->set_callback(&printhelp);
 		display_version->set_callback(&displayversion);
@@ -92,6 +126,98 @@ namespace config
 		{
 			client_poll_interval_sec = client_poll_interval->value();
 		}
+
+		if (reactor_thread_count->count() == 1)
+		{
+			reactor_threads = reactor_thread_count->value();
+		}
+
+		if (dispatcher_thread_count->count() == 1)
+		{
+			dispatcher_threads = dispatcher_thread_count->value();
+			if (dispatcher_threads == 0) dispatcher_threads = 1;
+		}
+
+		if (client_connect_timeout->count() == 1)
+		{
+			client_connect_timeout_ms = client_connect_timeout->value();
+		}
+
+		if (reconnect_min_delay->count() == 1)
+		{
+			reconnect_min_delay_ms = reconnect_min_delay->value();
+		}
+
+		if (reconnect_max_delay->count() == 1)
+		{
+			reconnect_max_delay_ms = reconnect_max_delay->value();
+		}
+		if (reconnect_max_delay_ms < reconnect_min_delay_ms)
+		{
+			reconnect_max_delay_ms = reconnect_min_delay_ms;
+		}
+
+		pm_delta_updates = pm_delta->is_set();
+
+		if (pm_snapshot_interval->count() == 1)
+		{
+			pm_snapshot_interval_sec = pm_snapshot_interval->value();
+		}
+
+		if (pm_delta_distance->count() == 1)
+		{
+			pm_delta_distance_m = pm_delta_distance->value();
+			if (pm_delta_distance_m < 0) pm_delta_distance_m = 0;
+		}
+
+		if (pm_delta_cr->count() == 1)
+		{
+			pm_delta_cr_change = pm_delta_cr->value();
+		}
+
+		if (pm_delta_age->count() == 1)
+		{
+			pm_delta_age_change = pm_delta_age->value();
+		}
+
+		if (pm_keepalive->count() == 1)
+		{
+			pm_keepalive_sec = pm_keepalive->value();
+		}
+
+		if (pm_keepalive_misses->count() == 1)
+		{
+			pm_keepalive_max_misses = pm_keepalive_misses->value();
+			if (pm_keepalive_max_misses < 1) pm_keepalive_max_misses = 1;
+		}
+
+		if (pm_deflate->count() == 1)
+		{
+			pm_deflate_level = pm_deflate->value();
+			if (pm_deflate_level > 9) pm_deflate_level = 9;
+		}
+
+		if (pm_deflate_min_size->count() == 1)
+		{
+			pm_deflate_min_bytes = pm_deflate_min_size->value();
+		}
+
+		if (subscriber_port->count() == 1)
+		{
+			subscriber_listening_port = subscriber_port->value();
+		}
+
+		if (subscriber_queue->count() == 1)
+		{
+			subscriber_queue_kb = subscriber_queue->value();
+			if (subscriber_queue_kb < 1) subscriber_queue_kb = 1;
+		}
+
+		if (pm_command_timeout->count() == 1)
+		{
+			pm_command_timeout_sec = pm_command_timeout->value();
+			if (pm_command_timeout_sec < 1) pm_command_timeout_sec = 1;
+		}
 		return(result);
 	}
 
@@ -56,11 +56,45 @@ namespace config
 	EXPORTED cmdline::arg_string *new_clients_filename;
 	EXPORTED cmdline::arg_uint   *supervisor_port;
 	EXPORTED cmdline::arg_uint   *client_poll_interval;
+	EXPORTED cmdline::arg_uint   *reactor_thread_count;
+	EXPORTED cmdline::arg_uint   *dispatcher_thread_count;
+	EXPORTED cmdline::arg_uint   *client_connect_timeout;
+	EXPORTED cmdline::arg_uint   *reconnect_min_delay;
+	EXPORTED cmdline::arg_uint   *reconnect_max_delay;
+	EXPORTED cmdline::arg_flag   *pm_delta;
+	EXPORTED cmdline::arg_uint   *pm_snapshot_interval;
+	EXPORTED cmdline::arg_double *pm_delta_distance;
+	EXPORTED cmdline::arg_uint   *pm_delta_cr;
+	EXPORTED cmdline::arg_uint   *pm_delta_age;
+	EXPORTED cmdline::arg_uint   *pm_keepalive;
+	EXPORTED cmdline::arg_uint   *pm_keepalive_misses;
+	EXPORTED cmdline::arg_uint   *pm_deflate;
+	EXPORTED cmdline::arg_uint   *pm_deflate_min_size;
+	EXPORTED cmdline::arg_uint   *subscriber_port;
+	EXPORTED cmdline::arg_uint   *subscriber_queue;
+	EXPORTED cmdline::arg_uint   *pm_command_timeout;
 
 	EXPORTED std::string clientlist_filename;
 	EXPORTED std::string presentation_manager;
 	EXPORTED unsigned    supervisor_listening_port;
 	EXPORTED unsigned    client_poll_interval_sec;
+	EXPORTED unsigned    reactor_threads;
+	EXPORTED unsigned    dispatcher_threads;
+	EXPORTED unsigned    client_connect_timeout_ms;
+	EXPORTED unsigned    reconnect_min_delay_ms;
+	EXPORTED unsigned    reconnect_max_delay_ms;
+	EXPORTED bool        pm_delta_updates;
+	EXPORTED unsigned    pm_snapshot_interval_sec;
+	EXPORTED double      pm_delta_distance_m;
+	EXPORTED unsigned    pm_delta_cr_change;
+	EXPORTED unsigned    pm_delta_age_change;
+	EXPORTED unsigned    pm_keepalive_sec;
+	EXPORTED unsigned    pm_keepalive_max_misses;
+	EXPORTED unsigned    pm_deflate_level;
+	EXPORTED unsigned    pm_deflate_min_bytes;
+	EXPORTED unsigned    subscriber_listening_port;
+	EXPORTED unsigned    subscriber_queue_kb;
+	EXPORTED unsigned    pm_command_timeout_sec;
 
 	RH set_default_values();
 	RH parse_commandline(int argc, char **argv);
@@ -6,6 +6,7 @@
 #include "stringutils.hpp"
 #include "vout.hpp"
 #include <cstring>
+#include <ctime>
 #include <iostream>
 #include <typeinfo>
 
@@ -17,11 +18,6 @@ bool ipsocket::init_done = false;
 void ipsocket::common_constructor()
 {
 	init();
-	inbuffer_size = 100;
-	inbuffer_used = 0;
-	inbuffer = new char[inbuffer_size];
-	memset(inbuffer, 0, inbuffer_size);
-	inbuffer_ptr = inbuffer;
 	set_endline("\n");
 	socket_going_down = false;
 }
@@ -31,9 +27,7 @@ void ipsocket::common_constructor()
 ipsocket::ipsocket()
 	: destination_(""),
 	  remote_port_(0),
-	  local_port_(0),
-	  inbuffer(NULL),
-	  inbuffer_ptr(NULL)
+	  local_port_(0)
 {
 	common_constructor();
 }
@@ -44,9 +38,7 @@ ipsocket::ipsocket()
 ipsocket::ipsocket(std::string destination, unsigned port)
 	: destination_(destination),
 	  remote_port_(port),
-	  local_port_(0),
-	  inbuffer(NULL),
-	  inbuffer_ptr(NULL)
+	  local_port_(0)
 {
 	common_constructor();
 }
@@ -57,9 +49,7 @@ ipsocket::ipsocket(std::string destination, unsigned port)
 ipsocket::ipsocket(std::string destination)
 	: destination_(destination),
 	  remote_port_(0),
-	  local_port_(0),
-	  inbuffer(NULL),
-	  inbuffer_ptr(NULL)
+	  local_port_(0)
 {
 	common_constructor();
 }
@@ -68,10 +58,6 @@ ipsocket::ipsocket(std::string destination)
 */
 ipsocket::~ipsocket()
 {
-	if (inbuffer != NULL)
-	{
-		delete[] inbuffer;
-	}
 }
 
 /*! Specifies the remote host address
@@ -180,83 +166,85 @@ unsigned ipsocket::listening_port()
 	return local_port_;
 }
 
-/*! \brief Fetches the next line (terminated by CR or CRLF) of incoming text.
+/*! \brief Fetches the next line (terminated by LF or CRLF) of incoming text.
  *
  *  CR and LF are never included in the returned textline.
  *
  *  Text are fetched from the \ref inbuffer buffer. If there's not
- *  enough characters there, more data is read from the socket.
+ *  a complete line there, more data is read from the socket.
  *
- *  \param[out] buffer Pointer to buffer where the returning textline should be stored
- *  \param max_bytes Size of buffer
- *  \param timeout Timeout in miliseconds before returning anyway
- *  \return #NO_ERRORS, #SOCKET_ERROR or #SOCKET_RECEIVE_TIMEOUT
+ *  \param[out] line Set to point at the textline. Only valid until the socket is read from again.
+ *  \param[out] length Length of the textline
+ *  \param timeout Timeout in miliseconds for each attempt to read from the socket
+ *  \return #NO_ERRORS, #SOCKET_ERROR, or #SOCKET_RECEIVE_TIMEOUT (not an error) if
+ *          the socket is going down before a line has been received
  *
  */
-RH ipsocket::get_next_line(char * const buffer, unsigned max_bytes, unsigned timeout)
+RH ipsocket::get_next_line(const char *&line, unsigned &length, unsigned timeout)
 {
 	RH result;
-	unsigned bytes_read = 0;
-	char * outbuffer_ptr;
-	bool giveup = false;
-
-	outbuffer_ptr = buffer;
 	result.set_ok();
 
-	while (!giveup && !socket_going_down)
+	while (!inbuffer.next_line(line, length))
 	{
-		// First, try to read from the buffer
-		while ((inbuffer_ptr < (inbuffer + inbuffer_used))
-			&& (inbuffer_ptr < (inbuffer + inbuffer_size))
-		    && (bytes_read < max_bytes)
-		    && (*inbuffer_ptr != '\n'))
+		if (socket_going_down)
 		{
-			if (*inbuffer_ptr != '\r' && (*inbuffer_ptr != '\0'))
-			{
-				*outbuffer_ptr = *inbuffer_ptr;
-				bytes_read += 1;
-				outbuffer_ptr += 1;
-			}
-			inbuffer_ptr += 1;
+			result.set_ok(SOCKET_RECEIVE_TIMEOUT);
+			length = 0;
+			break;
 		}
-		if ((inbuffer_ptr < (inbuffer + inbuffer_used))
-		 && (inbuffer_ptr < (inbuffer + inbuffer_size))
-		 && (*inbuffer_ptr == '\n'))
+		RH_INT fetch_result = fill_inbuffer(timeout);
+		if (fetch_result.is_not_ok())
 		{
-			*inbuffer_ptr = '\0'; // To prevent trigging on the same \n the next time
-			giveup = true;
+			result.set_not_ok();
+			result.set_exitstatus(fetch_result.id(), fetch_result.text());
+			break;
 		}
-		else if (bytes_read < max_bytes)
+	}
+
+	return(result);
+}
+
+/*! \brief Reads from the socket into \ref inbuffer.
+ *
+ *  Waits up to \c timeout for data to arrive, and then keeps reading for
+ *  as long as each read fills all the free space in the buffer, so that
+ *  everything waiting on the socket is taken in one go.
+ *
+ *  \param timeout Timeout in miliseconds
+ *  \return Number of bytes read, or the error from #fetch_data()
+ */
+RH_INT ipsocket::fill_inbuffer(unsigned timeout)
+{
+	RH_INT result;
+	result.set_ok();
+	result.set_value(0);
+
+	unsigned total = 0;
+	unsigned space = 0;
+	unsigned received = 0;
+	do
+	{
+		char *position = inbuffer.write_position(space);
+		if (space == 0)
 		{
-			// We've not read an entire line yet; neet to get more data
-			RH_INT fetch_result = fetch_data(inbuffer, inbuffer_size, timeout);
-			if (fetch_result.is_not_ok())
-			{
-//				std::cout << "Fetch data failed on " << destination_ << ":" << remote_port_ << std::endl;
-				result.set_not_ok(fetch_result.id());
-				giveup = true;
-			}
-			else
-			{
-				inbuffer_used = fetch_result.value();
-				inbuffer_ptr = inbuffer;
-				if (fetch_result.is_not_ok())
-				{
-					giveup = true;
-					if (fetch_result.is_not_ok())
-					{
-						result.set_not_ok();
-						result.set_exitstatus(fetch_result.id(), fetch_result.text());
-					}
-				}
-			}
+			break; // Full. Lines must be taken out first.
 		}
-		else
+		RH_INT fetch_result = fetch_data(position, space, (total == 0) ? timeout : 0);
+		if (fetch_result.is_not_ok())
 		{
-			// Return buffer is full
+			if (total == 0)
+			{
+				return(fetch_result);
+			}
+			break; // Deliver what we have; the error will show up again on next read
 		}
-	}
-	*outbuffer_ptr = '\0';
+		received = fetch_result.value();
+		inbuffer.commit(received);
+		total += received;
+	} while (received == space);
+
+	result.set_value(total);
 	return(result);
 }
 
@@ -305,6 +293,16 @@ void tcpsocket::common_constructor()
 	use_ipv4 = true;
 	use_ipv6 = false;
 	tcpsocket_client_listener_running = false;
+	listener_thread_started = false;
+	reactor_ = NULL;
+	resolved_addresses = NULL;
+	connect_candidate = NULL;
+	connect_timeout_ms_ = DEFAULT_CONNECT_TIMEOUT_MS;
+	outqueue_bytes = 0;
+	outqueue_offset = 0;
+	outqueue_limit = DEFAULT_SEND_QUEUE_LIMIT;
+	write_interest = false;
+	::pthread_mutex_init(&outqueue_mutex, NULL);
 }
 
 /*! \brief Default constructor.
@@ -352,81 +350,420 @@ tcpsocket::tcpsocket(std::string destination)
 tcpsocket::~tcpsocket()
 {
 	disconnect();
+	if (resolved_addresses != NULL)
+	{
+		::freeaddrinfo(resolved_addresses);
+	}
+	::pthread_mutex_destroy(&outqueue_mutex);
 }
 
 /*! \brief Establishes a connection to remote #destination_ : #remote_port_.
  *
- * \todo Make non-blocking connect to avoid long timeouts when host is not responding.
+ * Gives up after the time given by #set_connect_timeout() instead of
+ * waiting for the operating system's TCP timeout. That time starts once the
+ * name has been resolved; see #connect_all().
  *
  * \returns #NO_ERRORS, #SOCKET_ERROR_MISSING_DESTINATION,
- *          #SOCKET_ERROR_MISSING_DESTINATION_PORT or #SOCKET_ERROR_COULD_NOT_CONNECT
+ *          #SOCKET_ERROR_MISSING_DESTINATION_PORT, #SOCKET_ERROR_COULD_NOT_CONNECT,
+ *          #SOCKET_ERROR_CONNECT_TIMEOUT or an error message from gai_strerror()
  */
 RH tcpsocket::connect()
 {
 	RH result;
 	result.set_ok();
 
+	std::vector<tcpsocket*> sockets(1, this);
+	RH_INT connect_result = connect_all(sockets, connect_timeout_ms_);
+	if (connect_result.is_not_ok())
+	{
+		result.set_not_ok(connect_result.id(), connect_result.text());
+	}
+
+	return(result);
+}
+
+/*! \brief Specifies how long #connect() may wait for the remote end.
+ * \param timeout_ms Timeout in miliseconds
+ */
+void tcpsocket::set_connect_timeout(unsigned timeout_ms)
+{
+	connect_timeout_ms_ = timeout_ms;
+}
+
+/*! \brief Looks up the addresses of #destination_ : #remote_port_.
+ *
+ * Must be called before #begin_connect(). Blocks while the name is resolved.
+ *
+ * \returns #NO_ERRORS, #SOCKET_ERROR_MISSING_DESTINATION,
+ *          #SOCKET_ERROR_MISSING_DESTINATION_PORT or an error message from gai_strerror()
+ */
+RH tcpsocket::resolve()
+{
+	RH result;
+	result.set_ok();
+
 	if (destination_.length() == 0)
 	{
 		result.set_not_ok(SOCKET_ERROR_MISSING_DESTINATION);
-		goto connect_end;
+		return(result);
 	}
 	if (remote_port_ == 0)
 	{
 		result.set_not_ok(SOCKET_ERROR_MISSING_DESTINATION_PORT);
-		goto connect_end;
+		return(result);
 	}
 
-#ifdef PLATFORM_WINDOWS
-
-#endif
 #ifdef PLATFORM_LINUX
-	if (allow_auto_disconnect)
+	if (resolved_addresses != NULL)
 	{
-		disconnect(); // Make sure we close any existing connections
+		::freeaddrinfo(resolved_addresses);
+		resolved_addresses = NULL;
 	}
+	connect_candidate = NULL;
+
 	struct ::addrinfo socket_hints;
 	memset(&socket_hints, 0, sizeof (socket_hints));
 	socket_hints.ai_family = AF_UNSPEC;
 	socket_hints.ai_socktype = SOCK_STREAM;
 	int rv;
-	struct ::addrinfo *servinfo;
 	if ((rv = ::getaddrinfo(destination_.c_str(), int_to_string(remote_port_).c_str(),
-						  &socket_hints, &servinfo)) != 0)
+	                        &socket_hints, &resolved_addresses)) != 0)
 	{
+		resolved_addresses = NULL;
 		result.set_not_ok(::gai_strerror(rv));
-		goto connect_end;
+		return(result);
 	}
-	struct ::addrinfo *p;
-	for (p = servinfo; p != NULL; p = p->ai_next)
+	connect_candidate = resolved_addresses;
+#endif
+
+	return(result);
+}
+
+/*! \brief Starts a non-blocking connection attempt to the next \ref resolve() "resolved" address.
+ *
+ * \returns #NO_ERRORS if already connected, #SOCKET_CONNECT_IN_PROGRESS (which is not an error)
+ *          if #finish_connect() must be called when the socket becomes writable,
+ *          or #SOCKET_ERROR_COULD_NOT_CONNECT if there are no more addresses to try
+ */
+RH tcpsocket::begin_connect()
+{
+	RH result;
+	result.set_not_ok(SOCKET_ERROR_COULD_NOT_CONNECT);
+
+#ifdef PLATFORM_LINUX
+	if (allow_auto_disconnect && (socket_handle != 0))
 	{
-		if ((socket_handle = ::socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1)
+		disconnect(); // Make sure we close any existing connections
+	}
+	while (connect_candidate != NULL)
+	{
+		struct ::addrinfo *p = connect_candidate;
+		connect_candidate = p->ai_next;
+
+		int handle = ::socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK, p->ai_protocol);
+		if (handle == -1)
 		{
 			continue;
 		}
-		if (::connect(socket_handle, p->ai_addr, p->ai_addrlen) == -1)
+		if (::connect(handle, p->ai_addr, p->ai_addrlen) == 0)
 		{
-			::close(socket_handle);
-			continue;
+			socket_handle = handle;
+			return(finish_connect());
 		}
-		break;
+		if (errno == EINPROGRESS)
+		{
+			socket_handle = handle;
+			result.set_ok(SOCKET_CONNECT_IN_PROGRESS);
+			break;
+		}
+		::close(handle);
 	}
+#endif
 
-	if (p == NULL)
+	return(result);
+}
+
+/*! \brief Completes a connection attempt started by #begin_connect().
+ *
+ * If the attempt failed, the next resolved address is tried.
+ *
+ * \returns #NO_ERRORS when connected, #SOCKET_CONNECT_IN_PROGRESS if another
+ *          address is being tried, or #SOCKET_ERROR_COULD_NOT_CONNECT
+ */
+RH tcpsocket::finish_connect()
+{
+	RH result;
+	result.set_ok();
+
+#ifdef PLATFORM_LINUX
+	int error = 0;
+	::socklen_t length = sizeof error;
+	if ((::getsockopt(socket_handle, SOL_SOCKET, SO_ERROR, &error, &length) == -1) || (error != 0))
 	{
-		result.set_not_ok(SOCKET_ERROR_COULD_NOT_CONNECT);
-		::freeaddrinfo(servinfo);
-		goto connect_end;
+		abort_connect();
+		return(begin_connect());
+	}
+
+	// The rest of the class expects blocking sockets
+	int flags = ::fcntl(socket_handle, F_GETFL, 0);
+	if (flags != -1)
+	{
+		::fcntl(socket_handle, F_SETFL, flags & ~O_NONBLOCK);
 	}
 	is_connected = true;
+	vout(VOUT_DEBUG) << "[" << whoami() << "] connected to " << destination_ << ":" << remote_port_ << std::endlc;
+#endif
 
-	char s[INET6_ADDRSTRLEN];
-	::inet_ntop(p->ai_family, get_in_addr((struct ::sockaddr *)p->ai_addr), s, sizeof s);
-	::freeaddrinfo(servinfo);
+	return(result);
+}
 
-#endif
+/*! \brief Starts a new non-blocking connection attempt.
+ *
+ * Reuses the addresses from the previous #resolve() if there are any,
+ * so reconnecting does not have to wait for name resolution.
+ *
+ * \returns Same as #begin_connect(), or the error from #resolve()
+ */
+RH tcpsocket::restart_connect()
+{
+	if (resolved_addresses == NULL)
+	{
+		RH resolved = resolve();
+		if (resolved.is_not_ok())
+		{
+			return(resolved);
+		}
+	}
+	connect_candidate = resolved_addresses;
+	return(begin_connect());
+}
+
+/*! \brief Checks, without waiting, if a connection attempt has completed.
+ *
+ * \returns #SOCKET_CONNECT_IN_PROGRESS (which is not an error) if it is still
+ *          in progress, otherwise the same as #finish_connect()
+ */
+RH tcpsocket::poll_connect()
+{
+	RH result;
+	result.set_ok();
+
+	if (is_connected)
+	{
+		return(result);
+	}
+	if (socket_handle == 0)
+	{
+		result.set_not_ok(SOCKET_ERROR_COULD_NOT_CONNECT);
+		return(result);
+	}
+
+	struct ::pollfd ufds[1];
+	ufds[0].fd = socket_handle;
+	ufds[0].events = POLLOUT;
+	ufds[0].revents = 0;
+	if (::poll(ufds, 1, 0) == 0)
+	{
+		result.set_ok(SOCKET_CONNECT_IN_PROGRESS);
+		return(result);
+	}
+
+	return(finish_connect());
+}
+
+/*! \brief Abandons a connection attempt in progress.
+ */
+void tcpsocket::abort_connect()
+{
+	if ((socket_handle != 0) && !is_connected)
+	{
+		::close(socket_handle);
+		socket_handle = 0;
+	}
+}
+
+/*! \brief Worker thread for resolving host names in parallel.
+ *
+ * Used by tcpsocket::connect_all(). Each worker picks the next unresolved
+ * socket from the shared list until there are none left.
+ */
+class resolver_worker : public threadable
+{
+public:
+	resolver_worker(std::vector<tcpsocket*> *sockets, std::vector<RH> *results, volatile unsigned *next)
+		: sockets_(sockets), results_(results), next_(next) {}
+	void start() { run(); }
+	void join() { wait(); }
+private:
+	void thread_entry()
+	{
+		unsigned i;
+		while ((i = __sync_fetch_and_add(next_, 1)) < sockets_->size())
+		{
+			(*results_)[i] = (*sockets_)[i]->resolve();
+		}
+	}
+	std::vector<tcpsocket*> *sockets_; //!< Sockets to resolve
+	std::vector<RH> *results_; //!< Result for each socket
+	volatile unsigned *next_; //!< Index of next socket to resolve (shared by all workers)
+};
+
+/*! \brief Returns a monotonic timestamp in miliseconds.
+ */
+static unsigned long long monotonic_ms()
+{
+	struct timespec now;
+	::clock_gettime(CLOCK_MONOTONIC, &now);
+	return ((unsigned long long) now.tv_sec * 1000) + (now.tv_nsec / 1000000);
+}
+
+/*! \brief Returns a monotonic timestamp in microseconds.
+ */
+static unsigned long long monotonic_us()
+{
+	struct timespec now;
+	::clock_gettime(CLOCK_MONOTONIC, &now);
+	return ((unsigned long long) now.tv_sec * 1000000) + (now.tv_nsec / 1000);
+}
+
+/*! \brief Connects many sockets concurrently.
+ *
+ * All host names are resolved in parallel (using up to #MAX_RESOLVER_THREADS
+ * threads), and all connection attempts are started at once using non-blocking
+ * sockets. The call returns when all sockets are either connected or have failed,
+ * or when \c timeout_ms has passed, whichever comes first. A host that does not
+ * respond will therefore never delay the others.
+ *
+ * The deadline starts when every name has been resolved. Resolution cannot be
+ * interrupted, and is bounded by the resolver's own timeout instead (see
+ * resolv.conf(5)). Since the names are resolved in parallel, a name that does
+ * not resolve costs at most one resolver timeout, however many there are.
+ *
+ * Use #connected() to find out which sockets succeeded.
+ *
+ * \param sockets Sockets to connect. Destination and port must be set.
+ * \param timeout_ms Deadline for all connection attempts, in miliseconds
+ * \return #NO_ERRORS with value() set to the number of sockets that were connected.
+ *         If none were connected, the error of the last failing socket is returned.
+ */
+RH_INT tcpsocket::connect_all(std::vector<tcpsocket*> &sockets, unsigned timeout_ms)
+{
+	RH_INT result;
+	result.set_ok();
+	result.set_value(0);
+
+	if (sockets.empty())
+	{
+		return(result);
+	}
+
+	int connected_count = 0;
+	RH last_error;
+	last_error.set_not_ok(SOCKET_ERROR_COULD_NOT_CONNECT);
+
+	// Resolve all names in parallel
+	std::vector<RH> resolved(sockets.size());
+	volatile unsigned next = 0;
+	unsigned worker_count = sockets.size();
+	if (worker_count > MAX_RESOLVER_THREADS) worker_count = MAX_RESOLVER_THREADS;
+	std::vector<resolver_worker*> workers;
+	for (unsigned i = 0; i < worker_count; i++)
+	{
+		workers.push_back(new resolver_worker(&sockets, &resolved, &next));
+		workers.back()->start();
+	}
+	for (unsigned i = 0; i < worker_count; i++)
+	{
+		workers[i]->join();
+		delete workers[i];
+	}
+
+	// Start all connection attempts; the deadline does not cover resolution
+	unsigned long long deadline = monotonic_ms() + timeout_ms;
+	std::vector<tcpsocket*> pending;
+	for (unsigned i = 0; i < sockets.size(); i++)
+	{
+		if (resolved[i].is_not_ok())
+		{
+			last_error = resolved[i];
+			continue;
+		}
+		RH started = sockets[i]->begin_connect();
+		if (started == SOCKET_CONNECT_IN_PROGRESS)
+		{
+			pending.push_back(sockets[i]);
+		}
+		else if (started.is_ok())
+		{
+			connected_count += 1;
+		}
+		else
+		{
+			last_error = started;
+		}
+	}
+
+	// Wait for the attempts to complete
+	std::vector<struct ::pollfd> fds;
+	while (!pending.empty())
+	{
+		unsigned long long now = monotonic_ms();
+		if (now >= deadline)
+		{
+			break;
+		}
+		fds.resize(pending.size());
+		for (unsigned i = 0; i < pending.size(); i++)
+		{
+			fds[i].fd = pending[i]->socket_handle;
+			fds[i].events = POLLOUT;
+			fds[i].revents = 0;
+		}
+		int rv = ::poll(&fds[0], fds.size(), deadline - now);
+		if ((rv == -1) && (errno != EINTR))
+		{
+			break;
+		}
+		std::vector<tcpsocket*> still_pending;
+		for (unsigned i = 0; i < pending.size(); i++)
+		{
+			if (fds[i].revents == 0)
+			{
+				still_pending.push_back(pending[i]);
+				continue;
+			}
+			RH finished = pending[i]->finish_connect();
+			if (finished == SOCKET_CONNECT_IN_PROGRESS)
+			{
+				still_pending.push_back(pending[i]);
+			}
+			else if (finished.is_ok())
+			{
+				connected_count += 1;
+			}
+			else
+			{
+				last_error = finished;
+			}
+		}
+		pending.swap(still_pending);
+	}
+
+	// Whatever is left has run out of time
+	std::vector<tcpsocket*>::iterator pending_itr = pending.begin();
+	while (pending_itr != pending.end())
+	{
+		(*pending_itr)->abort_connect();
+		last_error.set_not_ok(SOCKET_ERROR_CONNECT_TIMEOUT);
+		pending_itr += 1;
+	}
+
+	result.set_value(connected_count);
+	if (connected_count == 0)
+	{
+		result.set_not_ok(last_error.id(), last_error.text());
+	}
 
-connect_end:
 	return(result);
 }
 
@@ -440,13 +777,19 @@ void tcpsocket::disconnect()
 	{
 		//::shutdown(socket_handle, SHUT_RDWR);
 		stop_tcpsocket_client_listener();
+		::pthread_mutex_lock(&outqueue_mutex);
 		if (socket_handle != 0)
 		{
 			::close(socket_handle);
 		}
+		outqueue.clear();
+		outqueue_bytes = 0;
+		outqueue_offset = 0;
+		write_interest = false;
+		socket_handle = 0;
+		::pthread_mutex_unlock(&outqueue_mutex);
 	}
 	is_connected = false;
-	socket_handle = 0;
 }
 
 /*! \brief Tells if the socket is \ref connect() "connected".
@@ -458,8 +801,14 @@ bool tcpsocket::connected()
 }
 
 /*! \brief Transmits a string over the socket.
+ *
+ * The string is added to the send queue, and as much as possible of the queue
+ * is written right away. The rest is sent by the listener when the socket can
+ * take more. Never blocks, unless there is no listener to send the rest; then
+ * it waits for the queue to empty.
+ *
  * \param data String to transmit
- * \return #NO_ERRORS, #SOCKET_ERROR_NOT_CONNECTED or #SOCKET_ERROR
+ * \return #NO_ERRORS, #SOCKET_ERROR_NOT_CONNECTED, #SOCKET_ERROR_SEND_QUEUE_FULL or #SOCKET_ERROR
  */
 RH tcpsocket::send(std::string data)
 {
@@ -472,13 +821,221 @@ RH tcpsocket::send(std::string data)
 		return(result);
 	}
 
-	vout(VOUT_DEBUG) << "[" << whoami() << "] (socket# " << socket_handle << ") sending string \"" << ascii_safe(data, true) << "\"" << std::endlc;
-	if (::send(socket_handle, data.c_str(), data.length(), MSG_NOSIGNAL) == -1)
+	if (verbosity >= VOUT_DEBUG)
 	{
-		result.set_not_ok(SOCKET_ERROR);
+		vout(VOUT_DEBUG) << "[" << whoami() << "] (socket# " << socket_handle << ") sending string \"" << ascii_safe(data, true) << "\"" << std::endlc;
+	}
+	::pthread_mutex_lock(&outqueue_mutex);
+	result = queue_locked(data);
+	if (result.is_ok())
+	{
+		result = flush_locked();
+	}
+	bool must_drain = result.is_ok() && !outqueue.empty() && (reactor_ == NULL) && !tcpsocket_client_listener_running;
+	::pthread_mutex_unlock(&outqueue_mutex);
+
+	if (must_drain)
+	{
+		// Nobody else will send the rest
+		result = drain_send_queue(connect_timeout_ms_);
+	}
+
+	return(result);
+}
+
+/*! \brief Adds a string to the send queue without sending anything.
+ *
+ * Use this for several strings that belong together, followed by #flush(),
+ * to have them all written in one system call.
+ *
+ * \param data String to transmit
+ * \return #NO_ERRORS, #SOCKET_ERROR_NOT_CONNECTED or #SOCKET_ERROR_SEND_QUEUE_FULL
+ */
+RH tcpsocket::queue(std::string data)
+{
+	RH result;
+	result.set_ok();
+
+	if (!is_connected)
+	{
+		result.set_not_ok(SOCKET_ERROR_NOT_CONNECTED);
 		return(result);
 	}
 
+	::pthread_mutex_lock(&outqueue_mutex);
+	result = queue_locked(data);
+	::pthread_mutex_unlock(&outqueue_mutex);
+
+	return(result);
+}
+
+/*! \brief Adds a string with an appended \ref set_endline() "newline" to the send queue.
+ *
+ * Nothing is sent until #flush() is called.
+ *
+ * \param data String to transmit
+ * \return #NO_ERRORS, #SOCKET_ERROR_NOT_CONNECTED or #SOCKET_ERROR_SEND_QUEUE_FULL
+ */
+RH tcpsocket::queueline(std::string data)
+{
+	data += endline_;
+	return queue(data);
+}
+
+/*! \brief Writes as much of the send queue as the socket will take without blocking.
+ * \return #NO_ERRORS or #SOCKET_ERROR
+ */
+RH tcpsocket::flush()
+{
+	::pthread_mutex_lock(&outqueue_mutex);
+	RH result = flush_locked();
+	::pthread_mutex_unlock(&outqueue_mutex);
+
+	return(result);
+}
+
+/*! \brief Sets the maximum number of bytes that may wait in the send queue.
+ * \param bytes Limit. Default is #DEFAULT_SEND_QUEUE_LIMIT.
+ */
+void tcpsocket::set_send_queue_limit(unsigned bytes)
+{
+	outqueue_limit = bytes;
+}
+
+/*! \brief Number of bytes waiting in the send queue.
+ */
+unsigned tcpsocket::send_queue_size()
+{
+	return outqueue_bytes;
+}
+
+/*! \brief Adds data to #outqueue. #outqueue_mutex must be held.
+ * \return #NO_ERRORS or #SOCKET_ERROR_SEND_QUEUE_FULL
+ */
+RH tcpsocket::queue_locked(const std::string &data)
+{
+	RH result;
+	result.set_ok();
+
+	if (outqueue_bytes + data.length() > outqueue_limit)
+	{
+		result.set_not_ok(SOCKET_ERROR_SEND_QUEUE_FULL);
+		result.set_not_ok(format_string("%s (%u bytes waiting)", result.text().c_str(), outqueue_bytes));
+		return(result);
+	}
+	if (!data.empty())
+	{
+		outqueue.push_back(data);
+		outqueue_bytes += data.length();
+	}
+
+	return(result);
+}
+
+/*! \brief Writes from #outqueue until it is empty or the socket would block.
+ *
+ * Queued strings are gathered into one sendmsg() call. If data is left, the
+ * #reactor (if any) is asked to report when the socket is writable again.
+ * #outqueue_mutex must be held.
+ *
+ * \return #NO_ERRORS or #SOCKET_ERROR. On errors the queue is emptied.
+ */
+RH tcpsocket::flush_locked()
+{
+	RH result;
+	result.set_ok();
+
+	while (!outqueue.empty() && (socket_handle != 0))
+	{
+		struct ::iovec iov[MAX_SEND_IOVECS];
+		unsigned iov_count = 0;
+		std::deque<std::string>::iterator itr = outqueue.begin();
+		while ((itr != outqueue.end()) && (iov_count < MAX_SEND_IOVECS))
+		{
+			unsigned skip = (iov_count == 0) ? outqueue_offset : 0;
+			iov[iov_count].iov_base = (void *) (itr->data() + skip);
+			iov[iov_count].iov_len = itr->length() - skip;
+			iov_count += 1;
+			itr += 1;
+		}
+
+		struct ::msghdr message;
+		memset(&message, 0, sizeof message);
+		message.msg_iov = iov;
+		message.msg_iovlen = iov_count;
+		ssize_t sent = ::sendmsg(socket_handle, &message, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (sent == -1)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+			{
+				result.set_not_ok(SOCKET_ERROR);
+				result.set_not_ok(result.text() + " (" + strerror(errno) + ")");
+				outqueue.clear();
+				outqueue_bytes = 0;
+				outqueue_offset = 0;
+			}
+			break; // Socket is full; the rest must wait
+		}
+
+		// Remove what was sent, which may end in the middle of a string
+		outqueue_bytes -= sent;
+		while (sent > 0)
+		{
+			unsigned remaining = outqueue.front().length() - outqueue_offset;
+			if ((unsigned) sent < remaining)
+			{
+				outqueue_offset += sent;
+				break;
+			}
+			sent -= remaining;
+			outqueue.pop_front();
+			outqueue_offset = 0;
+		}
+	}
+
+	bool pending = !outqueue.empty();
+	if ((reactor_ != NULL) && (pending != write_interest))
+	{
+		reactor_->watch_writable(socket_handle, this, pending);
+		write_interest = pending;
+	}
+
+	return(result);
+}
+
+/*! \brief Waits until everything in the send queue has been written.
+ *
+ * Only used when there is no listener that will send the rest later.
+ *
+ * \param timeout_ms How long to wait
+ * \return #NO_ERRORS, #SOCKET_ERROR or #SOCKET_ERROR_SEND_QUEUE_FULL if it timed out
+ */
+RH tcpsocket::drain_send_queue(unsigned timeout_ms)
+{
+	RH result;
+	result.set_ok();
+
+	unsigned long long deadline = monotonic_ms() + timeout_ms;
+	while (result.is_ok() && (send_queue_size() > 0))
+	{
+		unsigned long long now = monotonic_ms();
+		if (now >= deadline)
+		{
+			result.set_not_ok(SOCKET_ERROR_SEND_QUEUE_FULL);
+			break;
+		}
+		struct ::pollfd ufds[1];
+		ufds[0].fd = socket_handle;
+		ufds[0].events = POLLOUT;
+		ufds[0].revents = 0;
+		::poll(ufds, 1, (int) (deadline - now));
+		result = flush();
+	}
+
 	return(result);
 }
 
@@ -563,7 +1120,18 @@ RH_INT tcpsocket::fetch_data(char * const buffer, unsigned max_length, unsigned
 		int bytes_received = 0;
 		bytes_received = ::recv(socket_handle, buffer, max_length, 0);
 //if (remote_port_ == 4001) std::cout << bytes_received; std::cout.flush();
-		result.set_value(bytes_received);
+		if (bytes_received > 0)
+		{
+			result.set_value(bytes_received);
+		}
+		else if (bytes_received == 0)
+		{
+			result.set_not_ok(SOCKET_ERROR, "Connection closed by remote");
+		}
+		else if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+		{
+			result.set_not_ok(SOCKET_ERROR);
+		}
 //		if (bytes_received >= 0)
 //		{
 //			buffer[bytes_received] = '\0';
@@ -589,116 +1157,285 @@ RH_INT tcpsocket::fetch_data(char * const buffer, unsigned max_length, unsigned
  *          of #SOCKET_ERROR_NOT_CONNECTED, #SOCKET_ERROR or #SOCKET_RECEIVE_TIMEOUT
  *
  */
-RH_STRING tcpsocket::readline(unsigned max_length, unsigned timeout_ms)
+RH_STRING tcpsocket::readline(unsigned max_length, unsigned timeout_ms)
+{
+	RH_STRING result;
+	result.set_ok();
+
+	if (!is_connected)
+	{
+		result.set_not_ok(SOCKET_ERROR_NOT_CONNECTED);
+	}
+	else
+	{
+		const char *line;
+		unsigned length;
+		RH read_result = get_next_line(line, length, timeout_ms);
+		if (read_result.is_not_ok())
+		{
+			result.set_not_ok();
+			result.set_exitstatus(read_result.id(), read_result.text());
+		}
+		if (result.is_ok())
+		{
+			result.set_value(std::string(line, (length < max_length) ? length : max_length));
+		}
+	}
+
+	return(result);
+}
+
+/*! \brief Thread that dispatches incoming message events.
+ *
+ * This thread is started by calling #start_tcpsocket_client_listener().
+ * Incoming messages are dispatched to the specified
+ * \ref tcpsocket_callback "callback" function.
+ *
+ * The proper way to terminate this thread is to call #stop_tcpsocket_client_listener().
+ *
+ */
+void tcpsocket::thread_entry()
+{
+
+	vout(VOUT_DEBUG) << "[" << whoami() << "] listener thread for " << destination_ << ":" << remote_port_ << " started" << std::endlc;
+	RH_INT rcv;
+	tcpsocket_client_listener_running = true;
+	while (tcpsocket_client_listener_running && !socket_going_down)
+	{
+		RH sent;
+		sent.set_ok();
+		if (send_queue_size() > 0)
+		{
+			sent = flush();
+		}
+		if (sent.is_not_ok())
+		{
+			rcv.set_not_ok();
+			rcv.set_exitstatus(sent.id(), sent.text());
+		}
+		else
+		{
+			// Come back soon if the send queue could not be emptied
+			rcv = fill_inbuffer((send_queue_size() > 0) ? 20 : 1000);
+		}
+		if (rcv.is_ok())
+		{
+			dispatch_lines();
+		}
+		else
+		{
+			vout(VOUT_DEBUG) << ansi::red << ansi::bright << "[" << whoami() << " thread_entry()] " <<rcv.text() << std::endlc;
+			tcpsocket_client_listener_running = false;
+			if (rcv != SOCKET_ERROR_NOT_CONNECTED)
+			{
+				is_connected = false; // Lets the owner know the connection is lost
+			}
+		}
+	}
+	vout(VOUT_DEBUG) << "[" << whoami() << "] exiting listener thread for " << destination_ << ":" << remote_port_  << std::endlc;
+}
+
+/*! \brief Starts a thread that listens for incoming messages
+ *
+ * It starts a separate \ref thread_entry() "thread" that does all the work. It
+ * does not return until it has verified that the listener thread actually is running.
+ *
+ * \param callback Pointer to callback function that handles incoming messages
+ * \return Always returns #NO_ERRORS
+ */
+RH tcpsocket::start_tcpsocket_client_listener(tcpsocket_callback callback)
+{
+	RH result;
+	result.set_ok();
+
+	tcpsocketclient_callback = callback;
+
+	stop_tcpsocket_client_listener(); // Joins any previous listener thread
+	inbuffer.clear();
+	tcpsocket_client_listener_running = false;
+	socket_going_down = false;
+	listener_thread_started = true;
+	run();
+	while (!tcpsocket_client_listener_running);
+
+
+	return result;
+}
+
+/*! \brief Lets a shared #reactor listen for incoming messages.
+ *
+ * No thread is started for this socket. The socket is switched to non-blocking
+ * mode, and complete lines are dispatched to the callback from the reactor's thread.
+ *
+ * \param event_loop Running reactor that shall watch this socket
+ * \param callback Pointer to callback function that handles incoming messages
+ * \return #NO_ERRORS, #SOCKET_ERROR_NOT_CONNECTED or #SOCKET_ERROR
+ */
+RH tcpsocket::start_tcpsocket_reactor_listener(reactor *event_loop, tcpsocket_callback callback)
+{
+	RH result;
+	result.set_ok();
+
+	if (!is_connected)
+	{
+		result.set_not_ok(SOCKET_ERROR_NOT_CONNECTED);
+		return(result);
+	}
+
+	tcpsocketclient_callback = callback;
+	inbuffer.clear();
+
+	int flags = ::fcntl(socket_handle, F_GETFL, 0);
+	if ((flags == -1) || (::fcntl(socket_handle, F_SETFL, flags | O_NONBLOCK) == -1))
+	{
+		result.set_not_ok(SOCKET_ERROR);
+		result.set_not_ok(result.text() + " (fcntl)");
+		return(result);
+	}
+
+	tcpsocket_client_listener_running = true;
+	result = event_loop->add(socket_handle, this);
+	::pthread_mutex_lock(&outqueue_mutex);
+	if (result.is_not_ok())
+	{
+		tcpsocket_client_listener_running = false;
+	}
+	else
+	{
+		reactor_ = event_loop;
+		write_interest = false;
+		flush_locked(); // In case anything was queued before
+	}
+	::pthread_mutex_unlock(&outqueue_mutex);
+	if (result.is_ok())
+	{
+		vout(VOUT_DEBUG) << "[" << whoami() << "] reactor is listening on " << destination_ << ":" << remote_port_ << std::endlc;
+	}
+
+	return(result);
+}
+
+/*! \brief Stops a running message listener.
+ * It does not return until the listener actually has stopped.
+ * \return Always returns #NO_ERRORS
+ */
+RH tcpsocket::stop_tcpsocket_client_listener()
+{
+	RH result;
+	result.set_ok();
+
+	reactor *event_loop = reactor_; // May be cleared by on_hangup() in the reactor's thread
+	if (event_loop != NULL)
+	{
+		event_loop->remove(socket_handle, this);
+		::pthread_mutex_lock(&outqueue_mutex);
+		reactor_ = NULL;
+		::pthread_mutex_unlock(&outqueue_mutex);
+		tcpsocket_client_listener_running = false;
+	}
+	else if (listener_thread_started)
+	{
+		// The thread may already have stopped by itself, but must still be joined
+		tcpsocket_client_listener_running = false;
+		socket_going_down = true;
+		wait();
+		listener_thread_started = false;
+	}
+
+	return result;
+}
+
+/*! \brief Reads all pending data when the #reactor reports incoming data.
+ *
+ * The socket is read until it would block. Every complete line is passed on
+ * to the \ref tcpsocket_callback "callback" function as soon as it has been
+ * received. Incomplete lines are kept until the rest arrives.
+ */
+void tcpsocket::on_readable()
 {
-	RH_STRING result;
-	result.set_ok();
-
-	if (!is_connected)
-	{
-		result.set_not_ok(SOCKET_ERROR_NOT_CONNECTED);
-	}
-	else
+	while (tcpsocket_client_listener_running)
 	{
-		char *buffer;
-		buffer = new char[max_length+1];
-		RH read_result;
-		read_result = get_next_line(buffer, max_length, timeout_ms);
-		if (read_result.is_not_ok())
+		unsigned space;
+		char *position = inbuffer.write_position(space);
+		ssize_t count = ::recv(socket_handle, position, space, 0);
+		if (count == 0)
 		{
-			result.set_not_ok();
-			result.set_exitstatus(read_result.id(), read_result.text());
+			// Remote closed the connection
+			on_hangup();
+			return;
 		}
-		if (result.is_ok())
+		if (count == -1)
 		{
-			result.set_value(buffer);
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+			{
+				on_hangup();
+			}
+			return; // Everything has been read
 		}
-		delete[] buffer;
+		inbuffer.commit(count);
+		dispatch_lines();
 	}
-
-	return(result);
 }
 
-/*! \brief Thread that dispatches incoming message events.
- *
- * This thread is started by calling #start_tcpsocket_client_listener().
- * Incoming messages are dispatched to the specified
+/*! \brief Passes all complete lines in \ref inbuffer on to the
  * \ref tcpsocket_callback "callback" function.
  *
- * The proper way to terminate this thread is to call #stop_tcpsocket_client_listener().
- *
+ * The lines are handed over as pointers into the buffer; nothing is copied.
  */
-void tcpsocket::thread_entry()
+void tcpsocket::dispatch_lines()
 {
-
-	vout(VOUT_DEBUG) << "[" << whoami() << "] listener thread for " << destination_ << ":" << remote_port_ << " started" << std::endlc;
-	RH_STRING rcv;
-	tcpsocket_client_listener_running = true;
-	while (tcpsocket_client_listener_running)
+	const char *line;
+	unsigned length;
+	while (tcpsocket_client_listener_running && inbuffer.next_line(line, length))
 	{
-//		std::cout << "!" << destination_ << ":" << remote_port_; std::cout.flush();
-		rcv = readline(1000);
-//		std::cout << "! "; std::cout.flush();
-		if (rcv.is_ok())
-		{
-			vout(VOUT_DEBUG) << "[" << whoami() << "] received string \"" << ascii_safe(rcv.value(), true) << "\"" << std::endlc;
-			tcpsocketclient_callback(this, rcv.value());
-		}
-		else if (rcv != SOCKET_RECEIVE_TIMEOUT)
+		if (verbosity >= VOUT_DEBUG)
 		{
-			vout(VOUT_DEBUG) << ansi::red << ansi::bright << "[" << whoami() << " thread_entry()] " <<rcv.text() << std::endlc;
-			tcpsocket_client_listener_running = false;
+			vout(VOUT_DEBUG) << "[" << whoami() << "] received string \"" << ascii_safe(std::string(line, length), true) << "\"" << std::endlc;
 		}
+		tcpsocketclient_callback(this, line, length);
 	}
-	vout(VOUT_DEBUG) << "[" << whoami() << "] exiting listener thread for " << destination_ << ":" << remote_port_  << std::endlc;
 }
 
-/*! \brief Starts a thread that listens for incoming messages
- *
- * It starts a separate \ref thread_entry() "thread" that does all the work. It
- * does not return until it has verified that the listener thread actually is running.
+/*! \brief Called by the #reactor when the connection is lost.
  *
- * \param callback Pointer to callback function that handles incoming messages
- * \return Always returns #NO_ERRORS
+ * Stops listening, but leaves it to the owner to \ref disconnect() "disconnect".
  */
-RH tcpsocket::start_tcpsocket_client_listener(tcpsocket_callback callback)
+void tcpsocket::on_hangup()
 {
-	RH result;
-	result.set_ok();
-
-	tcpsocketclient_callback = callback;
-
+	vout(VOUT_DEBUG) << ansi::red << ansi::bright << "[" << whoami() << "] connection to " << destination_ << ":" << remote_port_ << " lost" << std::endlc;
+	if (reactor_ != NULL)
+	{
+		reactor_->remove(socket_handle, this);
+		::pthread_mutex_lock(&outqueue_mutex);
+		reactor_ = NULL;
+		::pthread_mutex_unlock(&outqueue_mutex);
+	}
 	tcpsocket_client_listener_running = false;
-	run();
-	while (!tcpsocket_client_listener_running);
-
-
-	return result;
+	is_connected = false;
 }
 
-/*! \brief Stops a running message listener.
- * It does not return until the listener actually has stopped.
- * \return Always returns #NO_ERRORS
+/*! \brief Called by the #reactor when the socket can take more outgoing data.
+ *
+ * Continues sending what is left in the send queue.
  */
-RH tcpsocket::stop_tcpsocket_client_listener()
+void tcpsocket::on_writable()
 {
-	RH result;
-	result.set_ok();
-
-	if (tcpsocket_client_listener_running)
+	if (flush().is_not_ok())
 	{
-		tcpsocket_client_listener_running = false;
-		socket_going_down = true;
-		wait();
+		on_hangup();
 	}
-
-	return result;
 }
 
 /*! \brief Common initialization called by all constructors.
 */
 void telnetserver::common_constructor()
 {
+	telnet_callback = NULL;
+	telnet_server_running = false;
 }
 
 /*! \brief Default constructor.
@@ -898,7 +1635,7 @@ void telnetserver::thread_entry()
 	}
 	events = (struct ::epoll_event*)calloc(MAX_EPOLL_EVENTS, sizeof event);
 
-	vout(VOUT_VERBOSER) << "Listening for telnet connections on port " << local_port_ << std::endlc;
+	vout(VOUT_VERBOSER) << "[" << whoami() << "] listening for connections on port " << local_port_ << std::endlc;
 
 	telnet_server_running = true;
 	while(telnet_server_running)
@@ -909,8 +1646,9 @@ void telnetserver::thread_entry()
 		{
 			if ((  events[i].events & EPOLLERR)
 			 || (  events[i].events & EPOLLHUP)
-			 || (!(events[i].events & EPOLLIN )))
+			 || (!(events[i].events & (EPOLLIN | EPOLLOUT))))
 			{
+				on_client_closed(events[i].data.fd);
 				::close(events[i].data.fd);
 				continue;
 			}
@@ -945,10 +1683,14 @@ void telnetserver::thread_entry()
 					                  sbuf, sizeof sbuf,
 					                  NI_NUMERICHOST | NI_NUMERICSERV) == 0)
 					{
-						vout(VOUT_VERBOSER) << "Accepted incoming telnet connection from ";
+						vout(VOUT_VERBOSER) << "[" << whoami() << "] accepted incoming connection from ";
 						vout(VOUT_VERBOSER) << hbuf << " on port " << sbuf << std::endlc;
-						send(new_handle, telnet_server_banner);
 					}
+					else
+					{
+						hbuf[0] = '\0';
+					}
+					on_client_accepted(new_handle, hbuf);
 					int flags = ::fcntl(new_handle, F_GETFL, 0);
 					if (flags == -1)
 					{
@@ -965,7 +1707,7 @@ void telnetserver::thread_entry()
 //						return(result);
 					}
 					event.data.fd = new_handle;
-					event.events = EPOLLIN | EPOLLET;
+					event.events = client_events();
 					if (::epoll_ctl(epoll_handle, EPOLL_CTL_ADD, new_handle, &event) == -1)
 					{
 //						result.set_not_ok(SOCKET_ERROR);
@@ -977,6 +1719,14 @@ void telnetserver::thread_entry()
 			}
 			else
 			{
+				if (events[i].events & EPOLLOUT)
+				{
+					on_client_writable(events[i].data.fd);
+				}
+				if (!(events[i].events & EPOLLIN))
+				{
+					continue;
+				}
 				// Data has been received and is waiting to be read
 				bool done = false;
 				struct ::sockaddr in_addr;
@@ -992,7 +1742,7 @@ void telnetserver::thread_entry()
 				{
 					ssize_t count;
 					char buf[512];
-					count = ::read(events[i].data.fd, buf, sizeof buf);
+					count = ::read(events[i].data.fd, buf, sizeof buf - 1);
 					if (count == -1)
 					{
 						// If errno == EAGAIN we have read all data
@@ -1011,10 +1761,11 @@ void telnetserver::thread_entry()
 						break;
 					}
 					buf[count] = '\0';
-					telnet_callback(this, events[i].data.fd, std::string(hbuf), std::string(buf));
+					on_client_data(events[i].data.fd, hbuf, buf, count);
 				}
 				if (done)
 				{
+					on_client_closed(events[i].data.fd);
 					::close(events[i].data.fd);
 				}
 			}
@@ -1026,6 +1777,37 @@ void telnetserver::thread_entry()
 	telnet_server_running = false;
 }
 
+/*! \brief The epoll events to wait for on client sockets.
+ */
+uint32_t telnetserver::client_events()
+{
+	return(EPOLLIN | EPOLLET);
+}
+
+/*! \brief Called when a client has connected. Greets it with the banner.
+ * \param socket_handle The client's socket
+ * \param host Address of the client
+ */
+void telnetserver::on_client_accepted(int socket_handle, const std::string &host)
+{
+	(void) host;
+	send(socket_handle, telnet_server_banner);
+}
+
+/*! \brief Called with whatever a client sends. Hands it to the callback.
+ * \param socket_handle The client's socket
+ * \param host Address of the client
+ * \param data Received data, NUL-terminated
+ * \param length Length of \c data
+ */
+void telnetserver::on_client_data(int socket_handle, const std::string &host, const char *data, unsigned length)
+{
+	if (telnet_callback != NULL)
+	{
+		telnet_callback(this, socket_handle, host, std::string(data, length));
+	}
+}
+
 /*! \brief Starts a TCP-server.
  *
  * #setup_server() must be used before calling this function.
@@ -1047,22 +1829,518 @@ RH telnetserver::start_telnet_server(telnetserver_callback callback)
 	run();
 	while (!telnet_server_running);
 
-	return result;
+	return result;
+}
+
+/*! \brief Stops a running TCP-server.
+ * It does not return until the server actually has stopped.
+ * \return Always returns #NO_ERRORS
+ */
+RH telnetserver::stop_telnet_server()
+{
+	RH result;
+	result.set_ok();
+
+	telnet_server_running = false;
+	wait();
+
+	return result;
+}
+
+/*! \brief Default constructor. #set_local_port() and #setup_server() must be called before the server is started.
+*/
+websocketserver::websocketserver()
+	: queue_limit(DEFAULT_WEBSOCKETSERVER_QUEUE_LIMIT),
+	  snapshot_callback(NULL),
+	  published(0)
+{
+	::pthread_mutex_init(&subscribers_mutex, NULL);
+}
+
+/*! \brief Destructor.
+*/
+websocketserver::~websocketserver()
+{
+	stop_websocket_server();
+	::pthread_mutex_destroy(&subscribers_mutex);
+}
+
+/*! \brief Starts accepting subscribers.
+ * \param callback Function to call when a subscriber needs a snapshot, or NULL
+ * \return Always returns #NO_ERRORS
+ */
+RH websocketserver::start_websocket_server(websocketserver_callback callback)
+{
+	snapshot_callback = callback;
+	return(start_telnet_server(NULL));
+}
+
+/*! \brief Stops the server, and closes every connection.
+ * \return Always returns #NO_ERRORS
+ */
+RH websocketserver::stop_websocket_server()
+{
+	RH result;
+	result.set_ok();
+
+	stop_telnet_server();
+	::pthread_mutex_lock(&subscribers_mutex);
+	std::map<int, subscriber*>::iterator itr = subscribers.begin();
+	while (itr != subscribers.end())
+	{
+		while (!itr->second->queue.empty())
+		{
+			release(itr->second->queue.front());
+			itr->second->queue.pop_front();
+		}
+		::close(itr->first);
+		delete itr->second;
+		itr++;
+	}
+	subscribers.clear();
+	::pthread_mutex_unlock(&subscribers_mutex);
+
+	return(result);
+}
+
+/*! \brief Sets how many bytes may wait in the queue of a subscriber before it is collapsed.
+ *
+ * A single message larger than this is still sent to a subscriber that
+ * has nothing else waiting.
+ */
+void websocketserver::set_queue_limit(unsigned bytes)
+{
+	queue_limit = bytes;
+}
+
+/*! \brief Number of subscribers that have completed the opening handshake.
+ */
+unsigned websocketserver::subscriber_count()
+{
+	unsigned count = 0;
+	::pthread_mutex_lock(&subscribers_mutex);
+	std::map<int, subscriber*>::iterator itr = subscribers.begin();
+	while (itr != subscribers.end())
+	{
+		if (itr->second->upgraded)
+		{
+			count += 1;
+		}
+		itr++;
+	}
+	::pthread_mutex_unlock(&subscribers_mutex);
+	return(count);
+}
+
+/*! \brief Sends a text message to every subscriber.
+ *
+ * The frame is made once and shared. Each subscriber gets as much of it
+ * right away as its socket takes; the rest is sent by the server thread.
+ * Never blocks on a slow subscriber.
+ *
+ * \param message The message
+ * \param snapshot TRUE if the message is a full snapshot, which a subscriber can start from
+ * \param only_if_waiting TRUE to send the snapshot only to the subscribers waiting for one
+ */
+void websocketserver::publish(const std::string &message, bool snapshot, bool only_if_waiting)
+{
+	uint8_t header[WSFRAME_MAX_HEADER_SIZE];
+	unsigned header_length = wsframe_header(header, wsframe_decoder::TEXT_FRAME, message.length());
+	shared_frame *frame = new shared_frame;
+	frame->data.reserve(header_length + message.length());
+	frame->data.assign((const char *) header, header_length);
+	frame->data += message;
+	frame->users = 1; // Ours, until every queue has it
+
+	bool snapshot_wanted = false;
+	::pthread_mutex_lock(&subscribers_mutex);
+	published += 1;
+	std::map<int, subscriber*>::iterator itr = subscribers.begin();
+	while (itr != subscribers.end())
+	{
+		subscriber *s = itr->second;
+		if (s->upgraded && !s->closing && (!only_if_waiting || s->waiting_for_snapshot))
+		{
+			if (snapshot)
+			{
+				if (over_limit(s, frame))
+				{
+					// Whatever is waiting is out of date anyway
+					collapse(s);
+				}
+				s->waiting_for_snapshot = false;
+			}
+			else if (!s->waiting_for_snapshot && over_limit(s, frame))
+			{
+				collapse(s);
+				s->waiting_for_snapshot = true;
+				snapshot_wanted = true;
+			}
+			if (!s->waiting_for_snapshot)
+			{
+				enqueue(s, frame);
+				s->sent_messages += 1;
+				flush(itr->first, s);
+			}
+		}
+		itr++;
+	}
+	bool call_back = snapshot_wanted && (snapshot_callback != NULL);
+	::pthread_mutex_unlock(&subscribers_mutex);
+	release(frame);
+	if (call_back)
+	{
+		snapshot_callback(this);
+	}
+}
+
+/*! \brief Describes the subscribers, e.g. for a status display.
+ */
+std::vector<std::string> websocketserver::status()
+{
+	std::vector<std::string> status;
+	::pthread_mutex_lock(&subscribers_mutex);
+	status.push_back(format_string("Subscribers on port %u: %u (%llu messages published)", local_port_, subscribers.size(), published));
+	std::map<int, subscriber*>::iterator itr = subscribers.begin();
+	while (itr != subscribers.end())
+	{
+		subscriber *s = itr->second;
+		status.push_back(format_string(" - %s: %s, %llu messages, %u bytes queued, %u collapses", s->host.c_str(),
+		                 (!s->upgraded ? "handshaking" : (s->waiting_for_snapshot ? "waiting for snapshot" : "up to date")),
+		                 s->sent_messages, s->queued_bytes - s->offset, s->collapses));
+		itr++;
+	}
+	::pthread_mutex_unlock(&subscribers_mutex);
+	return(status);
+}
+
+/*! \brief Subscribers are also waited for when their sockets can take more data.
+ */
+uint32_t websocketserver::client_events()
+{
+	return(EPOLLIN | EPOLLOUT | EPOLLET);
+}
+
+/*! \brief Sets up a new connection, which must start with the opening handshake.
+ */
+void websocketserver::on_client_accepted(int socket_handle, const std::string &host)
+{
+	subscriber *s = new subscriber;
+	s->host = host;
+	s->frames.set_require_masked(true); // Every frame from a client must be masked
+	::pthread_mutex_lock(&subscribers_mutex);
+	subscribers[socket_handle] = s;
+	::pthread_mutex_unlock(&subscribers_mutex);
+}
+
+/*! \brief Reads the opening handshake, and then frames from the subscriber.
+ *
+ * Broken connections are shut down, so the accept loop closes them.
+ */
+void websocketserver::on_client_data(int socket_handle, const std::string &host, const char *data, unsigned length)
+{
+	(void) host; // Kept in the subscriber since it connected
+	::pthread_mutex_lock(&subscribers_mutex);
+	std::map<int, subscriber*>::iterator itr = subscribers.find(socket_handle);
+	if (itr == subscribers.end())
+	{
+		::pthread_mutex_unlock(&subscribers_mutex);
+		return;
+	}
+	subscriber *s = itr->second;
+	bool call_back = false;
+	if (!s->upgraded)
+	{
+		s->request.append(data, length);
+		handshake(socket_handle, s);
+		if (!s->upgraded)
+		{
+			::pthread_mutex_unlock(&subscribers_mutex);
+			return;
+		}
+		// Anything after the handshake is frames
+		data = s->request.data();
+		length = s->request.length();
+		call_back = (snapshot_callback != NULL);
+	}
+	while (length > 0)
+	{
+		unsigned space = 0;
+		char *position = s->frames.write_position(space);
+		if (space == 0)
+		{
+			vout(VOUT_ERROR) << "[" << whoami() << "] too much data from " << s->host << std::endlc;
+			::shutdown(socket_handle, SHUT_RDWR);
+			break;
+		}
+		if (space > length) space = length;
+		memcpy(position, data, space);
+		s->frames.commit(space);
+		data += space;
+		length -= space;
+	}
+	s->request.clear();
+
+	wsframe_decoder::result_type decoded;
+	while ((decoded = s->frames.next()) != wsframe_decoder::NEED_MORE)
+	{
+		if (decoded == wsframe_decoder::PROTOCOL_ERROR)
+		{
+			// Tell the subscriber why, and hang up once the close has been sent
+			vout(VOUT_ERROR) << "[" << whoami() << "] invalid frame from " << s->host << ": " << s->frames.error() << std::endlc;
+			static const char status[2] = { (char) (WSFRAME_CLOSE_PROTOCOL_ERROR >> 8), (char) (WSFRAME_CLOSE_PROTOCOL_ERROR & 0xff) };
+			uint8_t header[WSFRAME_MAX_HEADER_SIZE];
+			unsigned header_length = wsframe_header(header, wsframe_decoder::CLOSE, sizeof status);
+			send_private(socket_handle, s, std::string((const char *) header, header_length) + std::string(status, sizeof status));
+			s->closing = true;
+			flush(socket_handle, s);
+			break;
+		}
+		if (decoded == wsframe_decoder::MESSAGE)
+		{
+			vout(VOUT_DEBUG) << "[" << whoami() << "] ignoring message from " << s->host << std::endlc;
+			continue;
+		}
+		uint8_t header[WSFRAME_MAX_HEADER_SIZE];
+		if (s->frames.control_opcode() == wsframe_decoder::PING)
+		{
+			unsigned header_length = wsframe_header(header, wsframe_decoder::PONG, s->frames.control().length());
+			send_private(socket_handle, s, std::string((const char *) header, header_length) + s->frames.control());
+		}
+		else if (s->frames.control_opcode() == wsframe_decoder::CLOSE)
+		{
+			// Echo the close, and hang up once everything before it has been sent
+			unsigned header_length = wsframe_header(header, wsframe_decoder::CLOSE, 0);
+			send_private(socket_handle, s, std::string((const char *) header, header_length));
+			s->closing = true;
+			flush(socket_handle, s);
+			break;
+		}
+	}
+	::pthread_mutex_unlock(&subscribers_mutex);
+	if (call_back)
+	{
+		snapshot_callback(this);
+	}
+}
+
+/*! \brief Sends more of the queue.
+ */
+void websocketserver::on_client_writable(int socket_handle)
+{
+	::pthread_mutex_lock(&subscribers_mutex);
+	std::map<int, subscriber*>::iterator itr = subscribers.find(socket_handle);
+	if (itr != subscribers.end())
+	{
+		flush(socket_handle, itr->second);
+	}
+	::pthread_mutex_unlock(&subscribers_mutex);
+}
+
+/*! \brief Forgets a connection that is about to be closed.
+ */
+void websocketserver::on_client_closed(int socket_handle)
+{
+	::pthread_mutex_lock(&subscribers_mutex);
+	std::map<int, subscriber*>::iterator itr = subscribers.find(socket_handle);
+	if (itr != subscribers.end())
+	{
+		subscriber *s = itr->second;
+		vout(VOUT_VERBOSE) << "[" << whoami() << "] subscriber " << s->host << " disconnected" << std::endlc;
+		while (!s->queue.empty())
+		{
+			release(s->queue.front());
+			s->queue.pop_front();
+		}
+		delete s;
+		subscribers.erase(itr);
+	}
+	::pthread_mutex_unlock(&subscribers_mutex);
+}
+
+/*! \brief Answers the opening handshake once all of it has arrived.
+ *
+ * On success the subscriber is marked as upgraded, is left waiting for a
+ * snapshot, and \c request keeps whatever came after the handshake. A
+ * request that is not a websocket upgrade gets an error, and the
+ * connection is shut down.
+ */
+void websocketserver::handshake(int socket_handle, subscriber *s)
+{
+	size_t end = s->request.find("\r\n\r\n");
+	if (end == std::string::npos)
+	{
+		if (s->request.length() > WEBSOCKETSERVER_MAX_REQUEST_SIZE)
+		{
+			::shutdown(socket_handle, SHUT_RDWR);
+		}
+		return;
+	}
+
+	std::string key = "";
+	bool upgrade = false;
+	size_t start = s->request.find("\r\n");
+	while (start < end)
+	{
+		start += 2;
+		size_t line_end = s->request.find("\r\n", start);
+		std::string line = s->request.substr(start, line_end - start);
+		start = line_end;
+		size_t colon = line.find(':');
+		if (colon == std::string::npos)
+		{
+			continue;
+		}
+		std::string name = to_lower(line.substr(0, colon));
+		std::string value = line.substr(colon + 1);
+		trim(name);
+		trim(value);
+		if (name == "sec-websocket-key")
+		{
+			key = value;
+		}
+		else if (name == "upgrade")
+		{
+			upgrade = (to_lower(value) == "websocket");
+		}
+	}
+	if ((s->request.compare(0, 4, "GET ") != 0) || !upgrade || key.empty())
+	{
+		vout(VOUT_ERROR) << "[" << whoami() << "] " << s->host << " did not ask for a websocket" << std::endlc;
+		send_private(socket_handle, s, "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+		s->closing = true;
+		flush(socket_handle, s);
+		s->request.clear();
+		return;
+	}
+
+	send_private(socket_handle, s, "HTTP/1.1 101 Switching Protocols\r\n"
+	                               "Upgrade: websocket\r\n"
+	                               "Connection: Upgrade\r\n"
+	                               "Sec-WebSocket-Accept: " + wsframe_accept_key(key) + "\r\n\r\n");
+	flush(socket_handle, s);
+	s->request.erase(0, end + 4);
+	s->upgraded = true;
+	s->waiting_for_snapshot = true;
+	vout(VOUT_VERBOSE) << "[" << whoami() << "] new subscriber " << s->host << std::endlc;
+}
+
+/*! \brief Queues data for one subscriber only, e.g. an answer to a ping.
+ */
+void websocketserver::send_private(int socket_handle, subscriber *s, const std::string &data)
+{
+	shared_frame *frame = new shared_frame;
+	frame->data = data;
+	frame->users = 0;
+	enqueue(s, frame);
+	flush(socket_handle, s);
+}
+
+/*! \brief Adds a frame to a subscriber's queue.
+ */
+void websocketserver::enqueue(subscriber *s, shared_frame *frame)
+{
+	frame->users += 1;
+	s->queue.push_back(frame);
+	s->queued_bytes += frame->data.length();
 }
 
-/*! \brief Stops a running TCP-server.
- * It does not return until the server actually has stopped.
- * \return Always returns #NO_ERRORS
+/*! \brief Checks whether adding a frame would take a subscriber's queue beyond #queue_limit.
+ *
+ * A frame is always let into an empty queue, however large it is.
  */
-RH telnetserver::stop_telnet_server()
+bool websocketserver::over_limit(subscriber *s, shared_frame *frame)
 {
-	RH result;
-	result.set_ok();
+	unsigned waiting = s->queued_bytes - s->offset;
+	return((waiting > 0) && (waiting + frame->data.length() > queue_limit));
+}
 
-	telnet_server_running = false;
-	wait();
+/*! \brief Drops every frame in a subscriber's queue that has not been begun on.
+ *
+ * A frame that is partly sent must be finished, or the stream would be broken.
+ */
+void websocketserver::collapse(subscriber *s)
+{
+	unsigned keep = (s->offset > 0) ? 1 : 0;
+	while (s->queue.size() > keep)
+	{
+		shared_frame *frame = s->queue.back();
+		s->queued_bytes -= frame->data.length();
+		s->queue.pop_back();
+		release(frame);
+	}
+	s->collapses += 1;
+	vout(VOUT_VERBOSE) << "[" << whoami() << "] subscriber " << s->host << " is too slow; skipping to the next snapshot" << std::endlc;
+}
 
-	return result;
+/*! \brief Sends as much of a subscriber's queue as its socket takes right away.
+ *
+ * Up to #MAX_SEND_IOVECS frames are handed to the kernel at a time. A
+ * socket that fails is shut down, so the accept loop closes it.
+ */
+void websocketserver::flush(int socket_handle, subscriber *s)
+{
+	while (!s->queue.empty())
+	{
+		struct ::iovec iov[MAX_SEND_IOVECS];
+		unsigned count = 0;
+		std::deque<shared_frame*>::iterator itr = s->queue.begin();
+		while ((itr != s->queue.end()) && (count < MAX_SEND_IOVECS))
+		{
+			unsigned skip = (count == 0) ? s->offset : 0;
+			iov[count].iov_base = (void *) ((*itr)->data.data() + skip);
+			iov[count].iov_len = (*itr)->data.length() - skip;
+			count += 1;
+			itr++;
+		}
+		struct ::msghdr message;
+		memset(&message, 0, sizeof message);
+		message.msg_iov = iov;
+		message.msg_iovlen = count;
+		ssize_t sent = ::sendmsg(socket_handle, &message, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (sent == -1)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+			{
+				::shutdown(socket_handle, SHUT_RDWR);
+			}
+			return; // The rest is sent when the socket is writable again
+		}
+		while ((sent > 0) && !s->queue.empty())
+		{
+			shared_frame *frame = s->queue.front();
+			unsigned left = frame->data.length() - s->offset;
+			if ((size_t) sent < left)
+			{
+				s->offset += sent;
+				break;
+			}
+			sent -= left;
+			s->queued_bytes -= frame->data.length();
+			s->offset = 0;
+			s->queue.pop_front();
+			release(frame);
+		}
+	}
+	if (s->closing)
+	{
+		::shutdown(socket_handle, SHUT_RDWR);
+	}
+}
+
+/*! \brief Lets go of a frame, deleting it if nobody else holds it.
+ */
+void websocketserver::release(shared_frame *frame)
+{
+	frame->users -= 1;
+	if (frame->users == 0)
+	{
+		delete frame;
+	}
 }
 
 /*! \brief Default constructor.
@@ -1183,9 +2461,15 @@ websocket::websocket(std::string destination)
 }
 
 /*! \brief Destructor.
+ *
+ * Stops the listener first, as it keeps running after the remote end has
+ * closed the connection.
 */
 websocket::~websocket()
 {
+	stop_websocket_client_listener();
+	::pthread_mutex_destroy(&send_mutex);
+	::pthread_mutex_destroy(&keepalive_mutex);
 }
 
 /*! \brief Common initialization called by all constructors.
@@ -1196,6 +2480,47 @@ void websocket::common_constructor()
 	remote_path_ = "";
 	use_mask = true;
 	websocket_is_connected_ = false;
+	websocket_client_listener_running = false;
+	websocket_listener_thread_started = false;
+	masking_key_pool_used = WEBSOCKET_MASKING_KEY_POOL_SIZE;
+	deflate_enabled = false;
+	::pthread_mutex_init(&send_mutex, NULL);
+	::pthread_mutex_init(&keepalive_mutex, NULL);
+	keepalive_interval_ms = 0;
+	keepalive_max_missed = DEFAULT_WEBSOCKET_MAX_MISSED_PONGS;
+	last_ping_us = 0;
+	ping_outstanding = false;
+	ping_sequence = 0;
+	missed_pongs_ = 0;
+}
+
+/*! \brief Gives a new masking key for an outgoing frame.
+ *
+ * Keys are taken from a pool of random bytes from \c /dev/urandom, which
+ * is refilled when used up, so that getting a key is usually just a copy.
+ * If \c /dev/urandom cannot be read, \c random() is used instead.
+ *
+ * \param[out] key The key
+ */
+void websocket::new_masking_key(uint8_t key[4])
+{
+	if (masking_key_pool_used + 4 > WEBSOCKET_MASKING_KEY_POOL_SIZE)
+	{
+		size_t got = 0;
+		FILE *urandom = fopen("/dev/urandom", "rb");
+		if (urandom != NULL)
+		{
+			got = fread(masking_key_pool, 1, WEBSOCKET_MASKING_KEY_POOL_SIZE, urandom);
+			fclose(urandom);
+		}
+		for (size_t i = got; i < WEBSOCKET_MASKING_KEY_POOL_SIZE; i++)
+		{
+			masking_key_pool[i] = random() & 0xff;
+		}
+		masking_key_pool_used = 0;
+	}
+	memcpy(key, masking_key_pool + masking_key_pool_used, 4);
+	masking_key_pool_used += 4;
 }
 
 /*! \brief Established a websocket connection to a remote server.
@@ -1208,6 +2533,9 @@ void websocket::common_constructor()
 RH websocket::connect()
 {
 	RH result = tcpsocket::connect();
+	frames.clear();
+	deflate.reset();
+	std::string extensions = "";
 	if (result.is_ok())
 	{
 		// Perform websocket handshake
@@ -1219,6 +2547,10 @@ RH websocket::connect()
 		sendline(format_string("Connection: Upgrade"));
 		sendline(format_string("Sec-WebSocket-Key: x3JJHMbDL1EzLkh9GBhXDw=="));
 		sendline(format_string("Sec-WebSocket-Version: 13"));
+		if (deflate_enabled)
+		{
+			sendline("Sec-WebSocket-Extensions: " + wsdeflate::offer());
+		}
 		sendline(format_string(""));
 
 		RH_STRING rcv = readline(100);
@@ -1234,6 +2566,10 @@ RH websocket::connect()
 					{
 						vout(VOUT_DEBUG) << "[" << whoami() << "] received string: \"" << ascii_safe(rcv.value(), true) << "\""  << std::endlc;
 						// Should do some checking here
+						if (to_lower(rcv.value().substr(0, 25)) == "sec-websocket-extensions:")
+						{
+							extensions += (extensions.empty() ? "" : ",") + rcv.value().substr(25);
+						}
 					}
 					else
 					{
@@ -1249,8 +2585,38 @@ RH websocket::connect()
 		}
 	}
 
+	if (result.is_ok() && !extensions.empty())
+	{
+		if (!deflate_enabled || !deflate.accept(extensions))
+		{
+			vout(VOUT_ERROR) << "[" << whoami() << "] server answered with extensions we did not ask for: " << extensions << std::endlc;
+			tcpsocket::disconnect();
+			result.set_not_ok();
+		}
+		else
+		{
+			vout(VOUT_VERBOSE) << "[" << whoami() << "] using permessage-deflate:" << extensions << std::endlc;
+		}
+	}
+	frames.set_allow_compressed(deflate.negotiated());
+
 	if (result.is_ok())
 	{
+		// Frames the server sent right after the handshake may already have been read
+		unsigned space = 0;
+		char *position = frames.write_position(space);
+		unsigned count = 0;
+		while ((space > 0) && ((count = inbuffer.read(position, space)) > 0))
+		{
+			frames.commit(count);
+			position = frames.write_position(space);
+		}
+		::pthread_mutex_lock(&keepalive_mutex);
+		last_ping_us = monotonic_us();
+		ping_outstanding = false;
+		missed_pongs_ = 0;
+		round_trip_times_.clear();
+		::pthread_mutex_unlock(&keepalive_mutex);
 		websocket_is_connected_ = true;
 	}
 
@@ -1277,13 +2643,18 @@ bool websocket::connected()
 	return websocket_is_connected_;
 }
 
-/*! \brief Reads a new data chunk from the websocket.
+/*! \brief Reads the next whole message from the websocket.
  *
- * Unless a timeout occurres, an entire data chunk is read.
+ * Frames are decoded by #frames, so headers split between reads,
+ * several frames in one read, and messages fragmented into continuation
+ * frames are all handled. Whatever is received after the message is kept
+ * for the next call. Control frames are taken care of here, and are not
+ * returned: pings are answered, and pongs are matched with our own pings.
  *
- * \param timeout_ms Timeout in miliseconds
- * \return #NO_ERRORS with the read string as a value(), or one of
- *         #SOCKET_ERROR_NOT_CONNECTED or #SOCKET_ERROR_INVALID_MESSAGE.
+ * \param timeout_ms Time to wait for more data before giving up
+ * \return #NO_ERRORS with the message as value(), or one of
+ *         #SOCKET_RECEIVE_TIMEOUT, #SOCKET_ERROR_NOT_CONNECTED,
+ *         #SOCKET_ERROR_INVALID_MESSAGE or #SOCKET_ERROR.
  */
 RH_STRING websocket::read_data(int timeout_ms)
 {
@@ -1291,204 +2662,90 @@ RH_STRING websocket::read_data(int timeout_ms)
 	result.set_ok();
 	result.set_value("");
 
-	std::string received_string = "";
-
 	if (!is_connected)
 	{
 		result.set_not_ok(SOCKET_ERROR_NOT_CONNECTED);
+		return(result);
 	}
-	else
+
+	while (true)
 	{
-		bool uses_mask;
-		unsigned bytes_received = 0;
-		uint8_t *buffer;
-		// \todo buffer size (1500) should NOT be hardcoded
-		buffer = new uint8_t[1501];
-		RH_INT fetch_result = fetch_data((char*)buffer, 1500, timeout_ms);
-		if ((fetch_result.is_ok()) && (fetch_result.id() != SOCKET_RECEIVE_TIMEOUT))
-		{
-			bytes_received = fetch_result.value();
-			wsheader_type ws;
-			const uint8_t * data = (uint8_t *) &buffer[0];
-			ws.fin = (data[0] & 0x80) == 0x80;
-			ws.opcode = (wsheader_type::opcode_type) (data[0] & 0x0f);
-			ws.mask = (data[1] & 0x80) == 0x80;
-			uses_mask = ws.mask;
-			ws.N0 = (data[1] & 0x7f);
-			ws.header_size = 2 + (ws.N0 == 126? 2 : 0) + (ws.N0 == 127? 6 : 0) + (ws.mask? 4 : 0);
-			//if (rxbuf.size() < ws.header_size) { return; /* Need: ws.header_size - rxbuf.size() */ }
-			int i;
-			if (ws.N0 < 126)
-			{
-				ws.N = ws.N0;
-				i = 2;
-			}
-			else if (ws.N0 == 126)
-			{
-				ws.N = 0;
-				ws.N |= ((uint64_t) data[2]) << 8;
-				ws.N |= ((uint64_t) data[3]) << 0;
-				i = 4;
-			}
-			else if (ws.N0 == 127)
+		wsframe_decoder::result_type decoded = frames.next();
+		if (decoded == wsframe_decoder::MESSAGE)
+		{
+			if (!frames.message_compressed())
 			{
-				ws.N = 0;
-				ws.N |= ((uint64_t) data[2]) << 56;
-				ws.N |= ((uint64_t) data[3]) << 48;
-				ws.N |= ((uint64_t) data[4]) << 40;
-				ws.N |= ((uint64_t) data[5]) << 32;
-				ws.N |= ((uint64_t) data[6]) << 24;
-				ws.N |= ((uint64_t) data[7]) << 16;
-				ws.N |= ((uint64_t) data[8]) << 8;
-				ws.N |= ((uint64_t) data[9]) << 0;
-				i = 10;
+				result.set_value(frames.message());
 			}
-			if (ws.mask)
+			else if (deflate.decompress(frames.message().data(), frames.message().length(), inflate_buffer, WSFRAME_MAX_MESSAGE_SIZE))
 			{
-				ws.masking_key[0] = ((uint8_t) data[i+0]) << 0;
-				ws.masking_key[1] = ((uint8_t) data[i+1]) << 0;
-				ws.masking_key[2] = ((uint8_t) data[i+2]) << 0;
-				ws.masking_key[3] = ((uint8_t) data[i+3]) << 0;
+				result.set_value(inflate_buffer);
 			}
 			else
 			{
-				ws.masking_key[0] = 0;
-				ws.masking_key[1] = 0;
-				ws.masking_key[2] = 0;
-				ws.masking_key[3] = 0;
+				vout(VOUT_ERROR) << "[" << whoami() << "] could not decompress message" << std::endlc;
+				result.set_not_ok(SOCKET_ERROR_INVALID_MESSAGE);
 			}
-			//if (rxbuf.size() < ws.header_size+ws.N) { return; /* Need: ws.header_size+ws.N - rxbuf.size() */ }
-#			ifdef DEBUG
-			if (verbosity >= VOUT_DEBUG2)
+			return(result);
+		}
+		if (decoded == wsframe_decoder::PROTOCOL_ERROR)
+		{
+			vout(VOUT_ERROR) << "[" << whoami() << "] invalid frame: " << frames.error() << std::endlc;
+			frames.clear();
+			result.set_not_ok(SOCKET_ERROR_INVALID_MESSAGE);
+			return(result);
+		}
+		if (decoded == wsframe_decoder::CONTROL)
+		{
+			if (frames.control_opcode() == wsframe_decoder::CLOSE)
 			{
-				vout(VOUT_DEBUG2) << "[" << whoami() << "] received data ";
-				if (ws.mask)
-				{
-					vout(VOUT_DEBUG2) << "(mask=on): ";
-					uint8_t *data_ptr = buffer;
-					int debug_i;
-					char hex[6];
-					for (debug_i = 0; debug_i < bytes_received; debug_i++)
-					{
-						sprintf(hex, "0x%02x ", *(data_ptr++));
-						vout(VOUT_DEBUG2) << hex;
-					}
-				}
-				else
-				{
-					vout(VOUT_DEBUG2) << ": ";
-					uint8_t *data_ptr = buffer;
-					int debug_i;
-					char hex[6];
-					for (debug_i = 0; debug_i < ws.header_size; debug_i++)
-					{
-						sprintf(hex, "0x%02x ", *(data_ptr++));
-						vout(VOUT_DEBUG2) << hex;
-					}
-					vout(VOUT_DEBUG2) << "\"";
-					for (debug_i = ws.header_size; debug_i < bytes_received; debug_i++)
-					{
-						vout(VOUT_DEBUG2) << *(data_ptr++);
-					}
-					vout(VOUT_DEBUG2) << "\"";
-				}
+				vout(VOUT_VERBOSE) << "[" << whoami() << "] closed by remote" << std::endlc;
+				websocket_is_connected_ = false;
+				result.set_not_ok(SOCKET_ERROR_NOT_CONNECTED);
+				return(result);
 			}
-#			endif
-
-			if (ws.opcode == wsheader_type::TEXT_FRAME && ws.fin)
+			if (frames.control_opcode() == wsframe_decoder::PING)
 			{
-				if (ws.mask)
-				{
-					size_t i;
-					for (i = 0; i != ws.N; ++i)
-					{
-						buffer[i + ws.header_size] ^= ws.masking_key[i & 0x3];
-					}
-				}
-				*(buffer + ws.header_size + ws.N) = '\0';
-				received_string = std::string((char*)buffer + ws.header_size);
-				size_t key_index = i & 0x03;
-				while (bytes_received < (ws.header_size + ws.N))
-				{
-					// We've not received the entire message yet.
-					// Loop-read until we have.
-					fetch_result = fetch_data((char*)buffer, 1500, timeout_ms);
-					if (fetch_result.is_ok())
-					{
-						bytes_received += fetch_result.value();
-						if (ws.mask)
-						{
-							for (size_t i = 0; i != fetch_result.value(); ++i)
-							{
-								buffer[i] ^= ws.masking_key[key_index++];
-								key_index &= 0x03;
-							}
-						}
-						*(buffer + fetch_result.value()) = '\0';
-						received_string += std::string((char*)buffer);
-					}
-#					ifdef DEBUG
-					if (verbosity >= VOUT_DEBUG2)
-					{
-						if (ws.mask)
-						{
-							uint8_t *data_ptr = buffer;
-							int debug_i;
-							char hex[6];
-							for (debug_i = 0; debug_i < bytes_received; debug_i++)
-							{
-								sprintf(hex, "0x%02x ", *(data_ptr++));
-								vout(VOUT_DEBUG2) << hex;
-							}
-						}
-						else
-						{
-							vout(VOUT_DEBUG2) << ": ";
-							uint8_t *data_ptr = buffer;
-							int debug_i;
-							for (debug_i = ws.header_size; debug_i < bytes_received; debug_i++)
-							{
-								vout(VOUT_DEBUG2) << *(data_ptr++);
-							}
-						}
-					}
-#					endif
-				}
+				send(frames.control().data(), frames.control().length(), wsframe_decoder::PONG);
 			}
-			else if (ws.opcode == wsheader_type::PING) { }
-			else if (ws.opcode == wsheader_type::PONG) { }
-//			else if (ws.opcode == wsheader_type::CLOSE) { close(); }
-			else
+			else if (frames.control_opcode() == wsframe_decoder::PONG)
 			{
-				result.set_not_ok(SOCKET_ERROR_INVALID_MESSAGE);
+				handle_pong(frames.control());
 			}
-
+			continue;
 		}
 
-		if ((fetch_result.is_ok()) && (fetch_result.id() != SOCKET_RECEIVE_TIMEOUT))
+		// Need more data
+		unsigned space = 0;
+		char *position = frames.write_position(space);
+		if (space == 0)
 		{
-#			ifdef DEBUG
-			if (verbosity >= VOUT_DEBUG2)
-			{
-				if (!uses_mask)
-				{
-					vout(VOUT_DEBUG2) << "\"";
-				}
-				vout(VOUT_DEBUG2) << std::endlc;
-			}
-#			endif
-			result.set_value(received_string);
+			// Cannot happen, as payloads are taken out while they arrive
+			frames.clear();
+			result.set_not_ok(SOCKET_ERROR_INVALID_MESSAGE);
+			return(result);
 		}
-		else
+		RH_INT fetch_result = fetch_data(position, space, timeout_ms);
+		if (fetch_result.is_not_ok() || (fetch_result.id() == SOCKET_RECEIVE_TIMEOUT))
 		{
 			result.set_not_ok(fetch_result.id());
+			return(result);
 		}
-		delete[] buffer;
+#		ifdef DEBUG
+		if (verbosity >= VOUT_DEBUG2)
+		{
+			vout(VOUT_DEBUG2) << "[" << whoami() << "] received " << fetch_result.value() << " bytes: ";
+			char hex[6];
+			for (unsigned debug_i = 0; debug_i < fetch_result.value(); debug_i++)
+			{
+				sprintf(hex, "0x%02x ", (uint8_t) position[debug_i]);
+				vout(VOUT_DEBUG2) << hex;
+			}
+			vout(VOUT_DEBUG2) << std::endlc;
+		}
+#		endif
+		frames.commit(fetch_result.value());
 	}
-
-
-
-	return(result);
 }
 
 /*! \brief Thread that dispatches incoming message events.
@@ -1508,16 +2765,158 @@ void websocket::thread_entry()
 
 	while (websocket_client_listener_running)
 	{
+		if (!websocket_is_connected_)
+		{
+			// Nothing more will come
+			usleep(250000);
+			continue;
+		}
 		rcv = read_data(250);
 		if (rcv.is_ok())
 		{
 			vout(VOUT_DEBUG) << "[" << whoami() << "] received string \"" << ascii_safe(rcv.value(), true) << "\"" << std::endlc;
 			websocketclient_callback(this, rcv.value());
 		}
+		keepalive();
 	}
 	vout(VOUT_DEBUG) << "[" << whoami() << "] exiting listener thread" << std::endlc;
 }
 
+/*! \brief Asks for permessage-deflate compression from the next #connect() on.
+ *
+ * Compression is only used if the server agrees to it in the handshake.
+ *
+ * \param level Compression level, 1 (fastest) to 9 (smallest); 0 turns compression off
+ * \param min_size Messages shorter than this are sent uncompressed, as compressing them gains little
+ */
+void websocket::set_compression(int level, unsigned min_size)
+{
+	deflate_enabled = (level > 0);
+	if (deflate_enabled)
+	{
+		deflate.configure(level, min_size);
+	}
+}
+
+/*! \brief Tells if messages are compressed, i.e.\ if permessage-deflate was negotiated.
+ */
+bool websocket::compressed()
+{
+	return(deflate.negotiated());
+}
+
+/*! \brief Turns sending of pings on or off.
+ *
+ * Pings are sent by the \ref start_websocket_client_listener() "listener",
+ * which also measures the time until they are answered. If
+ * \c max_missed_pongs pings in a row are not answered before the next is
+ * due, the connection is considered dead: it is shut down, and
+ * #connected() returns FALSE.
+ *
+ * \param interval_ms Time between pings; 0 turns them off
+ * \param max_missed_pongs Number of unanswered pings to accept, at least 1
+ */
+void websocket::set_keepalive(unsigned interval_ms, unsigned max_missed_pongs)
+{
+	keepalive_interval_ms = interval_ms;
+	keepalive_max_missed = (max_missed_pongs > 0) ? max_missed_pongs : 1;
+}
+
+/*! \brief Gives the round trip times of the last answered pings.
+ * \return A copy of the statistics
+ */
+rtt_histogram websocket::round_trip_times()
+{
+	::pthread_mutex_lock(&keepalive_mutex);
+	rtt_histogram copy = round_trip_times_;
+	::pthread_mutex_unlock(&keepalive_mutex);
+	return(copy);
+}
+
+/*! \brief Number of pings in a row that have gone unanswered.
+ */
+unsigned websocket::missed_pongs()
+{
+	::pthread_mutex_lock(&keepalive_mutex);
+	unsigned missed = missed_pongs_;
+	::pthread_mutex_unlock(&keepalive_mutex);
+	return(missed);
+}
+
+/*! \brief Sends a ping when one is due, and gives up the connection if too many have gone unanswered.
+ *
+ * Called regularly by the listener thread.
+ */
+void websocket::keepalive()
+{
+	if ((keepalive_interval_ms == 0) || !websocket_is_connected_)
+	{
+		return;
+	}
+	unsigned long long now = monotonic_us();
+	if (now - last_ping_us < (unsigned long long) keepalive_interval_ms * 1000)
+	{
+		return;
+	}
+
+	::pthread_mutex_lock(&keepalive_mutex);
+	if (ping_outstanding)
+	{
+		missed_pongs_ += 1;
+	}
+	bool dead = (missed_pongs_ >= keepalive_max_missed);
+	ping_sequence += 1;
+	last_ping_us = now;
+	ping_outstanding = !dead;
+	unsigned long long sequence = ping_sequence;
+	::pthread_mutex_unlock(&keepalive_mutex);
+
+	if (dead)
+	{
+		vout(VOUT_ERROR) << "[" << whoami() << "] " << url() << " has not answered " << keepalive_max_missed
+		                 << " pings in a row; giving up the connection" << std::endlc;
+		websocket_is_connected_ = false;
+		::shutdown(socket_handle, SHUT_RDWR); // Makes sends fail; the socket is closed by disconnect()
+		return;
+	}
+
+	char payload[8];
+	for (unsigned i = 0; i < 8; i++)
+	{
+		payload[i] = (sequence >> (56 - 8 * i)) & 0xff;
+	}
+	send(payload, sizeof payload, wsframe_decoder::PING);
+}
+
+/*! \brief Measures the round trip time if a pong answers our last ping.
+ *
+ * Unsolicited pongs, and late answers to older pings, are ignored.
+ *
+ * \param payload Payload of the pong
+ */
+void websocket::handle_pong(const std::string &payload)
+{
+	if (payload.length() != 8)
+	{
+		return;
+	}
+	unsigned long long sequence = 0;
+	for (unsigned i = 0; i < 8; i++)
+	{
+		sequence = (sequence << 8) | (uint8_t) payload[i];
+	}
+	unsigned long long now = monotonic_us();
+	::pthread_mutex_lock(&keepalive_mutex);
+	if (ping_outstanding && (sequence == ping_sequence))
+	{
+		ping_outstanding = false;
+		missed_pongs_ = 0;
+		unsigned long long rtt_us = now - last_ping_us;
+		round_trip_times_.add((rtt_us < 0xffffffffULL) ? rtt_us : 0xffffffffU);
+	}
+	::pthread_mutex_unlock(&keepalive_mutex);
+}
+
 /*! \brief Starts a thread that listens for incoming messages
  *
  * It starts a separate \ref thread_entry() "thread" that does all the work. It
@@ -1533,7 +2932,9 @@ RH websocket::start_websocket_client_listener(websocket_callback callback)
 
 	websocketclient_callback = callback;
 
+	stop_websocket_client_listener(); // Joins any previous listener thread
 	websocket_client_listener_running = false;
+	websocket_listener_thread_started = true;
 	run();
 	while (!websocket_client_listener_running);
 
@@ -1542,7 +2943,11 @@ RH websocket::start_websocket_client_listener(websocket_callback callback)
 }
 
 /*! \brief Stops a running message listener.
- * It does not return until the listener actually has stopped.
+ *
+ * It does not return until the listener actually has stopped. The listener
+ * keeps running after the link is lost, so this must be called whether or not
+ * the websocket is still #connected(). Does nothing if no listener was started.
+ *
  * \return Always returns #NO_ERRORS
  */
 RH websocket::stop_websocket_client_listener()
@@ -1550,22 +2955,43 @@ RH websocket::stop_websocket_client_listener()
 	RH result;
 	result.set_ok();
 
-	websocket_client_listener_running = false;
-	wait();
+	if (websocket_listener_thread_started)
+	{
+		websocket_client_listener_running = false;
+		wait();
+		websocket_listener_thread_started = false;
+	}
 
 	return result;
 }
 
-/*! \brief Sends a message over the websocket.
+/*! \brief Sends a text message over the websocket.
+ * \param message Message to send
+ * \return #NO_ERRORS if all is OK, otherwise either
+ *         #SOCKET_ERROR_NOT_CONNECTED or #SOCKET_ERROR.
+ */
+RH websocket::send(const std::string &message)
+{
+	return send(message.data(), message.length(), wsframe_decoder::TEXT_FRAME);
+}
+
+/*! \brief Sends one frame over the websocket, without copying the payload if it need not be masked.
  *
- * The proper header is added, and the message is "scrambled" (masked)
- * if #use_mask is set to TRUE.
+ * The header is built on the stack. If #use_mask is set to TRUE, the
+ * payload is masked into #mask_buffer, which is kept from one frame to the
+ * next; otherwise it is sent straight from the caller's buffer. If
+ * permessage-deflate has been negotiated, text and binary messages that
+ * are large enough are compressed into #deflate_buffer, and masked there. Header and
+ * payload are written with one gather write, which is repeated until all
+ * of the frame has been sent. Frames from different threads are not mixed.
  *
- * \param message Message to send
+ * \param payload Payload; only read, and only during the call
+ * \param length Length of \c payload
+ * \param opcode Frame opcode
  * \return #NO_ERRORS if all is OK, otherwise either
  *         #SOCKET_ERROR_NOT_CONNECTED or #SOCKET_ERROR.
  */
-RH websocket::send(std::string message)
+RH websocket::send(const char *payload, unsigned length, wsframe_decoder::opcode_type opcode)
 {
 	RH result;
 	result.set_ok();
@@ -1576,140 +3002,109 @@ RH websocket::send(std::string message)
 		return(result);
 	}
 
-	// TODO:
-	// Masking key should (must) be derived from a high quality random
-	// number generator, to mitigate attacks on non-WebSocket friendly
-	// middleware:
-	const uint8_t masking_key[4] = { 0x12, 0x34, 0x56, 0x78 };
-
-	std::vector<uint8_t> header;
-	uint64_t message_size = message.size();
-	header.assign(2 + (message_size >= 126 ? 2 : 0) + (message_size >= 65536 ? 6 : 0) + (use_mask ? 4 : 0), 0);
-	header[0] = 0x80 | wsheader_type::TEXT_FRAME;
-	if (message_size < 126)
-	{
-		header[1] = (message_size & 0xff) | (use_mask ? 0x80 : 0);
-		if (use_mask)
-		{
-			header[2] = masking_key[0];
-			header[3] = masking_key[1];
-			header[4] = masking_key[2];
-			header[5] = masking_key[3];
-		}
-	}
-	else if (message_size < 65536)
-	{
-		header[1] = 126 | (use_mask ? 0x80 : 0);
-		header[2] = (message_size >> 8) & 0xff;
-		header[3] = (message_size >> 0) & 0xff;
-		if (use_mask)
-		{
-			header[4] = masking_key[0];
-			header[5] = masking_key[1];
-			header[6] = masking_key[2];
-			header[7] = masking_key[3];
-		}
-	}
-	else
+	::pthread_mutex_lock(&send_mutex);
+	bool compressed = false;
+	if (((opcode == wsframe_decoder::TEXT_FRAME) || (opcode == wsframe_decoder::BINARY_FRAME))
+	    && deflate.worth_compressing(length))
 	{
-	// TODO: run coverage testing here
-		header[1] = 127 | (use_mask ? 0x80 : 0);
-		header[2] = (message_size >> 56) & 0xff;
-		header[3] = (message_size >> 48) & 0xff;
-		header[4] = (message_size >> 40) & 0xff;
-		header[5] = (message_size >> 32) & 0xff;
-		header[6] = (message_size >> 24) & 0xff;
-		header[7] = (message_size >> 16) & 0xff;
-		header[8] = (message_size >>  8) & 0xff;
-		header[9] = (message_size >>  0) & 0xff;
-		if (use_mask)
+		if (!deflate.compress(payload, length, deflate_buffer))
 		{
-			header[10] = masking_key[0];
-			header[11] = masking_key[1];
-			header[12] = masking_key[2];
-			header[13] = masking_key[3];
+			::pthread_mutex_unlock(&send_mutex);
+			result.set_not_ok(SOCKET_ERROR);
+			result.set_not_ok(result.text() + " (compression failed)");
+			return(result);
 		}
+		payload = deflate_buffer.data();
+		length = deflate_buffer.length();
+		compressed = true;
 	}
 
-	uint8_t *data = new uint8_t[header.size() + message.length()];
-	uint8_t *data_ptr = data;
-	unsigned header_length = 0;
-	unsigned data_length = 0;
+	uint8_t header[WSFRAME_MAX_HEADER_SIZE];
+	unsigned header_length = wsframe_header(header, opcode, length, compressed);
 
-	std::vector<uint8_t>::iterator header_itr = header.begin();
-	while (header_itr != header.end())
-	{
-		*(data_ptr++) = *(header_itr++);
-		header_length += 1;
-		data_length += 1;
-	}
-	if (!use_mask)
+	if (use_mask)
 	{
-		std::string::iterator message_itr = message.begin();
-		while (message_itr != message.end())
+		// A new unpredictable key for every frame, to mitigate attacks on
+		// non-WebSocket friendly middleware
+		header[1] |= 0x80;
+		new_masking_key(header + header_length);
+		if (compressed)
 		{
-			*(data_ptr++) = *(message_itr++);
-			data_length += 1;
+			// Already our own copy
+			wsframe_mask(&deflate_buffer[0], length, header + header_length);
 		}
-	}
-	else
-	{
-		std::string::iterator message_itr = message.begin();
-		int key_index = 0;
-		while (message_itr != message.end())
+		else if (length > 0)
 		{
-			*(data_ptr++) = *(message_itr++) ^ masking_key[key_index];
-			data_length += 1;
-			key_index += 1;
-			key_index &= 0x03;
+			if (mask_buffer.size() < length)
+			{
+				mask_buffer.resize(length);
+			}
+			wsframe_mask_copy(&mask_buffer[0], payload, length, header + header_length);
+			payload = &mask_buffer[0];
 		}
+		header_length += 4;
 	}
 
-#ifdef DEBUG
 	if (verbosity >= VOUT_DEBUG2)
 	{
-		vout(VOUT_DEBUG2) << "[" << whoami() << "] sending data ";
-		if (use_mask)
+		vout(VOUT_DEBUG2) << "[" << whoami() << "] sending frame ";
+		char hex[6];
+		for (unsigned i = 0; i < header_length; i++)
 		{
-			vout(VOUT_DEBUG2) << "(mask=on): ";
-			data_ptr = data;
-			int debug_i;
-			char hex[6];
-			for (debug_i = 0; debug_i < data_length; debug_i++)
-			{
-				sprintf(hex, "0x%02x ", *(data_ptr++));
-				vout(VOUT_DEBUG2) << hex;
-			}
+			sprintf(hex, "0x%02x ", header[i]);
+			vout(VOUT_DEBUG2) << hex;
 		}
-		else
+		vout(VOUT_DEBUG2) << "+ " << length << " bytes" << (use_mask ? " (masked)" : "") << std::endlc;
+	}
+
+	struct ::iovec iov[2];
+	iov[0].iov_base = header;
+	iov[0].iov_len = header_length;
+	iov[1].iov_base = (void *) payload;
+	iov[1].iov_len = length;
+	struct ::msghdr frame;
+	memset(&frame, 0, sizeof frame);
+	frame.msg_iov = iov;
+	frame.msg_iovlen = (length > 0) ? 2 : 1;
+	while (frame.msg_iovlen > 0)
+	{
+		ssize_t sent = ::sendmsg(socket_handle, &frame, MSG_NOSIGNAL);
+		if (sent == -1)
 		{
-			vout(VOUT_DEBUG2) << ": ";
-			data_ptr = data;
-			int debug_i;
-			char hex[6];
-			for (debug_i = 0; debug_i < header_length; debug_i++)
+			if (errno == EINTR)
 			{
-				sprintf(hex, "0x%02x ", *(data_ptr++));
-				vout(VOUT_DEBUG2) << hex;
+				continue;
 			}
-			vout(VOUT_DEBUG2) << "\"";
-			for (debug_i = header_length; debug_i < data_length; debug_i++)
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
 			{
-				vout(VOUT_DEBUG2) << *(data_ptr++);
+				struct ::pollfd ufds[1];
+				ufds[0].fd = socket_handle;
+				ufds[0].events = POLLOUT;
+				ufds[0].revents = 0;
+				if (::poll(ufds, 1, DEFAULT_CONNECT_TIMEOUT_MS) > 0)
+				{
+					continue;
+				}
 			}
-			vout(VOUT_DEBUG2) << "\"";
+			result.set_not_ok(SOCKET_ERROR);
+			result.set_not_ok(result.text() + " (" + strerror(errno) + ")");
+			break;
+		}
+		// Skip what was sent, which may end in the middle of the header
+		while ((frame.msg_iovlen > 0) && ((size_t) sent >= frame.msg_iov->iov_len))
+		{
+			sent -= frame.msg_iov->iov_len;
+			frame.msg_iov += 1;
+			frame.msg_iovlen -= 1;
+		}
+		if (frame.msg_iovlen > 0)
+		{
+			frame.msg_iov->iov_base = (char *) frame.msg_iov->iov_base + sent;
+			frame.msg_iov->iov_len -= sent;
 		}
-
-		vout(VOUT_DEBUG2) << std::endlc;
-	}
-#endif
-
-	if (::send(socket_handle, data, data_length, 0) == -1)
-	{
-		result.set_not_ok(SOCKET_ERROR);
 	}
+	::pthread_mutex_unlock(&send_mutex);
 
-	delete[] data;
 	return(result);
 }
 
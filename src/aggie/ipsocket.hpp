@@ -8,7 +8,15 @@
 #include "resulthandler.hpp"
 #include "messagelist.hpp"
 #include "threadable.hpp"
+#include "reactor.hpp"
+#include "linebuffer.hpp"
+#include "wsframe.hpp"
+#include "rtthistogram.hpp"
+#include "wsdeflate.hpp"
 #include <string>
+#include <vector>
+#include <deque>
+#include <map>
 
 
 #include "platform.h"
@@ -26,6 +34,7 @@
 #	include <sys/poll.h>
 #	include <sys/epoll.h>
 #	include <sys/fcntl.h>
+#	include <sys/uio.h>
 #	include <errno.h>
 #	include <pthread.h>
 #endif
@@ -33,7 +42,23 @@
 #define MAX_EPOLL_EVENTS 64
 
 #define DEFAULT_RECEIVE_TIMEOUT_MS 500
+//! \brief Default time to wait for the remote end to accept a connection, after its name is resolved.
+#define DEFAULT_CONNECT_TIMEOUT_MS 3000
+//! \brief Default maximum number of bytes waiting in a tcpsocket's send queue.
+#define DEFAULT_SEND_QUEUE_LIMIT (64 * 1024)
+//! \brief Maximum number of queued strings handed to the kernel in one go.
+#define MAX_SEND_IOVECS 64
+//! \brief Maximum number of threads resolving host names in parallel in tcpsocket::connect_all().
+#define MAX_RESOLVER_THREADS 16
 #define TELNET_SERVER_PROMPT "> "
+//! \brief Number of random bytes fetched at a time for websocket masking keys. Must be a multiple of 4.
+#define WEBSOCKET_MASKING_KEY_POOL_SIZE 256
+//! \brief Default number of pings in a row a websocket may leave unanswered before the connection is given up.
+#define DEFAULT_WEBSOCKET_MAX_MISSED_PONGS 3
+//! \brief Default maximum number of bytes waiting in the queue of a websocketserver subscriber.
+#define DEFAULT_WEBSOCKETSERVER_QUEUE_LIMIT (1024 * 1024)
+//! \brief Longest opening handshake a websocketserver accepts from a subscriber.
+#define WEBSOCKETSERVER_MAX_REQUEST_SIZE 8192
 
 
 
@@ -75,14 +100,12 @@ protected:
 	void *get_in_addr(struct sockaddr *sa);
 	int socket_handle;
 #endif
-	RH get_next_line(char * const buffer, unsigned max_bytes, unsigned timeout);
+	RH get_next_line(const char *&line, unsigned &length, unsigned timeout);
+	RH_INT fill_inbuffer(unsigned timeout);
+	linebuffer inbuffer; //!< Incoming data not yet split into lines.
 private:
 	void init();
 	static bool init_done; //!< Makes sure init() is only called once.
-	char *inbuffer; //!< Buffer where the incoming payload is stored.
-	char *inbuffer_ptr; //!< Buffer pointer in \ref inbuffer. Points to next unread byte.
-	unsigned inbuffer_used; //!< How many unread bytes there are in \ref inbuffer.
-	unsigned inbuffer_size; //!< How many bytes are allocated for \ref inbuffer.
 };
 
 /*! \brief TCP socket communications.
@@ -90,8 +113,17 @@ private:
  * Uses threads when acting as a TCP-server.
  * Needs a callback function for processing those messages.
  *
+ * Incoming messages can be received either by a dedicated listener thread
+ * (#start_tcpsocket_client_listener()), or by a shared #reactor
+ * (#start_tcpsocket_reactor_listener()) which serves many sockets at once.
+ *
+ * Outgoing data is put in a send queue and written without blocking. Whatever
+ * the socket cannot take right away is sent later by the listener, so a slow
+ * receiver never holds up the sender. When the queue is full, sending fails
+ * with #SOCKET_ERROR_SEND_QUEUE_FULL.
+ *
  */
-class tcpsocket : public ipsocket, public threadable
+class tcpsocket : public ipsocket, public threadable, public reactor_handler
 {
 public:
 	tcpsocket();
@@ -101,17 +133,35 @@ public:
 	~tcpsocket();
 	void common_constructor();
 	virtual RH connect();
+	static RH_INT connect_all(std::vector<tcpsocket*> &sockets, unsigned timeout_ms);
+	RH resolve();
+	RH begin_connect();
+	RH finish_connect();
+	RH restart_connect();
+	RH poll_connect();
+	void abort_connect();
+	void set_connect_timeout(unsigned timeout_ms);
 	void disconnect();
 	bool connected();
 	RH send(std::string data);
 	RH sendline(std::string data);
+	RH queue(std::string data);
+	RH queueline(std::string data);
+	RH flush();
+	void set_send_queue_limit(unsigned bytes);
+	unsigned send_queue_size();
 	RH send(int socket_handle, std::string data);
 	RH sendline(int socket_handle, std::string data);
 	RH_STRING readline(unsigned max_length, unsigned timeout_ms = DEFAULT_RECEIVE_TIMEOUT_MS);
 	RH_INT fetch_data(char *buffer, unsigned max_length, unsigned timeout_ms);
-	typedef void (*tcpsocket_callback)(tcpsocket *, std::string);
+	//! Signature of callback function that handles incoming lines. The line is only valid during the call.
+	typedef void (*tcpsocket_callback)(tcpsocket *, const char *line, unsigned length);
 	RH start_tcpsocket_client_listener(tcpsocket_callback);
+	RH start_tcpsocket_reactor_listener(reactor *, tcpsocket_callback);
 	RH stop_tcpsocket_client_listener();
+	void on_readable();
+	void on_writable();
+	void on_hangup();
 protected:
 	virtual std::string whoami() { return "tcpsocket"; }
 	volatile bool is_connected; //!< TRUE if socket is connected
@@ -121,7 +171,24 @@ private:
 //	RH telnet_server_loop(server_callback);
 	tcpsocket_callback tcpsocketclient_callback; //!< Pointer to the websocket callback function
 	void thread_entry();
+	void dispatch_lines();
 	volatile bool tcpsocket_client_listener_running; //!< TRUE when we're able to receive messages
+	bool listener_thread_started; //!< TRUE from #start_tcpsocket_client_listener() until the thread has been joined
+	reactor *reactor_; //!< Reactor dispatching our incoming messages, or NULL if we use our own thread
+	struct ::addrinfo *resolved_addresses; //!< Result of the last #resolve(), or NULL
+	struct ::addrinfo *connect_candidate; //!< Next address for #begin_connect() to try
+	unsigned connect_timeout_ms_; //!< How long #connect() waits before giving up
+	RH queue_locked(const std::string &data);
+	RH flush_locked();
+	RH drain_send_queue(unsigned timeout_ms);
+	std::deque<std::string> outqueue; //!< Data waiting to be sent
+	unsigned outqueue_bytes; //!< Number of unsent bytes in #outqueue
+	unsigned outqueue_offset; //!< Number of bytes of the first entry in #outqueue already sent
+	unsigned outqueue_limit; //!< #outqueue_bytes may not grow beyond this
+	bool write_interest; //!< TRUE if #reactor_ has been asked for on_writable() calls
+#	ifdef PLATFORM_LINUX
+		pthread_mutex_t outqueue_mutex; //!< Protects #outqueue, and #reactor_ and #socket_handle against being changed while sending
+#	endif
 	bool allow_auto_disconnect; //!< If TRUE, we must manually disconnect a session before connecting somewhere else.
 };
 
@@ -163,6 +230,11 @@ public:
 	RH stop_telnet_server();
 protected:
 	virtual std::string whoami() { return "telnetserver"; }
+	virtual uint32_t client_events();
+	virtual void on_client_accepted(int socket_handle, const std::string &host);
+	virtual void on_client_data(int socket_handle, const std::string &host, const char *data, unsigned length);
+	virtual void on_client_writable(int socket_handle) { (void) socket_handle; } //!< Called when a client socket can take more data. Nothing to do for telnet.
+	virtual void on_client_closed(int socket_handle) { (void) socket_handle; } //!< Called just before a client socket is closed. Nothing to do for telnet.
 private:
 	void thread_entry();
 	telnetserver_callback telnet_callback; //!< Pointer to the TCP-server callback function
@@ -170,6 +242,84 @@ private:
 	std::string telnet_server_banner; //!< Welcome banner for new clients
 };
 
+/*! \brief Websocket server fanning out updates to any number of subscribers.
+ *
+ * Uses the accept loop of #telnetserver. Each connection is upgraded to a
+ * websocket, and then gets every message given to #publish(). A message is
+ * framed once, and the frame is shared by all the subscribers' queues, so
+ * the cost of a message does not grow with the number of subscribers.
+ *
+ * Whatever a subscriber's socket cannot take right away stays in its queue
+ * until the socket is writable again. A queue may not grow beyond
+ * #set_queue_limit(). A subscriber that falls that far behind has its
+ * queue collapsed: everything not yet begun on is dropped, and it is sent
+ * nothing until the next snapshot, which brings it up to date again. A
+ * subscriber that has just connected waits for a snapshot the same way.
+ * Whenever a snapshot is wanted, the callback given to
+ * #start_websocket_server() is called, so the publisher can send one
+ * soon instead of everyone having to wait for the next regular one.
+ *
+ * Messages from subscribers are not used; pings are answered.
+ */
+class websocketserver : public telnetserver
+{
+public:
+	websocketserver();
+	~websocketserver();
+	//! Signature of callback function that is called when a subscriber needs a snapshot.
+	typedef void (*websocketserver_callback)(websocketserver *);
+	RH start_websocket_server(websocketserver_callback);
+	RH stop_websocket_server();
+	void publish(const std::string &message, bool snapshot, bool only_if_waiting = false);
+	void set_queue_limit(unsigned bytes);
+	unsigned subscriber_count();
+	std::vector<std::string> status();
+protected:
+	virtual std::string whoami() { return "websocketserver"; }
+	uint32_t client_events();
+	void on_client_accepted(int socket_handle, const std::string &host);
+	void on_client_data(int socket_handle, const std::string &host, const char *data, unsigned length);
+	void on_client_writable(int socket_handle);
+	void on_client_closed(int socket_handle);
+private:
+	//! \brief A frame ready to be sent, shared by the queues of every subscriber it is for.
+	struct shared_frame
+	{
+		std::string data; //!< Header and payload
+		unsigned users; //!< Number of queues holding the frame; it is deleted when the last one lets go
+	};
+	//! \brief One connection, and what is waiting to be sent to it.
+	struct subscriber
+	{
+		subscriber() : upgraded(false), closing(false), waiting_for_snapshot(true), queued_bytes(0), offset(0), sent_messages(0), collapses(0) {}
+		std::string host; //!< Address of the subscriber
+		bool upgraded; //!< TRUE when the opening handshake is done
+		bool closing; //!< TRUE when the connection is to be closed once the queue is empty
+		bool waiting_for_snapshot; //!< TRUE if only a snapshot can be sent next
+		std::string request; //!< Opening handshake received so far
+		wsframe_decoder frames; //!< Incoming data not yet decoded
+		std::deque<shared_frame*> queue; //!< Frames waiting to be sent
+		unsigned queued_bytes; //!< Unsent bytes in #queue
+		unsigned offset; //!< Number of bytes of the first frame in #queue already sent
+		unsigned long long sent_messages; //!< Number of published messages queued for the subscriber
+		unsigned collapses; //!< Number of times the queue has been collapsed
+	};
+	void handshake(int socket_handle, subscriber *s);
+	void send_private(int socket_handle, subscriber *s, const std::string &data);
+	void enqueue(subscriber *s, shared_frame *frame);
+	bool over_limit(subscriber *s, shared_frame *frame);
+	void collapse(subscriber *s);
+	void flush(int socket_handle, subscriber *s);
+	static void release(shared_frame *frame);
+	std::map<int, subscriber*> subscribers; //!< Every connection, by socket handle
+	unsigned queue_limit; //!< A subscriber's queue may not grow beyond this many bytes
+	websocketserver_callback snapshot_callback; //!< Called when a snapshot is wanted, or NULL
+	unsigned long long published; //!< Number of messages published
+#	ifdef PLATFORM_LINUX
+		pthread_mutex_t subscribers_mutex; //!< Protects #subscribers; the publisher and the server thread both send
+#	endif
+};
+
 /*! \brief Websocket communications (specialized TCP-socket).
  *
  * Uses threads for receiving messages from a websocket server.
@@ -196,21 +346,52 @@ public:
 	typedef void (*websocket_callback)(websocket *, std::string);
 	RH start_websocket_client_listener(websocket_callback);
 	RH stop_websocket_client_listener();
-	RH send(std::string);
+	RH send(const std::string &message);
+	RH send(const char *payload, unsigned length, wsframe_decoder::opcode_type opcode);
 	RH_STRING read_data(int timeout_ms = DEFAULT_RECEIVE_TIMEOUT_MS);
 	std::string url();
+	void set_compression(int level, unsigned min_size = WSDEFLATE_DEFAULT_MIN_SIZE);
+	bool compressed();
+	void set_keepalive(unsigned interval_ms, unsigned max_missed_pongs);
+	rtt_histogram round_trip_times();
+	unsigned missed_pongs();
 protected:
 	virtual std::string whoami() { return "websocket"; }
 private:
 	websocket_callback websocketclient_callback; //!< Pointer to the websocket callback function
 	void thread_entry();
 	volatile bool websocket_client_listener_running; //!< TRUE when we're able to receive messages
+	bool websocket_listener_thread_started; //!< TRUE from #start_websocket_client_listener() until the thread has been joined
 	std::string remote_path_; //!< Remote path of websocket (with leading / if not empty)
 	bool use_mask; //!< TRUE if we should mask the data we're sending (http://tools.ietf.org/html/rfc6455#section-5.3)
 	/*! \brief TRUE if websocket is connected to the other end.
 	 * \note NOT the same as \ref is_connected in #tcpsocket which works at a lower level in the stack.
 	 */
 	volatile bool websocket_is_connected_;
+	wsframe_decoder frames; //!< Incoming data not yet decoded into messages
+	void new_masking_key(uint8_t key[4]);
+	uint8_t masking_key_pool[WEBSOCKET_MASKING_KEY_POOL_SIZE]; //!< Random bytes for masking keys
+	unsigned masking_key_pool_used; //!< Number of bytes of #masking_key_pool already used
+	void keepalive();
+	void handle_pong(const std::string &payload);
+	unsigned keepalive_interval_ms; //!< Time between pings; 0 if no pings are sent
+	unsigned keepalive_max_missed; //!< The connection is given up when this many pings in a row go unanswered
+	unsigned long long last_ping_us; //!< When the last ping was sent
+	bool ping_outstanding; //!< TRUE if the last ping has not been answered
+	unsigned long long ping_sequence; //!< Number of the last ping, sent as its payload
+	unsigned missed_pongs_; //!< Number of pings in a row that were not answered in time
+	rtt_histogram round_trip_times_; //!< Round trip times of the last answered pings
+#	ifdef PLATFORM_LINUX
+		pthread_mutex_t keepalive_mutex; //!< Protects #round_trip_times_ and #missed_pongs_, which are read by other threads
+#	endif
+	bool deflate_enabled; //!< TRUE if permessage-deflate is offered in the handshake
+	wsdeflate deflate; //!< Compression state; the compressor is protected by #send_mutex, the decompressor used by the listener only
+	std::string deflate_buffer; //!< Compressed payload of the frame being sent
+	std::string inflate_buffer; //!< Last decompressed incoming message
+	std::vector<char> mask_buffer; //!< Masked payload of the frame being sent; kept to avoid allocating for every frame
+#	ifdef PLATFORM_LINUX
+		pthread_mutex_t send_mutex; //!< Keeps frames sent from different threads apart, and protects #mask_buffer and #masking_key_pool
+#	endif
 
 	//! \brief Websocket header definition
 	//!
@@ -0,0 +1,258 @@
+/*! \file jsonwriter.cpp
+ *  \copydoc jsonwriter.hpp
+ */
+
+#include "jsonwriter.hpp"
+
+#include <cstring>
+#include <cstdio>
+#include <cmath>
+
+/*! \brief Constructor.
+ */
+json_writer::json_writer()
+{
+	clear();
+}
+
+/*! \brief Starts on a new message. The buffer keeps its allocated memory.
+ */
+void json_writer::clear()
+{
+	buffer.clear();
+	depth = 0;
+	first[0] = true;
+	after_key = false;
+}
+
+void json_writer::begin_object()
+{
+	separate();
+	buffer += '{';
+	if (depth < JSON_WRITER_MAX_DEPTH) depth += 1;
+	first[depth] = true;
+}
+
+void json_writer::end_object()
+{
+	buffer += '}';
+	if (depth > 0) depth -= 1;
+}
+
+void json_writer::begin_array()
+{
+	separate();
+	buffer += '[';
+	if (depth < JSON_WRITER_MAX_DEPTH) depth += 1;
+	first[depth] = true;
+}
+
+void json_writer::end_array()
+{
+	buffer += ']';
+	if (depth > 0) depth -= 1;
+}
+
+/*! \brief Writes the name of the next member of an object.
+ * \param name Member name. Must not need escaping.
+ */
+void json_writer::key(const char *name)
+{
+	separate();
+	buffer += '"';
+	buffer += name;
+	buffer += "\":";
+	after_key = true;
+}
+
+/*! \brief Writes a string.
+ * \param text NUL-terminated string
+ */
+void json_writer::value(const char *text)
+{
+	value(text, strlen(text));
+}
+
+/*! \brief Writes a string.
+ * \param text String, escaped as needed
+ * \param length Length of \c text
+ */
+void json_writer::value(const char *text, unsigned length)
+{
+	separate();
+	buffer += '"';
+	append_escaped(text, length);
+	buffer += '"';
+}
+
+void json_writer::value(const std::string &text)
+{
+	value(text.data(), text.length());
+}
+
+void json_writer::value(unsigned number)
+{
+	value((unsigned long long) number);
+}
+
+void json_writer::value(unsigned long long number)
+{
+	char text[JSON_NUMBER_TEXT_LENGTH];
+	separate();
+	buffer.append(text, format_unsigned(text, number));
+}
+
+/*! \brief Writes a number with up to seven decimals.
+ *
+ * Whole numbers get one decimal, so they still read back as doubles.
+ * JSON has no infinity or NaN, so these are written as \c null.
+ */
+void json_writer::value(double number)
+{
+	char text[JSON_NUMBER_TEXT_LENGTH];
+	separate();
+	unsigned length = format_double(text, number);
+	if ((length == 0) || (strchr(text, 'n') != NULL))
+	{
+		buffer += "null";
+		return;
+	}
+	buffer.append(text, length);
+	if (strpbrk(text, ".e") == NULL)
+	{
+		buffer += ".0";
+	}
+}
+
+/*! \brief Writes JSON that has already been written elsewhere, as the next value.
+ * \param json A complete JSON value
+ * \param length Length of \c json
+ */
+void json_writer::raw(const char *json, unsigned length)
+{
+	separate();
+	buffer.append(json, length);
+}
+
+/*! \brief Formats a number in decimal without going through a stream.
+ * \param buffer Room for at least #JSON_NUMBER_TEXT_LENGTH characters
+ * \param number Number to format
+ * \return Length of the text, not counting the terminating NUL
+ */
+unsigned json_writer::format_unsigned(char *buffer, unsigned long long number)
+{
+	char digits[JSON_NUMBER_TEXT_LENGTH];
+	unsigned count = 0;
+	do
+	{
+		digits[count++] = '0' + (number % 10);
+		number /= 10;
+	} while (number > 0);
+	for (unsigned i = 0; i < count; i++)
+	{
+		buffer[i] = digits[count - 1 - i];
+	}
+	buffer[count] = '\0';
+	return(count);
+}
+
+/*! \brief Formats a number with a fixed number of decimals, leaving out trailing zeros.
+ *
+ * Numbers that are too large to be handled as fixed point fall back on
+ * \c snprintf(). Seven decimals of a degree are about a centimetre.
+ *
+ * \param buffer Room for at least #JSON_NUMBER_TEXT_LENGTH characters
+ * \param number Number to format
+ * \param decimals Number of decimals, at most 9
+ * \return Length of the text, not counting the terminating NUL
+ */
+unsigned json_writer::format_double(char *buffer, double number, unsigned decimals)
+{
+	static const unsigned long long scales[] = { 1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL,
+	                                             1000000ULL, 10000000ULL, 100000000ULL, 1000000000ULL };
+	if (decimals > 9) decimals = 9;
+	if (!(fabs(number) < 1e9))
+	{
+		// Also NaN and infinity
+		int length = snprintf(buffer, JSON_NUMBER_TEXT_LENGTH, "%.17g", number);
+		return((length > 0) ? length : 0);
+	}
+	unsigned length = 0;
+	unsigned long long scale = scales[decimals];
+	unsigned long long scaled = (unsigned long long) (fabs(number) * scale + 0.5);
+	if ((number < 0) && (scaled > 0))
+	{
+		buffer[length++] = '-';
+	}
+	length += format_unsigned(buffer + length, scaled / scale);
+	unsigned long long fraction = scaled % scale;
+	if (fraction > 0)
+	{
+		buffer[length++] = '.';
+		while ((fraction % 10) == 0)
+		{
+			fraction /= 10;
+			decimals -= 1;
+		}
+		for (unsigned i = decimals; i > 0; i--)
+		{
+			buffer[length + i - 1] = '0' + (fraction % 10);
+			fraction /= 10;
+		}
+		length += decimals;
+	}
+	buffer[length] = '\0';
+	return(length);
+}
+
+/*! \brief Puts a comma before the next member, unless it is the first or follows its key.
+ */
+void json_writer::separate()
+{
+	if (after_key)
+	{
+		after_key = false;
+		return;
+	}
+	if (!first[depth])
+	{
+		buffer += ',';
+	}
+	first[depth] = false;
+}
+
+/*! \brief Appends a string with the characters JSON does not allow escaped.
+ */
+void json_writer::append_escaped(const char *text, unsigned length)
+{
+	static const char hex[] = "0123456789abcdef";
+	const char *end = text + length;
+	while (text < end)
+	{
+		// Copy the run of characters that need no escaping in one go
+		const char *start = text;
+		while ((text < end) && ((unsigned char) *text >= 0x20) && (*text != '"') && (*text != '\\'))
+		{
+			text += 1;
+		}
+		buffer.append(start, text - start);
+		if (text == end)
+		{
+			break;
+		}
+		unsigned char c = *text++;
+		switch (c)
+		{
+		case '"':  buffer += "\\\""; break;
+		case '\\': buffer += "\\\\"; break;
+		case '\n': buffer += "\\n"; break;
+		case '\r': buffer += "\\r"; break;
+		case '\t': buffer += "\\t"; break;
+		default:
+			buffer += "\\u00";
+			buffer += hex[c >> 4];
+			buffer += hex[c & 0xf];
+			break;
+		}
+	}
+}
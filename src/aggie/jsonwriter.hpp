@@ -0,0 +1,69 @@
+/*! \file jsonwriter.hpp
+ * \brief Streaming writer for compact JSON.
+ *
+ * Writes JSON text straight into a buffer as the values are given, without
+ * building a document tree first. The buffer is kept between messages, so
+ * once it has grown to the size of a typical message, writing does not
+ * allocate at all.
+ */
+
+#ifndef __JSONWRITER_HPP
+#define __JSONWRITER_HPP
+
+#include "platform.h"
+
+#include <string>
+
+//! \brief Deepest nesting of objects and arrays a #json_writer supports.
+#define JSON_WRITER_MAX_DEPTH 32
+//! \brief Room needed by json_writer::format_double(), including the terminating NUL.
+#define JSON_NUMBER_TEXT_LENGTH 32
+
+/*! \brief Writes compact JSON into a reusable buffer.
+ *
+ * Commas and colons are put in automatically. Typical use:
+ *
+ * \code
+ * writer.clear();
+ * writer.begin_object();
+ * writer.key("data");
+ * writer.begin_array();
+ * writer.value(42u);
+ * writer.end_array();
+ * writer.end_object();
+ * send(writer.str());  // {"data":[42]}
+ * \endcode
+ *
+ * \note Not thread safe.
+ */
+class json_writer
+{
+public:
+	json_writer();
+	void clear();
+	const std::string &str() const { return(buffer); } //!< The JSON written since #clear()
+	unsigned length() const { return(buffer.length()); } //!< Number of characters written since #clear()
+	void begin_object();
+	void end_object();
+	void begin_array();
+	void end_array();
+	void key(const char *name);
+	void value(const char *text);
+	void value(const char *text, unsigned length);
+	void value(const std::string &text);
+	void value(unsigned number);
+	void value(unsigned long long number);
+	void value(double number);
+	void raw(const char *json, unsigned length);
+	static unsigned format_unsigned(char *buffer, unsigned long long number);
+	static unsigned format_double(char *buffer, double number, unsigned decimals = 7);
+private:
+	void separate();
+	void append_escaped(const char *text, unsigned length);
+	std::string buffer; //!< The JSON text
+	unsigned depth; //!< Number of objects and arrays not yet ended
+	bool first[JSON_WRITER_MAX_DEPTH + 1]; //!< TRUE until the object or array at each depth has a member
+	bool after_key; //!< TRUE when a key has been written and its value has not
+};
+
+#endif // __JSONWRITER_HPP
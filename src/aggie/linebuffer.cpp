@@ -0,0 +1,265 @@
+/*! \file linebuffer.cpp
+ *  \copydoc linebuffer.hpp
+ */
+
+#include "linebuffer.hpp"
+
+#include <cstring>
+
+/*! \brief Constructor.
+ *
+ * Sizes are rounded up to the nearest power of two.
+ *
+ * \param initial_size Size of the buffer to begin with
+ * \param max_size Maximum size of the buffer
+ */
+linebuffer::linebuffer(unsigned initial_size, unsigned max_size)
+	: buffer(NULL),
+	  capacity(1),
+	  max_capacity(1),
+	  read_index(0),
+	  write_index(0),
+	  scanned(0),
+	  scratch(NULL),
+	  scratch_size(0)
+{
+	while (capacity < initial_size) capacity *= 2;
+	while (max_capacity < max_size) max_capacity *= 2;
+	if (max_capacity < capacity) max_capacity = capacity;
+	buffer = new char[capacity];
+}
+
+/*! \brief Destructor.
+ */
+linebuffer::~linebuffer()
+{
+	delete[] buffer;
+	delete[] scratch;
+}
+
+/*! \brief Gives the place where the next incoming data should be stored.
+ *
+ * If the buffer is full it is enlarged, unless it already has its maximum size.
+ *
+ * \param[out] space Number of bytes that may be written at the returned position.
+ *                   Zero if the buffer is full and cannot grow.
+ * \return Pointer into the buffer
+ */
+char *linebuffer::write_position(unsigned &space)
+{
+	if ((used() == capacity) && (capacity < max_capacity))
+	{
+		grow();
+	}
+	unsigned position = write_index & (capacity - 1);
+	space = capacity - used();
+	if (space > capacity - position)
+	{
+		space = capacity - position; // Only up to the end of the buffer
+	}
+	return(buffer + position);
+}
+
+/*! \brief Tells the buffer how many bytes were written at #write_position().
+ * \param count Number of bytes
+ */
+void linebuffer::commit(unsigned count)
+{
+	write_index += count;
+}
+
+/*! \brief Finds the next complete line in the buffer.
+ *
+ * The line is removed from the buffer. The returned pointer is only valid
+ * until the buffer is used again, and the line is not NUL-terminated.
+ *
+ * \param[out] line Pointer to the first character of the line
+ * \param[out] length Number of characters in the line, without the line ending
+ * \return TRUE if a line was found
+ */
+bool linebuffer::next_line(const char *&line, unsigned &length)
+{
+	unsigned mask = capacity - 1;
+	unsigned start = read_index & mask;
+	unsigned available = used();
+	unsigned line_length = available; // Unless a LF is found
+
+	// Search for LF in at most two contiguous pieces, skipping what has been searched before
+	while (scanned < available)
+	{
+		unsigned from = (read_index + scanned) & mask;
+		unsigned count = available - scanned;
+		if (count > capacity - from)
+		{
+			count = capacity - from;
+		}
+		const char *lf = (const char *) memchr(buffer + from, '\n', count);
+		if (lf != NULL)
+		{
+			line_length = scanned + (lf - (buffer + from));
+			break;
+		}
+		scanned += count;
+	}
+
+	bool found = (scanned < available);
+	if (!found && ((available < capacity) || (capacity < max_capacity)))
+	{
+		return(false); // Incomplete line; wait for more data
+	}
+
+	// Line is either terminated by LF, or fills the entire buffer
+	if (start + line_length <= capacity)
+	{
+		line = buffer + start;
+	}
+	else
+	{
+		if (scratch_size < line_length)
+		{
+			delete[] scratch;
+			scratch_size = line_length;
+			scratch = new char[scratch_size];
+		}
+		unsigned first_part = capacity - start;
+		memcpy(scratch, buffer + start, first_part);
+		memcpy(scratch + first_part, buffer, line_length - first_part);
+		line = scratch;
+	}
+	length = line_length;
+	line = sanitize(line, length);
+
+	read_index += line_length + (found ? 1 : 0);
+	scanned = 0;
+	if (read_index == write_index)
+	{
+		// Empty; start from the beginning to get the most contiguous space
+		read_index = 0;
+		write_index = 0;
+	}
+
+	return(true);
+}
+
+/*! \brief Takes unread data out of the buffer as it is, without looking for lines.
+ *
+ * Used when a connection switches from a line based protocol to something else.
+ *
+ * \param destination Where to copy the data
+ * \param max_length Maximum number of bytes to copy
+ * \return Number of bytes copied
+ */
+unsigned linebuffer::read(char *destination, unsigned max_length)
+{
+	unsigned count = used();
+	if (count > max_length)
+	{
+		count = max_length;
+	}
+	unsigned start = read_index & (capacity - 1);
+	unsigned first_part = count;
+	if (first_part > capacity - start)
+	{
+		first_part = capacity - start;
+	}
+	memcpy(destination, buffer + start, first_part);
+	memcpy(destination + first_part, buffer, count - first_part);
+	read_index += count;
+	scanned = 0;
+	if (read_index == write_index)
+	{
+		read_index = 0;
+		write_index = 0;
+	}
+	return(count);
+}
+
+/*! \brief Removes CR and NUL from a line.
+ *
+ * The usual CRLF line ending only costs a length adjustment. Lines with
+ * CR or NUL anywhere else are copied to #scratch without them.
+ *
+ * \param line Line to clean
+ * \param[in,out] length Length of the line
+ * \return Pointer to the cleaned line
+ */
+const char *linebuffer::sanitize(const char *line, unsigned &length)
+{
+	if ((length > 0) && (line[length - 1] == '\r'))
+	{
+		length -= 1;
+	}
+	if ((memchr(line, '\r', length) == NULL) && (memchr(line, '\0', length) == NULL))
+	{
+		return(line);
+	}
+
+	if (line != scratch)
+	{
+		if (scratch_size < length)
+		{
+			delete[] scratch;
+			scratch_size = length;
+			scratch = new char[scratch_size];
+		}
+		memcpy(scratch, line, length);
+	}
+	unsigned kept = 0;
+	for (unsigned i = 0; i < length; i++)
+	{
+		if ((scratch[i] != '\r') && (scratch[i] != '\0'))
+		{
+			scratch[kept++] = scratch[i];
+		}
+	}
+	length = kept;
+	return(scratch);
+}
+
+/*! \brief Doubles the size of the buffer.
+ *
+ * Unread data is moved to the beginning of the new buffer.
+ */
+void linebuffer::grow()
+{
+	unsigned new_capacity = capacity * 2;
+	char *new_buffer = new char[new_capacity];
+	unsigned count = used();
+	unsigned start = read_index & (capacity - 1);
+	unsigned first_part = count;
+	if (first_part > capacity - start)
+	{
+		first_part = capacity - start;
+	}
+	memcpy(new_buffer, buffer + start, first_part);
+	memcpy(new_buffer + first_part, buffer, count - first_part);
+
+	delete[] buffer;
+	buffer = new_buffer;
+	capacity = new_capacity;
+	read_index = 0;
+	write_index = count;
+}
+
+/*! \brief Number of unread bytes in the buffer.
+ */
+unsigned linebuffer::used() const
+{
+	return(write_index - read_index);
+}
+
+/*! \brief Current size of the buffer.
+ */
+unsigned linebuffer::size() const
+{
+	return(capacity);
+}
+
+/*! \brief Discards all unread data.
+ */
+void linebuffer::clear()
+{
+	read_index = 0;
+	write_index = 0;
+	scanned = 0;
+}
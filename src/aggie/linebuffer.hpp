@@ -0,0 +1,56 @@
+/*! \file linebuffer.hpp
+ * \brief Ring buffer that splits incoming socket data into text lines.
+ *
+ * Data is received directly into the buffer, and complete lines are handed
+ * out as pointers into the buffer, so no memory is allocated per line.
+ */
+
+#ifndef __LINEBUFFER_HPP
+#define __LINEBUFFER_HPP
+
+#include "platform.h"
+
+//! \brief Initial size of a #linebuffer. Must be a power of two.
+#define LINEBUFFER_INITIAL_SIZE 4096
+//! \brief A #linebuffer never grows beyond this size. Longer lines are split.
+#define LINEBUFFER_MAX_SIZE (1024 * 1024)
+
+/*! \brief Ring buffer for line based protocols.
+ *
+ * Typical use is to receive into the space given by #write_position(),
+ * report the number of bytes received with #commit(), and then call
+ * #next_line() until it returns FALSE.
+ *
+ * Lines are terminated by LF. CR and NUL are never part of the returned lines.
+ *
+ * The buffer doubles its size when it is full, up to the maximum size given
+ * to the constructor. A line that does not fit even then is returned in pieces.
+ */
+class linebuffer
+{
+public:
+	linebuffer(unsigned initial_size = LINEBUFFER_INITIAL_SIZE, unsigned max_size = LINEBUFFER_MAX_SIZE);
+	~linebuffer();
+	char *write_position(unsigned &space);
+	void commit(unsigned count);
+	bool next_line(const char *&line, unsigned &length);
+	unsigned read(char *destination, unsigned max_length);
+	unsigned used() const;
+	unsigned size() const;
+	void clear();
+private:
+	linebuffer(const linebuffer &); // Not copyable
+	linebuffer &operator=(const linebuffer &);
+	void grow();
+	const char *sanitize(const char *line, unsigned &length);
+	char *buffer; //!< Storage, #capacity bytes
+	unsigned capacity; //!< Size of #buffer; always a power of two
+	unsigned max_capacity; //!< #capacity is never increased beyond this
+	unsigned read_index; //!< Position of first unread byte (not wrapped; mask with #capacity - 1)
+	unsigned write_index; //!< Position of next byte to be written (not wrapped)
+	unsigned scanned; //!< Bytes after #read_index already known not to contain LF
+	char *scratch; //!< Used for lines that wrap around the end of #buffer, or need cleaning
+	unsigned scratch_size; //!< Size of #scratch
+};
+
+#endif // __LINEBUFFER_HPP
@@ -157,15 +157,26 @@ void pm_listener(websocket *listener, std::string data)
 	agg->pm_listener(listener, data);
 }
 
+/*! \brief Callback for the subscriber server.
+ *
+ * Called whenever a subscriber needs a snapshot.
+ * \param server Pointer to the subscriber server
+ */
+void subscriber_listener(websocketserver *server)
+{
+	agg->subscriber_listener(server);
+}
+
 /*! \brief Callback for Client messages.
  *
  * Called whenever we receive a message from one of the clients.
  * \param listener Pointer to socket instance message is received on
- * \param data Received message
+ * \param line Received message (not NUL-terminated)
+ * \param length Length of message
  */
-void client_listener(tcpsocket *listener, std::string data)
+void client_listener(tcpsocket *listener, const char *line, unsigned length)
 {
-	agg->client_listener(listener, data);
+	agg->client_listener(listener, line, length);
 }
 
 
@@ -229,10 +240,7 @@ void supervisor_msghandler(telnetserver *server, int socket_handle, std::string
 	{
 		if (parameter1 == "clients")
 		{
-			agg->disconnect_clients();
-			agg->delete_clients();
-			agg->add_clients();
-			agg->connect_clients();
+			agg->request_client_reload(); // Done by the main thread, which owns the poll schedule
 			valid_command = true;
 		}
 	}
@@ -250,7 +258,10 @@ void supervisor_msghandler(telnetserver *server, int socket_handle, std::string
 		}
 		if (parameter1 == "connect")
 		{
-			agg->connect_pm(parameter2);
+			if (agg->connect_pm(parameter2).is_ok())
+			{
+				agg->start_pm_listener(pm_listener);
+			}
 			valid_command = true;
 		}
 	}
@@ -397,7 +408,16 @@ int main(int argc, char **argv)
 	}
 
 
-	agg->start_message_listener();
+	agg->start_message_listener(config::dispatcher_threads);
+
+	if (config::subscriber_listening_port != 0)
+	{
+		result = agg->start_subscriber_server(config::subscriber_listening_port, subscriber_listener);
+		if (result.is_not_ok())
+		{
+			vout(VOUT_ERROR) << "Unable to accept subscribers: " << result.text() << std::endlc;
+		}
+	}
 
 	agg->add_clients(config::clientlist_filename);
 	if (agg->connect_clients().is_ok())
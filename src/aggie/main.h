@@ -29,6 +29,22 @@
 #define DEFAULT_CLIENTLIST_FILENAME "clients.txt"
 #define DEFAULT_SUPERVISOR_LISTENING_PORT 17408
 #define DEFAULT_CLIENT_REPOLL_INTERVALL_SEC 15
+#define DEFAULT_REACTOR_THREADS 1
+#define DEFAULT_DISPATCHER_THREADS 1
+#define DEFAULT_CLIENT_CONNECT_TIMEOUT_MS DEFAULT_CONNECT_TIMEOUT_MS
+#define DEFAULT_RECONNECT_MIN_DELAY_MS 500
+#define DEFAULT_RECONNECT_MAX_DELAY_MS 30000
+#define DEFAULT_PM_SNAPSHOT_INTERVAL_SEC 60
+#define DEFAULT_PM_DELTA_DISTANCE_M 1.0
+#define DEFAULT_PM_DELTA_CR 1
+#define DEFAULT_PM_DELTA_AGE 0
+#define DEFAULT_PM_KEEPALIVE_SEC 2
+#define DEFAULT_PM_KEEPALIVE_MISSES 3
+#define DEFAULT_PM_DEFLATE_LEVEL 6
+#define DEFAULT_PM_DEFLATE_MIN_SIZE 64
+#define DEFAULT_SUBSCRIBER_LISTENING_PORT 0
+#define DEFAULT_SUBSCRIBER_QUEUE_KB 1024
+#define DEFAULT_PM_COMMAND_TIMEOUT_SEC 10
 
 void displayversion(cmdline *cmdl);
 void printhelp(cmdline *cmdl);
@@ -36,7 +52,7 @@ void printhelp(cmdline *cmdl);
 extern void sleep_ms(unsigned long ms);
 extern timetools timers;
 extern timetools::handle uptime;
-extern void client_listener(tcpsocket *listener, std::string data);
+extern void client_listener(tcpsocket *listener, const char *line, unsigned length);
 
 
 #endif // __MAIN_H
@@ -74,6 +90,9 @@ extern void client_listener(tcpsocket *listener, std::string data);
    10.10.100.110 4500
    \endcode
  *
+ * A third, optional number gives the poll interval in seconds for that client, overriding
+ * \c "-p seconds" on the command line (e.g. \c "192.168.1.11 4002 5").
+ *
  * \subsection Controlling Aggie
  *
  * Aggie also has a supervisor interface, which is basically a telnet-server listening on port
@@ -85,7 +104,7 @@ extern void client_listener(tcpsocket *listener, std::string data);
  * Certain aspects of Aggie can be set on the command line. Aggie recognizes the following options:
  *
  * \code
-   $ ./aggie ws://url-of-pm [-h] [-v] [-q] [-c filename] [-l port]
+   $ ./aggie ws://url-of-pm [-h] [-v] [-q] [-c filename] [-l port] [-r count] [-d count] [-t ms] [-p seconds]
    \endcode
  *
  * Only the \c url-of-pm part is mandatory. This is the websocket-URL of the presentation manager
@@ -101,6 +120,25 @@ extern void client_listener(tcpsocket *listener, std::string data);
  *
  * The \c "-l port" tells Aggie which port the supervisor should be listening on (default 17408).
  *
+ * The \c "-r count" tells Aggie how many threads should serve the client connections (default 1).
+ * All client sockets are multiplexed through epoll on these threads, so the number of threads
+ * stays the same regardless of how many clients there are. \c "-r 0" gives every client its
+ * own listener thread instead.
+ *
+ * The \c "-d count" tells Aggie how many threads should process the messages from the clients
+ * (default 1). Each client is handled by one of these threads, so its messages are always
+ * processed in the order they arrived.
+ *
+ * The \c "-t ms" tells Aggie how long to wait for the clients to accept a connection (default 3000).
+ * All clients are connected at the same time, so clients that are down never hold up the others.
+ *
+ * The \c "-p seconds" tells Aggie how often to poll the clients (default 15, 0 means no repolling).
+ * The polls are spread evenly over the interval, so the clients are not all polled at the same time.
+ *
+ * A client whose connection is lost is redialled on its own, without disturbing the other clients.
+ * The first attempt is made after \c "--reconnect-delay ms" (default 500), and the delay is doubled
+ * for every failed attempt, up to \c "--reconnect-max-delay ms" (default 30000).
+ *
  * \c -h gives a list of all options.
  *
  *
@@ -28,6 +28,12 @@ resulthandler_messages_t resulthandler_messages[] =
 	  "Socket receive timeout" },
 	{ SOCKET_ERROR_INVALID_MESSAGE,
 	  "Received an unknown or invalid message" },
+	{ SOCKET_CONNECT_IN_PROGRESS,
+	  "Connection in progress" },
+	{ SOCKET_ERROR_CONNECT_TIMEOUT,
+	  "Timed out while connecting" },
+	{ SOCKET_ERROR_SEND_QUEUE_FULL,
+	  "Send queue is full" },
 
 	{ AGGIE_ERROR_INVALID_PM_URL,
 	  "Invalid websocket-URL for presentation manager" },
@@ -35,6 +35,9 @@ enum {
 	SOCKET_ERROR_NOT_CONNECTED,
 	SOCKET_RECEIVE_TIMEOUT,
 	SOCKET_ERROR_INVALID_MESSAGE,
+	SOCKET_CONNECT_IN_PROGRESS,
+	SOCKET_ERROR_CONNECT_TIMEOUT,
+	SOCKET_ERROR_SEND_QUEUE_FULL,
 };
 //!@}
 
@@ -0,0 +1,217 @@
+/*! \file mpscqueue.hpp
+ * \brief Lock-free queue with many producers and a single consumer.
+ *
+ * Based on the intrusive MPSC node queue by Dmitry Vyukov
+ * (http://www.1024cores.net/home/lock-free-algorithms/queues/non-intrusive-mpsc-node-based-queue).
+ */
+
+#ifndef __MPSCQUEUE_HPP
+#define __MPSCQUEUE_HPP
+
+#include "platform.h"
+
+#include <cstddef>
+#include <vector>
+
+#ifdef PLATFORM_LINUX
+#	include <sys/eventfd.h>
+#	include <unistd.h>
+#	include <stdint.h>
+#endif
+
+/*! \brief Unbounded lock-free multi-producer/single-consumer queue.
+ *
+ * Any number of threads may #push() at the same time without ever waiting
+ * for each other or for the consumer. Only one thread may #pop().
+ *
+ * A producer that has been interrupted half-way through #push() hides the
+ * entries pushed after it until it continues, so #pop() may return FALSE
+ * while #empty() does not. The consumer should simply try again.
+ */
+template <class T>
+class mpscqueue
+{
+public:
+	mpscqueue() : head(&stub), tail(&stub)
+	{
+		stub.next = NULL;
+	}
+	~mpscqueue()
+	{
+		T discarded;
+		while (pop(discarded));
+	}
+
+	/*! \brief Adds an entry to the queue. May be called from any thread.
+	 * \param value Entry to add
+	 */
+	void push(const T &value)
+	{
+		node *n = new node(value);
+		push(n);
+	}
+
+	/*! \brief Takes out the oldest entry. Must only be called from the consumer thread.
+	 * \param[out] value The entry, if any
+	 * \return TRUE if an entry was taken out
+	 */
+	bool pop(T &value)
+	{
+		node *first = tail;
+		node *next = __atomic_load_n(&first->next, __ATOMIC_ACQUIRE);
+		if (first == &stub)
+		{
+			if (next == NULL)
+			{
+				return(false); // Empty
+			}
+			tail = next;
+			first = next;
+			next = __atomic_load_n(&first->next, __ATOMIC_ACQUIRE);
+		}
+		if (next == NULL)
+		{
+			if (first != __atomic_load_n(&head, __ATOMIC_ACQUIRE))
+			{
+				return(false); // A producer has not finished linking in its entry
+			}
+			// Last entry; put the stub behind it so it can be taken out
+			push(&stub);
+			next = __atomic_load_n(&first->next, __ATOMIC_ACQUIRE);
+			if (next == NULL)
+			{
+				return(false);
+			}
+		}
+		tail = next;
+		value = first->value;
+		delete first;
+		return(true);
+	}
+
+	/*! \brief Takes out several entries at once. Must only be called from the consumer thread.
+	 * \param[out] values Entries are appended to this list, oldest first
+	 * \param max_count Maximum number of entries to take out
+	 * \return Number of entries taken out
+	 */
+	unsigned pop_batch(std::vector<T> &values, unsigned max_count)
+	{
+		unsigned count = 0;
+		T value;
+		while ((count < max_count) && pop(value))
+		{
+			values.push_back(value);
+			count += 1;
+		}
+		return(count);
+	}
+
+	/*! \brief Checks whether anything has been pushed that is not yet taken out.
+	 *
+	 * Must only be called from the consumer thread. Ordered with #push(), so a
+	 * consumer that announces it is going to sleep and then finds the queue
+	 * empty can rely on every later producer seeing the announcement.
+	 */
+	bool empty()
+	{
+		return((tail == &stub) && (__atomic_load_n(&head, __ATOMIC_SEQ_CST) == &stub));
+	}
+
+private:
+	mpscqueue(const mpscqueue &); // Not copyable
+	mpscqueue &operator=(const mpscqueue &);
+
+	struct node
+	{
+		node() : next(NULL) {}
+		node(const T &v) : next(NULL), value(v) {}
+		node *next;
+		T value;
+	};
+
+	void push(node *n)
+	{
+		__atomic_store_n(&n->next, (node *) NULL, __ATOMIC_RELAXED);
+		node *previous = __atomic_exchange_n(&head, n, __ATOMIC_SEQ_CST);
+		__atomic_store_n(&previous->next, n, __ATOMIC_RELEASE);
+	}
+
+	node *head; //!< Most recently pushed node. Shared by all producers.
+	node *tail; //!< Next node to take out. Only used by the consumer.
+	node stub; //!< Placeholder that keeps the list from ever being empty
+};
+
+/*! \brief #mpscqueue that the consumer can sleep on until something is pushed.
+ *
+ * The consumer announces that it is going to sleep before it checks the
+ * queue a final time. A producer that finds the announcement writes to an
+ * eventfd, so no wake-up is lost, and as long as the consumer is busy the
+ * producers pay nothing but an atomic exchange.
+ */
+template <class T>
+class waitable_mpscqueue : public mpscqueue<T>
+{
+public:
+	waitable_mpscqueue() : sleeping(0)
+	{
+		wakeup_handle = ::eventfd(0, EFD_CLOEXEC);
+	}
+	~waitable_mpscqueue()
+	{
+		if (wakeup_handle != -1)
+		{
+			::close(wakeup_handle);
+		}
+	}
+
+	/*! \brief Adds an entry to the queue, and wakes the consumer if it sleeps.
+	 * \param value Entry to add
+	 */
+	void push(const T &value)
+	{
+		mpscqueue<T>::push(value);
+		if (__atomic_exchange_n(&sleeping, 0, __ATOMIC_SEQ_CST) == 1)
+		{
+			signal();
+		}
+	}
+
+	/*! \brief Sleeps until something has been pushed, or #interrupt() is called.
+	 *
+	 * Must only be called from the consumer thread. Returns at once if the
+	 * queue is not empty.
+	 *
+	 * \param keep_waiting Does not sleep if this is FALSE
+	 */
+	void wait(volatile bool &keep_waiting)
+	{
+		__atomic_store_n(&sleeping, 1, __ATOMIC_SEQ_CST);
+		if (this->empty() && keep_waiting)
+		{
+			uint64_t count;
+			ssize_t received = ::read(wakeup_handle, &count, sizeof(count));
+			(void) received;
+		}
+		__atomic_store_n(&sleeping, 0, __ATOMIC_SEQ_CST);
+	}
+
+	/*! \brief Makes the consumer return from #wait(), whether it sleeps now or later.
+	 */
+	void interrupt()
+	{
+		signal();
+	}
+
+private:
+	void signal()
+	{
+		uint64_t one = 1;
+		ssize_t written = ::write(wakeup_handle, &one, sizeof(one));
+		(void) written;
+	}
+
+	int wakeup_handle; //!< eventfd the consumer sleeps on
+	volatile int sleeping; //!< 1 while the consumer is, or is about to be, sleeping
+};
+
+#endif // __MPSCQUEUE_HPP
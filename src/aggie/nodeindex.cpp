@@ -0,0 +1,334 @@
+/*! \file nodeindex.cpp
+ *  \copydoc nodeindex.hpp
+ */
+
+#include "nodeindex.hpp"
+
+//! \brief Number of buckets a #node_index starts with. Must be a power of two.
+#define NODEINDEX_INITIAL_BUCKETS 64
+
+/*! \brief Constructor.
+ */
+node_index::node_index()
+	: mask(0),
+	  update_count(0)
+{
+	rehash(NODEINDEX_INITIAL_BUCKETS);
+}
+
+/*! \brief Replaces everything a source reports with a new list.
+ *
+ * Nodes the source no longer reports lose its report, and are removed
+ * if no other source reports them.
+ *
+ * \param source Source of the list
+ * \param nodes Every node the source now reports
+ * \return Number of nodes that were added, removed, or changed
+ */
+unsigned node_index::update(const void *source, const std::vector<struct wclient::client_node> &nodes)
+{
+	unsigned changes = 0;
+	update_count += 1;
+
+	std::vector<unsigned> &ids = source_ids[source];
+	std::vector<unsigned> previous_ids;
+	previous_ids.swap(ids);
+	ids.reserve(nodes.size());
+
+	std::vector<struct wclient::client_node>::const_iterator nodes_itr = nodes.begin();
+	while (nodes_itr != nodes.end())
+	{
+		int index = find_index(nodes_itr->id);
+		bool added = (index < 0);
+		if (added)
+		{
+			index = insert(nodes_itr->id);
+			changes += 1;
+		}
+		struct entry &e = entries[index];
+		if (added)
+		{
+			mark_changed(e);
+		}
+		std::vector<struct report>::iterator reports_itr = e.reports.begin();
+		while ((reports_itr != e.reports.end()) && (reports_itr->source != source))
+		{
+			reports_itr += 1;
+		}
+		if (reports_itr == e.reports.end())
+		{
+			struct report r;
+			r.source = source;
+			e.reports.push_back(r);
+			reports_itr = e.reports.end() - 1;
+			ids.push_back(nodes_itr->id);
+		}
+		else if (reports_itr->update != update_count)
+		{
+			ids.push_back(nodes_itr->id);
+		}
+		reports_itr->update = update_count;
+		reports_itr->node = *nodes_itr;
+		if (resolve(e) && !added)
+		{
+			mark_changed(e);
+			changes += 1;
+		}
+		nodes_itr += 1;
+	}
+
+	// Whatever the source reported last time, but not now, is gone
+	std::vector<unsigned>::iterator ids_itr = previous_ids.begin();
+	while (ids_itr != previous_ids.end())
+	{
+		int index = find_index(*ids_itr);
+		ids_itr += 1;
+		if (index < 0)
+		{
+			continue;
+		}
+		struct entry &e = entries[index];
+		std::vector<struct report>::iterator reports_itr = e.reports.begin();
+		while ((reports_itr != e.reports.end()) && (reports_itr->source != source))
+		{
+			reports_itr += 1;
+		}
+		if ((reports_itr == e.reports.end()) || (reports_itr->update == update_count))
+		{
+			continue;
+		}
+		e.reports.erase(reports_itr);
+		if (e.reports.empty())
+		{
+			mark_changed(e);
+			erase(index);
+			changes += 1;
+		}
+		else if (resolve(e))
+		{
+			mark_changed(e);
+			changes += 1;
+		}
+	}
+
+	if (ids.empty())
+	{
+		source_ids.erase(source);
+	}
+	return(changes);
+}
+
+/*! \brief Removes every report from a source.
+ * \param source Source to forget
+ * \return Number of nodes that were removed or changed
+ */
+unsigned node_index::remove_source(const void *source)
+{
+	return(update(source, std::vector<struct wclient::client_node>()));
+}
+
+/*! \brief Finds a node.
+ * \param id Node id
+ * \return The node's entry, or NULL if no source reports it. Only valid until the index is changed.
+ */
+const struct node_index::entry *node_index::find(unsigned id) const
+{
+	int index = find_index(id);
+	return((index < 0) ? NULL : &entries[index]);
+}
+
+/*! \brief Tells how many nodes a source reports.
+ * \param source Source
+ * \return Number of nodes
+ */
+unsigned node_index::source_count(const void *source) const
+{
+	std::map<const void*, std::vector<unsigned> >::const_iterator itr = source_ids.find(source);
+	return((itr == source_ids.end()) ? 0 : itr->second.size());
+}
+
+/*! \brief Copies the freshest report of every node into a list.
+ * \param[out] nodes Replaced with one entry for each node. Keeps its allocated memory.
+ */
+void node_index::copy_nodes(std::vector<struct wclient::client_node> &nodes) const
+{
+	nodes.resize(entries.size());
+	for (unsigned i = 0; i < entries.size(); i++)
+	{
+		nodes[i] = entries[i].node;
+	}
+}
+
+/*! \brief Hands out the ids of the nodes that were added, changed, or removed since the last call.
+ *
+ * Look the ids up with #find() to tell removed nodes from the others.
+ * An id may be listed more than once.
+ *
+ * \param[out] ids Replaced with the ids. Keeps its allocated memory.
+ */
+void node_index::take_changes(std::vector<unsigned> &ids)
+{
+	ids.swap(changed_ids);
+	changed_ids.clear();
+	std::vector<unsigned>::iterator itr = ids.begin();
+	while (itr != ids.end())
+	{
+		int index = find_index(*itr);
+		if (index >= 0)
+		{
+			entries[index].pending = false;
+		}
+		itr += 1;
+	}
+}
+
+/*! \brief Removes every node and source.
+ *
+ * The removed nodes are not reported by #take_changes().
+ */
+void node_index::clear()
+{
+	entries.clear();
+	changed_ids.clear();
+	source_ids.clear();
+	rehash(NODEINDEX_INITIAL_BUCKETS);
+}
+
+/*! \brief Finds the position of a node in #entries.
+ * \param id Node id
+ * \return Index into #entries, or -1 if not found
+ */
+int node_index::find_index(unsigned id) const
+{
+	int index = buckets[bucket_of(id)];
+	while ((index >= 0) && (entries[index].node.id != id))
+	{
+		index = entries[index].next;
+	}
+	return(index);
+}
+
+/*! \brief Adds an entry without any reports. The node must not already be in the index.
+ * \param id Node id
+ * \return Index of the new entry in #entries
+ */
+int node_index::insert(unsigned id)
+{
+	if (entries.size() >= buckets.size())
+	{
+		rehash(buckets.size() * 2);
+	}
+	int index = entries.size();
+	entries.push_back(entry());
+	struct entry &e = entries.back();
+	e.node = wclient::client_node();
+	e.node.id = id;
+	e.source = NULL;
+	e.pending = false;
+	unsigned bucket = bucket_of(id);
+	e.next = buckets[bucket];
+	buckets[bucket] = index;
+	return(index);
+}
+
+/*! \brief Removes an entry.
+ *
+ * The last entry is moved into its place, so the entries stay densely packed.
+ *
+ * \param index Index of the entry in #entries
+ */
+void node_index::erase(int index)
+{
+	// Unlink the entry from its bucket
+	int *link = &buckets[bucket_of(entries[index].node.id)];
+	while (*link != index)
+	{
+		link = &entries[*link].next;
+	}
+	*link = entries[index].next;
+
+	int last = entries.size() - 1;
+	if (index != last)
+	{
+		// Move the last entry, and point its bucket at the new position
+		link = &buckets[bucket_of(entries[last].node.id)];
+		while (*link != last)
+		{
+			link = &entries[*link].next;
+		}
+		*link = index;
+		entries[index].node = entries[last].node;
+		entries[index].source = entries[last].source;
+		entries[index].reports.swap(entries[last].reports);
+		entries[index].next = entries[last].next;
+		entries[index].pending = entries[last].pending;
+		entries[index].fragment.swap(entries[last].fragment);
+	}
+	entries.pop_back();
+}
+
+/*! \brief Rebuilds the buckets.
+ * \param bucket_count New number of buckets. Must be a power of two.
+ */
+void node_index::rehash(unsigned bucket_count)
+{
+	buckets.assign(bucket_count, -1);
+	mask = bucket_count - 1;
+	for (unsigned i = 0; i < entries.size(); i++)
+	{
+		unsigned bucket = bucket_of(entries[i].node.id);
+		entries[i].next = buckets[bucket];
+		buckets[bucket] = i;
+	}
+}
+
+/*! \brief Picks the freshest of the reports of a node.
+ * \param e Entry with at least one report
+ * \return TRUE if the resolved node changed
+ */
+bool node_index::resolve(struct entry &e)
+{
+	const struct report *best = NULL;
+	std::vector<struct report>::const_iterator itr = e.reports.begin();
+	while (itr != e.reports.end())
+	{
+		if ((best == NULL) || (itr->node.age < best->node.age) ||
+		    ((itr->node.age == best->node.age) && (itr->source == e.source)))
+		{
+			best = &(*itr);
+		}
+		itr += 1;
+	}
+	if ((best->source == e.source) && same_node(best->node, e.node))
+	{
+		return(false);
+	}
+	bool changed = !same_node(best->node, e.node);
+	if (changed)
+	{
+		e.fragment.clear();
+	}
+	e.node = best->node;
+	e.source = best->source;
+	return(changed);
+}
+
+/*! \brief Adds a node to #changed_ids, unless it is there already.
+ */
+void node_index::mark_changed(struct entry &e)
+{
+	if (!e.pending)
+	{
+		e.pending = true;
+		changed_ids.push_back(e.node.id);
+	}
+}
+
+/*! \brief Compares every field of two nodes.
+ */
+bool node_index::same_node(const struct wclient::client_node &n1, const struct wclient::client_node &n2)
+{
+	return((n1.id == n2.id) && (n1.age == n2.age) && (n1.cr == n2.cr) &&
+	       (n1.lat == n2.lat) && (n1.lon == n2.lon) &&
+	       (n1.p2p_ip == n2.p2p_ip) && (n1.radac_ip == n2.radac_ip));
+}
@@ -0,0 +1,90 @@
+/*! \file nodeindex.hpp
+ * \brief Incrementally maintained index of the client nodes reported by all clients.
+ *
+ * The same node is often seen by several clients. The index keeps what
+ * each client (the source) last reported about each node, and resolves
+ * the duplicates into one entry per node id. Updating the index with a new
+ * list from one source only touches the nodes that source reports, so the
+ * cost does not grow with the number of other clients.
+ */
+
+#ifndef __NODEINDEX_HPP
+#define __NODEINDEX_HPP
+
+#include "platform.h"
+#include "wclient.hpp"
+
+#include <map>
+#include <string>
+#include <vector>
+
+/*! \brief Hash index of client nodes by node id.
+ *
+ * Sources are identified by any pointer, typically the #wclient. When
+ * several sources report the same node, the report with the lowest age
+ * wins; on equal age the node keeps the source it already had.
+ *
+ * The entries are kept densely packed, so iterating from #begin() to
+ * #end() visits every node exactly once, in no particular order.
+ *
+ * The ids of nodes that are added, changed, or removed are collected
+ * until #take_changes() is called, so users of the index can follow it
+ * without comparing every node.
+ *
+ * Each entry can hold a cached rendering of its node in #entry::fragment,
+ * in whatever output format the user of the index needs. The index
+ * empties the fragment whenever the node changes.
+ *
+ * \note Not thread safe. All calls must be made from the same thread.
+ */
+class node_index
+{
+public:
+	//! \brief What one source last reported about a node.
+	struct report
+	{
+		const void *source; //!< Source of the report
+		unsigned long long update; //!< Number of the #update() that last confirmed the report
+		struct wclient::client_node node; //!< The node as reported
+	};
+	//! \brief One node, with every report of it.
+	struct entry
+	{
+		struct wclient::client_node node; //!< Freshest report of the node
+		const void *source; //!< Source of #node
+		std::vector<struct report> reports; //!< Every source reporting the node
+		int next; //!< Next entry in the same bucket, or -1
+		bool pending; //!< TRUE if the id is in #changed_ids
+		mutable std::string fragment; //!< Cached rendering of #node; empty when it must be rendered again
+	};
+	typedef std::vector<struct entry>::const_iterator const_iterator;
+
+	node_index();
+	unsigned update(const void *source, const std::vector<struct wclient::client_node> &nodes);
+	unsigned remove_source(const void *source);
+	const struct entry *find(unsigned id) const;
+	const_iterator begin() const { return(entries.begin()); }
+	const_iterator end() const { return(entries.end()); }
+	unsigned size() const { return(entries.size()); }
+	unsigned source_count(const void *source) const;
+	void copy_nodes(std::vector<struct wclient::client_node> &nodes) const;
+	void take_changes(std::vector<unsigned> &ids);
+	void clear();
+private:
+	int find_index(unsigned id) const;
+	int insert(unsigned id);
+	void erase(int index);
+	void rehash(unsigned bucket_count);
+	bool resolve(struct entry &e);
+	void mark_changed(struct entry &e);
+	static bool same_node(const struct wclient::client_node &n1, const struct wclient::client_node &n2);
+	unsigned bucket_of(unsigned id) const { return((id * 2654435761u) & mask); }
+	std::vector<struct entry> entries; //!< Every node, densely packed
+	std::vector<int> buckets; //!< First entry in each bucket, or -1
+	unsigned mask; //!< Number of buckets - 1
+	std::map<const void*, std::vector<unsigned> > source_ids; //!< Node ids each source reported in its last #update()
+	unsigned long long update_count; //!< Number of calls to #update()
+	std::vector<unsigned> changed_ids; //!< Nodes added, changed, or removed since the last #take_changes()
+};
+
+#endif // __NODEINDEX_HPP
@@ -0,0 +1,318 @@
+/*! \file pmbinary.cpp
+ *  \copydoc pmbinary.hpp
+ */
+
+#include "pmbinary.hpp"
+
+#include <cmath>
+#include <cstring>
+
+//! \brief Latitude and longitude are sent in units of 1e-7 degrees.
+#define PM_BINARY_DEGREE_SCALE 1e7
+//! \brief Altitude and speed are sent in tenths.
+#define PM_BINARY_TENTH_SCALE 10.0
+
+/*! \brief Constructor.
+ */
+pm_binary_encoder::pm_binary_encoder()
+{
+	reset();
+}
+
+/*! \brief Empties the dictionary, e.g. for a new connection.
+ */
+void pm_binary_encoder::reset()
+{
+	buffer.clear();
+	dictionary.clear();
+}
+
+/*! \brief Starts on a new message. The buffer keeps its allocated memory.
+ *
+ * A snapshot empties the dictionary.
+ *
+ * \param type Kind of message
+ * \param sequence Sequence number, as in the JSON updates
+ */
+void pm_binary_encoder::begin(pm_binary_type type, unsigned long long sequence)
+{
+	if (type == PM_BINARY_SNAPSHOT)
+	{
+		dictionary.clear();
+	}
+	buffer.clear();
+	buffer += (char) PM_BINARY_MAGIC;
+	buffer += (char) PM_BINARY_VERSION;
+	buffer += (char) type;
+	put_varint(sequence);
+}
+
+/*! \brief Writes the number of entries in the list that follows.
+ */
+void pm_binary_encoder::count(unsigned n)
+{
+	put_varint(n);
+}
+
+/*! \brief Writes one unit.
+ * \param id Unit id
+ * \param lat Latitude in degrees
+ * \param lon Longitude in degrees
+ * \param symbol Map symbol
+ * \param enumeration Unit enum
+ * \param alt Altitude in metres
+ * \param speed Speed in metres per second
+ */
+void pm_binary_encoder::unit(unsigned id, double lat, double lon, const char *symbol, const char *enumeration, double alt, double speed)
+{
+	put_varint(id);
+	put_signed(llround(lat * PM_BINARY_DEGREE_SCALE));
+	put_signed(llround(lon * PM_BINARY_DEGREE_SCALE));
+	put_string(symbol);
+	put_string(enumeration);
+	put_signed(llround(alt * PM_BINARY_TENTH_SCALE));
+	put_signed(llround(speed * PM_BINARY_TENTH_SCALE));
+}
+
+/*! \brief Writes the id of a removed unit.
+ */
+void pm_binary_encoder::id(unsigned id)
+{
+	put_varint(id);
+}
+
+void pm_binary_encoder::put_varint(unsigned long long value)
+{
+	while (value >= 0x80)
+	{
+		buffer += (char) ((value & 0x7f) | 0x80);
+		value >>= 7;
+	}
+	buffer += (char) value;
+}
+
+void pm_binary_encoder::put_signed(long long value)
+{
+	put_varint(((unsigned long long) value << 1) ^ (unsigned long long) (value >> 63));
+}
+
+/*! \brief Writes a reference to a string in the dictionary, adding the string if it is new.
+ */
+void pm_binary_encoder::put_string(const char *text)
+{
+	// The dictionary is tiny in practice (a handful of symbols), so a linear search is fastest
+	for (unsigned i = 0; i < dictionary.size(); i++)
+	{
+		if (dictionary[i] == text)
+		{
+			put_varint(i);
+			return;
+		}
+	}
+	unsigned length = strlen(text);
+	put_varint(dictionary.size());
+	put_varint(length);
+	buffer.append(text, length);
+	if (dictionary.size() < PM_BINARY_MAX_DICTIONARY)
+	{
+		dictionary.push_back(text);
+	}
+}
+
+/*! \brief Constructor.
+ */
+pm_binary_decoder::pm_binary_decoder()
+	: type(PM_BINARY_SNAPSHOT),
+	  sequence(0),
+	  position(NULL),
+	  end(NULL),
+	  error_("")
+{
+}
+
+/*! \brief Empties the dictionary, e.g. for a new connection.
+ */
+void pm_binary_decoder::reset()
+{
+	dictionary.clear();
+	units.clear();
+	changed.clear();
+	removed.clear();
+}
+
+/*! \brief Decodes one message into #type, #sequence, #units, #changed and #removed.
+ * \param data The message
+ * \param length Length of \c data
+ * \return TRUE if all is OK; otherwise #error() tells what was wrong
+ */
+bool pm_binary_decoder::decode(const char *data, unsigned length)
+{
+	position = (const unsigned char *) data;
+	end = position + length;
+	units.clear();
+	changed.clear();
+	removed.clear();
+	error_ = "";
+
+	if ((length < 3) || (position[0] != PM_BINARY_MAGIC))
+	{
+		return(fail("not a binary PM message"));
+	}
+	if (position[1] != PM_BINARY_VERSION)
+	{
+		return(fail("unknown version"));
+	}
+	if ((position[2] != PM_BINARY_SNAPSHOT) && (position[2] != PM_BINARY_DELTA))
+	{
+		return(fail("unknown message type"));
+	}
+	type = (pm_binary_type) position[2];
+	position += 3;
+	if (!get_varint(sequence))
+	{
+		return(false);
+	}
+	if (type == PM_BINARY_SNAPSHOT)
+	{
+		dictionary.clear();
+		if (!get_units(units))
+		{
+			return(false);
+		}
+	}
+	else
+	{
+		unsigned long long count = 0;
+		if (!get_units(units) || !get_units(changed) || !get_varint(count))
+		{
+			return(false);
+		}
+		if (count > (unsigned long long) (end - position))
+		{
+			return(fail("truncated"));
+		}
+		for (unsigned long long i = 0; i < count; i++)
+		{
+			unsigned long long id = 0;
+			if (!get_varint(id))
+			{
+				return(false);
+			}
+			removed.push_back(id);
+		}
+	}
+	if (position != end)
+	{
+		return(fail("trailing data"));
+	}
+	return(true);
+}
+
+bool pm_binary_decoder::get_varint(unsigned long long &value)
+{
+	value = 0;
+	for (unsigned shift = 0; shift < 64; shift += 7)
+	{
+		if (position == end)
+		{
+			return(fail("truncated"));
+		}
+		unsigned char byte = *position++;
+		value |= (unsigned long long) (byte & 0x7f) << shift;
+		if ((byte & 0x80) == 0)
+		{
+			return(true);
+		}
+	}
+	return(fail("varint too long"));
+}
+
+bool pm_binary_decoder::get_signed(long long &value)
+{
+	unsigned long long zigzag = 0;
+	if (!get_varint(zigzag))
+	{
+		return(false);
+	}
+	value = (long long) (zigzag >> 1) ^ -(long long) (zigzag & 1);
+	return(true);
+}
+
+/*! \brief Reads a dictionary reference, and the new string it brings, if any.
+ */
+bool pm_binary_decoder::get_string(std::string &text)
+{
+	unsigned long long index = 0;
+	if (!get_varint(index))
+	{
+		return(false);
+	}
+	if (index < dictionary.size())
+	{
+		text = dictionary[index];
+		return(true);
+	}
+	if (index > dictionary.size())
+	{
+		return(fail("unknown dictionary entry"));
+	}
+	unsigned long long length = 0;
+	if (!get_varint(length))
+	{
+		return(false);
+	}
+	if (length > (unsigned long long) (end - position))
+	{
+		return(fail("truncated"));
+	}
+	text.assign((const char *) position, length);
+	position += length;
+	if (dictionary.size() < PM_BINARY_MAX_DICTIONARY)
+	{
+		dictionary.push_back(text);
+	}
+	return(true);
+}
+
+/*! \brief Reads a count followed by that many units.
+ */
+bool pm_binary_decoder::get_units(std::vector<struct unit> &list)
+{
+	unsigned long long count = 0;
+	if (!get_varint(count))
+	{
+		return(false);
+	}
+	if (count > (unsigned long long) (end - position))
+	{
+		return(fail("truncated")); // Every unit takes several bytes
+	}
+	list.resize(count);
+	for (unsigned long long i = 0; i < count; i++)
+	{
+		struct unit &u = list[i];
+		unsigned long long id = 0;
+		long long lat = 0, lon = 0, alt = 0, speed = 0;
+		if (!get_varint(id) || !get_signed(lat) || !get_signed(lon) || !get_string(u.symbol)
+		    || !get_string(u.enumeration) || !get_signed(alt) || !get_signed(speed))
+		{
+			return(false);
+		}
+		u.id = id;
+		u.lat = lat / PM_BINARY_DEGREE_SCALE;
+		u.lon = lon / PM_BINARY_DEGREE_SCALE;
+		u.alt = alt / PM_BINARY_TENTH_SCALE;
+		u.speed = speed / PM_BINARY_TENTH_SCALE;
+	}
+	return(true);
+}
+
+/*! \brief Remembers what was wrong.
+ * \param reason Static text
+ * \return Always FALSE
+ */
+bool pm_binary_decoder::fail(const char *reason)
+{
+	error_ = reason;
+	return(false);
+}
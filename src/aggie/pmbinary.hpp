@@ -0,0 +1,123 @@
+/*! \file pmbinary.hpp
+ * \brief Compact binary encoding of the updates sent to the PM.
+ *
+ * An alternative to the JSON updates, for presentation managers that ask
+ * for it. It carries the same snapshots and deltas, sent as binary
+ * websocket messages. Each message is:
+ *
+ * \code
+ * magic (1 byte, 0xA6)  version (1 byte)  type (1 byte: 0 snapshot, 1 delta)  seq (varint)
+ * snapshot: count (varint), then that many units
+ * delta:    count, units (added)   count, units (changed)   count, ids (removed)
+ * \endcode
+ *
+ * A unit is its id (varint), latitude and longitude in 1e-7 degrees, altitude
+ * in decimetres and speed in decimetres per second (all zigzag varints), and
+ * its symbol and enum as references into a string dictionary.
+ *
+ * A varint is 7 bits per byte, least significant first, with the top bit
+ * set on all bytes but the last. A zigzag varint maps 0, -1, 1, -2 ... to
+ * 0, 1, 2, 3 ... first. A dictionary reference is the index of a string
+ * sent earlier; the index one past the last entry means a new string
+ * follows (length as a varint, then the bytes), which gets that index. The
+ * dictionary is emptied at every snapshot, so a decoder must see every
+ * message from the last snapshot on, in order.
+ */
+
+#ifndef __PMBINARY_HPP
+#define __PMBINARY_HPP
+
+#include "platform.h"
+
+#include <string>
+#include <vector>
+
+//! \brief First byte of every binary PM message.
+#define PM_BINARY_MAGIC 0xA6
+//! \brief Version of the encoding.
+#define PM_BINARY_VERSION 1
+//! \brief Largest number of strings in the dictionary. Once full, new strings are sent in full every time.
+#define PM_BINARY_MAX_DICTIONARY 4096
+
+//! \brief Kinds of binary PM messages.
+enum pm_binary_type {
+	PM_BINARY_SNAPSHOT = 0, //!< Every unit
+	PM_BINARY_DELTA = 1, //!< Added, changed and removed units
+};
+
+/*! \brief Writes binary PM messages.
+ *
+ * Typical use for a delta:
+ *
+ * \code
+ * encoder.begin(PM_BINARY_DELTA, seq);
+ * encoder.count(added.size());
+ * // encoder.unit(...) for each added unit
+ * encoder.count(changed.size());
+ * // encoder.unit(...) for each changed unit
+ * encoder.count(removed.size());
+ * // encoder.id(...) for each removed unit
+ * send(encoder.str());
+ * \endcode
+ *
+ * \note Not thread safe. Use one encoder per PM connection, and send every message it writes.
+ */
+class pm_binary_encoder
+{
+public:
+	pm_binary_encoder();
+	void reset();
+	void begin(pm_binary_type type, unsigned long long sequence);
+	void count(unsigned n);
+	void unit(unsigned id, double lat, double lon, const char *symbol, const char *enumeration, double alt, double speed);
+	void id(unsigned id);
+	const std::string &str() const { return(buffer); } //!< The message written since #begin()
+private:
+	void put_varint(unsigned long long value);
+	void put_signed(long long value);
+	void put_string(const char *text);
+	std::string buffer; //!< The message
+	std::vector<std::string> dictionary; //!< Strings sent since the last snapshot, by index
+};
+
+/*! \brief Reads binary PM messages, e.g. in a presentation manager.
+ *
+ * \note Not thread safe. Every message from a connection must be given to the same decoder, in order.
+ */
+class pm_binary_decoder
+{
+public:
+	//! \brief One unit, as decoded.
+	struct unit
+	{
+		unsigned id;
+		double lat;
+		double lon;
+		std::string symbol;
+		std::string enumeration;
+		double alt;
+		double speed;
+	};
+	pm_binary_decoder();
+	void reset();
+	bool decode(const char *data, unsigned length);
+	bool decode(const std::string &message) { return(decode(message.data(), message.length())); } //!< \copydoc decode(const char*, unsigned)
+	pm_binary_type type; //!< Kind of the last decoded message
+	unsigned long long sequence; //!< Sequence number of the last decoded message
+	std::vector<struct unit> units; //!< Every unit of a snapshot, or the units added by a delta
+	std::vector<struct unit> changed; //!< Units changed by a delta
+	std::vector<unsigned> removed; //!< Units removed by a delta
+	const char *error() const { return(error_); } //!< What was wrong, after #decode() returned FALSE
+private:
+	bool get_varint(unsigned long long &value);
+	bool get_signed(long long &value);
+	bool get_string(std::string &text);
+	bool get_units(std::vector<struct unit> &list);
+	bool fail(const char *reason);
+	const unsigned char *position; //!< Next byte to decode
+	const unsigned char *end; //!< End of the message being decoded
+	std::vector<std::string> dictionary; //!< Strings received since the last snapshot, by index
+	const char *error_; //!< Reason for the last failure
+};
+
+#endif // __PMBINARY_HPP
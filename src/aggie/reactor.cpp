@@ -0,0 +1,275 @@
+/*! \file reactor.cpp
+ *  \copydoc reactor.hpp
+ */
+
+#include "reactor.hpp"
+#include "vout.hpp"
+
+#include <cstring>
+
+#ifdef PLATFORM_LINUX
+#	include <sys/eventfd.h>
+#	include <unistd.h>
+#	include <errno.h>
+#	include <stdint.h>
+#endif
+
+/*! \brief Constructor.
+ *
+ * Creates the epoll instance, but does not start the event loop.
+ * Use #start() for that.
+ */
+reactor::reactor()
+	: epoll_handle(-1),
+	  wakeup_handle(-1),
+	  reactor_running(false)
+{
+	pthread_mutexattr_t attr;
+	::pthread_mutexattr_init(&attr);
+	::pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	::pthread_mutex_init(&dispatch_mutex, &attr);
+	::pthread_mutexattr_destroy(&attr);
+
+	epoll_handle = ::epoll_create(1);
+	wakeup_handle = ::eventfd(0, EFD_NONBLOCK);
+	if ((epoll_handle != -1) && (wakeup_handle != -1))
+	{
+		struct ::epoll_event event;
+		memset(&event, 0, sizeof event); // To please valgrind
+		event.data.ptr = NULL; // NULL means wake-up
+		event.events = EPOLLIN;
+		::epoll_ctl(epoll_handle, EPOLL_CTL_ADD, wakeup_handle, &event);
+	}
+}
+
+/*! \brief Destructor.
+ *
+ * Stops the event loop if it is still running.
+ */
+reactor::~reactor()
+{
+	stop();
+	if (wakeup_handle != -1) ::close(wakeup_handle);
+	if (epoll_handle != -1) ::close(epoll_handle);
+	::pthread_mutex_destroy(&dispatch_mutex);
+}
+
+/*! \brief Starts the event loop in a separate \ref thread_entry() "thread".
+ *
+ * Does not return until the thread is running.
+ * \return #NO_ERRORS or #SOCKET_ERROR if epoll could not be set up
+ */
+RH reactor::start()
+{
+	RH result;
+	result.set_ok();
+
+	if ((epoll_handle == -1) || (wakeup_handle == -1))
+	{
+		result.set_not_ok(SOCKET_ERROR);
+		result.set_not_ok(result.text() + " (epoll_create)");
+		return(result);
+	}
+
+	if (!reactor_running)
+	{
+		reactor_running = false;
+		run();
+		while (!reactor_running);
+	}
+
+	return(result);
+}
+
+/*! \brief Stops the event loop.
+ *
+ * It does not return until the thread actually has stopped.
+ * \return Always returns #NO_ERRORS
+ */
+RH reactor::stop()
+{
+	RH result;
+	result.set_ok();
+
+	if (reactor_running)
+	{
+		reactor_running = false;
+		uint64_t one = 1;
+		if (::write(wakeup_handle, &one, sizeof one) == -1)
+		{
+			vout(VOUT_DEBUG) << "[reactor] could not signal wake-up" << std::endlc;
+		}
+		wait();
+	}
+
+	return(result);
+}
+
+/*! \brief Tells if the event loop is running.
+ * \return TRUE if running
+ */
+bool reactor::running()
+{
+	return reactor_running;
+}
+
+/*! \brief Starts watching a socket for incoming data.
+ *
+ * \param handle Socket handle
+ * \param handler Object that will receive events for this socket
+ * \return #NO_ERRORS or #SOCKET_ERROR
+ */
+RH reactor::add(int handle, reactor_handler *handler)
+{
+	RH result;
+	result.set_ok();
+
+	struct ::epoll_event event;
+	memset(&event, 0, sizeof event);
+	event.data.ptr = handler;
+	event.events = EPOLLIN | EPOLLRDHUP;
+
+	::pthread_mutex_lock(&dispatch_mutex);
+	if (::epoll_ctl(epoll_handle, EPOLL_CTL_ADD, handle, &event) == -1)
+	{
+		result.set_not_ok(SOCKET_ERROR);
+		result.set_not_ok(result.text() + " (epoll_ctl)");
+	}
+	else
+	{
+		handlers.insert(handler);
+	}
+	::pthread_mutex_unlock(&dispatch_mutex);
+
+	return(result);
+}
+
+/*! \brief Stops watching a socket.
+ *
+ * Safe to call from any thread. When called from another thread than the
+ * reactor's own, it will wait for any ongoing dispatch to finish, so the
+ * handler may be deleted as soon as this returns.
+ *
+ * \param handle Socket handle
+ * \param handler Object that was receiving events for this socket
+ * \return Always returns #NO_ERRORS
+ */
+RH reactor::remove(int handle, reactor_handler *handler)
+{
+	RH result;
+	result.set_ok();
+
+	::pthread_mutex_lock(&dispatch_mutex);
+	::epoll_ctl(epoll_handle, EPOLL_CTL_DEL, handle, NULL);
+	handlers.erase(handler);
+	::pthread_mutex_unlock(&dispatch_mutex);
+
+	return(result);
+}
+
+/*! \brief Enables or disables notifications for when a socket becomes writable.
+ *
+ * Does not wait for an ongoing dispatch, so it may be called while holding
+ * locks that the handler's own callbacks take. The caller must make sure the
+ * socket is still registered and open.
+ *
+ * \param handle Socket handle
+ * \param handler Object receiving events for this socket
+ * \param enable TRUE to receive reactor_handler::on_writable() calls
+ * \return #NO_ERRORS or #SOCKET_ERROR
+ */
+RH reactor::watch_writable(int handle, reactor_handler *handler, bool enable)
+{
+	RH result;
+	result.set_ok();
+
+	struct ::epoll_event event;
+	memset(&event, 0, sizeof event);
+	event.data.ptr = handler;
+	event.events = EPOLLIN | EPOLLRDHUP | (enable ? (uint32_t) EPOLLOUT : 0u);
+
+	if (::epoll_ctl(epoll_handle, EPOLL_CTL_MOD, handle, &event) == -1)
+	{
+		result.set_not_ok(SOCKET_ERROR);
+		result.set_not_ok(result.text() + " (epoll_ctl)");
+	}
+
+	return(result);
+}
+
+/*! \brief Number of sockets currently watched by this reactor.
+ */
+unsigned reactor::handler_count()
+{
+	unsigned count;
+	::pthread_mutex_lock(&dispatch_mutex);
+	count = handlers.size();
+	::pthread_mutex_unlock(&dispatch_mutex);
+	return(count);
+}
+
+/*! \brief Tells if a handler is still registered.
+ *
+ * Events fetched in the same batch may refer to a handler that
+ * was removed by an earlier event in that batch.
+ */
+bool reactor::registered(reactor_handler *handler)
+{
+	return (handlers.find(handler) != handlers.end());
+}
+
+/*! \brief Event loop.
+ *
+ * Sleeps in epoll_wait() until any of the registered sockets has activity,
+ * and dispatches the events to their handlers.
+ *
+ * The proper way to terminate this thread is to call #stop().
+ */
+void reactor::thread_entry()
+{
+	struct ::epoll_event events[REACTOR_MAX_EVENTS];
+
+	vout(VOUT_DEBUG) << "[reactor] event loop started" << std::endlc;
+	reactor_running = true;
+	while (reactor_running)
+	{
+		int n = ::epoll_wait(epoll_handle, events, REACTOR_MAX_EVENTS, -1);
+		if (n == -1)
+		{
+			if (errno != EINTR)
+			{
+				vout(VOUT_ERROR) << "[reactor] epoll_wait failed: " << strerror(errno) << std::endlc;
+				break;
+			}
+			continue;
+		}
+
+		::pthread_mutex_lock(&dispatch_mutex);
+		for (int i = 0; i < n; i++)
+		{
+			reactor_handler *handler = (reactor_handler *) events[i].data.ptr;
+			if (handler == NULL)
+			{
+				uint64_t count;
+				if (::read(wakeup_handle, &count, sizeof count) == -1) { /* Already drained */ }
+				continue;
+			}
+			if ((events[i].events & EPOLLIN) && registered(handler))
+			{
+				// Read first, so that data sent right before a hangup is not lost
+				handler->on_readable();
+			}
+			if ((events[i].events & EPOLLOUT) && registered(handler))
+			{
+				handler->on_writable();
+			}
+			if ((events[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) && registered(handler))
+			{
+				handler->on_hangup();
+			}
+		}
+		::pthread_mutex_unlock(&dispatch_mutex);
+	}
+	reactor_running = false;
+	vout(VOUT_DEBUG) << "[reactor] event loop exiting" << std::endlc;
+}
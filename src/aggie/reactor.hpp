@@ -0,0 +1,67 @@
+/*! \file reactor.hpp
+ * \brief Event loop that multiplexes many sockets through epoll.
+ *
+ * Instead of dedicating one listener thread to every socket, a small
+ * number of reactor threads wait on all registered sockets at once and
+ * dispatch events to the \ref reactor_handler "handler" owning the socket.
+ */
+
+#ifndef __REACTOR_HPP
+#define __REACTOR_HPP
+
+#include "platform.h"
+#include "resulthandler.hpp"
+#include "threadable.hpp"
+
+#include <set>
+
+#ifdef PLATFORM_LINUX
+#	include <sys/epoll.h>
+#	include <pthread.h>
+#endif
+
+//! \brief Maximum number of events fetched from epoll in one go.
+#define REACTOR_MAX_EVENTS 64
+
+/*! \brief Interface for objects that want events from a #reactor.
+ *
+ */
+class reactor_handler
+{
+public:
+	virtual ~reactor_handler() {}
+	virtual void on_readable() = 0; //!< Called when data is waiting to be read
+	virtual void on_writable() {} //!< Called when the socket can accept more outgoing data
+	virtual void on_hangup() = 0; //!< Called when the other end has gone away or the socket failed
+};
+
+/*! \brief Single epoll event loop running in its own thread.
+ *
+ * Handlers may be added and removed from any thread, also from within
+ * their own event callbacks.
+ */
+class reactor : public threadable
+{
+public:
+	reactor();
+	~reactor();
+	RH start();
+	RH stop();
+	RH add(int handle, reactor_handler *handler);
+	RH remove(int handle, reactor_handler *handler);
+	RH watch_writable(int handle, reactor_handler *handler, bool enable);
+	unsigned handler_count();
+	bool running();
+private:
+	void thread_entry();
+	bool registered(reactor_handler *handler);
+	int epoll_handle; //!< Handle of the epoll instance
+	int wakeup_handle; //!< eventfd used for waking the thread when stopping
+	volatile bool reactor_running; //!< TRUE while the event loop is executing
+	std::set<reactor_handler*> handlers; //!< All currently registered handlers
+#	ifdef PLATFORM_LINUX
+		pthread_mutex_t dispatch_mutex; //!< Held while dispatching; makes removal safe from other threads
+#	endif
+};
+
+#endif // __REACTOR_HPP
@@ -0,0 +1,131 @@
+/*! \file rtthistogram.cpp
+ *  \copydoc rtthistogram.hpp
+ */
+
+#include "rtthistogram.hpp"
+#include "stringutils.hpp"
+
+#include <algorithm>
+
+/*! \brief Constructor.
+ */
+rtt_histogram::rtt_histogram()
+{
+	clear();
+}
+
+/*! \brief Adds a sample, pushing out the oldest one when full.
+ * \param rtt_us Round trip time in microseconds
+ */
+void rtt_histogram::add(unsigned rtt_us)
+{
+	if (count_ == RTT_HISTOGRAM_SAMPLES)
+	{
+		buckets[bucket_of(samples[next])] -= 1;
+	}
+	else
+	{
+		count_ += 1;
+	}
+	samples[next] = rtt_us;
+	buckets[bucket_of(rtt_us)] += 1;
+	next = (next + 1) % RTT_HISTOGRAM_SAMPLES;
+}
+
+/*! \brief Forgets all samples.
+ */
+void rtt_histogram::clear()
+{
+	next = 0;
+	count_ = 0;
+	for (unsigned i = 0; i < RTT_HISTOGRAM_BUCKETS; i++)
+	{
+		buckets[i] = 0;
+	}
+}
+
+/*! \brief Shortest time, in microseconds. Zero if there are no samples.
+ */
+unsigned rtt_histogram::minimum() const
+{
+	return((count_ > 0) ? *std::min_element(samples, samples + count_) : 0);
+}
+
+/*! \brief Longest time, in microseconds. Zero if there are no samples.
+ */
+unsigned rtt_histogram::maximum() const
+{
+	return((count_ > 0) ? *std::max_element(samples, samples + count_) : 0);
+}
+
+/*! \brief Average time, in microseconds. Zero if there are no samples.
+ */
+unsigned rtt_histogram::mean() const
+{
+	unsigned long long sum = 0;
+	for (unsigned i = 0; i < count_; i++)
+	{
+		sum += samples[i];
+	}
+	return((count_ > 0) ? sum / count_ : 0);
+}
+
+/*! \brief The time that the given share of the samples do not exceed.
+ * \param percent Share of the samples, 0 to 100. 50 gives the median.
+ * \return Time in microseconds. Zero if there are no samples.
+ */
+unsigned rtt_histogram::percentile(unsigned percent) const
+{
+	if (count_ == 0)
+	{
+		return(0);
+	}
+	unsigned sorted[RTT_HISTOGRAM_SAMPLES];
+	std::copy(samples, samples + count_, sorted);
+	unsigned rank = (percent >= 100) ? count_ - 1 : (count_ * percent) / 100;
+	std::nth_element(sorted, sorted + rank, sorted + count_);
+	return(sorted[rank]);
+}
+
+/*! \brief Describes the samples in one line, e.g. for a status display.
+ */
+std::string rtt_histogram::text() const
+{
+	if (count_ == 0)
+	{
+		return("no samples");
+	}
+	std::string text = format_string("last %u: min %.1f, median %.1f, 95%% %.1f, max %.1f ms;",
+	                                 count_, minimum() / 1000.0, percentile(50) / 1000.0,
+	                                 percentile(95) / 1000.0, maximum() / 1000.0);
+	for (unsigned i = 0; i < RTT_HISTOGRAM_BUCKETS; i++)
+	{
+		if (buckets[i] == 0)
+		{
+			continue;
+		}
+		if (i < RTT_HISTOGRAM_BUCKETS - 1)
+		{
+			text += format_string(" <%u ms: %u", 1u << i, buckets[i]);
+		}
+		else
+		{
+			text += format_string(" >=%u ms: %u", 1u << (i - 1), buckets[i]);
+		}
+	}
+	return(text);
+}
+
+/*! \brief Finds the bucket a time belongs in.
+ */
+unsigned rtt_histogram::bucket_of(unsigned rtt_us)
+{
+	unsigned index = 0;
+	unsigned limit_us = 1000;
+	while ((index < RTT_HISTOGRAM_BUCKETS - 1) && (rtt_us >= limit_us))
+	{
+		index += 1;
+		limit_us *= 2;
+	}
+	return(index);
+}
@@ -0,0 +1,48 @@
+/*! \file rtthistogram.hpp
+ * \brief Rolling statistics of round trip times.
+ *
+ * Only the most recent samples are kept, so the figures follow the link as
+ * it changes instead of being dominated by its whole history.
+ */
+
+#ifndef __RTTHISTOGRAM_HPP
+#define __RTTHISTOGRAM_HPP
+
+#include "platform.h"
+
+#include <string>
+
+//! \brief Number of most recent samples a #rtt_histogram is made from.
+#define RTT_HISTOGRAM_SAMPLES 128
+//! \brief Number of buckets in a #rtt_histogram. Bucket \c n holds times below 2^n ms; the last holds the rest.
+#define RTT_HISTOGRAM_BUCKETS 13
+
+/*! \brief Histogram of the last #RTT_HISTOGRAM_SAMPLES round trip times.
+ *
+ * Times are given in microseconds. The buckets double in width, from
+ * below 1 ms up to 2 seconds and more.
+ *
+ * \note Not thread safe. Copy it while holding whatever lock protects it.
+ */
+class rtt_histogram
+{
+public:
+	rtt_histogram();
+	void add(unsigned rtt_us);
+	void clear();
+	unsigned count() const { return(count_); } //!< Number of samples, at most #RTT_HISTOGRAM_SAMPLES
+	unsigned bucket(unsigned index) const { return(buckets[index]); } //!< Number of samples in a bucket
+	unsigned minimum() const;
+	unsigned maximum() const;
+	unsigned mean() const;
+	unsigned percentile(unsigned percent) const;
+	std::string text() const;
+private:
+	static unsigned bucket_of(unsigned rtt_us);
+	unsigned samples[RTT_HISTOGRAM_SAMPLES]; //!< Ring of the most recent samples
+	unsigned next; //!< Where the next sample goes in #samples
+	unsigned count_; //!< Number of valid samples in #samples
+	unsigned buckets[RTT_HISTOGRAM_BUCKETS]; //!< Number of the samples in #samples falling in each bucket
+};
+
+#endif // __RTTHISTOGRAM_HPP
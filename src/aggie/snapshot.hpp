@@ -0,0 +1,86 @@
+/*! \file snapshot.hpp
+ * \brief Wait-free publication of data built by one thread and read by another.
+ */
+
+#ifndef __SNAPSHOT_HPP
+#define __SNAPSHOT_HPP
+
+#include "platform.h"
+
+/*! \brief Data that one thread builds generation by generation and another thread reads.
+ *
+ * The writer fills the #back() buffer and calls #publish() when it is complete.
+ * The reader calls #read() and gets the most recently published generation,
+ * which stays untouched until the reader calls #read() again. Neither side
+ * ever waits for the other.
+ *
+ * Three buffers take turns: one is owned by the writer, one by the reader,
+ * and the third holds the latest published generation. Publishing and
+ * reading only swap buffer indexes, so the buffers are recycled and keep
+ * their allocated memory from one generation to the next.
+ *
+ * \note Only one thread may write, and only one thread may read.
+ */
+template <class T>
+class snapshot
+{
+public:
+	snapshot() : back_index(0), front_index(1), shared(2) {}
+
+	/*! \brief The buffer the writer is building. Must only be used by the writer.
+	 *
+	 * Holds whatever was left from an older generation; call \c clear() or
+	 * similar before starting on a new one.
+	 */
+	T &back()
+	{
+		return(buffers[back_index]);
+	}
+
+	/*! \brief Makes the #back() buffer the latest generation. Must only be called by the writer.
+	 *
+	 * The writer gets an older buffer in return.
+	 */
+	void publish()
+	{
+		int previous = __atomic_exchange_n(&shared, back_index | FRESH, __ATOMIC_ACQ_REL);
+		back_index = previous & INDEX_MASK;
+	}
+
+	/*! \brief Gets the latest published generation. Must only be called by the reader.
+	 *
+	 * The returned data stays valid and unchanged until the next call.
+	 */
+	const T &read()
+	{
+		if (fresh())
+		{
+			int previous = __atomic_exchange_n(&shared, front_index, __ATOMIC_ACQ_REL);
+			front_index = previous & INDEX_MASK;
+		}
+		return(buffers[front_index]);
+	}
+
+	/*! \brief Checks whether anything has been published since the reader's last #read().
+	 */
+	bool fresh() const
+	{
+		return((__atomic_load_n(&shared, __ATOMIC_ACQUIRE) & FRESH) != 0);
+	}
+
+private:
+	snapshot(const snapshot &); // Not copyable
+	snapshot &operator=(const snapshot &);
+
+	enum
+	{
+		INDEX_MASK = 3,
+		FRESH = 4 //!< Set in #shared when it holds a generation the reader has not seen
+	};
+	T buffers[3];
+	int back_index; //!< Buffer owned by the writer
+	int front_index; //!< Buffer owned by the reader
+	int shared; //!< Buffer holding the latest generation, and the #FRESH flag
+};
+
+#endif // __SNAPSHOT_HPP
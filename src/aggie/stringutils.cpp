@@ -4,6 +4,9 @@
 
  #include "stringutils.hpp"
 
+#include <cstring>
+#include <cmath>
+
 /*! \brief Converts string to integer.
  * \param s_value string to convert
  * \param i_value resulting integer
@@ -339,3 +342,98 @@ std::string ascii_safe(std::string str, bool print_unsafe)
 
 	return(result);
 }
+
+/*! \brief Splits a NUL-terminated line into tokens without copying it.
+ *
+ * Every separator following a token is overwritten with NUL, so each
+ * token can be used as a string of its own. Consecutive separators
+ * count as one, and leading or trailing separators give no empty tokens.
+ *
+ * \param line Line to split. It is modified.
+ * \param[out] tokens Pointers to the tokens are appended to this list
+ * \param separators Characters that separate the tokens
+ * \return Number of tokens appended
+ */
+unsigned split_in_place(char *line, std::vector<char*> &tokens, const char *separators)
+{
+	unsigned count = 0;
+	char *position = line;
+	while (*position != '\0')
+	{
+		position += strspn(position, separators);
+		if (*position == '\0')
+		{
+			break;
+		}
+		tokens.push_back(position);
+		count += 1;
+		position += strcspn(position, separators);
+		if (*position != '\0')
+		{
+			*position = '\0';
+			position += 1;
+		}
+	}
+	return(count);
+}
+
+/*! \brief Converts a string to unsigned integer, accepting nothing but digits.
+ *
+ * Unlike string_to_unsigned(), the string is neither copied nor trimmed,
+ * and values that do not fit are rejected.
+ *
+ * \param text NUL-terminated string to convert
+ * \param[out] value Resulting integer. Left unchanged on failure.
+ * \return TRUE if success
+ */
+bool parse_unsigned(const char *text, unsigned &value)
+{
+	if (*text == '\0')
+	{
+		return(false);
+	}
+	unsigned result = 0;
+	while (*text != '\0')
+	{
+		unsigned digit = (unsigned) (*text - '0');
+		if ((digit > 9) || (result > (~0u - digit) / 10))
+		{
+			return(false); // Not a digit, or too large
+		}
+		result = result * 10 + digit;
+		text += 1;
+	}
+	value = result;
+	return(true);
+}
+
+/*! \brief Converts a string to double, rejecting anything but an ordinary decimal number.
+ *
+ * A sign and an exponent are allowed, and a decimal comma is accepted
+ * like in string_to_double(). Infinity, NaN, hexadecimal numbers and
+ * trailing characters are rejected.
+ *
+ * \param text NUL-terminated string to convert. A decimal comma is replaced with a point.
+ * \param[out] value Resulting number. Left unchanged on failure.
+ * \return TRUE if success
+ */
+bool parse_double(char *text, double &value)
+{
+	if ((*text == '\0') || (text[strspn(text, "+-.,0123456789eE")] != '\0'))
+	{
+		return(false);
+	}
+	char *comma = strchr(text, ',');
+	if (comma != NULL)
+	{
+		*comma = '.';
+	}
+	char *end = NULL;
+	double result = strtod(text, &end);
+	if ((end == text) || (*end != '\0') || !std::isfinite(result))
+	{
+		return(false);
+	}
+	value = result;
+	return(true);
+}
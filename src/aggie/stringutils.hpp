@@ -18,6 +18,7 @@
 #include <cstdarg>
 #include <cstdio>
 #include <cstdlib>
+#include <vector>
 
 int string_to_int(std::string, int&);
 int string_to_unsigned(std::string, unsigned&);
@@ -38,6 +39,9 @@ std::string to_lower(std::string);
 std::string format_string(std::string, ...);
 std::string format_string(std::string*, ...);
 std::string ascii_safe(std::string str, bool print_unsafe);
+unsigned split_in_place(char *line, std::vector<char*> &tokens, const char *separators = " \t");
+bool parse_unsigned(const char *text, unsigned &value);
+bool parse_double(char *text, double &value);
 
 #endif // __STRINGUTILS_HPP
 
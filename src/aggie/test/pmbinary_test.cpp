@@ -0,0 +1,199 @@
+/*! \file pmbinary_test.cpp
+ * \brief Round-trip test of the binary PM encoding. Built and run by \c make \c test.
+ *
+ * Encodes snapshots and deltas with #pm_binary_encoder, decodes them with
+ * #pm_binary_decoder, and checks that everything comes back, including
+ * strings sent as dictionary references and strings that no longer fit in
+ * the dictionary. Damaged messages must be refused.
+ */
+
+#include "pmbinary.hpp"
+
+#include <cmath>
+#include <cstdio>
+#include <string>
+
+static unsigned failures = 0;
+
+//! \brief Reports a failed check, and carries on.
+#define CHECK(condition) \
+	do { if (!(condition)) { failures += 1; printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); } } while (0)
+
+/*! \brief Checks a decoded unit against what was encoded, allowing for the rounding of the encoding.
+ */
+static void check_unit(const pm_binary_decoder::unit &u, unsigned id, double lat, double lon,
+                       const std::string &symbol, const std::string &enumeration, double alt, double speed)
+{
+	CHECK(u.id == id);
+	CHECK(fabs(u.lat - lat) < 1e-7);
+	CHECK(fabs(u.lon - lon) < 1e-7);
+	CHECK(u.symbol == symbol);
+	CHECK(u.enumeration == enumeration);
+	CHECK(fabs(u.alt - alt) < 0.051);
+	CHECK(fabs(u.speed - speed) < 0.051);
+}
+
+/*! \brief A snapshot and a delta that refers to the strings the snapshot brought.
+ */
+static void test_snapshot_and_delta()
+{
+	pm_binary_encoder encoder;
+	pm_binary_decoder decoder;
+
+	encoder.begin(PM_BINARY_SNAPSHOT, 7);
+	encoder.count(3);
+	encoder.unit(1, 59.9138688, 10.7522454, "SFGPICU---Exxx", "", 120.5, 3.2);
+	encoder.unit(2, -33.8688197, 151.2092955, "SFGPICU---Exxx", "radio", -4.0, 0.0);
+	encoder.unit(300000, 0.0, -179.9999999, "SHGPU-----Exxx", "radio", 0.0, 250.7);
+	std::string snapshot = encoder.str();
+	CHECK(decoder.decode(snapshot));
+	CHECK(decoder.type == PM_BINARY_SNAPSHOT);
+	CHECK(decoder.sequence == 7);
+	CHECK(decoder.units.size() == 3);
+	if (decoder.units.size() == 3)
+	{
+		check_unit(decoder.units[0], 1, 59.9138688, 10.7522454, "SFGPICU---Exxx", "", 120.5, 3.2);
+		check_unit(decoder.units[1], 2, -33.8688197, 151.2092955, "SFGPICU---Exxx", "radio", -4.0, 0.0);
+		check_unit(decoder.units[2], 300000, 0.0, -179.9999999, "SHGPU-----Exxx", "radio", 0.0, 250.7);
+	}
+
+	// Only dictionary references for strings the snapshot brought
+	encoder.begin(PM_BINARY_DELTA, 8);
+	encoder.count(1);
+	encoder.unit(4, 1.5, 2.5, "SHGPU-----Exxx", "radio", 10.0, 1.0);
+	encoder.count(1);
+	encoder.unit(1, 59.9, 10.7, "SFGPICU---Exxx", "", 121.0, 3.0);
+	encoder.count(2);
+	encoder.id(2);
+	encoder.id(300000);
+	std::string delta = encoder.str();
+	CHECK(delta.find("SHGPU") == std::string::npos);
+	CHECK(decoder.decode(delta));
+	CHECK(decoder.type == PM_BINARY_DELTA);
+	CHECK(decoder.sequence == 8);
+	CHECK(decoder.units.size() == 1);
+	CHECK(decoder.changed.size() == 1);
+	CHECK(decoder.removed.size() == 2);
+	if ((decoder.units.size() == 1) && (decoder.changed.size() == 1) && (decoder.removed.size() == 2))
+	{
+		check_unit(decoder.units[0], 4, 1.5, 2.5, "SHGPU-----Exxx", "radio", 10.0, 1.0);
+		check_unit(decoder.changed[0], 1, 59.9, 10.7, "SFGPICU---Exxx", "", 121.0, 3.0);
+		CHECK(decoder.removed[0] == 2);
+		CHECK(decoder.removed[1] == 300000);
+	}
+
+	// Without the snapshot, the references mean nothing
+	pm_binary_decoder fresh;
+	CHECK(!fresh.decode(delta));
+	CHECK(std::string(fresh.error()) == "unknown dictionary entry");
+
+	// A new snapshot empties the dictionary on both sides
+	encoder.begin(PM_BINARY_SNAPSHOT, 9);
+	encoder.count(1);
+	encoder.unit(5, 0.0, 0.0, "SHGPU-----Exxx", "", 0.0, 0.0);
+	CHECK(encoder.str().find("SHGPU") != std::string::npos);
+	CHECK(decoder.decode(encoder.str()));
+	CHECK((decoder.units.size() == 1) && (decoder.units[0].symbol == "SHGPU-----Exxx"));
+}
+
+/*! \brief More strings than the dictionary holds; the extra ones are sent in full every time.
+ */
+static void test_full_dictionary()
+{
+	pm_binary_encoder encoder;
+	pm_binary_decoder decoder;
+	const unsigned count = PM_BINARY_MAX_DICTIONARY + 10;
+	char symbol[32];
+
+	encoder.begin(PM_BINARY_SNAPSHOT, 1);
+	encoder.count(count);
+	for (unsigned i = 0; i < count; i++)
+	{
+		snprintf(symbol, sizeof symbol, "S%u", i);
+		encoder.unit(i, 0.0, 0.0, symbol, "", 0.0, 0.0);
+	}
+	CHECK(decoder.decode(encoder.str()));
+	CHECK(decoder.units.size() == count);
+	for (unsigned i = 0; i < decoder.units.size(); i++)
+	{
+		snprintf(symbol, sizeof symbol, "S%u", i);
+		CHECK(decoder.units[i].symbol == symbol);
+	}
+
+	// The first strings are references, the last ones are sent again
+	encoder.begin(PM_BINARY_DELTA, 2);
+	encoder.count(2);
+	encoder.unit(0, 0.0, 0.0, "S1", "", 0.0, 0.0);
+	encoder.unit(1, 0.0, 0.0, "S4100", "", 0.0, 0.0);
+	encoder.count(0);
+	encoder.count(0);
+	std::string delta = encoder.str();
+	CHECK(delta.find("S1") == std::string::npos);
+	CHECK(delta.find("S4100") != std::string::npos);
+	CHECK(decoder.decode(delta));
+	CHECK(decoder.units.size() == 2);
+	if (decoder.units.size() == 2)
+	{
+		CHECK(decoder.units[0].symbol == "S1");
+		CHECK(decoder.units[1].symbol == "S4100");
+	}
+}
+
+/*! \brief Damaged messages are refused, and say why.
+ */
+static void test_errors()
+{
+	pm_binary_encoder encoder;
+	encoder.begin(PM_BINARY_DELTA, 300);
+	encoder.count(1);
+	encoder.unit(1234, 60.0, 11.0, "SFGPICU---Exxx", "radio", 5.0, 1.0);
+	encoder.count(0);
+	encoder.count(1);
+	encoder.id(99);
+	const std::string message = encoder.str();
+
+	// Every shorter message is truncated
+	for (unsigned length = 0; length < message.length(); length++)
+	{
+		pm_binary_decoder decoder;
+		bool decoded = decoder.decode(message.data(), length);
+		CHECK(!decoded);
+		if (!decoded && (length >= 3))
+		{
+			CHECK(std::string(decoder.error()) == "truncated");
+		}
+	}
+
+	pm_binary_decoder decoder;
+	CHECK(!decoder.decode(message + '\0'));
+	CHECK(std::string(decoder.error()) == "trailing data");
+	decoder.reset();
+	CHECK(decoder.decode(message));
+
+	std::string damaged = message;
+	damaged[0] = 0;
+	CHECK(!decoder.decode(damaged));
+	CHECK(std::string(decoder.error()) == "not a binary PM message");
+	damaged = message;
+	damaged[1] = PM_BINARY_VERSION + 1;
+	CHECK(!decoder.decode(damaged));
+	CHECK(std::string(decoder.error()) == "unknown version");
+	damaged = message;
+	damaged[2] = 2;
+	CHECK(!decoder.decode(damaged));
+	CHECK(std::string(decoder.error()) == "unknown message type");
+}
+
+int main()
+{
+	test_snapshot_and_delta();
+	test_full_dictionary();
+	test_errors();
+	if (failures > 0)
+	{
+		printf("pmbinary_test: %u check%s failed\n", failures, (failures != 1 ? "s" : ""));
+		return(1);
+	}
+	printf("pmbinary_test: all checks passed\n");
+	return(0);
+}
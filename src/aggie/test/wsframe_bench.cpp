@@ -0,0 +1,142 @@
+/*! \file wsframe_bench.cpp
+ * \brief Compares the websocket masking kernel with a plain byte loop. Built and run by \c make \c bench.
+ *
+ * First checks that #wsframe_mask_copy() gives the same bytes as the byte
+ * loop for every alignment of source and destination, every key offset and
+ * odd as well as even lengths. Then times both on payloads of typical sizes.
+ */
+
+#include "wsframe.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <time.h>
+
+//! \brief Bytes masked for each timing, whatever the payload size.
+#define BENCH_BYTES_PER_RUN (256u * 1024 * 1024)
+
+/*! \brief The obvious implementation, one byte at a time.
+ */
+static void byte_loop_mask_copy(char *destination, const char *source, unsigned length, const uint8_t key[4], unsigned offset)
+{
+	for (unsigned i = 0; i < length; i++)
+	{
+		destination[i] = source[i] ^ key[(offset + i) & 0x3];
+	}
+}
+
+/*! \brief Returns a monotonic timestamp in seconds.
+ */
+static double monotonic_s()
+{
+	struct timespec now;
+	::clock_gettime(CLOCK_MONOTONIC, &now);
+	return(now.tv_sec + now.tv_nsec / 1e9);
+}
+
+/*! \brief Checks the kernel against the byte loop.
+ * \return Number of mismatches
+ */
+static unsigned check()
+{
+	static const uint8_t key[4] = { 0x37, 0xfa, 0x21, 0x3d };
+	std::vector<char> source(1024 + 32);
+	for (unsigned i = 0; i < source.size(); i++)
+	{
+		source[i] = (char) (i * 131 + 7);
+	}
+	std::vector<char> expected(source.size()), actual(source.size());
+	unsigned mismatches = 0;
+	for (unsigned length = 0; length <= 300; length += ((length < 70) ? 1 : 37))
+	{
+		for (unsigned source_align = 0; source_align < 16; source_align++)
+		{
+			for (unsigned destination_align = 0; destination_align < 16; destination_align++)
+			{
+				for (unsigned offset = 0; offset < 4; offset++)
+				{
+					memset(&expected[0], 0x55, expected.size());
+					memset(&actual[0], 0x55, actual.size());
+					byte_loop_mask_copy(&expected[destination_align], &source[source_align], length, key, offset);
+					wsframe_mask_copy(&actual[destination_align], &source[source_align], length, key, offset);
+					if (expected != actual)
+					{
+						if (mismatches++ < 10)
+						{
+							printf("mismatch: length %u, source +%u, destination +%u, key offset %u\n",
+							       length, source_align, destination_align, offset);
+						}
+					}
+				}
+			}
+		}
+	}
+	// In place, as wsframe_mask() does it
+	for (unsigned length = 1; length <= 257; length += 2)
+	{
+		std::vector<char> data(source.begin() + 3, source.begin() + 3 + length);
+		byte_loop_mask_copy(&expected[0], &data[0], length, key, 1);
+		wsframe_mask(&data[0], length, key, 1);
+		if (memcmp(&expected[0], &data[0], length) != 0)
+		{
+			mismatches += 1;
+			printf("mismatch in place: length %u\n", length);
+		}
+	}
+	return(mismatches);
+}
+
+/*! \brief Times both implementations on payloads of one size.
+ * \param length Payload size
+ */
+static void bench(unsigned length)
+{
+	static const uint8_t key[4] = { 0x12, 0x34, 0x56, 0x78 };
+	std::vector<char> source(length + 1, 'x'), destination(length + 1);
+	unsigned runs = BENCH_BYTES_PER_RUN / length;
+	volatile char sink = 0;
+
+	double start = monotonic_s();
+	for (unsigned r = 0; r < runs; r++)
+	{
+		// Odd alignment and key offset, as for a payload after a 2 byte header
+		byte_loop_mask_copy(&destination[1], &source[1], length, key, r & 0x3);
+		sink ^= destination[1 + r % length];
+	}
+	double byte_loop = monotonic_s() - start;
+
+	start = monotonic_s();
+	for (unsigned r = 0; r < runs; r++)
+	{
+		wsframe_mask_copy(&destination[1], &source[1], length, key, r & 0x3);
+		sink ^= destination[1 + r % length];
+	}
+	double kernel = monotonic_s() - start;
+
+	double megabytes = (double) runs * length / (1024 * 1024);
+	printf("%8u bytes: byte loop %8.0f MB/s, kernel %8.0f MB/s, %5.1fx\n",
+	       length, megabytes / byte_loop, megabytes / kernel, byte_loop / kernel);
+}
+
+int main()
+{
+	unsigned mismatches = check();
+	if (mismatches > 0)
+	{
+		printf("wsframe_bench: %u mismatch%s with the byte loop\n", mismatches, (mismatches != 1 ? "es" : ""));
+		return(1);
+	}
+	printf("wsframe_bench: same output as the byte loop at every alignment, key offset and length\n");
+#	ifdef __SSE2__
+	printf("Kernel uses SSE2\n");
+#	else
+	printf("Kernel uses 64 bit words (no SSE2)\n");
+#	endif
+	static const unsigned lengths[] = { 16, 125, 1000, 16 * 1024, 1024 * 1024 };
+	for (unsigned i = 0; i < sizeof lengths / sizeof lengths[0]; i++)
+	{
+		bench(lengths[i]);
+	}
+	return(0);
+}
@@ -0,0 +1,185 @@
+/*! \file timerwheel.cpp
+ *  \copydoc timerwheel.hpp
+ */
+
+#include "timerwheel.hpp"
+
+#include <time.h>
+
+/*! \brief Constructor.
+ *
+ * The number of slots is rounded up to the nearest power of two.
+ *
+ * \param resolution_ms Length of one tick. Deadlines are rounded up to whole ticks.
+ * \param slot_count Number of slots
+ */
+timerwheel::timerwheel(unsigned resolution_ms, unsigned slot_count)
+	: resolution_ms_(resolution_ms > 0 ? resolution_ms : 1),
+	  mask(0),
+	  current_tick(0)
+{
+	unsigned size = 1;
+	while (size < slot_count) size *= 2;
+	slots.resize(size);
+	mask = size - 1;
+	current_tick = now_in_ms() / resolution_ms_;
+}
+
+/*! \brief Sets the deadline of an item.
+ *
+ * Any previous deadline of the item is replaced.
+ *
+ * \param item Item to schedule
+ * \param delay_ms Time from now until the item is due
+ */
+void timerwheel::schedule(void *item, unsigned delay_ms)
+{
+	cancel(item);
+
+	tick_type tick = (now_in_ms() + delay_ms + resolution_ms_ - 1) / resolution_ms_;
+	if (tick < current_tick)
+	{
+		tick = current_tick; // Cannot go back in time
+	}
+	entry e;
+	e.item = item;
+	e.tick = tick;
+	position p;
+	p.slot = tick & mask;
+	p.where = slots[p.slot].insert(slots[p.slot].end(), e);
+	positions[item] = p;
+}
+
+/*! \brief Removes the deadline of an item, if it has one.
+ * \param item Item to remove
+ */
+void timerwheel::cancel(void *item)
+{
+	std::map<void*, position>::iterator itr = positions.find(item);
+	if (itr != positions.end())
+	{
+		slots[itr->second.slot].erase(itr->second.where);
+		positions.erase(itr);
+	}
+}
+
+/*! \brief Checks whether an item has a deadline.
+ * \param item Item to check
+ * \return TRUE if the item is scheduled
+ */
+bool timerwheel::scheduled(void *item) const
+{
+	return(positions.find(item) != positions.end());
+}
+
+/*! \brief Takes out all items that are due.
+ *
+ * The items are removed from the wheel, and must be scheduled again
+ * if they are to be due another time.
+ *
+ * \param[out] due Due items are appended to this list, earliest first
+ * \return Number of items appended
+ */
+unsigned timerwheel::expire(std::vector<void*> &due)
+{
+	tick_type target = now_in_ms() / resolution_ms_;
+	if (target < current_tick)
+	{
+		return(0);
+	}
+
+	unsigned count = 0;
+	tick_type first = current_tick;
+	if (target - current_tick > mask)
+	{
+		first = target - mask; // Every slot is visited only once, however long it's been
+	}
+	for (tick_type tick = first; tick <= target; tick++)
+	{
+		slot_type &slot = slots[tick & mask];
+		slot_type::iterator itr = slot.begin();
+		while (itr != slot.end())
+		{
+			if (itr->tick <= target)
+			{
+				due.push_back(itr->item);
+				positions.erase(itr->item);
+				itr = slot.erase(itr);
+				count += 1;
+			}
+			else
+			{
+				itr++; // Due in a later revolution
+			}
+		}
+	}
+	current_tick = target + 1;
+
+	return(count);
+}
+
+/*! \brief Tells how long it is until the next item is due.
+ *
+ * Only the part of the wheel that is covered by \c limit_ms is searched.
+ *
+ * \param limit_ms Maximum value to return
+ * \return Milliseconds until the next item is due (0 if already due), or \c limit_ms
+ *         if nothing is due before that
+ */
+unsigned timerwheel::time_to_next(unsigned limit_ms)
+{
+	unsigned long long now = now_in_ms();
+	tick_type ticks = limit_ms / resolution_ms_ + 1;
+	if (ticks > slots.size())
+	{
+		ticks = slots.size();
+	}
+	for (tick_type tick = current_tick; tick < current_tick + ticks; tick++)
+	{
+		slot_type &slot = slots[tick & mask];
+		slot_type::iterator itr = slot.begin();
+		while (itr != slot.end())
+		{
+			if (itr->tick <= tick)
+			{
+				unsigned long long due_ms = tick * resolution_ms_;
+				if (due_ms <= now)
+				{
+					return(0);
+				}
+				return((due_ms - now < limit_ms) ? (unsigned) (due_ms - now) : limit_ms);
+			}
+			itr++;
+		}
+	}
+	return(limit_ms);
+}
+
+/*! \brief Number of items with a deadline.
+ */
+unsigned timerwheel::size() const
+{
+	return(positions.size());
+}
+
+/*! \brief Removes all deadlines.
+ */
+void timerwheel::clear()
+{
+	std::vector<slot_type>::iterator itr = slots.begin();
+	while (itr != slots.end())
+	{
+		itr->clear();
+		itr++;
+	}
+	positions.clear();
+}
+
+/*! \brief Monotonic time in milliseconds. Not affected by changes to the system clock.
+ */
+unsigned long long timerwheel::now_in_ms()
+{
+	struct timespec ts;
+	::clock_gettime(CLOCK_MONOTONIC, &ts);
+	return((unsigned long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
@@ -0,0 +1,68 @@
+/*! \file timerwheel.hpp
+ * \brief Hashed timer wheel for keeping many deadlines at once.
+ *
+ * Deadlines are hashed into a fixed number of slots by the tick they are due,
+ * so finding what is due only visits the slots of the ticks that have passed,
+ * not every deadline. The deadline of each item is also looked up by item,
+ * which makes scheduling, cancelling and expiring a deadline take
+ * logarithmic time in the number of items.
+ */
+
+#ifndef __TIMERWHEEL_HPP
+#define __TIMERWHEEL_HPP
+
+#include "platform.h"
+
+#include <list>
+#include <map>
+#include <vector>
+
+//! \brief Default length of one tick of a #timerwheel.
+#define TIMERWHEEL_RESOLUTION_MS 10
+//! \brief Default number of slots in a #timerwheel. Must be a power of two.
+#define TIMERWHEEL_SLOTS 512
+
+/*! \brief Hashed timer wheel.
+ *
+ * Each item (any pointer) has at most one deadline. Typical use is to
+ * #schedule() items, wait for #time_to_next() milliseconds, and then
+ * collect whatever is due with #expire().
+ *
+ * Deadlines further away than one revolution of the wheel simply stay in
+ * their slot until the wheel has come round often enough.
+ *
+ * \note Not thread safe. All calls must be made from the same thread.
+ */
+class timerwheel
+{
+public:
+	timerwheel(unsigned resolution_ms = TIMERWHEEL_RESOLUTION_MS, unsigned slot_count = TIMERWHEEL_SLOTS);
+	void schedule(void *item, unsigned delay_ms);
+	void cancel(void *item);
+	bool scheduled(void *item) const;
+	unsigned expire(std::vector<void*> &due);
+	unsigned time_to_next(unsigned limit_ms);
+	unsigned size() const;
+	void clear();
+private:
+	typedef unsigned long long tick_type;
+	struct entry
+	{
+		void *item;
+		tick_type tick; //!< Tick at which the item is due
+	};
+	typedef std::list<entry> slot_type;
+	struct position
+	{
+		unsigned slot;
+		slot_type::iterator where;
+	};
+	std::vector<slot_type> slots; //!< Deadlines, hashed by tick
+	std::map<void*, position> positions; //!< Where to find the deadline of each item; looked up in O(log n)
+	unsigned resolution_ms_; //!< Length of one tick
+	unsigned mask; //!< Number of slots - 1
+	tick_type current_tick; //!< First tick not yet processed by #expire()
+	unsigned long long now_in_ms();
+};
+
+#endif // __TIMERWHEEL_HPP
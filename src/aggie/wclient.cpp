@@ -8,69 +8,300 @@
 #include "vout.hpp"
 
 #include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+
+#ifdef PLATFORM_LINUX
+#	include <arpa/inet.h>
+#endif
 
 ip_address::ip_address()
-	: host_(""),
-	  port_("")
+	: port_(0),
+	  family_(FAMILY_NONE),
+	  hostname_(NULL)
 {
-
+	memset(address_, 0, sizeof(address_));
 }
 
 ip_address::ip_address(std::string host, std::string port)
+	: port_(0),
+	  family_(FAMILY_NONE),
+	  hostname_(NULL)
 {
 	set_host(host);
 	set_port(port);
 }
 
 ip_address::ip_address(std::string host, unsigned port)
+	: port_(0),
+	  family_(FAMILY_NONE),
+	  hostname_(NULL)
 {
 	set_host(host);
 	set_port(port);
 }
 
 ip_address::ip_address(std::string host_and_port)
+	: port_(0),
+	  family_(FAMILY_NONE),
+	  hostname_(NULL)
 {
 	set_host_and_port(host_and_port);
 }
 
+ip_address::ip_address(const ip_address &other)
+	: port_(other.port_),
+	  family_(other.family_),
+	  hostname_(NULL)
+{
+	memcpy(address_, other.address_, sizeof(address_));
+	if (other.hostname_ != NULL)
+	{
+		hostname_ = new std::string(*other.hostname_);
+	}
+}
+
+ip_address::~ip_address()
+{
+	delete hostname_;
+}
+
+ip_address &ip_address::operator=(const ip_address &other)
+{
+	if (this != &other)
+	{
+		memcpy(address_, other.address_, sizeof(address_));
+		port_ = other.port_;
+		family_ = other.family_;
+		if (other.hostname_ == NULL)
+		{
+			forget_hostname();
+		}
+		else if (hostname_ == NULL)
+		{
+			hostname_ = new std::string(*other.hostname_);
+		}
+		else
+		{
+			*hostname_ = *other.hostname_;
+		}
+	}
+	return(*this);
+}
+
+/*! \brief Compares host and port.
+ *
+ * Hostnames are compared as text, so a hostname never equals an address.
+ */
+bool ip_address::operator==(const ip_address &other) const
+{
+	if ((port_ != other.port_) || (family_ != other.family_))
+	{
+		return(false);
+	}
+	if (family_ == FAMILY_HOSTNAME)
+	{
+		return(*hostname_ == *other.hostname_);
+	}
+	return(memcmp(address_, other.address_, sizeof(address_)) == 0);
+}
+
+void ip_address::forget_hostname()
+{
+	delete hostname_;
+	hostname_ = NULL;
+}
+
 void ip_address::set_host(std::string host)
 {
-	host_ = host;
+	set_host(host.data(), host.length());
+}
+
+/*! \brief Sets the host from an address or a hostname.
+ * \param host Address or hostname; need not be NUL-terminated
+ * \param length Length of \c host
+ * \return FALSE if \c host is empty
+ */
+bool ip_address::set_host(const char *host, size_t length)
+{
+	char text[INET6_ADDRSTRLEN];
+	memset(address_, 0, sizeof(address_));
+	if (length == 0)
+	{
+		family_ = FAMILY_NONE;
+		forget_hostname();
+		return(false);
+	}
+	if (length < sizeof(text))
+	{
+		memcpy(text, host, length);
+		text[length] = '\0';
+		if (::inet_pton(AF_INET, text, address_) == 1)
+		{
+			family_ = FAMILY_IPV4;
+			forget_hostname();
+			return(true);
+		}
+		if (::inet_pton(AF_INET6, text, address_) == 1)
+		{
+			family_ = FAMILY_IPV6;
+			forget_hostname();
+			return(true);
+		}
+	}
+	family_ = FAMILY_HOSTNAME;
+	if (hostname_ == NULL)
+	{
+		hostname_ = new std::string(host, length);
+	}
+	else
+	{
+		hostname_->assign(host, length);
+	}
+	return(true);
 }
 
 void ip_address::set_port(std::string port)
 {
-	port_ = port;
-	if (port_.length() == 0) port_ = "0";
+	unsigned value = 0;
+	port_ = (parse_unsigned(port.c_str(), value) && (value <= 0xffff)) ? value : 0;
 }
 
 void ip_address::set_port(unsigned port)
 {
-	port_ = int_to_string(port);
+	port_ = (port <= 0xffff) ? port : 0;
 }
 
-void ip_address::set_host_and_port(std::string host_and_port)
+bool ip_address::set_host_and_port(std::string host_and_port)
+{
+	return(set_host_and_port(host_and_port.c_str()));
+}
+
+/*! \brief Sets host and port from "host port", "host:port" or "[IPv6-address]:port".
+ *
+ * The port may be left out. Does not allocate unless the host is a hostname.
+ *
+ * \param host_and_port NUL-terminated string
+ * \return FALSE if there is no host, or the port is not a valid port number
+ */
+bool ip_address::set_host_and_port(const char *host_and_port)
 {
-	std::replace(host_and_port.begin(), host_and_port.end(), ':', ' ');
-	std::istringstream iss(host_and_port);
-	iss >> host_;
-	iss >> port_;
-	if (port_.length() == 0) port_ = "0";
+	const char *whitespace = " \t";
+	const char *position = host_and_port + strspn(host_and_port, whitespace);
+	const char *host = position;
+	size_t host_length = strcspn(position, whitespace);
+	const char *port = position + host_length;
+	if (*host == '[')
+	{
+		// Bracketed IPv6 address, so the colons don't separate the port
+		const char *end = (const char *) memchr(host, ']', host_length);
+		if (end != NULL)
+		{
+			host += 1;
+			host_length = end - host;
+			port = end + 1;
+		}
+	}
+	else
+	{
+		const char *colon = (const char *) memchr(host, ':', host_length);
+		if ((colon != NULL) && (memchr(colon + 1, ':', host + host_length - colon - 1) == NULL))
+		{
+			// Exactly one colon; more than one would be an IPv6 address
+			host_length = colon - host;
+			port = colon;
+		}
+	}
+	bool valid = set_host(host, host_length);
+
+	port += strspn(port, ":");
+	port += strspn(port, whitespace);
+	char text[8];
+	size_t port_length = strcspn(port, whitespace);
+	unsigned value = 0;
+	port_ = 0;
+	if (port_length > 0)
+	{
+		if (port_length < sizeof(text))
+		{
+			memcpy(text, port, port_length);
+			text[port_length] = '\0';
+			valid = valid && parse_unsigned(text, value) && (value <= 0xffff);
+		}
+		else
+		{
+			valid = false;
+		}
+		port_ = valid ? value : 0;
+	}
+	return(valid);
 }
 
 std::string ip_address::host() const
 {
-	return host_;
+	char text[IP_ADDRESS_TEXT_LENGTH];
+	switch (family_)
+	{
+	case FAMILY_IPV4:
+		return(::inet_ntop(AF_INET, address_, text, sizeof(text)));
+	case FAMILY_IPV6:
+		return(::inet_ntop(AF_INET6, address_, text, sizeof(text)));
+	case FAMILY_HOSTNAME:
+		return(*hostname_);
+	default:
+		return("");
+	}
 }
 
 std::string ip_address::port() const
 {
-	return port_;
+	return(int_to_string(port_));
+}
+
+uint16_t ip_address::port_number() const
+{
+	return(port_);
 }
 
 std::string ip_address::host_and_port() const
 {
-	return host_ + ":" + port_;
+	if (family_ == FAMILY_HOSTNAME)
+	{
+		return(*hostname_ + ":" + port());
+	}
+	char text[IP_ADDRESS_TEXT_LENGTH];
+	return(format_host_and_port(text));
+}
+
+/*! \brief Writes "host:port" without allocating, or "[host]:port" for IPv6 addresses.
+ *
+ * Hostnames are cut short if they do not fit.
+ *
+ * \param buffer Room for at least #IP_ADDRESS_TEXT_LENGTH characters
+ * \return \c buffer
+ */
+const char *ip_address::format_host_and_port(char *buffer) const
+{
+	char text[INET6_ADDRSTRLEN];
+	switch (family_)
+	{
+	case FAMILY_IPV4:
+		::inet_ntop(AF_INET, address_, text, sizeof(text));
+		snprintf(buffer, IP_ADDRESS_TEXT_LENGTH, "%s:%u", text, (unsigned) port_);
+		break;
+	case FAMILY_IPV6:
+		::inet_ntop(AF_INET6, address_, text, sizeof(text));
+		snprintf(buffer, IP_ADDRESS_TEXT_LENGTH, "[%s]:%u", text, (unsigned) port_);
+		break;
+	case FAMILY_HOSTNAME:
+		snprintf(buffer, IP_ADDRESS_TEXT_LENGTH, "%s:%u", hostname_->c_str(), (unsigned) port_);
+		break;
+	default:
+		snprintf(buffer, IP_ADDRESS_TEXT_LENGTH, ":%u", (unsigned) port_);
+		break;
+	}
+	return(buffer);
 }
 
 /*! \brief Constructor specifying new client.
@@ -79,6 +310,13 @@ std::string ip_address::host_and_port() const
 wclient::wclient(std::string new_entry)
 {
 	ip.set_host_and_port(new_entry);
+	// An optional third field overrides the poll interval for this client
+	poll_interval_sec = 0;
+	shard = 0;
+	std::replace(new_entry.begin(), new_entry.end(), ':', ' ');
+	std::istringstream fields(new_entry);
+	std::string host, port;
+	fields >> host >> port >> poll_interval_sec;
 	socket = new tcpsocket();
 	received_message = false;
 	last_received_message = 0;
@@ -87,15 +325,21 @@ wclient::wclient(std::string new_entry)
 	last_sent_message = 0;
 	last_sent_message = timers.add_stopwatch();
 	::pthread_mutex_init(&request_command_mutex, NULL);
-	client_nodes_list_finished = false;
-	config_list_finished = false;
-	connection_list_finished = false;
 	data_changed = false;
+	connection_state = STATE_CONNECTED;
+	reconnect_attempts = 0;
+	reconnect_count = 0;
+	reconnect_delay_ms = 0;
+	reconnect_timer = timers.add_stopwatch();
+	columns_dataset = DATASET_NONE;
+	columns_required = 0;
+	rejected_rows = 0;
 }
 
 wclient::~wclient()
 {
 	::pthread_mutex_destroy(&request_command_mutex);
+	timers.delete_stopwatch(reconnect_timer);
 	timers.delete_stopwatch(last_sent_message);
 	timers.delete_stopwatch(last_received_message);
 	//if (socket != NULL)	delete socket;
@@ -141,7 +385,10 @@ RH wclient::send_command(std::string command)
 	if (result.is_ok())
 	{
 //		std::cout << "command " << command << " sent succesfully to " << ip.host_and_port() << std::endlc;
-		request_command.push(command);
+		struct request r;
+		r.command = command;
+		r.ticket = 0;
+		request_command.push(r);
 		sent_message = true;
 		timers.restart_stopwatch(last_sent_message);
 	}
@@ -149,3 +396,303 @@ RH wclient::send_command(std::string command)
 
 	return(result);
 }
+
+/*! \brief Sends several commands to the client in one write.
+ *
+ * The commands are pipelined; the client answers them one after the other,
+ * and the answers are matched with the commands through #request_command.
+ * If the send queue fills up, the commands queued so far are still sent.
+ *
+ * \param commands Commands to send
+ * \return #NO_ERRORS, or the first error from the socket
+ */
+RH wclient::send_commands(const std::vector<std::string> &commands)
+{
+	RH result;
+	result.set_ok();
+
+	socket->set_endline("\r\n");
+	::pthread_mutex_lock(&request_command_mutex);
+	std::vector<std::string>::const_iterator itr = commands.begin();
+	while (itr != commands.end())
+	{
+		result = queue_request(*itr, 0);
+		if (result.is_not_ok())
+		{
+			break;
+		}
+		itr += 1;
+	}
+	if (itr != commands.begin())
+	{
+		RH flushed = flush_requests();
+		if (flushed.is_not_ok())
+		{
+			result = flushed;
+		}
+	}
+	::pthread_mutex_unlock(&request_command_mutex);
+
+	return(result);
+}
+
+/*! \brief Sends several commands, each with its own ticket, in one write.
+ *
+ * Works like #send_commands(), but the tickets are kept with the commands
+ * in #request_command, so the answers can be handed back to whoever asked.
+ *
+ * \param requests Commands to send
+ * \return The number of requests sent, which is less than all of them if
+ *         the send queue filled up; #NO_ERRORS, or the first error from the socket
+ */
+RH_INT wclient::send_requests(const std::vector<struct request> &requests)
+{
+	RH_INT result;
+	result.set_ok();
+
+	socket->set_endline("\r\n");
+	::pthread_mutex_lock(&request_command_mutex);
+	unsigned sent = 0;
+	while (sent < requests.size())
+	{
+		RH queued = queue_request(requests[sent].command, requests[sent].ticket);
+		if (queued.is_not_ok())
+		{
+			result.set_not_ok(queued.id(), queued.text());
+			break;
+		}
+		sent += 1;
+	}
+	if (sent > 0)
+	{
+		RH flushed = flush_requests();
+		if (flushed.is_not_ok())
+		{
+			result.set_not_ok(flushed.id(), flushed.text());
+		}
+	}
+	::pthread_mutex_unlock(&request_command_mutex);
+	result.set_value(sent);
+
+	return(result);
+}
+
+/*! \brief Puts a command in the send queue, and remembers it for the answer. #request_command_mutex must be held.
+ */
+RH wclient::queue_request(const std::string &command, unsigned ticket)
+{
+	vout(VOUT_DEBUG) << "[wclient] sending command to " << ip.host_and_port() << ": " << command << std::endlc;
+	RH result = socket->queueline(command);
+	if (result.is_ok())
+	{
+		struct request r;
+		r.command = command;
+		r.ticket = ticket;
+		request_command.push(r);
+	}
+	return(result);
+}
+
+/*! \brief Sends whatever #queue_request() has queued. #request_command_mutex must be held.
+ */
+RH wclient::flush_requests()
+{
+	RH result = socket->flush();
+	if (result.is_ok())
+	{
+		sent_message = true;
+		timers.restart_stopwatch(last_sent_message);
+	}
+	return(result);
+}
+
+/*! \brief Forgets all requests still waiting for an answer.
+ */
+void wclient::forget_requests()
+{
+	::pthread_mutex_lock(&request_command_mutex);
+	while (!request_command.empty())
+	{
+		request_command.pop();
+	}
+	::pthread_mutex_unlock(&request_command_mutex);
+}
+
+/*! \brief Decides when the next reconnect attempt should be made.
+ *
+ * The delay doubles for every failed attempt, up to \c max_delay_ms, and
+ * a random part is added so that many clients lost at the same time are
+ * not all redialled at the same moment. The delay is picked from the upper
+ * half of the current backoff interval.
+ *
+ * \param min_delay_ms Delay before the first attempt
+ * \param max_delay_ms Longest delay between attempts
+ */
+void wclient::schedule_reconnect(unsigned min_delay_ms, unsigned max_delay_ms)
+{
+	unsigned backoff = min_delay_ms;
+	for (unsigned i = 0; (i < reconnect_attempts) && (backoff < max_delay_ms); i++)
+	{
+		backoff *= 2;
+	}
+	if (backoff > max_delay_ms) backoff = max_delay_ms;
+	if (backoff == 0) backoff = 1;
+
+	reconnect_delay_ms = (backoff / 2) + (::random() % ((backoff / 2) + 1));
+	reconnect_attempts += 1;
+	connection_state = STATE_WAITING_TO_RECONNECT;
+	timers.restart_stopwatch(reconnect_timer);
+}
+
+/*! \brief Forgets everything belonging to the previous session.
+ *
+ * Outstanding requests will never be answered, and partly received
+ * lists must be thrown away when the next list arrives.
+ */
+void wclient::reset_session()
+{
+	forget_requests();
+	command_output.clear();
+	data_column.clear();
+	column_decoders.clear();
+	columns_dataset = DATASET_NONE;
+	columns_required = 0;
+	discard_partial_lists();
+}
+
+/*! \brief Makes a completely received list available to the readers.
+ *
+ * The next list of the same kind is built in a recycled buffer.
+ *
+ * \param dataset The list that is complete
+ */
+void wclient::publish_list(dataset_type dataset)
+{
+	switch (dataset)
+	{
+	case DATASET_CLIENT_NODES:
+		client_nodes.publish();
+		client_nodes.back().clear();
+		break;
+	case DATASET_CONFIGS:
+		configs.publish();
+		configs.back().clear();
+		break;
+	case DATASET_CONNECTIONS:
+		connections.publish();
+		connections.back().clear();
+		break;
+	default:
+		break;
+	}
+}
+
+/*! \brief Throws away the rows of lists that are not yet complete.
+ *
+ * The published lists are kept.
+ */
+void wclient::discard_partial_lists()
+{
+	client_nodes.back().clear();
+	configs.back().clear();
+	connections.back().clear();
+}
+
+/*! \brief Returns a textual description of #connection_state.
+ * \return Description
+ */
+std::string wclient::connection_state_text()
+{
+	unsigned elapsed = timers.get_stopwatch_elapsed_time_in_ms(reconnect_timer).value();
+	switch (connection_state)
+	{
+	case STATE_CONNECTED:
+		return(format_string("connected (reconnected %u time%s)", reconnect_count, (reconnect_count != 1 ? "s" : "")));
+	case STATE_WAITING_TO_RECONNECT:
+		return(format_string("lost - reconnect attempt %u in %u ms", reconnect_attempts,
+		                     (elapsed < reconnect_delay_ms ? reconnect_delay_ms - elapsed : 0)));
+	case STATE_RECONNECTING:
+		return(format_string("reconnecting (attempt %u, %u ms so far)", reconnect_attempts, elapsed));
+	}
+	return("unknown");
+}
+
+/*! \brief Tells which list is the answer to a command.
+ * \param command One of the \ref CLIENT_COMMANDS "commands"
+ * \return The dataset, or #DATASET_NONE if the command does not give us a list
+ */
+wclient::dataset_type wclient::dataset_of(const std::string &command)
+{
+	if (command == GET_CLIENT_NODES) return(DATASET_CLIENT_NODES);
+	if (command == GET_CONFIGS) return(DATASET_CONFIGS);
+	if (command == GET_CONNECTIONS) return(DATASET_CONNECTIONS);
+	return(DATASET_NONE);
+}
+
+//! \defgroup FIELD_DECODERS Decoders for the fields of the lists from the clients.
+//! Each returns FALSE if the field is not valid.
+//!@{
+static bool decode_cn_id(struct wclient::row &r, char *token) { return(parse_unsigned(token, r.cn.id)); }
+static bool decode_cn_age(struct wclient::row &r, char *token) { return(parse_unsigned(token, r.cn.age)); }
+static bool decode_cn_cr(struct wclient::row &r, char *token) { return(parse_unsigned(token, r.cn.cr)); }
+static bool decode_cn_lat(struct wclient::row &r, char *token) { return(parse_double(token, r.cn.lat)); }
+static bool decode_cn_lon(struct wclient::row &r, char *token) { return(parse_double(token, r.cn.lon)); }
+static bool decode_cn_p2p_ip(struct wclient::row &r, char *token) { return(r.cn.p2p_ip.set_host_and_port(token)); }
+static bool decode_cn_radac_ip(struct wclient::row &r, char *token) { return(r.cn.radac_ip.set_host_and_port(token)); }
+static bool decode_config_id(struct wclient::row &r, char *token) { return(parse_unsigned(token, r.config.id)); }
+static bool decode_config_age(struct wclient::row &r, char *token) { return(parse_unsigned(token, r.config.age)); }
+static bool decode_config_src_ip(struct wclient::row &r, char *token) { return(r.config.src_ip.set_host_and_port(token)); }
+static bool decode_config_config(struct wclient::row &r, char *token) { r.config.config = token; return(true); }
+static bool decode_conn_dir(struct wclient::row &r, char *token) { r.conn.dir = token; return(true); }
+static bool decode_conn_peer_id(struct wclient::row &r, char *token) { return(parse_unsigned(token, r.conn.peer_id)); }
+static bool decode_conn_peer_ip(struct wclient::row &r, char *token) { return(r.conn.peer_ip.set_host_and_port(token)); }
+//!@}
+
+//! \brief Column names we know, and how to decode them in each dataset.
+static const struct
+{
+	wclient::dataset_type dataset;
+	const char *column;
+	wclient::field_decoder decoder;
+} known_columns[] = {
+	{ wclient::DATASET_CLIENT_NODES, "ID",       decode_cn_id },
+	{ wclient::DATASET_CLIENT_NODES, "AGE",      decode_cn_age },
+	{ wclient::DATASET_CLIENT_NODES, "CR",       decode_cn_cr },
+	{ wclient::DATASET_CLIENT_NODES, "LAT",      decode_cn_lat },
+	{ wclient::DATASET_CLIENT_NODES, "LON",      decode_cn_lon },
+	{ wclient::DATASET_CLIENT_NODES, "P2P_IP",   decode_cn_p2p_ip },
+	{ wclient::DATASET_CLIENT_NODES, "RADAC_IP", decode_cn_radac_ip },
+	{ wclient::DATASET_CONFIGS,      "ID",       decode_config_id },
+	{ wclient::DATASET_CONFIGS,      "AGE",      decode_config_age },
+	{ wclient::DATASET_CONFIGS,      "SRC_IP",   decode_config_src_ip },
+	{ wclient::DATASET_CONFIGS,      "CONFIG",   decode_config_config },
+	{ wclient::DATASET_CONNECTIONS,  "DIR",      decode_conn_dir },
+	{ wclient::DATASET_CONNECTIONS,  "PEER_ID",  decode_conn_peer_id },
+	{ wclient::DATASET_CONNECTIONS,  "PEER_IP",  decode_conn_peer_ip },
+};
+
+/*! \brief Turns the column names in #data_column into a table of decoders.
+ *
+ * Done once for every header (214) the client sends, so the rows (201)
+ * that follow can be parsed without looking at the column names.
+ *
+ * \param dataset The list the header belongs to
+ */
+void wclient::compile_columns(dataset_type dataset)
+{
+	column_decoders.assign(data_column.size(), (field_decoder) NULL);
+	columns_required = 0;
+	for (unsigned column = 0; column < data_column.size(); column++)
+	{
+		for (unsigned i = 0; i < sizeof(known_columns) / sizeof(known_columns[0]); i++)
+		{
+			if ((known_columns[i].dataset == dataset) && (data_column[column] == known_columns[i].column))
+			{
+				column_decoders[column] = known_columns[i].decoder;
+				columns_required = column + 1;
+				break;
+			}
+		}
+	}
+	columns_dataset = dataset;
+}
@@ -16,11 +16,13 @@
 #include "ipsocket.hpp"
 #include "timetools.hpp"
 #include "resulthandler.hpp"
+#include "snapshot.hpp"
 
 #include <sstream>
 #include <string>
 #include <vector>
 #include <queue>
+#include <stdint.h>
 
 #ifdef PLATFORM_WINDOWS
 
@@ -47,8 +49,21 @@ extern timetools timers;
 #define IPCSERVER_REPLY_INVALID_PARAMETER 401
 //}@
 
+//! \defgroup CLIENT_COMMANDS Commands we send to the clients.
+//!@{
+#define GET_CLIENT_NODES "list cn"
+#define GET_CONFIGS "list configs"
+#define GET_CONNECTIONS "list connections"
+//!@}
+
+//! \brief Room needed by ip_address::format_host_and_port(), including the terminating NUL.
+#define IP_ADDRESS_TEXT_LENGTH 56
+
 /*! \brief Container class for Host/IP and Port.
  *
+ * IPv4 and IPv6 addresses are stored parsed, in a fixed number of bytes,
+ * so copying and storing them never touches the heap. Anything that is
+ * not a valid address is kept as a hostname, which does allocate.
  */
 class ip_address
 {
@@ -57,16 +72,35 @@ public:
 	ip_address(std::string host, std::string port);
 	ip_address(std::string host, unsigned port);
 	ip_address(std::string host_and_port);
+	ip_address(const ip_address &other);
+	~ip_address();
+	ip_address &operator=(const ip_address &other);
+	bool operator==(const ip_address &other) const;
+	bool operator!=(const ip_address &other) const { return(!(*this == other)); }
 	std::string host() const;
 	std::string port() const;
 	std::string host_and_port() const;
+	const char *format_host_and_port(char *buffer) const;
+	uint16_t port_number() const;
 	void set_host(std::string);
 	void set_port(std::string);
 	void set_port(unsigned);
-	void set_host_and_port(std::string);
+	bool set_host_and_port(std::string);
+	bool set_host_and_port(const char *);
 private:
-	std::string host_;
-	std::string port_;
+	//! \brief What #address_ holds.
+	enum family_type {
+		FAMILY_NONE, //!< No host
+		FAMILY_IPV4, //!< IPv4 address in the first 4 bytes
+		FAMILY_IPV6, //!< IPv6 address
+		FAMILY_HOSTNAME, //!< Not an address; the host is in #hostname_
+	};
+	bool set_host(const char *host, size_t length);
+	void forget_hostname();
+	unsigned char address_[16]; //!< Address in network byte order
+	uint16_t port_; //!< Port, or 0 if none was given
+	unsigned char family_; //!< A #family_type
+	std::string *hostname_; //!< Only allocated for #FAMILY_HOSTNAME
 };
 
 
@@ -102,6 +136,23 @@ public:
 		unsigned peer_id;
 		ip_address peer_ip;
 	};
+	//! \brief The lists a client sends us, one for each \ref CLIENT_COMMANDS "command".
+	enum dataset_type {
+		DATASET_NONE, //!< Not a list we know
+		DATASET_CLIENT_NODES, //!< Answer to #GET_CLIENT_NODES
+		DATASET_CONFIGS, //!< Answer to #GET_CONFIGS
+		DATASET_CONNECTIONS, //!< Answer to #GET_CONNECTIONS
+	};
+	static dataset_type dataset_of(const std::string &command);
+	//! \brief One row of a list while it is being parsed. Only the member matching the dataset is used.
+	struct row
+	{
+		struct client_node cn;
+		struct configuration config;
+		struct connection conn;
+	};
+	//! \brief Stores one field of a row. Returns FALSE if the field is not valid.
+	typedef bool (*field_decoder)(struct row &, char *token);
 	class compare
 	{
 	public:
@@ -119,20 +170,52 @@ public:
 	timetools::handle last_received_message;
 	bool sent_message;
 	timetools::handle last_sent_message;
-	std::vector<struct client_node> client_nodes;
-	std::vector<struct configuration> configs;
-	std::vector<struct connection> connections;
-	bool client_nodes_list_finished;
-	bool config_list_finished;
-	bool connection_list_finished;
+	// The lists are built by the client's dispatcher shard and read by the main thread
+	snapshot<std::vector<struct client_node> > client_nodes; //!< Client nodes from the last complete #GET_CLIENT_NODES
+	snapshot<std::vector<struct configuration> > configs; //!< Configurations from the last complete #GET_CONFIGS
+	snapshot<std::vector<struct connection> > connections; //!< Connections from the last complete #GET_CONNECTIONS
+	void publish_list(dataset_type dataset);
+	void discard_partial_lists();
+	//! \brief A command sent to the client, waiting for its answer.
+	struct request
+	{
+		std::string command; //!< The command as sent
+		unsigned ticket; //!< Ticket of a command from the #command_router, or 0 for our own polls
+	};
 	RH send_command(std::string);
+	RH send_commands(const std::vector<std::string> &commands);
+	RH_INT send_requests(const std::vector<struct request> &requests);
+	void forget_requests();
+	//! \brief State of the connection to the client, as seen by the reconnect manager.
+	enum connection_state_type {
+		STATE_CONNECTED, //!< Session is up (or believed to be)
+		STATE_WAITING_TO_RECONNECT, //!< Session is lost; waiting for #reconnect_delay_ms to pass
+		STATE_RECONNECTING, //!< A connection attempt is in progress
+	} connection_state;
+	unsigned reconnect_attempts; //!< Failed attempts since the session was lost
+	unsigned reconnect_count; //!< Number of times the session has been re-established
+	unsigned reconnect_delay_ms; //!< Time to wait (measured by #reconnect_timer) before the next attempt
+	timetools::handle reconnect_timer; //!< Started when the connection was lost or the last attempt started
+	void schedule_reconnect(unsigned min_delay_ms, unsigned max_delay_ms);
+	void reset_session();
+	std::string connection_state_text();
+	unsigned shard; //!< Decides which dispatcher shard processes the messages from this client
+	unsigned poll_interval_sec; //!< Seconds between polls of this client, or 0 to use the global poll interval
 	std::vector<std::string> data_column;
-	std::queue<std::string> request_command;
+	void compile_columns(dataset_type dataset);
+	std::vector<field_decoder> column_decoders; //!< Decoder for each entry in #data_column; NULL for columns we don't use
+	dataset_type columns_dataset; //!< Dataset #column_decoders was compiled for
+	unsigned columns_required; //!< Rows with fewer columns than this lack fields we need
+	unsigned rejected_rows; //!< Number of rows thrown away because they were not valid
+	std::queue<struct request> request_command; //!< Commands sent and not yet answered, oldest first
+	std::string command_output; //!< Output so far of the oldest request, if it has a ticket. Only used by the client's dispatcher shard.
 #	ifdef PLATFORM_LINUX
 	pthread_mutex_t request_command_mutex;
 #	endif
 	bool data_changed;
 private:
+	RH queue_request(const std::string &command, unsigned ticket);
+	RH flush_requests();
 	ip_address ip;
 };
 
@@ -0,0 +1,278 @@
+/*! \file wsdeflate.cpp
+ *  \copydoc wsdeflate.hpp
+ */
+
+#include "wsdeflate.hpp"
+#include "stringutils.hpp"
+
+#include <cstring>
+#include <cstdlib>
+
+//! \brief Every message compressed with Z_SYNC_FLUSH ends with these bytes, which are left out on the wire.
+static const unsigned char deflate_tail[4] = { 0x00, 0x00, 0xff, 0xff };
+
+/*! \brief Constructor. The extension is not used until the server has #accept()ed it.
+ */
+wsdeflate::wsdeflate()
+	: level_(WSDEFLATE_DEFAULT_LEVEL),
+	  min_size_(WSDEFLATE_DEFAULT_MIN_SIZE),
+	  deflate_ready(false),
+	  inflate_ready(false)
+{
+	reset();
+}
+
+/*! \brief Destructor.
+ */
+wsdeflate::~wsdeflate()
+{
+	end_streams();
+}
+
+/*! \brief Sets how to compress. Takes effect from the next connection.
+ * \param level Compression level, 1 to 9
+ * \param min_size Messages shorter than this are sent uncompressed
+ */
+void wsdeflate::configure(int level, unsigned min_size)
+{
+	level_ = (level < 1) ? 1 : ((level > 9) ? 9 : level);
+	min_size_ = min_size;
+}
+
+/*! \brief The value of the \c Sec-WebSocket-Extensions header asking for the extension.
+ *
+ * We let the server limit our window, and accept whatever else it wants.
+ */
+std::string wsdeflate::offer()
+{
+	return("permessage-deflate; client_max_window_bits");
+}
+
+/*! \brief Forgets the negotiation and the compression windows, e.g. when reconnecting.
+ */
+void wsdeflate::reset()
+{
+	end_streams();
+	negotiated_ = false;
+	client_no_context_takeover = false;
+	server_no_context_takeover = false;
+	client_window_bits = MAX_WBITS;
+}
+
+/*! \brief Reads the server's answer to our #offer().
+ *
+ * \param extensions Value of the \c Sec-WebSocket-Extensions header in the
+ *                   server's handshake response. Several headers may be
+ *                   given separated by commas.
+ * \return TRUE if permessage-deflate is to be used, with parameters we
+ *         can follow. FALSE if the server did not accept it, or answered
+ *         with parameters that are not allowed.
+ */
+bool wsdeflate::accept(const std::string &extensions)
+{
+	reset();
+	size_t start = 0;
+	while (start <= extensions.length())
+	{
+		size_t end = extensions.find(',', start);
+		if (end == std::string::npos) end = extensions.length();
+		std::string extension = extensions.substr(start, end - start);
+		start = end + 1;
+
+		bool is_deflate = false;
+		bool valid = true;
+		size_t param_start = 0;
+		unsigned param_count = 0;
+		while (param_start <= extension.length())
+		{
+			size_t param_end = extension.find(';', param_start);
+			if (param_end == std::string::npos) param_end = extension.length();
+			std::string param = extension.substr(param_start, param_end - param_start);
+			param_start = param_end + 1;
+			std::string value = "";
+			size_t equals = param.find('=');
+			if (equals != std::string::npos)
+			{
+				value = param.substr(equals + 1);
+				param = param.substr(0, equals);
+				trim(value, " \t\"");
+			}
+			trim(param);
+			param = to_lower(param);
+			if (param_count++ == 0)
+			{
+				is_deflate = (param == "permessage-deflate");
+				if (!is_deflate) break;
+			}
+			else if (param == "client_no_context_takeover")
+			{
+				client_no_context_takeover = true;
+			}
+			else if (param == "server_no_context_takeover")
+			{
+				server_no_context_takeover = true;
+			}
+			else if (param == "client_max_window_bits")
+			{
+				int bits = atoi(value.c_str());
+				// zlib cannot make a raw deflate stream with a 256 byte window,
+				// and a larger one would break the limit the server set
+				if ((bits < 9) || (bits > 15))
+				{
+					valid = false;
+				}
+				client_window_bits = bits;
+			}
+			else if (param == "server_max_window_bits")
+			{
+				// The decompressor always has room for the largest window
+			}
+			else
+			{
+				valid = false;
+			}
+		}
+		if (is_deflate)
+		{
+			negotiated_ = valid;
+			return(negotiated_);
+		}
+	}
+	return(false);
+}
+
+/*! \brief Compresses a whole message.
+ * \param data Message
+ * \param length Length of \c data
+ * \param[out] compressed The compressed message, ready to be sent with RSV1 set. Its memory is reused.
+ * \return TRUE if all is OK
+ */
+bool wsdeflate::compress(const char *data, unsigned length, std::string &compressed)
+{
+	if (!deflate_ready)
+	{
+		memset(&deflater, 0, sizeof deflater);
+		if (deflateInit2(&deflater, level_, Z_DEFLATED, -client_window_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		{
+			return(false);
+		}
+		deflate_ready = true;
+	}
+
+	compressed.resize(deflateBound(&deflater, length) + 16);
+	deflater.next_in = (Bytef *) data;
+	deflater.avail_in = length;
+	unsigned produced = 0;
+	while (true)
+	{
+		deflater.next_out = (Bytef *) &compressed[produced];
+		deflater.avail_out = compressed.size() - produced;
+		int status = deflate(&deflater, Z_SYNC_FLUSH);
+		produced = compressed.size() - deflater.avail_out;
+		if ((status != Z_OK) && (status != Z_BUF_ERROR))
+		{
+			return(false);
+		}
+		if ((deflater.avail_in == 0) && (deflater.avail_out > 0))
+		{
+			break; // All flushed
+		}
+		compressed.resize(compressed.size() * 2);
+	}
+	if ((produced >= 4) && (memcmp(&compressed[produced - 4], deflate_tail, 4) == 0))
+	{
+		produced -= 4;
+	}
+	compressed.resize(produced);
+
+	if (client_no_context_takeover)
+	{
+		deflateReset(&deflater);
+	}
+	return(true);
+}
+
+/*! \brief Decompresses a whole message that arrived with RSV1 set.
+ * \param data Compressed message
+ * \param length Length of \c data
+ * \param[out] decompressed The message. Its memory is reused.
+ * \param max_length Largest message to accept
+ * \return TRUE if all is OK; FALSE if the data is not valid or the message is too large
+ */
+bool wsdeflate::decompress(const char *data, unsigned length, std::string &decompressed, unsigned max_length)
+{
+	if (!inflate_ready)
+	{
+		memset(&inflater, 0, sizeof inflater);
+		if (inflateInit2(&inflater, -MAX_WBITS) != Z_OK)
+		{
+			return(false);
+		}
+		inflate_ready = true;
+	}
+
+	decompressed.resize((length < max_length / 4) ? length * 4 + 64 : max_length);
+	unsigned produced = 0;
+	bool stream_end = false;
+	for (unsigned part = 0; (part < 2) && !stream_end; part++)
+	{
+		// The message, and then the tail that was left out
+		inflater.next_in = (part == 0) ? (Bytef *) data : (Bytef *) deflate_tail;
+		inflater.avail_in = (part == 0) ? length : sizeof deflate_tail;
+		while (true)
+		{
+			if (produced == decompressed.size())
+			{
+				if (produced >= max_length)
+				{
+					inflateReset(&inflater);
+					return(false);
+				}
+				decompressed.resize((produced < max_length / 2) ? produced * 2 : max_length);
+			}
+			inflater.next_out = (Bytef *) &decompressed[produced];
+			inflater.avail_out = decompressed.size() - produced;
+			int status = inflate(&inflater, Z_SYNC_FLUSH);
+			produced = decompressed.size() - inflater.avail_out;
+			if (status == Z_STREAM_END)
+			{
+				// The server ended the stream; the next message starts a new one
+				stream_end = true;
+				inflateReset(&inflater);
+				break;
+			}
+			if ((status != Z_OK) && (status != Z_BUF_ERROR))
+			{
+				inflateReset(&inflater);
+				return(false);
+			}
+			if (inflater.avail_out > 0)
+			{
+				break; // All input used, or more is needed
+			}
+		}
+	}
+	decompressed.resize(produced);
+
+	if (server_no_context_takeover)
+	{
+		inflateReset(&inflater);
+	}
+	return(true);
+}
+
+/*! \brief Frees the zlib streams.
+ */
+void wsdeflate::end_streams()
+{
+	if (deflate_ready)
+	{
+		deflateEnd(&deflater);
+		deflate_ready = false;
+	}
+	if (inflate_ready)
+	{
+		inflateEnd(&inflater);
+		inflate_ready = false;
+	}
+}
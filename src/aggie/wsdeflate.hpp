@@ -0,0 +1,62 @@
+/*! \file wsdeflate.hpp
+ * \brief The permessage-deflate websocket extension.
+ *
+ * Compresses and decompresses whole websocket messages with DEFLATE, as
+ * described in http://tools.ietf.org/html/rfc7692. Unless the peer asks
+ * otherwise, the compression window is kept from one message to the next,
+ * so repetitive messages compress much better than they would one by one.
+ */
+
+#ifndef __WSDEFLATE_HPP
+#define __WSDEFLATE_HPP
+
+#include "platform.h"
+
+#include <string>
+#include <zlib.h>
+
+//! \brief Default compression level; 1 is fastest, 9 compresses best.
+#define WSDEFLATE_DEFAULT_LEVEL 6
+//! \brief Messages shorter than this are by default sent uncompressed.
+#define WSDEFLATE_DEFAULT_MIN_SIZE 64
+
+/*! \brief Compressor and decompressor for one websocket connection, client side.
+ *
+ * Typical use is to send #offer() in the handshake, hand the server's
+ * answer to #accept(), and if that returns TRUE, use #compress() for
+ * outgoing messages (setting RSV1 on their first frame) and #decompress()
+ * for incoming messages that have RSV1 set.
+ *
+ * \note Not thread safe. Messages must be compressed one at a time, in the
+ *       order they are sent, and decompressed in the order they arrive.
+ */
+class wsdeflate
+{
+public:
+	wsdeflate();
+	~wsdeflate();
+	void configure(int level, unsigned min_size);
+	static std::string offer();
+	bool accept(const std::string &extensions);
+	void reset();
+	bool negotiated() const { return(negotiated_); } //!< TRUE if the server accepted the extension
+	bool worth_compressing(unsigned length) const { return(negotiated_ && (length >= min_size_)); } //!< TRUE if a message of this size should be compressed
+	bool compress(const char *data, unsigned length, std::string &compressed);
+	bool decompress(const char *data, unsigned length, std::string &decompressed, unsigned max_length);
+private:
+	wsdeflate(const wsdeflate &); // Not copyable
+	wsdeflate &operator=(const wsdeflate &);
+	void end_streams();
+	int level_; //!< Compression level
+	unsigned min_size_; //!< Messages shorter than this are not compressed
+	bool negotiated_; //!< TRUE if the server accepted the extension
+	bool client_no_context_takeover; //!< TRUE if our compressor must start afresh for every message
+	bool server_no_context_takeover; //!< TRUE if the server starts afresh for every message
+	int client_window_bits; //!< Window size of our compressor, as a power of two
+	bool deflate_ready; //!< TRUE when #deflater has been initialised
+	bool inflate_ready; //!< TRUE when #inflater has been initialised
+	z_stream deflater; //!< Compressor; keeps its window between messages unless #client_no_context_takeover
+	z_stream inflater; //!< Decompressor; keeps its window between messages
+};
+
+#endif // __WSDEFLATE_HPP
@@ -0,0 +1,511 @@
+/*! \file wsframe.cpp
+ *  \copydoc wsframe.hpp
+ */
+
+#include "wsframe.hpp"
+
+#include <cstring>
+
+#ifdef __SSE2__
+#	include <emmintrin.h>
+#endif
+
+/*! \brief XORs data with a websocket masking key, copying it on the way.
+ *
+ * Bytes are handled one at a time only until the destination is aligned;
+ * the rest is done 16 bytes at a time (with SSE2) or 8 bytes at a time,
+ * with the key repeated to fill a whole word.
+ *
+ * \param destination Where to put the masked data. May be the same as \c source.
+ * \param source Data to mask
+ * \param length Number of bytes
+ * \param key Masking key
+ * \param offset Position of \c source within the frame's payload, which decides where in the key to start
+ */
+void wsframe_mask_copy(char *destination, const char *source, unsigned length, const uint8_t key[4], unsigned offset)
+{
+	unsigned i = 0;
+	// Head: up to the first aligned destination byte
+	while ((i < length) && (((uintptr_t) (destination + i)) & 0x7))
+	{
+		destination[i] = source[i] ^ key[(offset + i) & 0x3];
+		i += 1;
+	}
+	if (length - i >= 8)
+	{
+		// The key, rotated to start where the aligned part starts, and repeated
+		uint8_t rotated[16];
+		for (unsigned k = 0; k < 16; k++)
+		{
+			rotated[k] = key[(offset + i + k) & 0x3];
+		}
+		uint64_t key64;
+		memcpy(&key64, rotated, sizeof(key64));
+#		ifdef __SSE2__
+		__m128i key128 = _mm_loadu_si128((const __m128i *) rotated);
+		while (length - i >= 16)
+		{
+			__m128i block = _mm_loadu_si128((const __m128i *) (source + i));
+			_mm_storeu_si128((__m128i *) (destination + i), _mm_xor_si128(block, key128));
+			i += 16;
+		}
+#		endif
+		while (length - i >= 8)
+		{
+			uint64_t block;
+			memcpy(&block, source + i, sizeof(block));
+			block ^= key64;
+			memcpy(destination + i, &block, sizeof(block));
+			i += 8;
+		}
+	}
+	// Tail
+	while (i < length)
+	{
+		destination[i] = source[i] ^ key[(offset + i) & 0x3];
+		i += 1;
+	}
+}
+
+/*! \brief XORs data with a websocket masking key, in place. Masking and unmasking is the same.
+ * \param data Data to mask
+ * \param length Number of bytes
+ * \param key Masking key
+ * \param offset Position of \c data within the frame's payload
+ */
+void wsframe_mask(char *data, unsigned length, const uint8_t key[4], unsigned offset)
+{
+	wsframe_mask_copy(data, data, length, key, offset);
+}
+
+/*! \brief Writes the header of a frame carrying a whole message, or a control frame.
+ *
+ * The MASK bit is not set; a client must set it and append the masking key.
+ *
+ * \param header Where to write the header; room for #WSFRAME_MAX_HEADER_SIZE bytes
+ * \param opcode Frame opcode
+ * \param length Payload length
+ * \param compressed TRUE to set RSV1, for a message compressed with permessage-deflate
+ * \return Length of the header
+ */
+unsigned wsframe_header(uint8_t *header, wsframe_decoder::opcode_type opcode, unsigned length, bool compressed)
+{
+	unsigned header_length = 2;
+	header[0] = 0x80 | (compressed ? 0x40 : 0) | opcode;
+	if (length < 126)
+	{
+		header[1] = length;
+	}
+	else if (length < 65536)
+	{
+		header[1] = 126;
+		header[2] = (length >> 8) & 0xff;
+		header[3] = (length >> 0) & 0xff;
+		header_length += 2;
+	}
+	else
+	{
+		uint64_t length64 = length;
+		header[1] = 127;
+		for (unsigned i = 0; i < 8; i++)
+		{
+			header[2 + i] = (length64 >> (56 - 8 * i)) & 0xff;
+		}
+		header_length += 8;
+	}
+	return(header_length);
+}
+
+//! \brief Rotates a 32 bit word left.
+#define SHA1_ROTATE(word, bits) (((word) << (bits)) | ((word) >> (32 - (bits))))
+
+/*! \brief SHA-1 digest of a short text, as needed for the opening handshake only.
+ */
+static void sha1(const std::string &text, uint8_t digest[20])
+{
+	uint32_t h[5] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 };
+	std::string message = text;
+	uint64_t bits = (uint64_t) text.length() * 8;
+	message += (char) 0x80;
+	while (message.length() % 64 != 56)
+	{
+		message += (char) 0;
+	}
+	for (int i = 7; i >= 0; i--)
+	{
+		message += (char) ((bits >> (8 * i)) & 0xff);
+	}
+
+	for (unsigned block = 0; block < message.length(); block += 64)
+	{
+		uint32_t w[80];
+		for (unsigned i = 0; i < 16; i++)
+		{
+			const uint8_t *p = (const uint8_t *) message.data() + block + 4 * i;
+			w[i] = ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+		}
+		for (unsigned i = 16; i < 80; i++)
+		{
+			w[i] = SHA1_ROTATE(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+		}
+		uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+		for (unsigned i = 0; i < 80; i++)
+		{
+			uint32_t f, k;
+			if (i < 20)      { f = (b & c) | (~b & d);          k = 0x5a827999; }
+			else if (i < 40) { f = b ^ c ^ d;                   k = 0x6ed9eba1; }
+			else if (i < 60) { f = (b & c) | (b & d) | (c & d); k = 0x8f1bbcdc; }
+			else             { f = b ^ c ^ d;                   k = 0xca62c1d6; }
+			uint32_t temp = SHA1_ROTATE(a, 5) + f + e + k + w[i];
+			e = d;
+			d = c;
+			c = SHA1_ROTATE(b, 30);
+			b = a;
+			a = temp;
+		}
+		h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+	}
+	for (unsigned i = 0; i < 20; i++)
+	{
+		digest[i] = (h[i / 4] >> (24 - 8 * (i % 4))) & 0xff;
+	}
+}
+
+/*! \brief Computes the \c Sec-WebSocket-Accept value a server answers a handshake with.
+ *
+ * See http://tools.ietf.org/html/rfc6455#section-4.2.2
+ *
+ * \param key Value of the client's \c Sec-WebSocket-Key header
+ * \return Base64 of the SHA-1 of the key and the websocket GUID
+ */
+std::string wsframe_accept_key(const std::string &key)
+{
+	static const char base64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	uint8_t digest[21];
+	sha1(key + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11", digest);
+	digest[20] = 0;
+	std::string accept = "";
+	for (unsigned i = 0; i < 20; i += 3)
+	{
+		uint32_t triple = ((uint32_t) digest[i] << 16) | ((uint32_t) digest[i + 1] << 8) | digest[i + 2];
+		accept += base64[(triple >> 18) & 0x3f];
+		accept += base64[(triple >> 12) & 0x3f];
+		accept += (i + 1 < 20) ? base64[(triple >> 6) & 0x3f] : '=';
+		accept += (i + 2 < 20) ? base64[triple & 0x3f] : '=';
+	}
+	return(accept);
+}
+
+/*! \brief Constructor.
+ *
+ * Sizes are rounded up to the nearest power of two.
+ *
+ * \param initial_size Size of the ring buffer to begin with
+ * \param max_size Maximum size of the ring buffer
+ */
+wsframe_decoder::wsframe_decoder(unsigned initial_size, unsigned max_size)
+	: buffer(NULL),
+	  capacity(1),
+	  max_capacity(1),
+	  allow_compressed(false),
+	  require_masked(false),
+	  error_("")
+{
+	while (capacity < initial_size) capacity *= 2;
+	while (max_capacity < max_size) max_capacity *= 2;
+	if (max_capacity < capacity) max_capacity = capacity;
+	buffer = new char[capacity];
+	clear();
+}
+
+/*! \brief Destructor.
+ */
+wsframe_decoder::~wsframe_decoder()
+{
+	delete[] buffer;
+}
+
+/*! \brief Forgets all undecoded data and any partial message, e.g. when reconnecting.
+ */
+void wsframe_decoder::clear()
+{
+	read_index = 0;
+	write_index = 0;
+	in_frame = false;
+	in_message = false;
+	message_done = false;
+	message_.clear();
+	control_.clear();
+	message_opcode_ = TEXT_FRAME;
+	message_compressed_ = false;
+	control_opcode_ = PING;
+}
+
+/*! \brief Tells whether RSV1 may be set, i.e.\ whether permessage-deflate has been negotiated.
+ * \param allow TRUE to accept compressed messages
+ */
+void wsframe_decoder::set_allow_compressed(bool allow)
+{
+	allow_compressed = allow;
+}
+
+/*! \brief Tells whether every frame must be masked, i.e.\ whether we are the server.
+ * \param require TRUE to refuse unmasked frames
+ */
+void wsframe_decoder::set_require_masked(bool require)
+{
+	require_masked = require;
+}
+
+/*! \brief Gives the place where the next incoming data should be stored.
+ *
+ * If the buffer is full it is enlarged, unless it already has its maximum size.
+ *
+ * \param[out] space Number of bytes that may be written at the returned position.
+ *                   Zero if the buffer is full and cannot grow.
+ * \return Pointer into the buffer
+ */
+char *wsframe_decoder::write_position(unsigned &space)
+{
+	if ((used() == capacity) && (capacity < max_capacity))
+	{
+		grow();
+	}
+	unsigned position = write_index & (capacity - 1);
+	space = capacity - used();
+	if (space > capacity - position)
+	{
+		space = capacity - position; // Only up to the end of the buffer
+	}
+	return(buffer + position);
+}
+
+/*! \brief Tells the decoder how many bytes were written at #write_position().
+ * \param count Number of bytes
+ */
+void wsframe_decoder::commit(unsigned count)
+{
+	write_index += count;
+}
+
+/*! \brief Decodes as much as possible of the received data.
+ *
+ * Returns as soon as a whole message or a control frame is complete. The
+ * payload stays available until the next call. Payloads of large frames
+ * are taken out of the ring buffer as they arrive, so a frame never has
+ * to fit in the buffer.
+ *
+ * \return What was found
+ */
+wsframe_decoder::result_type wsframe_decoder::next()
+{
+	if (message_done)
+	{
+		message_done = false;
+		message_.clear();
+	}
+	while (true)
+	{
+		if (!in_frame && !read_header())
+		{
+			return(NEED_MORE);
+		}
+		if (in_frame && (error_[0] != '\0'))
+		{
+			return(PROTOCOL_ERROR);
+		}
+		bool control_frame = ((frame_opcode & 0x8) != 0);
+		unsigned count = used();
+		if (count > frame_remaining)
+		{
+			count = frame_remaining;
+		}
+		take_payload(control_frame ? control_ : message_, count);
+		if (frame_remaining > 0)
+		{
+			return(NEED_MORE);
+		}
+		in_frame = false;
+		if (control_frame)
+		{
+			control_opcode_ = frame_opcode;
+			return(CONTROL);
+		}
+		if (frame_fin)
+		{
+			in_message = false;
+			message_done = true;
+			return(MESSAGE);
+		}
+	}
+}
+
+/*! \brief Decodes the header of the next frame, if all of it has been received.
+ *
+ * Sets #error_ if the header is not valid.
+ *
+ * \return TRUE if a header was decoded
+ */
+bool wsframe_decoder::read_header()
+{
+	unsigned available = used();
+	if (available < 2)
+	{
+		return(false);
+	}
+	uint8_t b0 = peek(0);
+	uint8_t b1 = peek(1);
+	unsigned length_size = ((b1 & 0x7f) == 126) ? 2 : (((b1 & 0x7f) == 127) ? 8 : 0);
+	unsigned header_size = 2 + length_size + ((b1 & 0x80) ? 4 : 0);
+	if (available < header_size)
+	{
+		return(false);
+	}
+	uint64_t length = b1 & 0x7f;
+	if (length_size > 0)
+	{
+		length = 0;
+		for (unsigned i = 0; i < length_size; i++)
+		{
+			length = (length << 8) | peek(2 + i);
+		}
+	}
+	frame_masked = ((b1 & 0x80) != 0);
+	for (unsigned i = 0; i < 4; i++)
+	{
+		masking_key[i] = frame_masked ? peek(2 + length_size + i) : 0;
+	}
+	read_index += header_size;
+	in_frame = true;
+	frame_fin = ((b0 & 0x80) != 0);
+	frame_opcode = (opcode_type) (b0 & 0x0f);
+	frame_remaining = length;
+	mask_offset = 0;
+	error_ = "";
+
+	bool rsv1 = ((b0 & 0x40) != 0);
+	if (require_masked && !frame_masked)
+	{
+		fail("frame not masked");
+	}
+	else if ((b0 & 0x30) != 0)
+	{
+		fail("reserved bits set");
+	}
+	else if (rsv1 && (!allow_compressed || (frame_opcode == CONTINUATION) || (frame_opcode & 0x8)))
+	{
+		fail("RSV1 set without permessage-deflate on the first frame of a message");
+	}
+	else if (frame_opcode & 0x8)
+	{
+		if ((frame_opcode != CLOSE) && (frame_opcode != PING) && (frame_opcode != PONG))
+		{
+			fail("unknown control opcode");
+		}
+		else if (!frame_fin || (length > 125))
+		{
+			fail("fragmented or oversized control frame");
+		}
+		control_.clear();
+	}
+	else if (frame_opcode == CONTINUATION)
+	{
+		if (!in_message)
+		{
+			fail("continuation without a message");
+		}
+	}
+	else if ((frame_opcode == TEXT_FRAME) || (frame_opcode == BINARY_FRAME))
+	{
+		if (in_message)
+		{
+			fail("new message before the last one was finished");
+		}
+		in_message = true;
+		message_opcode_ = frame_opcode;
+		message_compressed_ = rsv1;
+		message_.clear();
+	}
+	else
+	{
+		fail("unknown opcode");
+	}
+	if (!(frame_opcode & 0x8) && (message_.size() + length > WSFRAME_MAX_MESSAGE_SIZE))
+	{
+		fail("message too large");
+	}
+	return(true);
+}
+
+/*! \brief Moves payload bytes from the ring buffer to a string, unmasking them on the way.
+ * \param destination String to append to
+ * \param count Number of bytes; no more than are in the buffer
+ */
+void wsframe_decoder::take_payload(std::string &destination, unsigned count)
+{
+	unsigned start = read_index & (capacity - 1);
+	unsigned first_part = count;
+	if (first_part > capacity - start)
+	{
+		first_part = capacity - start;
+	}
+	size_t offset = destination.size();
+	destination.append(buffer + start, first_part);
+	destination.append(buffer, count - first_part);
+	if (frame_masked && (count > 0))
+	{
+		wsframe_mask(&destination[offset], count, masking_key, mask_offset);
+	}
+	mask_offset += count;
+	frame_remaining -= count;
+	read_index += count;
+	if (read_index == write_index)
+	{
+		// Empty; start from the beginning to get the most contiguous space
+		read_index = 0;
+		write_index = 0;
+	}
+}
+
+/*! \brief Looks at an undecoded byte without taking it out.
+ * \param offset Position counted from the first undecoded byte
+ */
+uint8_t wsframe_decoder::peek(unsigned offset) const
+{
+	return((uint8_t) buffer[(read_index + offset) & (capacity - 1)]);
+}
+
+/*! \brief Marks the current frame as invalid.
+ * \param reason Static text telling what was wrong
+ * \return #PROTOCOL_ERROR
+ */
+wsframe_decoder::result_type wsframe_decoder::fail(const char *reason)
+{
+	error_ = reason;
+	return(PROTOCOL_ERROR);
+}
+
+/*! \brief Doubles the size of the ring buffer.
+ *
+ * Undecoded data is moved to the beginning of the new buffer.
+ */
+void wsframe_decoder::grow()
+{
+	unsigned new_capacity = capacity * 2;
+	char *new_buffer = new char[new_capacity];
+	unsigned count = used();
+	unsigned start = read_index & (capacity - 1);
+	unsigned first_part = count;
+	if (first_part > capacity - start)
+	{
+		first_part = capacity - start;
+	}
+	memcpy(new_buffer, buffer + start, first_part);
+	memcpy(new_buffer + first_part, buffer, count - first_part);
+
+	delete[] buffer;
+	buffer = new_buffer;
+	capacity = new_capacity;
+	read_index = 0;
+	write_index = count;
+}
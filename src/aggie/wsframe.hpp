@@ -0,0 +1,116 @@
+/*! \file wsframe.hpp
+ * \brief Incremental decoder for websocket frames, and helpers for writing them.
+ *
+ * Socket data is received directly into a ring buffer, and frames are
+ * decoded from it as far as the data goes, so it does not matter how the
+ * frames are split between reads. See
+ * http://tools.ietf.org/html/rfc6455#section-5.2 for the frame format.
+ */
+
+#ifndef __WSFRAME_HPP
+#define __WSFRAME_HPP
+
+#include "platform.h"
+
+#include <string>
+#include <stdint.h>
+
+//! \brief Initial size of a #wsframe_decoder's ring buffer. Must be a power of two.
+#define WSFRAME_BUFFER_INITIAL_SIZE 4096
+//! \brief The ring buffer of a #wsframe_decoder never grows beyond this size.
+#define WSFRAME_BUFFER_MAX_SIZE (256 * 1024)
+//! \brief Largest message a #wsframe_decoder accepts, after reassembly.
+#define WSFRAME_MAX_MESSAGE_SIZE (16 * 1024 * 1024)
+//! \brief Longest frame header, with 64 bit length and masking key.
+#define WSFRAME_MAX_HEADER_SIZE 14
+//! \brief Status code of a close frame sent because the peer broke the protocol.
+#define WSFRAME_CLOSE_PROTOCOL_ERROR 1002
+
+void wsframe_mask(char *data, unsigned length, const uint8_t key[4], unsigned offset = 0);
+void wsframe_mask_copy(char *destination, const char *source, unsigned length, const uint8_t key[4], unsigned offset = 0);
+
+/*! \brief Decodes websocket frames into whole messages.
+ *
+ * Typical use is to receive into the space given by #write_position(),
+ * report the number of bytes received with #commit(), and then call
+ * #next() until it returns #NEED_MORE.
+ *
+ * Fragmented messages are put together from their continuation frames.
+ * Control frames may come between the fragments, and are handed out
+ * on their own. Payloads are unmasked while they are copied out of the
+ * ring buffer, and the buffers are kept from one message to the next, so
+ * decoding does not allocate once they have grown to a typical size.
+ *
+ * If permessage-deflate is in use, compressed messages are handed out as
+ * they are, with #message_compressed() set.
+ */
+class wsframe_decoder
+{
+public:
+	//! \brief Frame opcodes.
+	enum opcode_type {
+		CONTINUATION = 0x0,
+		TEXT_FRAME = 0x1,
+		BINARY_FRAME = 0x2,
+		CLOSE = 0x8,
+		PING = 0x9,
+		PONG = 0xa,
+	};
+	//! \brief What #next() found.
+	enum result_type {
+		NEED_MORE, //!< No complete message or control frame yet
+		MESSAGE, //!< A whole text or binary message is in #message()
+		CONTROL, //!< A control frame is in #control()
+		PROTOCOL_ERROR, //!< The data is not valid websocket frames; the connection should be closed
+	};
+	wsframe_decoder(unsigned initial_size = WSFRAME_BUFFER_INITIAL_SIZE, unsigned max_size = WSFRAME_BUFFER_MAX_SIZE);
+	~wsframe_decoder();
+	char *write_position(unsigned &space);
+	void commit(unsigned count);
+	result_type next();
+	const std::string &message() const { return(message_); } //!< Payload of the last #MESSAGE
+	opcode_type message_opcode() const { return(message_opcode_); } //!< #TEXT_FRAME or #BINARY_FRAME
+	bool message_compressed() const { return(message_compressed_); } //!< TRUE if the last #MESSAGE had RSV1 set, and must be decompressed
+	void set_allow_compressed(bool allow);
+	void set_require_masked(bool require);
+	const std::string &control() const { return(control_); } //!< Payload of the last #CONTROL frame
+	opcode_type control_opcode() const { return(control_opcode_); } //!< Opcode of the last #CONTROL frame
+	const char *error() const { return(error_); } //!< What was wrong, after #PROTOCOL_ERROR
+	unsigned used() const { return(write_index - read_index); } //!< Number of undecoded bytes
+	void clear();
+private:
+	wsframe_decoder(const wsframe_decoder &); // Not copyable
+	wsframe_decoder &operator=(const wsframe_decoder &);
+	bool read_header();
+	void take_payload(std::string &destination, unsigned count);
+	uint8_t peek(unsigned offset) const;
+	result_type fail(const char *reason);
+	void grow();
+	char *buffer; //!< Ring buffer storage, #capacity bytes
+	unsigned capacity; //!< Size of #buffer; always a power of two
+	unsigned max_capacity; //!< #capacity is never increased beyond this
+	unsigned read_index; //!< Position of first undecoded byte (not wrapped; mask with #capacity - 1)
+	unsigned write_index; //!< Position of next byte to be written (not wrapped)
+	bool in_frame; //!< TRUE when the header of the current frame has been decoded
+	bool frame_fin; //!< FIN bit of the current frame
+	opcode_type frame_opcode; //!< Opcode of the current frame
+	uint64_t frame_remaining; //!< Payload bytes of the current frame not yet taken out
+	uint8_t masking_key[4]; //!< Masking key of the current frame
+	bool frame_masked; //!< TRUE if the current frame is masked
+	unsigned mask_offset; //!< Payload bytes of the current frame already unmasked
+	bool in_message; //!< TRUE while a fragmented message is being put together
+	bool message_done; //!< TRUE when #message_ holds a message that has been handed out
+	std::string message_; //!< Message being put together, or the last complete one
+	opcode_type message_opcode_; //!< Opcode of the first frame of #message_
+	bool message_compressed_; //!< TRUE if the first frame of #message_ had RSV1 set
+	bool allow_compressed; //!< TRUE if RSV1 may be set on the first frame of a message
+	bool require_masked; //!< TRUE if unmasked frames are a protocol error, as they are from a client
+	std::string control_; //!< Payload of the current or last control frame
+	opcode_type control_opcode_; //!< Opcode of the last control frame
+	const char *error_; //!< Reason for the last #PROTOCOL_ERROR
+};
+
+unsigned wsframe_header(uint8_t *header, wsframe_decoder::opcode_type opcode, unsigned length, bool compressed = false);
+std::string wsframe_accept_key(const std::string &key);
+
+#endif // __WSFRAME_HPP